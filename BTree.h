@@ -24,7 +24,11 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <type_traits>
 
 #include <stdint.h>
 #include <assert.h>
@@ -32,6 +36,7 @@
 #include "BlockStorage.h"
 #include "BTreeCommon.h"
 #include "Utils.h"
+#include "RWLock.h"
 
 namespace milliways {
 
@@ -106,6 +111,7 @@ public:
 	/* -- Misc ----------------------------------------------------- */
 
 	size_type size() const { assert(m_io); return m_io->size(); }
+	bool empty() { shptr<node_type> root_( root(false) ); return (! root_) || (root_->leaf() && (root_->n() == 0)); }
 
 	/* -- Operations ----------------------------------------------- */
 
@@ -114,6 +120,33 @@ public:
 	bool search(lookup_type& res, const key_type& key_);
 	bool remove(lookup_type& res, const key_type& key_);
 
+	/* read-only lookup, copying the value out (storages may avoid materializing nodes) */
+	bool find(const key_type& key_, mapped_type& value_) { assert(m_io); return m_io->find(key_, value_); }
+
+	/*
+	 * optimistic lock coupling: concurrent_find() and concurrent_put() can
+	 * be called from many threads at once, on a storage that allows it (see
+	 * BTreeStorage::concurrent()), which today is only BTreeMemoryStorage:
+	 * on any other storage they fail. Readers don't lock: they validate the
+	 * version of each node they went through and restart when it changed.
+	 * Writers lock only the nodes they modify: the leaf, or a node along
+	 * with the full child it splits (the right sibling of the child, and
+	 * the children an internal child hands over to its new sibling).
+	 * Keys and values are read while they could be changing, hence they
+	 * must be trivially copyable. The other operations need the tree for
+	 * themselves.
+	 */
+	bool concurrent_find(const key_type& key_, mapped_type& value_);
+	bool concurrent_put(const key_type& key_, const mapped_type& value_);		/* insert or update */
+
+	/*
+	 * builds an empty tree bottom-up from (key, value) pairs sorted by
+	 * strictly increasing key. Nodes are filled up to 'fill_factor' (never
+	 * below the minimum occupancy) and written once, straight to storage.
+	 */
+	template <class ForwardIterator>
+	bool bulk_load(ForwardIterator first, ForwardIterator last, double fill_factor = 1.0);
+
 	/* -- Node I/O ------------------------------------------------- */
 
 	shptr<node_type> node_alloc() { assert(m_io); return m_io->node_alloc(); }
@@ -122,6 +155,7 @@ public:
 	shptr<node_type> node_get(node_id_t node_id) { assert(m_io); return m_io->node_get(node_id); }
 	shptr<node_type> node_get(shptr<node_type>& node) { assert(m_io); return m_io->node_get(node); }
 	shptr<node_type> node_put(shptr<node_type>& node) { assert(m_io); return m_io->node_put(node); }
+	shptr<node_type> node_relocate(shptr<node_type>& node, const shptr<node_type>& parent, int pos, node_id_t new_id) { assert(m_io); return m_io->node_relocate(node, parent, pos, new_id); }
 
 	/* -- Output --------------------------------------------------- */
 
@@ -199,9 +233,20 @@ private:
 	BTree(const BTree& other);
 	BTree& operator= (const BTree& other);
 
+	/* one optimistic pass, 'restart' when it met a concurrent change */
+	bool concurrent_find_pass(const key_type& key_, mapped_type& value_, bool& restart);
+	bool concurrent_put_pass(const key_type& key_, const mapped_type& value_, bool& restart);
+
+	/* the children of a full node that a split moves to the new node (their parent id changes) */
+	bool concurrent_latch_moved(const shptr<node_type>& node, std::vector< shptr<node_type> >& latched);
+	void concurrent_unlatch(std::vector< shptr<node_type> >& latched);
+
 	storage_type* m_io;
 	bool m_io_allocated;
 
+	/* guards the root id (and the creation of the root) */
+	OptLock m_root_latch;
+
 	friend class BTreeStorage<B_, KeyTraits, TTraits, Compare>;
 };
 
@@ -301,9 +346,18 @@ public:
 
 	virtual bool openHelper(bool& created_) { created_ = false; return true; }
 	virtual bool closeHelper() { return true; }
+	/* closes without writing anything, see open() */
+	virtual bool abandonHelper() { return closeHelper(); }
 
 	bool created() const { return m_created; }
 
+	/*
+	 * node I/O can be called from many threads at once (see
+	 * BTree::concurrent_put()). Not so on the file storage: its block cache
+	 * writes nodes back on eviction, while a writer could be changing them.
+	 */
+	virtual bool concurrent() const { return false; }
+
 	/* -- Node I/O - low level (direct) ---------------------------- */
 
 	virtual bool has_id(node_id_t node_id) = 0;
@@ -349,6 +403,8 @@ public:
 		assert(node);
 		node_dispose_id(node->id());
 		node_dealloc(node);
+		if (m_n_nodes > 0)
+			m_n_nodes--;
 	}
 
 	virtual shptr<node_type> node_alloc(node_id_t node_id) = 0;		// this must also perform a node_put() (put into cache)
@@ -377,6 +433,88 @@ public:
 	}
 	virtual shptr<node_type> node_put(shptr<node_type>& node) = 0;
 
+	/* -- Lookups -------------------------------------------------- */
+
+	virtual bool find(const key_type& key_, mapped_type& value_)
+	{
+		shptr<node_type> root_( root(false) );
+		if (! root_)
+			return false;
+		BTreeLookup<B_, KeyTraits, TTraits, Compare> where;
+		if (! root_->search(where, key_))
+			return false;
+		value_ = where.node()->value(where.pos());
+		return true;
+	}
+
+	/*
+	 * moves 'node' (child 'pos' of 'parent', or the root when 'parent' is
+	 * null) to the free id 'new_id', fixing up the references to it, and
+	 * disposes the old id. Returns the node at its new place.
+	 */
+	virtual shptr<node_type> node_relocate(shptr<node_type>& node, const shptr<node_type>& parent, int pos, node_id_t new_id)
+	{
+		assert(node);
+		assert(node_id_valid(node->id()));
+		assert(node_id_valid(new_id));
+		node_id_t old_id = node->id();
+		bool is_root = (this->rootId() == old_id);
+		assert(parent || is_root);
+
+		shptr<node_type> moved( node_alloc(new_id) );
+		assert(moved);
+		*moved = *node;
+		moved->id(new_id);
+		node_put(moved);
+
+		// the node keeps existing under its new id: don't touch the node count
+		node_dispose_id(old_id);
+		node_dealloc(node);
+		if (is_root)
+			this->rootId(new_id);
+
+		if (parent)
+		{
+			shptr<node_type> parent_( parent );
+			assert(parent_->child(pos) == old_id);
+			parent_->child(pos) = new_id;
+			node_put(parent_);
+		}
+		if (! moved->leaf())
+		{
+			for (int i = 0; i <= moved->n(); i++)
+			{
+				if (! moved->hasChild(i))
+					continue;
+				shptr<node_type> child( node_get(moved->child(i)) );
+				if (child && (child->parentId() == old_id))
+				{
+					child->parentId(new_id);
+					node_put(child);
+				}
+			}
+		}
+		if (moved->hasLeft())
+		{
+			shptr<node_type> left( node_get(moved->leftId()) );
+			if (left && (left->rightId() == old_id))
+			{
+				left->rightId(new_id);
+				node_put(left);
+			}
+		}
+		if (moved->hasRight())
+		{
+			shptr<node_type> right( node_get(moved->rightId()) );
+			if (right && (right->leftId() == old_id))
+			{
+				right->leftId(new_id);
+				node_put(right);
+			}
+		}
+		return moved;
+	}
+
 	/* -- Header I/O ----------------------------------------------- */
 
 	virtual bool header_write() { return true; }
@@ -393,6 +531,77 @@ protected:
 private:
 	BTreeStorage(const BTreeStorage& other);
 	BTreeStorage& operator= (const BTreeStorage& other);
+
+	friend class BTree<B_, KeyTraits, TTraits, Compare>;
+};
+
+
+/* ----------------------------------------------------------------- *
+ *   BTreeMemoryStorage                                              *
+ * ----------------------------------------------------------------- */
+
+/*
+ * the nodes of BTreeMemoryStorage by id, in chunks of slots found
+ * without locks. Chunks never move: when the ids outgrow the directory
+ * of chunks, a bigger copy is published and the old one is kept until
+ * clear(). Writers are serialized by the caller, and set the slot of a
+ * node before its id can be reached (eg. through its parent). erase()
+ * and clear() need no concurrent readers.
+ */
+template <typename NodeT>
+class BTreeNodeTable
+{
+public:
+	typedef shptr<NodeT> node_ptr_type;
+
+	static const size_t CHUNK_SIZE = 1024;		/* slots per chunk */
+
+	BTreeNodeTable() : m_directory(NULL) {}
+	~BTreeNodeTable() { clear(); }
+
+	node_ptr_type get(node_id_t node_id) const
+	{
+		slot_type* slot = find(node_id);
+		node_ptr_type* entry = slot ? slot->load(std::memory_order_acquire) : NULL;
+		return entry ? *entry : node_ptr_type();
+	}
+	bool has(node_id_t node_id) const { slot_type* slot = find(node_id); return slot && slot->load(std::memory_order_acquire); }
+
+	void set(node_id_t node_id, const node_ptr_type& node);
+	void erase(node_id_t node_id);
+	void clear();
+
+private:
+	BTreeNodeTable(const BTreeNodeTable& other);
+	BTreeNodeTable& operator= (const BTreeNodeTable& other);
+
+	typedef std::atomic<node_ptr_type*> slot_type;
+
+	struct directory_type
+	{
+		directory_type(size_t capacity_) : capacity(capacity_), chunks(new std::atomic<slot_type*>[capacity_])
+		{
+			for (size_t i = 0; i < capacity; i++)
+				chunks[i].store(NULL, std::memory_order_relaxed);
+		}
+		~directory_type() { delete[] chunks; }
+
+		size_t capacity;
+		std::atomic<slot_type*>* chunks;
+	};
+
+	slot_type* find(node_id_t node_id) const
+	{
+		directory_type* directory = m_directory.load(std::memory_order_acquire);
+		size_t chunk_i = static_cast<size_t>(node_id) / CHUNK_SIZE;
+		if ((! node_id_valid(node_id)) || (! directory) || (chunk_i >= directory->capacity))
+			return NULL;
+		slot_type* chunk = directory->chunks[chunk_i].load(std::memory_order_acquire);
+		return chunk ? &chunk[static_cast<size_t>(node_id) % CHUNK_SIZE] : NULL;
+	}
+
+	std::atomic<directory_type*> m_directory;
+	std::vector<directory_type*> m_retired;		/* outgrown, readers may still be on them */
 };
 
 template < int B_, typename KeyTraits, typename TTraits, class Compare = std::less<typename KeyTraits::type> >
@@ -410,7 +619,8 @@ public:
 	typedef BTree<B_, KeyTraits, TTraits, Compare> tree_type;
 	typedef BTreeNode<B_, KeyTraits, TTraits, Compare> node_type;
 	typedef BTreeStorage<B_, KeyTraits, TTraits, Compare> base_type;
-	typedef std::map< int, shptr<node_type> > node_map_type;
+	typedef BTreeNodeTable<node_type> node_table_type;
+	typedef std::lock_guard<std::recursive_mutex> lock_type;
 
 	static const int B = B_;
 
@@ -431,15 +641,19 @@ public:
 	bool close() { return base_type::close(); }
 	bool flush() { return true; }
 
-	bool openHelper(bool& created_) { created_ = true; m_next_id = 1; m_nodes.clear(); return true; }
-	bool closeHelper() { m_next_id = 1; m_nodes.clear(); return true; }
+	bool openHelper(bool& created_) { lock_type lock(m_mutex); created_ = true; m_next_id = 1; m_nodes.clear(); return true; }
+	bool closeHelper() { lock_type lock(m_mutex); m_next_id = 1; m_nodes.clear(); return true; }
+
+	/* nodes are looked up without locks, allocated and disposed under a mutex */
+	bool concurrent() const { return true; }
 
 	/* -- Node I/O - low level (direct) ---------------------------- */
 
-	bool has_id(node_id_t node_id) { return m_nodes.count(node_id) ? true : false; }
-	node_id_t node_alloc_id() { node_id_t id = m_next_id++; return id; }
+	bool has_id(node_id_t node_id) { return m_nodes.has(node_id); }
+	node_id_t node_alloc_id() { lock_type lock(m_mutex); node_id_t id = m_next_id++; return id; }
 	void node_dispose_id_helper(node_id_t node_id)
 	{
+		lock_type lock(m_mutex);
 		assert(node_id != NODE_ID_INVALID);
 		if (m_next_id == (node_id + 1))
 			m_next_id--;
@@ -450,7 +664,7 @@ public:
 	bool node_read(node_type& node)
 	{
 		assert(node.id() != NODE_ID_INVALID);
-		shptr<node_type> node_ptr( m_nodes[node.id()] );
+		shptr<node_type> node_ptr( m_nodes.get(node.id()) );
 		if (node_ptr)
 		{
 			if (node_ptr != &node)
@@ -462,8 +676,9 @@ public:
 	}
 	bool node_write(node_type& node)
 	{
+		lock_type lock(m_mutex);
 		assert(node.id() != NODE_ID_INVALID);
-		shptr<node_type> node_ptr( m_nodes[node.id()] );
+		shptr<node_type> node_ptr( m_nodes.get(node.id()) );
 		if (node_ptr)
 		{
 			if (node_ptr != &node)
@@ -472,26 +687,30 @@ public:
 		{
 			node_ptr.reset( new node_type(this->tree(), node.id()) );
 			*node_ptr = node;
-			m_nodes[node.id()] = node_ptr;
+			m_nodes.set(node.id(), node_ptr);
 		}
 		return true;
 	}
 
 	/* -- Node I/O - hight level (cached) -------------------------- */
 
+	shptr<node_type> node_child_alloc(shptr<node_type> parent) { lock_type lock(m_mutex); return base_type::node_child_alloc(parent); }
+
 	shptr<node_type> node_alloc(node_id_t node_id)
 	{
 		// this must also perform a node_put() (put into cache)
+		lock_type lock(m_mutex);
 		assert(node_id != NODE_ID_INVALID);
 		shptr<node_type> node_ptr( new node_type(this->tree(), node_id) );
 		assert(node_ptr && (node_ptr->id() == node_id));
 		assert(! node_ptr->dirty());
-		m_nodes[node_id] = node_ptr;
+		m_nodes.set(node_id, node_ptr);
 		return node_ptr;
 	}
 
 	void node_dealloc(shptr<node_type>& node)
 	{
+		lock_type lock(m_mutex);
 		if (node && (node->id() != NODE_ID_INVALID))
 			m_nodes.erase(node->id());
 		base_type::node_dealloc(node);
@@ -499,23 +718,20 @@ public:
 
 	shptr<node_type> node_get(node_id_t node_id)
 	{
-		typename node_map_type::const_iterator it = m_nodes.find(node_id);
-		if (it != m_nodes.end())
-		{
-			assert(node_id == it->first);
-			return it->second;
-		}
-		return shptr<node_type>();
+		shptr<node_type> node_ptr( m_nodes.get(node_id) );
+		assert((! node_ptr) || (node_ptr->id() == node_id));
+		return node_ptr;
 	}
 
 	shptr<node_type> node_put(shptr<node_type>& node)
 	{
 		assert(node);
 		assert(node->id() != NODE_ID_INVALID);
-		shptr<node_type> node_ptr( m_nodes[node->id()] );
+		shptr<node_type> node_ptr( m_nodes.get(node->id()) );
 		if (! node_ptr)
 		{
-			m_nodes[node->id()] = node;
+			lock_type lock(m_mutex);
+			m_nodes.set(node->id(), node);
 			node_ptr = node;
 		} else if (node_ptr != node)
 			*node_ptr = *node;
@@ -532,7 +748,8 @@ private:
 	BTreeMemoryStorage& operator= (const BTreeMemoryStorage& other);
 
 	node_id_t m_next_id;
-	node_map_type m_nodes;
+	node_table_type m_nodes;
+	mutable std::recursive_mutex m_mutex;		/* serializes allocations and disposals */
 };
 
 } /* end of namespace milliways */
@@ -86,6 +86,8 @@ shptr<typename BTree<B_, KeyTraits, TTraits, Compare>::node_type> BTree<B_, KeyT
 		assert(new_root->n() == 0);
 		new_root->child(0) = old_root->id();
 		new_root->rank(old_root->rank() - 1);
+		old_root->parentId(new_root->id());
+		node_put(old_root);
 		root(new_root);
 		new_root->split_child(0);
 		root_ = new_root;
@@ -107,6 +109,7 @@ shptr<typename BTree<B_, KeyTraits, TTraits, Compare>::node_type> BTree<B_, KeyT
 	shptr<node_type> node_( where.node() );
 	assert(node_);
 	node_->value(where.pos()) = value_;
+	node_put(node_);
 
 	return node_;
 }
@@ -124,7 +127,424 @@ bool BTree<B_, KeyTraits, TTraits, Compare>::remove(lookup_type& res, const key_
 {
 	shptr<node_type> root_( root() );
 	assert(root_);
-	return root_->remove(res, key_);
+	bool found = root_->remove(res, key_);
+
+	// merging the last two children of the root leaves it without keys:
+	// its only child becomes the new root
+	root_ = root();
+	while (root_ && (! root_->leaf()) && (root_->n() == 0))
+	{
+		shptr<node_type> new_root( root_->child_node(0) );
+		assert(new_root);
+		new_root->parentId(NODE_ID_INVALID);
+		node_put(new_root);
+		node_dispose(root_);
+		root(new_root);
+		root_ = new_root;
+	}
+	return found;
+}
+
+/* -- Optimistic lock coupling --------------------------------- */
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTree<B_, KeyTraits, TTraits, Compare>::concurrent_find(const key_type& key_, mapped_type& value_)
+{
+	static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<mapped_type>::value,
+			"optimistic readers need trivially copyable keys and values");
+	assert(m_io);
+	if (! m_io->concurrent())
+		return false;
+
+	bool restart = false;
+	bool found = concurrent_find_pass(key_, value_, restart);
+	while (restart)
+	{
+		std::this_thread::yield();
+		found = concurrent_find_pass(key_, value_, restart);
+	}
+	return found;
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTree<B_, KeyTraits, TTraits, Compare>::concurrent_put(const key_type& key_, const mapped_type& value_)
+{
+	static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<mapped_type>::value,
+			"optimistic readers need trivially copyable keys and values");
+	assert(m_io);
+	if (! m_io->concurrent())
+		return false;
+
+	bool restart = false;
+	bool ok = concurrent_put_pass(key_, value_, restart);
+	while (restart)
+	{
+		std::this_thread::yield();
+		ok = concurrent_put_pass(key_, value_, restart);
+	}
+	return ok;
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTree<B_, KeyTraits, TTraits, Compare>::concurrent_find_pass(const key_type& key_, mapped_type& value_, bool& restart)
+{
+	restart = true;
+
+	uint64_t root_version;
+	if (! m_root_latch.read_begin(root_version))
+		return false;
+	node_id_t node_id = rootId();
+	if (! node_id_valid(node_id))
+	{
+		restart = (! m_root_latch.validate(root_version));
+		return false;
+	}
+
+	shptr<node_type> node( node_get(node_id) );
+	uint64_t version;
+	if ((! node) || (! node->latch().read_begin(version)) || (! m_root_latch.validate(root_version)))
+		return false;
+
+	for (;;)
+	{
+		bool found = false;
+		int pos = node->locate(key_, found);
+		if (pos < 0)
+			return false;
+
+		if (node->leaf())
+		{
+			if (found)
+				value_ = node->value(pos);
+			restart = (! node->latch().validate(version));
+			return found;
+		}
+
+		node_id_t child_id = node->child(pos);
+		if (! node->latch().validate(version))
+			return false;
+
+		// the child is checked before letting go of its parent
+		shptr<node_type> child( node_get(child_id) );
+		uint64_t child_version;
+		if ((! child) || (! child->latch().read_begin(child_version)) || (! node->latch().validate(version)))
+			return false;
+
+		node = child;
+		version = child_version;
+	}
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTree<B_, KeyTraits, TTraits, Compare>::concurrent_put_pass(const key_type& key_, const mapped_type& value_, bool& restart)
+{
+	restart = true;
+
+	uint64_t root_version;
+	if (! m_root_latch.read_begin(root_version))
+		return false;
+
+	if (! hasRoot())
+	{
+		// the first writer creates the root
+		if (! m_root_latch.try_upgrade(root_version))
+			return false;
+		if (! hasRoot())
+			root(true);
+		m_root_latch.unlock();
+		return false;
+	}
+
+	shptr<node_type> node( node_get(rootId()) );
+	uint64_t version;
+	if ((! node) || (! node->latch().read_begin(version)) || (! m_root_latch.validate(root_version)))
+		return false;
+
+	if (node->full())
+	{
+		// grow at the top, as insert() does
+		if (! m_root_latch.try_upgrade(root_version))
+			return false;
+		if (! node->latch().try_upgrade(version))
+		{
+			m_root_latch.unlock();
+			return false;
+		}
+		std::vector< shptr<node_type> > moved;
+		if (! concurrent_latch_moved(node, moved))
+		{
+			node->latch().unlock();
+			m_root_latch.unlock();
+			return false;
+		}
+		shptr<node_type> old_root( node );
+		shptr<node_type> new_root( node_alloc() );
+		new_root->leaf(false);
+		assert(new_root->n() == 0);
+		new_root->child(0) = old_root->id();
+		new_root->rank(old_root->rank() - 1);
+		old_root->parentId(new_root->id());
+		node_put(old_root);
+		root(new_root);
+		new_root->split_child(0);
+		concurrent_unlatch(moved);
+		old_root->latch().unlock();
+		m_root_latch.unlock();
+		return false;
+	}
+
+	for (;;)
+	{
+		bool found = false;
+		int pos = node->locate(key_, found);
+		if (pos < 0)
+			return false;
+
+		if (node->leaf())
+		{
+			// unchanged since its parent pointed here: still the leaf of the key, and not full
+			if (! node->latch().try_upgrade(version))
+				return false;
+			if (found)
+			{
+				node->value(pos) = value_;
+				node_put(node);
+			} else
+				node->insert_non_full(key_, value_);
+			node->latch().unlock();
+			restart = false;
+			return true;
+		}
+
+		node_id_t child_id = node->child(pos);
+		if (! node->latch().validate(version))
+			return false;
+
+		shptr<node_type> child( node_get(child_id) );
+		uint64_t child_version;
+		if ((! child) || (! child->latch().read_begin(child_version)) || (! node->latch().validate(version)))
+			return false;
+
+		if (child->full())
+		{
+			// split it from its parent (not full, or it would have been split on the way down)
+			if (! node->latch().try_upgrade(version))
+				return false;
+			if (! child->latch().try_upgrade(child_version))
+			{
+				node->latch().unlock();
+				return false;
+			}
+			shptr<node_type> right;
+			if (child->hasRight())
+			{
+				right = node_get(child->rightId());
+				if (right && (! right->latch().try_lock()))
+				{
+					child->latch().unlock();
+					node->latch().unlock();
+					return false;
+				}
+			}
+			std::vector< shptr<node_type> > moved;
+			if (! concurrent_latch_moved(child, moved))
+			{
+				if (right)
+					right->latch().unlock();
+				child->latch().unlock();
+				node->latch().unlock();
+				return false;
+			}
+			node->split_child(pos);
+			concurrent_unlatch(moved);
+			if (right)
+				right->latch().unlock();
+			child->latch().unlock();
+			node->latch().unlock();
+			return false;
+		}
+
+		node = child;
+		version = child_version;
+	}
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTree<B_, KeyTraits, TTraits, Compare>::concurrent_latch_moved(const shptr<node_type>& node, std::vector< shptr<node_type> >& latched)
+{
+	latched.clear();
+	if (node->leaf())
+		return true;
+
+	// split_child() hands children B..2B-1 over to the new node (see BTreeNode::adopt_child())
+	assert(node->full());
+	for (int j = B; j <= node->n(); j++)
+	{
+		shptr<node_type> child( node_get(node->child(j)) );
+		if ((! child) || (! child->latch().try_lock()))
+		{
+			concurrent_unlatch(latched);
+			return false;
+		}
+		latched.push_back(child);
+	}
+	return true;
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTree<B_, KeyTraits, TTraits, Compare>::concurrent_unlatch(std::vector< shptr<node_type> >& latched)
+{
+	typename std::vector< shptr<node_type> >::iterator it;
+	for (it = latched.begin(); it != latched.end(); ++it)
+		(*it)->latch().unlock();
+	latched.clear();
+}
+
+/* number of nodes for n_items, at most per_node and (if more than one node) at least min_items each */
+inline size_t btree_bulk_nodes(size_t n_items, size_t per_node, size_t min_items)
+{
+	assert(per_node >= min_items);
+	size_t n_nodes = (n_items + per_node - 1) / per_node;
+	if ((n_nodes > 1) && ((n_items / n_nodes) < min_items))
+		n_nodes--;
+	return (n_nodes > 0) ? n_nodes : 1;
+}
+
+/* items of node j when n_items are spread evenly over n_nodes */
+inline size_t btree_bulk_share(size_t n_items, size_t n_nodes, size_t j)
+{
+	return (n_items / n_nodes) + ((j < (n_items % n_nodes)) ? 1 : 0);
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+template <class ForwardIterator>
+bool BTree<B_, KeyTraits, TTraits, Compare>::bulk_load(ForwardIterator first, ForwardIterator last, double fill_factor)
+{
+	assert(m_io);
+	if (! empty())
+		return false;
+
+	// sorted input only, in the order of the key traits
+	size_t n_entries = 0;
+	ForwardIterator prev = first;
+	for (ForwardIterator it = first; it != last; ++it)
+	{
+		if ((n_entries > 0) && (KeyTraits::compare(key_type(prev->first), key_type(it->first)) >= 0))
+			return false;
+		prev = it;
+		n_entries++;
+	}
+	if (n_entries == 0)
+		return true;
+
+	if (fill_factor > 1.0)
+		fill_factor = 1.0;
+	size_t leaf_min = (B > 1) ? (B - 1) : 1;
+	size_t leaf_fill = static_cast<size_t>(fill_factor * (2 * B - 1) + 0.5);
+	if (leaf_fill < leaf_min)
+		leaf_fill = leaf_min;
+	size_t node_min = B;
+	size_t node_fill = static_cast<size_t>(fill_factor * (2 * B) + 0.5);
+	if (node_fill < node_min)
+		node_fill = node_min;
+
+	// shape of the tree: number of nodes per level, from the leaves up
+	std::vector<size_t> level_nodes;
+	level_nodes.push_back(btree_bulk_nodes(n_entries, leaf_fill, leaf_min));
+	while (level_nodes.back() > 1)
+		level_nodes.push_back(btree_bulk_nodes(level_nodes.back(), node_fill, node_min));
+	int height = static_cast<int>(level_nodes.size());
+
+	shptr<node_type> old_root( root(false) );
+	if (old_root)
+		node_dispose(old_root);
+
+	// ids are known up front, so that links and parents can be written along with each node
+	std::vector< std::vector<node_id_t> > ids(height);
+	for (int level = 0; level < height; level++)
+	{
+		ids[level].reserve(level_nodes[level]);
+		for (size_t j = 0; j < level_nodes[level]; j++)
+		{
+			node_id_t node_id = m_io->node_alloc_id();
+			if (! node_id_valid(node_id))
+				return false;
+			ids[level].push_back(node_id);
+		}
+	}
+
+	std::vector<key_type> first_keys;		/* smallest key under each node of the level below */
+	size_t n_nodes = 0;
+	ForwardIterator it = first;
+	for (int level = 0; level < height; level++)
+	{
+		const std::vector<node_id_t>& level_ids = ids[level];
+		size_t count = level_ids.size();
+		size_t n_items = (level == 0) ? n_entries : ids[level - 1].size();
+		size_t item = 0;
+		size_t parent_j = 0, parent_used = 0;
+
+		std::vector<key_type> level_first_keys;
+		level_first_keys.reserve(count);
+
+		for (size_t j = 0; j < count; j++)
+		{
+			node_type node(this, level_ids[j]);
+			node.leaf(level == 0);
+			node.rank(height - 1 - level);
+			if (j > 0)
+				node.leftId(level_ids[j - 1]);
+			if ((j + 1) < count)
+				node.rightId(level_ids[j + 1]);
+			if ((level + 1) < height)
+			{
+				const std::vector<node_id_t>& parent_ids = ids[level + 1];
+				node.parentId(parent_ids[parent_j]);
+				if (++parent_used == btree_bulk_share(count, parent_ids.size(), parent_j))
+				{
+					parent_j++;
+					parent_used = 0;
+				}
+			}
+
+			int share = static_cast<int>(btree_bulk_share(n_items, count, j));
+			if (level == 0)
+			{
+				assert(share <= (2 * B - 1));
+				for (int i = 0; i < share; i++, ++it)
+				{
+					node.key(i) = it->first;
+					node.value(i) = it->second;
+				}
+				node.n(share);
+				level_first_keys.push_back(node.key(0));
+			} else
+			{
+				// 'share' children, separated by the smallest key under each but the first
+				assert(share <= (2 * B));
+				for (int i = 0; i < share; i++)
+				{
+					node.child(i) = ids[level - 1][item + i];
+					if (i > 0)
+						node.key(i - 1) = first_keys[item + i];
+				}
+				node.n(share - 1);
+				level_first_keys.push_back(first_keys[item]);
+			}
+			item += share;
+
+			if (! m_io->node_write(node))
+				return false;
+			n_nodes++;
+		}
+		assert(item == n_items);
+
+		first_keys.swap(level_first_keys);
+	}
+
+	rootId(ids[height - 1][0]);
+	m_io->size(m_io->size() + n_nodes);
+	return true;
 }
 
 
@@ -262,7 +682,12 @@ bool BTreeStorage<B_, KeyTraits, TTraits, Compare>::open()
 	if (! openHelper(created_))
 		return false;
 	m_created = created_;
-	return postOpen();
+	if (postOpen())
+		return true;
+
+	/* left closed and as found: a refused file isn't rewritten */
+	abandonHelper();
+	return false;
 }
 
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
@@ -293,6 +718,89 @@ bool BTreeStorage<B_, KeyTraits, TTraits, Compare>::preClose()
 	return header_write();
 }
 
+
+/* ----------------------------------------------------------------- *
+ *   BTreeNodeTable                                                  *
+ * ----------------------------------------------------------------- */
+
+template <typename NodeT>
+const size_t BTreeNodeTable<NodeT>::CHUNK_SIZE;
+
+template <typename NodeT>
+void BTreeNodeTable<NodeT>::set(node_id_t node_id, const node_ptr_type& node)
+{
+	assert(node_id_valid(node_id));
+	size_t chunk_i = static_cast<size_t>(node_id) / CHUNK_SIZE;
+
+	directory_type* directory = m_directory.load(std::memory_order_relaxed);
+	if ((! directory) || (chunk_i >= directory->capacity))
+	{
+		size_t capacity = directory ? directory->capacity : 16;
+		while (capacity <= chunk_i)
+			capacity *= 2;
+		directory_type* grown = new directory_type(capacity);
+		if (directory)
+		{
+			for (size_t i = 0; i < directory->capacity; i++)
+				grown->chunks[i].store(directory->chunks[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			m_retired.push_back(directory);
+		}
+		m_directory.store(grown, std::memory_order_release);
+		directory = grown;
+	}
+
+	slot_type* chunk = directory->chunks[chunk_i].load(std::memory_order_relaxed);
+	if (! chunk)
+	{
+		chunk = new slot_type[CHUNK_SIZE];
+		for (size_t i = 0; i < CHUNK_SIZE; i++)
+			chunk[i].store(NULL, std::memory_order_relaxed);
+		directory->chunks[chunk_i].store(chunk, std::memory_order_release);
+	}
+
+	/* a slot in use is replaced only without concurrent readers */
+	slot_type& slot = chunk[static_cast<size_t>(node_id) % CHUNK_SIZE];
+	node_ptr_type* old = slot.load(std::memory_order_relaxed);
+	slot.store(new node_ptr_type(node), std::memory_order_release);
+	delete old;
+}
+
+template <typename NodeT>
+void BTreeNodeTable<NodeT>::erase(node_id_t node_id)
+{
+	slot_type* slot = find(node_id);
+	if (! slot)
+		return;
+	node_ptr_type* old = slot->load(std::memory_order_relaxed);
+	slot->store(NULL, std::memory_order_release);
+	delete old;
+}
+
+template <typename NodeT>
+void BTreeNodeTable<NodeT>::clear()
+{
+	directory_type* directory = m_directory.load(std::memory_order_relaxed);
+	if (directory)
+	{
+		for (size_t i = 0; i < directory->capacity; i++)
+		{
+			slot_type* chunk = directory->chunks[i].load(std::memory_order_relaxed);
+			if (! chunk)
+				continue;
+			for (size_t j = 0; j < CHUNK_SIZE; j++)
+				delete chunk[j].load(std::memory_order_relaxed);
+			delete[] chunk;
+		}
+		delete directory;
+		m_directory.store(NULL, std::memory_order_release);
+	}
+
+	typename std::vector<directory_type*>::iterator it;
+	for (it = m_retired.begin(); it != m_retired.end(); ++it)
+		delete *it;
+	m_retired.clear();
+}
+
 } /* end of namespace milliways */
 
 #endif /* MILLIWAYS_BTREE_IMPL_H */
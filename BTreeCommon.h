@@ -47,9 +47,10 @@
 #define MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE 8192
 #endif /* MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE */
 
-#ifndef MILLIWAYS_DEFAULT_NODE_CACHE_SIZE
-#define MILLIWAYS_DEFAULT_NODE_CACHE_SIZE 1024
-#endif /* MILLIWAYS_DEFAULT_NODE_CACHE_SIZE */
+/* top levels of a B+tree (root included) kept pinned in the block cache */
+#ifndef MILLIWAYS_DEFAULT_PINNED_LEVELS
+#define MILLIWAYS_DEFAULT_PINNED_LEVELS 2
+#endif /* MILLIWAYS_DEFAULT_PINNED_LEVELS */
 
 
 /* ----------------------------------------------------------------- */
@@ -66,6 +67,20 @@ static const node_id_t NODE_ID_INVALID = static_cast<node_id_t>(BLOCK_ID_INVALID
 
 inline bool node_id_valid(node_id_t node_id) { return (node_id != NODE_ID_INVALID); }
 
+/*
+ * heap memory owned by a key or value beyond its sizeof: none for the
+ * inline types (integers, FixedKey), the buffer of a std::string too long
+ * for its small string storage
+ */
+template <typename T>
+inline size_t heap_footprint(const T& value) { UNUSED(value); return 0; }
+
+inline size_t heap_footprint(const std::string& value)
+{
+	static const size_t inline_capacity = std::string().capacity();
+	return (value.capacity() > inline_capacity) ? (value.capacity() + 1) : 0;
+}
+
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
 class BTreeNode;
 
@@ -78,7 +93,7 @@ class BTreeStorage;
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
 class BTreeMemoryStorage;
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
 class BTreeFileStorage;
 
 } /* end of namespace milliways */
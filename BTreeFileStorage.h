@@ -26,110 +26,148 @@
 #include <string>
 #include <functional>
 #include <array>
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
 
 #include <stdint.h>
 #include <assert.h>
 
 #include "BlockStorage.h"
 #include "BTreeCommon.h"
-#include "LRUCache.h"
 
 namespace milliways {
 
-template < size_t CACHESIZE, size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare = std::less<typename KeyTraits::type> >
-class LRUNodeCache : public LRUCache< CACHESIZE, node_id_t, shptr< BTreeNode<B_, KeyTraits, TTraits, Compare> > >
+/* ----------------------------------------------------------------- *
+ *   BTreeNodePayload                                                *
+ * ----------------------------------------------------------------- */
+
+/*
+ * decoded node attached to its cached block (see Block::payload()), so
+ * that a node lives only once in the block storage buffer pool, in its
+ * serialized form, decoded form or both
+ */
+template <class StorageT>
+class BTreeNodePayload : public BlockPayload<StorageT::BlockSize>
 {
 public:
-	typedef node_id_t key_type;
-	typedef BTreeNode<B_, KeyTraits, TTraits, Compare> node_type;
-	typedef shptr<node_type> node_ptr_type;
-	typedef node_ptr_type mapped_type;
-	typedef std::pair<key_type, mapped_type> value_type;
-	typedef ordered_map<key_type, mapped_type> ordered_map_type;
-	typedef LRUCache<CACHESIZE, node_id_t, node_ptr_type> base_type;
-	typedef typename base_type::size_type size_type;
-
-	typedef BTreeStorage<B_, KeyTraits, TTraits, Compare>* storage_ptr_type;
+	typedef StorageT storage_type;
+	typedef typename StorageT::node_type node_type;
+	typedef typename StorageT::block_t block_t;
 
-	static const size_type Size = CACHESIZE;
-	static const size_type BlockSize = BLOCKSIZE;
-	static const node_id_t InvalidCacheKey = NODE_ID_INVALID;
+	BTreeNodePayload(storage_type* storage, const shptr<node_type>& node) :
+			m_storage(storage), m_node(node) { assert(storage); assert(node); }
 
-	LRUNodeCache(storage_ptr_type storage) :
-			base_type(LRUNodeCache::InvalidCacheKey), m_storage(storage) {}
-	~LRUNodeCache() { this->evict_all(); }
+	const shptr<node_type>& node() const { return m_node; }
 
-	bool on_miss(typename base_type::op_type op, const key_type& key, mapped_type& value)
-	{
-		// std::cerr << "node MISS id:" << key << " op:" << (int)op << "\n";
-		node_id_t node_id = key;
-		if (m_storage->has_id(node_id)) {
-			/* allocate node object and read node data from disk */
-			shptr<node_type> node( new node_type(m_storage->tree(), node_id) );
-			if (! node) return false;
-			assert(node->id() == node_id);
-			switch (op)
-			{
-			case base_type::op_get:
-				if (! m_storage->node_read(*node)) return false;
-				node->dirty(false);
-				value = node;
-				break;
-			case base_type::op_set:
-				assert(value);
-				*node = *value;
-				break;
-			case base_type::op_sub:
-				//assert(value);
-				bool rv = m_storage->node_read(*node);
-				assert(rv || node->dirty());
-				value = node;
-				return rv;
-				break;
-			}
-			return true;
-		}
-		return false;
-	}
-	bool on_set(const key_type& key, const mapped_type& value)
+	bool encode(block_t& dst) { return m_storage->serialize_node(dst, *m_node); }
+	/* the node and the heap memory of its keys and values (see heap_footprint()) */
+	size_t footprint() const
 	{
-		return true;
-	}
-	//bool on_delete(const key_type& key);
-	bool on_eviction(const key_type& key, mapped_type& value)
-	{
-		/* write back block */
-		/* node_id_t node_id = key; */
-		node_type* node = value.get();
-		if (node)
-		{
-			if (node->id() != NODE_ID_INVALID)
-			{
-				bool ok = m_storage->node_write(*node);
-				assert(ok);
-			}
-			// node->id(NODE_ID_INVALID);
-			// value.reset();
-		}
-		return true;
+		size_t n = sizeof(node_type);
+		for (size_t i = 0; i < m_node->keys().size(); i++)
+			n += heap_footprint(m_node->keys()[i]) + heap_footprint(m_node->values()[i]);
+		return n;
 	}
 
 private:
-	storage_ptr_type m_storage;
+	storage_type* m_storage;
+	shptr<node_type> m_node;
+};
+
+/* ----------------------------------------------------------------- *
+ *   BTreeNodeView                                                   *
+ * ----------------------------------------------------------------- */
+
+/*
+ * read-only view of a node: the serialized block, interpreted in place
+ * (header fields, keys deserialized one at a time on access), or the
+ * materialized node when the node cache holds one (it may be newer than
+ * its block). See BTreeFileStorage::node_view().
+ */
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare = std::less<typename KeyTraits::type> >
+class BTreeNodeView
+{
+public:
+	static const int B = B_;
+	static const size_t BlockSize = BLOCKSIZE;
+
+	typedef Block<BLOCKSIZE> block_t;
+	typedef typename KeyTraits::type key_type;
+	typedef typename TTraits::type mapped_type;
+	typedef BTreeNode<B_, KeyTraits, TTraits, Compare> node_type;
+
+	BTreeNodeView() { reset(); }
+
+	void reset();
+	bool reset(const shptr<node_type>& node);
+	bool reset(const shptr<block_t>& block);
+
+	bool valid() const { return node_id_valid(m_id); }
+	bool materialized() const { return m_node ? true : false; }
+
+	node_id_t id() const { return m_id; }
+	node_id_t parentId() const { return m_parent_id; }
+	node_id_t leftId() const { return m_left_id; }
+	node_id_t rightId() const { return m_right_id; }
+	bool hasLeft() const { return node_id_valid(m_left_id); }
+	bool hasRight() const { return node_id_valid(m_right_id); }
+	bool leaf() const { return m_leaf; }
+	int n() const { return m_n; }
+	int rank() const { return m_rank; }
+
+	bool key(int i, key_type& dst) const;
+	key_type key(int i) const { key_type dst; key(i, dst); return dst; }
+	/*
+	 * the bytes of a key in place in the block, for keys serialized as
+	 * length + bytes (std::string, FixedKey). False on materialized nodes.
+	 */
+	bool keyData(int i, const char*& bytes, size_t& length) const;
+	bool value(int i, mapped_type& dst) const;
+	node_id_t child(int i) const;
+
+	/* same result as BTreeNode::bsearch() */
+	bool bsearch(const key_type& key_, int& pos) const;
+
+private:
+	const char* data() const;
+
+	shptr<node_type> m_node;
+	shptr<block_t> m_block;
+	uint32_t m_version;
+
+	node_id_t m_id;
+	node_id_t m_parent_id;
+	node_id_t m_left_id;
+	node_id_t m_right_id;
+	bool m_leaf;
+	int m_n;
+	int m_rank;
+
+	/* block offsets of the keys, then (at n) of the values or children */
+	std::array<uint16_t, 2 * B_> m_offsets;
 };
 
 template <size_t BLOCKSIZE, size_t MAX_SERIALIZED_KEYSIZE, typename TTraits>
 int BTreeFileStorage_Compute_Max_B();
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare = std::less<typename KeyTraits::type> >
+/*
+ * The block storage backend is a template parameter: it can be any
+ * BlockStorage providing cached get()/put() of blocks, for example
+ * FileBlockStorage (with the StreamFileIO or PosixFileIO engine) or
+ * MmapBlockStorage.
+ */
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare = std::less<typename KeyTraits::type>, class BlockStorageT = FileBlockStorage<BLOCKSIZE, MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE> >
 class BTreeFileStorage : public BTreeStorage<B_, KeyTraits, TTraits, Compare>
 {
 public:
 	static const size_t BlockSize = BLOCKSIZE;
 	static const int BlockCacheSize = MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE;
+	static const int FORMAT_VERSION = 1;		/* 1: internal splits move the median up, no shared child */
 
 	typedef Block<BLOCKSIZE> block_t;
-	typedef FileBlockStorage<BLOCKSIZE, BlockCacheSize> block_storage_t;
+	typedef BlockStorageT block_storage_t;
 
 	typedef KeyTraits key_traits_type;
 	typedef TTraits mapped_traits_type;
@@ -143,12 +181,14 @@ public:
 	typedef BTreeNode<B_, KeyTraits, TTraits, Compare> node_type;
 	typedef BTreeStorage<B_, KeyTraits, TTraits, Compare> base_type;
 
-	typedef LRUNodeCache< MILLIWAYS_DEFAULT_NODE_CACHE_SIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare > cache_type;
+	typedef BTreeNodePayload<BTreeFileStorage> node_payload_type;
+	typedef BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare> node_view_type;
 
 	static const int B = B_;
 
 	BTreeFileStorage(block_storage_t* block_storage) :
-			BTreeStorage<B_, KeyTraits, TTraits, Compare>(), m_block_storage(block_storage), m_bs_allocated(false), m_btree_header_uid(-1), m_lru(this)
+			BTreeStorage<B_, KeyTraits, TTraits, Compare>(), m_block_storage(block_storage), m_bs_allocated(false), m_btree_header_uid(-1), m_format(FORMAT_VERSION),
+			m_pinned_levels(MILLIWAYS_DEFAULT_PINNED_LEVELS), m_root_rank(0), m_root_seen(false)
 	{
 		assert(block_storage);
 		m_btree_header_uid = m_block_storage->allocUserHeader();
@@ -156,7 +196,8 @@ public:
 	}
 
 	BTreeFileStorage(const std::string& pathname) :
-			BTreeStorage<B_, KeyTraits, TTraits, Compare>(), m_block_storage(NULL), m_bs_allocated(false), m_btree_header_uid(-1), m_lru(this)
+			BTreeStorage<B_, KeyTraits, TTraits, Compare>(), m_block_storage(NULL), m_bs_allocated(false), m_btree_header_uid(-1), m_format(FORMAT_VERSION),
+			m_pinned_levels(MILLIWAYS_DEFAULT_PINNED_LEVELS), m_root_rank(0), m_root_seen(false)
 	{
 		m_block_storage = new block_storage_t(pathname);
 		m_bs_allocated = true;
@@ -176,10 +217,23 @@ public:
 	bool isOpen() const { assert(m_block_storage); return m_block_storage->isOpen(); }
 	bool open() { return base_type::open(); }
 	bool close() { return base_type::close(); }
-	bool flush() { assert(m_block_storage); return m_block_storage->flush(); }
+	bool flush();
 
 	bool openHelper(bool& created_) { assert(m_block_storage); bool r = m_block_storage->open(); created_ = m_block_storage->created(); return r; }
-	bool closeHelper() { assert(m_block_storage); m_lru.evict_all(); return m_block_storage->close(); }
+	bool closeHelper() { assert(m_block_storage); unpin_all(); return m_block_storage->close(); }
+	bool abandonHelper() { assert(m_block_storage); unpin_all(); return m_block_storage->abandon(); }
+
+	/*
+	 * trees of an older format (see FORMAT_VERSION) are migrated on open:
+	 * format 0 internal nodes could share a child between both halves of
+	 * a split, which remove() can't rebalance. The entries are read along
+	 * the leaf links, bulk loaded into fresh nodes, the old nodes disposed
+	 * and the result flushed (atomically in copy-on-write mode). Until
+	 * then the file keeps the old tree. Newer formats are refused, and
+	 * the refused file is left as found.
+	 */
+	bool postOpen();
+	int format() const { return m_format; }
 
 	/* -- Node I/O - low level (direct) ---------------------------- */
 
@@ -192,11 +246,50 @@ public:
 
 	/* -- Node I/O - hight level (cached) -------------------------- */
 
+	/*
+	 * nodes are cached as payloads of their blocks, in the block storage
+	 * cache. Nodes handed out can be modified in place by the tree, so
+	 * their pages are considered modified (re-encoded when written back).
+	 */
+
 	shptr<node_type> node_alloc(node_id_t node_id);
 	void node_dealloc(shptr<node_type>& node);
 	shptr<node_type> node_get(node_id_t node_id);
 	shptr<node_type> node_put(shptr<node_type>& node);
 
+	/* -- Node views (read-only, no materialization) --------------- */
+
+	bool node_view(node_id_t node_id, node_view_type& view);
+	bool find(const key_type& key_, mapped_type& value_);
+
+	/* read-ahead of the nodes about to be viewed, see the block storage prefetch() */
+	size_t prefetch(const std::vector<node_id_t>& node_ids) { assert(m_block_storage); return m_block_storage->prefetch(node_ids); }
+
+	/* -- Copy-on-write -------------------------------------------- */
+
+	/*
+	 * with a block storage in copy-on-write mode (see FileBlockStorage,
+	 * set before open()) modified nodes go to fresh blocks and flush()
+	 * commits them atomically along with the header holding the root id:
+	 * after a crash the tree reopens as of its last flush().
+	 */
+	bool copyOnWrite() const { assert(m_block_storage); return m_block_storage->copyOnWrite(); }
+	void copyOnWrite(bool value) { assert(m_block_storage); m_block_storage->copyOnWrite(value); }
+
+	/* -- Pinning -------------------------------------------------- */
+
+	/*
+	 * the blocks of the nodes in the top pinnedLevels() levels (0: none)
+	 * are pinned in the block cache as the nodes are met, so that lookups
+	 * start from cached pages whatever the leaf traffic. Levels are
+	 * counted by rank() from the root, and follow root splits/collapses.
+	 * Pins are capped at half of the block cache capacity. Concurrent
+	 * readers update them under their own lock.
+	 */
+	int pinnedLevels() const { std::lock_guard<std::mutex> lock(m_pin_mutex); return m_pinned_levels; }
+	void pinnedLevels(int n_levels);
+	size_type pinnedCount() const { std::lock_guard<std::mutex> lock(m_pin_mutex); return m_pinned.size(); }
+
 	/* -- Header I/O ----------------------------------------------- */
 
 	bool header_write();
@@ -211,11 +304,24 @@ private:
 	BTreeFileStorage(const BTreeFileStorage& other);
 	BTreeFileStorage& operator= (const BTreeFileStorage& other);
 
+	static node_payload_type* node_payload(const shptr<block_t>& block) { return block ? dynamic_cast<node_payload_type*>(block->payload()) : NULL; }
+
+	bool migrate();
+
+	void pin_update(node_id_t node_id, int rank);
+	void unpin_deeper();						/* called with m_pin_mutex held */
+	void unpin_all();
+
 	block_storage_t* m_block_storage;
 	bool m_bs_allocated;
 	int m_btree_header_uid;
+	int m_format;							/* as found on open */
 
-	cache_type m_lru;
+	int m_pinned_levels;
+	std::map<node_id_t, int> m_pinned;		/* pinned node id -> rank */
+	int m_root_rank;
+	bool m_root_seen;
+	mutable std::mutex m_pin_mutex;
 };
 
 } /* end of namespace milliways */
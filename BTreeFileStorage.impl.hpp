@@ -30,18 +30,11 @@
 
 namespace milliways {
 
-template < size_t CACHESIZE, size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-const typename LRUNodeCache<CACHESIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::size_type LRUNodeCache<CACHESIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::Size;
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+const int BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::FORMAT_VERSION;
 
-template < size_t CACHESIZE, size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-const typename LRUNodeCache<CACHESIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::size_type LRUNodeCache<CACHESIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::BlockSize;
-
-template < size_t CACHESIZE, size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-const node_id_t LRUNodeCache<CACHESIZE, BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::InvalidCacheKey;
-
-
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::~BTreeFileStorage()
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::~BTreeFileStorage()
 {
 	if (isOpen())
 	{
@@ -57,19 +50,108 @@ BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::~BTreeFileStorage(
 	}
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_dispose_id_helper(node_id_t node_id)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::flush()
+{
+	assert(m_block_storage);
+	if (! isOpen())
+		return false;
+
+	/* nodes are re-encoded into their blocks as the block storage writes back dirty blocks in order */
+	bool ok = header_write();
+	if (! m_block_storage->flush())
+		ok = false;
+	return ok;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::postOpen()
+{
+	m_format = FORMAT_VERSION;
+	if (! base_type::postOpen())
+		return false;
+	if (m_format < FORMAT_VERSION)
+		return migrate();
+	return true;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::migrate()
+{
+	assert(isOpen());
+	assert(this->tree());
+	std::cerr << "'" << m_block_storage->pathname() << "' btree format " << m_format << ", migrating to " << FORMAT_VERSION << std::endl;
+
+	/* the entries in key order, along the leaf links (leaves were never shared) */
+	std::vector<value_type> entries;
+	shptr<node_type> node( this->root(false) );
+	while (node && (! node->leaf()))
+		node = this->node_get(node->child(0));
+	while (node)
+	{
+		for (int i = 0; i < node->n(); i++)
+			entries.push_back(value_type(node->key(i), node->value(i)));
+		node = node_id_valid(node->rightId()) ? this->node_get(node->rightId()) : shptr<node_type>();
+	}
+
+	/* the old nodes, each once even when shared */
+	std::set<node_id_t> old_ids;
+	std::vector<node_id_t> pending;
+	if (this->hasRoot())
+		pending.push_back(this->rootId());
+	while (! pending.empty())
+	{
+		node_id_t node_id = pending.back();
+		pending.pop_back();
+		if (! old_ids.insert(node_id).second)
+			continue;
+		node = this->node_get(node_id);
+		if (! node)
+			return false;
+		if (! node->leaf())
+			for (int i = 0; i <= node->n(); i++)
+				pending.push_back(node->child(i));
+	}
+	node.reset();
+
+	/* the new tree goes to fresh blocks, the old one is still allocated */
+	unpin_all();
+	this->rootId(NODE_ID_INVALID);
+	if (! this->tree()->bulk_load(entries.begin(), entries.end()))
+		return false;
+
+	typename std::set<node_id_t>::const_iterator it;
+	for (it = old_ids.begin(); it != old_ids.end(); ++it)
+	{
+		shptr<node_type> old_node( this->node_get(*it) );
+		if (old_node)
+			this->node_dispose(old_node);
+	}
+
+	m_format = FORMAT_VERSION;
+	return flush();
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_dispose_id_helper(node_id_t node_id)
 {
 	assert(m_block_storage);
 	assert(m_block_storage->isOpen());
 	assert(node_id != NODE_ID_INVALID);
+	std::unique_lock<std::mutex> lock(m_pin_mutex);
 	if (this->rootId() == node_id)
+	{
 		this->rootId(NODE_ID_INVALID);
+		m_root_seen = false;
+	}
+	/* disposing drops the block from the cache, pin included */
+	m_pinned.erase(node_id);
+	lock.unlock();
 	m_block_storage->dispose(static_cast<block_id_t>(node_id));
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_read(node_type& node)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_read(node_type& node)
 {
 	assert(m_block_storage);
 	assert(m_block_storage->isOpen());
@@ -77,25 +159,25 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_read(nod
 	// std::cerr << "nFS::node_read(" << node.id() << ")\n";
 	node_id_t node_id = node.id();
 	shptr<block_t> block( m_block_storage->get(static_cast<block_id_t>(node_id)) );
-	if ((! block) || block->dirty())
+	if (! block)
 	{
 		node.dirty(true);
 		// std::cerr << "nFS::node_read(" << node.id() << ") <- DIRTY\n";
 		return false;
 	}
-	assert(block && (! block->dirty()));
+	assert(block);
 	// TODO: convert block to node
 	// TODO: implement LRU node cache
+	/* fails on blocks not holding this node (eg. allocated but never written) */
 	bool ok = deserialize_node(node, *block);
 	node.dirty(!ok);
 	assert(node.id() == node_id);
-	assert(! node.dirty());
 	// std::cerr << "nFS::node_read(" << node.id() << ") <- " << (ok ? "OK" : "NO") << std::endl;
 	return ok;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_write(node_type& node)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_write(node_type& node)
 {
 	assert(m_block_storage);
 	assert(m_block_storage->isOpen());
@@ -109,36 +191,51 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_write(no
 
 	assert(node_id != NODE_ID_INVALID);
 
-	block_t block(static_cast<block_id_t>(node_id));
-	assert(! block.dirty());
+	/* serialized in place into the cached block, no intermediate copy */
+	shptr<block_t> block( m_block_storage->claim(static_cast<block_id_t>(node_id)) );
+	if (! block)
+		return false;
+	assert(block->index() == static_cast<block_id_t>(node_id));
 
-	bool ok = serialize_node(block, node);
-	m_block_storage->put(block);
-	assert(block.index() == static_cast<block_id_t>(node_id));
+	node_payload_type* payload = node_payload(block);
+	if (payload && (payload->node().get() == &node))
+	{
+		block->modified();
+		return true;
+	}
+
+	block->discard();
+	memset(block->data(), 0, BLOCKSIZE);
+	bool ok = serialize_node(*block, node);
+	block->dirty(true);
 	node.dirty(!ok);
 
 	// std::cerr << "nFS::node_write(" << node.id() << ") <- " << (ok ? "OK" : "NO") << std::endl;
 	return ok;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_alloc(node_id_t node_id)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_alloc(node_id_t node_id)
 {
 	// std::cerr << "nFS::node_alloc(" << node_id << ")\n";
 	assert(node_id != NODE_ID_INVALID);
 	assert(m_block_storage);
 	assert(m_block_storage->isOpen());
 
-	assert (! m_lru.has(node_id));
 	shptr<node_type> node_ptr( new node_type(this->tree(), node_id) );
 	assert(node_ptr && (node_ptr->id() == node_id));
-	m_lru.set(node_id, node_ptr);
+
+	/* a new node: nothing to read, the node is the page content */
+	shptr<block_t> block( m_block_storage->claim(static_cast<block_id_t>(node_id)) );
+	assert(block);
+	block->payload(new node_payload_type(this, node_ptr));
+	block->modified();
 	assert(! node_ptr->dirty());
 	return node_ptr;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_dealloc(shptr<node_type>& node)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_dealloc(shptr<node_type>& node)
 {
 	// std::cerr << "nFS::node_dealloc(" << node->id() << ")\n";
 	if (node && (node->id() != NODE_ID_INVALID))
@@ -148,74 +245,212 @@ void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_dealloc(
 
 		base_type::node_dealloc(node);
 
-		shptr<node_type> cached_ptr;
-		if (m_lru.get(cached_ptr, node_id))
-		{
-			assert(cached_ptr == node);
-			m_lru.del(node_id);
-			// TODO: how to handle deletion? should we reset the ptr?
-			// TODO: cached_ptr.reset() ?
-		}
+		/* disposed ids are already out of the cache, otherwise drop the payload */
+		shptr<block_t> block( m_block_storage->cached(static_cast<block_id_t>(node_id)) );
+		node_payload_type* payload = node_payload(block);
+		if (payload && (payload->node().get() == node.get()))
+			block->discard();
 	}
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_get(node_id_t node_id)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_get(node_id_t node_id)
 {
 	// std::cerr << "nFS::node_get(" << node_id << ")\n";
-	// block_t* block = m_block_storage->get(static_cast<block_id_t>(node_id));
-	// node_type* node = new node_type(this->tree(), node_id);
-	// deserialize_node(*node, *block);
-	// assert(node->id() == node_id);
-	// return node;
+	assert(m_block_storage);
+
+	if (! has_id(node_id))
+		return shptr<node_type>();
+	shptr<block_t> block( m_block_storage->get(static_cast<block_id_t>(node_id)) );
+	if (! block)
+		return shptr<node_type>();
+
+	/* read-only until node_put(): the page stays clean, its data in sync */
+	node_payload_type* payload = node_payload(block);
+	if (payload)
+	{
+		pin_update(node_id, payload->node()->rank());
+		return payload->node();
+	}
 
-	return m_lru[node_id];
+	/* decode the page: from now on the node is its content */
+	shptr<node_type> node( new node_type(this->tree(), node_id) );
+	if (! deserialize_node(*node, *block))
+	{
+		/* not holding a node (eg. allocated but never written) */
+		node->dirty(true);
+		return node;
+	}
+	node->dirty(false);
+	block->payload(new node_payload_type(this, node));
+	pin_update(node_id, node->rank());
+	return node;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::node_put(shptr<node_type>& node)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+shptr<typename BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_type> BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_put(shptr<node_type>& node)
 {
 	// std::cerr << "nFS::node_put(" << node->id() << ")\n";
 	assert(node);
 	assert(m_block_storage);
 
-	// block_t block(static_cast<block_id_t>(node->id()));
-
-	// serialize_node(block, *node);
-	// m_block_storage->put(block);
-	// assert(block.index() == static_cast<block_id_t>(node->id()));
-
-	// return node;
-
 	node_id_t node_id = node->id();
 	assert(node_id != NODE_ID_INVALID);
 	assert(! node->dirty());
-	shptr<node_type> node_ptr( m_lru[node_id] );
-	if (! node_ptr)
-	{
-		node_ptr = node;
-		m_lru[node_id] = node;
-	} else if (node_ptr != node)
+
+	/* the node replaces the page content (it could have been evicted meanwhile) */
+	shptr<block_t> block( m_block_storage->claim(static_cast<block_id_t>(node_id)) );
+	assert(block);
+	node_payload_type* payload = node_payload(block);
+	if (! payload)
 	{
-		*node_ptr = *node;
+		block->payload(new node_payload_type(this, node));
+		block->modified();
+		pin_update(node_id, node->rank());
+		return node;
 	}
+
+	shptr<node_type> node_ptr( payload->node() );
+	if (node_ptr.get() != node.get())
+		*node_ptr = *node;
+	block->modified();
 	assert(! node_ptr->dirty());
+	pin_update(node_id, node_ptr->rank());
 	return node_ptr;
 }
 
+/* -- Node views ----------------------------------------------- */
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::node_view(node_id_t node_id, node_view_type& view)
+{
+	assert(m_block_storage);
+
+	if (! has_id(node_id))
+	{
+		view.reset();
+		return false;
+	}
+	shptr<block_t> block( m_block_storage->get(static_cast<block_id_t>(node_id)) );
+	if (! block)
+	{
+		view.reset();
+		return false;
+	}
+
+	/* a decoded page is read through its node, that can be newer than the data */
+	node_payload_type* payload = node_payload(block);
+	bool ok = payload ? view.reset(payload->node()) : view.reset(block);
+	if (ok)
+		pin_update(node_id, view.rank());
+	return ok;
+}
+
+/* -- Pinning -------------------------------------------------- */
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::pinnedLevels(int n_levels)
+{
+	std::lock_guard<std::mutex> lock(m_pin_mutex);
+	m_pinned_levels = (n_levels > 0) ? n_levels : 0;
+	unpin_deeper();
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::pin_update(node_id_t node_id, int rank)
+{
+	std::lock_guard<std::mutex> lock(m_pin_mutex);
+	if (m_pinned_levels <= 0)
+		return;
+
+	if (node_id == this->rootId())
+	{
+		if ((! m_root_seen) || (rank != m_root_rank))
+		{
+			// the tree grew or shrank at the top
+			m_root_rank = rank;
+			m_root_seen = true;
+			unpin_deeper();
+		}
+	} else if (! m_root_seen)
+		return;
+
+	int level = rank - m_root_rank;
+	if ((level < 0) || (level >= m_pinned_levels))
+		return;
+
+	/* the block cache may have dropped the pin meanwhile (eg. on block rewrites) */
+	block_id_t block_id = static_cast<block_id_t>(node_id);
+	if (m_block_storage->pinned(block_id))
+		return;
+	/* pins never take more than half of the cache */
+	if ((2 * m_block_storage->pinnedCount()) >= m_block_storage->cacheCapacity())
+		return;
+	if (m_block_storage->pin(block_id))
+		m_pinned[node_id] = rank;
+	// std::cerr << "nFS::pin_update(" << node_id << ") rank:" << rank << " level:" << level << " pinned:" << m_pinned.size() << std::endl;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::unpin_deeper()
+{
+	typename std::map<node_id_t, int>::iterator it = m_pinned.begin();
+	while (it != m_pinned.end())
+	{
+		int level = it->second - m_root_rank;
+		if ((m_pinned_levels <= 0) || (level < 0) || (level >= m_pinned_levels))
+		{
+			m_block_storage->unpin(static_cast<block_id_t>(it->first));
+			m_pinned.erase(it++);
+		} else
+			++it;
+	}
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+void BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::unpin_all()
+{
+	std::lock_guard<std::mutex> lock(m_pin_mutex);
+	typename std::map<node_id_t, int>::const_iterator it;
+	for (it = m_pinned.begin(); it != m_pinned.end(); ++it)
+		m_block_storage->unpin(static_cast<block_id_t>(it->first));
+	m_pinned.clear();
+	m_root_seen = false;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::find(const key_type& key_, mapped_type& value_)
+{
+	if (! this->hasRoot())
+		return false;
+
+	node_view_type view;
+	node_id_t node_id = this->rootId();
+	while (node_view(node_id, view))
+	{
+		int pos = -1;
+		bool found = view.bsearch(key_, pos);
+		if (view.leaf())
+			return found && view.value(pos, value_);
+		node_id = view.child(pos);
+	}
+	return false;
+}
+
 /* -- Header I/O ----------------------------------------------- */
 
 #define MAX_USER_HEADER 240
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::header_write()
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::header_write()
 {
 	seriously::Packer<MAX_USER_HEADER> packer;
 	std::string headerPrefix("MWB+TREE");
 	packer << headerPrefix <<
 		static_cast<uint32_t>(B) << static_cast<uint32_t>(BLOCKSIZE) <<
-		static_cast<uint64_t>(this->size()) << static_cast<uint64_t>(this->rootId());
-	// std::cerr << "<- WRITE B:" << B << " BLOCKSIZE:" << BLOCKSIZE << " count:" << this->size() << " rootId:" << this->rootId() << std::endl;
+		static_cast<uint64_t>(this->size()) << static_cast<uint64_t>(this->rootId()) <<
+		static_cast<uint32_t>(FORMAT_VERSION);
+	// std::cerr << "<- WRITE B:" << B << " BLOCKSIZE:" << BLOCKSIZE << " count:" << this->size() << " rootId:" << this->rootId() << " format:" << FORMAT_VERSION << std::endl;
 
 	std::string userHeader(packer.data(), packer.size());
 	m_block_storage->setUserHeader(m_btree_header_uid, userHeader);
@@ -226,8 +461,8 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::header_write(
 	return true;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::header_read()
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::header_read()
 {
 	std::string userHeader = m_block_storage->getUserHeader(m_btree_header_uid);
 
@@ -239,10 +474,20 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::header_read()
 	std::string headerPrefix;
 	uint32_t v_B, v_BLOCKSIZE;
 	uint64_t v_size, v_root_id;
+	uint32_t v_format = 0;
 
 	packer >> headerPrefix >> v_B >> v_BLOCKSIZE >> v_size >> v_root_id;
+	/* headers written before the format version was introduced end here */
+	if (packer.unpacking_avail() >= seriously::Traits<uint32_t>::SerializedSize)
+		packer >> v_format;
 
-	// std::cerr << "-> READ B:" << v_B << " BLOCKSIZE:" << v_BLOCKSIZE << " count:" << v_size << " rootId:" << v_root_id << std::endl;
+	// std::cerr << "-> READ B:" << v_B << " BLOCKSIZE:" << v_BLOCKSIZE << " count:" << v_size << " rootId:" << v_root_id << " format:" << v_format << std::endl;
+
+	if ((headerPrefix != "MWB+TREE") || packer.error())
+	{
+		std::cerr << "ERROR: '" << m_block_storage->pathname() << "' has no btree header" << std::endl;
+		return false;
+	}
 
 	if ((v_B != B) || (v_BLOCKSIZE != BLOCKSIZE))
 	{
@@ -250,6 +495,15 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::header_read()
 		return false;
 	}
 
+	/* older formats are migrated by postOpen() */
+	if (v_format > static_cast<uint32_t>(FORMAT_VERSION))
+	{
+		std::cerr << "ERROR: '" << m_block_storage->pathname() << "' btree format not supported (found:" <<
+			v_format << " library:" << static_cast<uint32_t>(FORMAT_VERSION) << ")" << std::endl;
+		return false;
+	}
+	m_format = static_cast<int>(v_format);
+
 	assert(v_B == B);
 	assert(v_BLOCKSIZE == BLOCKSIZE);
 	this->rootId(v_root_id);
@@ -302,8 +556,8 @@ inline int BTreeFileStorage_Compute_Max_B()
 	return (leaf_B < internal_B) ? leaf_B : internal_B;
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::serialize_node(block_t& dst_block, const node_type& src_node)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::serialize_node(block_t& dst_block, const node_type& src_node)
 {
 	seriously::Packer<BLOCKSIZE> packer;
 
@@ -342,8 +596,8 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::serialize_nod
 	return (! packer.error());
 }
 
-template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
-bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::deserialize_node(node_type& dst_node, const block_t& src_block)
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare, class BlockStorageT >
+bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare, BlockStorageT>::deserialize_node(node_type& dst_node, const block_t& src_block)
 {
 	seriously::Packer<BLOCKSIZE> packer(src_block.data(), src_block.size());
 
@@ -361,6 +615,9 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::deserialize_n
 			v_leaf >> v_n >> v_rank;
 	assert(! packer.error());
 
+	if (static_cast<block_id_t>(v_node_id) != src_block.index())
+		return false;
+
 	dst_node.id(v_node_id);
 	dst_node.parentId(v_parent_id);
 	dst_node.leftId(v_left_id);
@@ -392,6 +649,240 @@ bool BTreeFileStorage<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::deserialize_n
 	return (! packer.error());
 }
 
+/* -- BTreeNodeView ---------------------------------------------- */
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::reset()
+{
+	m_node.reset();
+	m_block.reset();
+	m_id = NODE_ID_INVALID;
+	m_parent_id = NODE_ID_INVALID;
+	m_left_id = NODE_ID_INVALID;
+	m_right_id = NODE_ID_INVALID;
+	m_leaf = true;
+	m_n = 0;
+	m_rank = 0;
+	m_version = 0;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::reset(const shptr<node_type>& node)
+{
+	reset();
+	if ((! node) || (! node->valid()))
+		return false;
+
+	m_node = node;
+	m_id = node->id();
+	m_parent_id = node->parentId();
+	m_left_id = node->leftId();
+	m_right_id = node->rightId();
+	m_leaf = node->leaf();
+	m_n = node->n();
+	m_rank = node->rank();
+	return true;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::reset(const shptr<block_t>& block)
+{
+	reset();
+	if (! block)
+		return false;
+
+	/* same layout as BTreeFileStorage::serialize_node() */
+	const char* base = block->data();
+	const char* src = base;
+	size_t avail = BLOCKSIZE;
+
+	uint32_t v_node_id, v_parent_id, v_left_id, v_right_id;
+	bool v_leaf;
+	uint16_t v_n;
+	int16_t v_rank;
+
+	if ((seriously::Traits<uint32_t>::deserialize(src, avail, v_node_id) < 0) ||
+		(seriously::Traits<uint32_t>::deserialize(src, avail, v_parent_id) < 0) ||
+		(seriously::Traits<uint32_t>::deserialize(src, avail, v_left_id) < 0) ||
+		(seriously::Traits<uint32_t>::deserialize(src, avail, v_right_id) < 0) ||
+		(seriously::Traits<bool>::deserialize(src, avail, v_leaf) < 0) ||
+		(seriously::Traits<uint16_t>::deserialize(src, avail, v_n) < 0) ||
+		(seriously::Traits<int16_t>::deserialize(src, avail, v_rank) < 0))
+		return false;
+
+	if ((static_cast<block_id_t>(v_node_id) != block->index()) || (v_n > (2 * B - 1)))
+		return false;
+
+	/* locate the keys */
+	key_type scratch;
+	for (int i = 0; i < v_n; i++)
+	{
+		m_offsets[i] = static_cast<uint16_t>(src - base);
+		if (KeyTraits::SerializedSize > 0)
+		{
+			if (avail < static_cast<size_t>(KeyTraits::SerializedSize))
+				return false;
+			src += KeyTraits::SerializedSize;
+			avail -= KeyTraits::SerializedSize;
+		} else if (KeyTraits::deserialize(src, avail, scratch) < 0)
+			return false;
+	}
+	m_offsets[v_n] = static_cast<uint16_t>(src - base);
+
+	m_block = block;
+	m_version = block->version();
+	m_id = static_cast<node_id_t>(v_node_id);
+	m_parent_id = static_cast<node_id_t>(v_parent_id);
+	m_left_id = static_cast<node_id_t>(v_left_id);
+	m_right_id = static_cast<node_id_t>(v_right_id);
+	m_leaf = v_leaf;
+	m_n = v_n;
+	m_rank = v_rank;
+	return true;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::key(int i, key_type& dst) const
+{
+	assert((i >= 0) && (i < m_n));
+	if (m_node)
+	{
+		dst = m_node->key(i);
+		return true;
+	}
+	const char* base = data();
+	if ((! base) || (i >= m_n))
+		return false;
+
+	const char* src = base + m_offsets[i];
+	size_t avail = BLOCKSIZE - m_offsets[i];
+	return KeyTraits::deserialize(src, avail, dst) >= 0;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::keyData(int i, const char*& bytes, size_t& length) const
+{
+	assert((i >= 0) && (i < m_n));
+	if (m_node)
+		return false;
+	const char* base = data();
+	if ((! base) || (i >= m_n))
+		return false;
+
+	/* length + bytes, as the string-like key traits serialize them */
+	const char* src = base + m_offsets[i];
+	size_t avail = BLOCKSIZE - m_offsets[i];
+	uint32_t s_len = 0;
+	if ((seriously::Traits<uint32_t>::deserialize(src, avail, s_len) < 0) || (avail < s_len))
+		return false;
+	bytes = src;
+	length = s_len;
+	return true;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::value(int i, mapped_type& dst) const
+{
+	assert(m_leaf);
+	assert((i >= 0) && (i < m_n));
+	if (m_node)
+	{
+		dst = m_node->value(i);
+		return true;
+	}
+	const char* base = data();
+	if ((! base) || (i >= m_n))
+		return false;
+
+	const char* src = base + m_offsets[m_n];
+	size_t avail = BLOCKSIZE - m_offsets[m_n];
+	if (TTraits::SerializedSize > 0)
+	{
+		size_t skip = static_cast<size_t>(i) * TTraits::SerializedSize;
+		if (avail < skip)
+			return false;
+		src += skip;
+		avail -= skip;
+	} else
+	{
+		for (int j = 0; j < i; j++)
+		{
+			if (TTraits::deserialize(src, avail, dst) < 0)
+				return false;
+		}
+	}
+	return TTraits::deserialize(src, avail, dst) >= 0;
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+node_id_t BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::child(int i) const
+{
+	assert(! m_leaf);
+	assert((i >= 0) && (i <= m_n));
+	if (m_node)
+		return m_node->child(i);
+	const char* base = data();
+	if ((! base) || (i > m_n))
+		return NODE_ID_INVALID;
+
+	size_t offset = m_offsets[m_n] + static_cast<size_t>(i) * sizeof(uint32_t);
+	const char* src = base + offset;
+	size_t avail = BLOCKSIZE - offset;
+	uint32_t v_child;
+	if (seriously::Traits<uint32_t>::deserialize(src, avail, v_child) < 0)
+		return NODE_ID_INVALID;
+	return static_cast<node_id_t>(v_child);
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+const char* BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::data() const
+{
+	if (! m_block)
+		return NULL;
+	if (m_block->version() != m_version)
+	{
+		/* the page has been modified (or replaced) since: parse it again */
+		shptr<block_t> block( m_block );
+		const_cast<BTreeNodeView*>(this)->reset(block);
+		if (! m_block)
+			return NULL;
+	}
+	return m_block->data();
+}
+
+template < size_t BLOCKSIZE, int B_, typename KeyTraits, typename TTraits, class Compare >
+bool BTreeNodeView<BLOCKSIZE, B_, KeyTraits, TTraits, Compare>::bsearch(const key_type& key_, int& pos) const
+{
+	int lo = 0;
+	int hi = m_n - 1;
+	key_type probe;
+
+	while (hi >= lo)
+	{
+		int m = (hi + lo) / 2;
+
+		const key_type* km = &probe;
+		if (m_node)
+			km = &m_node->key(m);
+		else if (! key(m, probe))
+			break;
+
+		int cmp = KeyTraits::compare(key_, *km);
+		if (cmp < 0)
+			hi = m - 1;
+		else if (cmp > 0)
+			lo = m + 1;
+		else
+		{
+			pos = m_leaf ? m : (m + 1);
+			return true;
+		}
+	}
+
+	pos = lo;
+	return false;
+}
+
 } /* end of namespace milliways */
 
 #endif /* MILLIWAYS_BTREEFILESTORAGE_IMPL_H */
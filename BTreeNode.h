@@ -32,6 +32,7 @@
 
 #include "BlockStorage.h"
 #include "BTreeCommon.h"
+#include "RWLock.h"
 
 namespace milliways {
 
@@ -197,10 +198,20 @@ public:
 	bool search(lookup_type& res, const key_type& key_);
 	void truncate(int num);
 	bool bsearch(lookup_type& res, const key_type& key_);
+	/* bsearch() position, without a lookup. -1: inconsistent node (read while being modified) */
+	int locate(const key_type& key_, bool& found) const;
 	void split_child(int i);
 	shptr<node_type> insert_non_full(const key_type& key_, const mapped_type& value_);
 	bool remove(lookup_type& res, const key_type& key_);
 
+	/* -- Rebalancing ---------------------------------------------- */
+
+	void adopt_child(int i);
+	void fill_child(int i);
+	void borrow_from_left(int i);
+	void borrow_from_right(int i);
+	void merge_children(int i);
+
 	/* -- Node I/O ------------------------------------------------- */
 
 	shptr<node_type> node_alloc() { assert(m_tree); return m_tree->node_alloc(); }
@@ -214,6 +225,11 @@ public:
 
 	shptr<node_type> this_node() const { assert(m_tree); assert(node_id_valid(id())); return m_tree->node_get(id()); }
 
+	/* -- Concurrency ---------------------------------------------- */
+
+	/* version lock for optimistic lock coupling (see BTree::concurrent_put()), not copied */
+	OptLock& latch() const { return m_latch; }
+
 	/* -- Output --------------------------------------------------- */
 
 	std::ostream& dotGraph(std::ostream& out);
@@ -234,6 +250,8 @@ private:
 	keys_array_type m_keys;
 	values_array_type m_values;
 	children_array_type m_children;
+
+	mutable OptLock m_latch;
 };
 
 } /* end of namespace milliways */
@@ -131,34 +131,49 @@ void BTreeNode<B_, KeyTraits, TTraits, Compare>::truncate(int num)
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
 bool BTreeNode<B_, KeyTraits, TTraits, Compare>::bsearch(lookup_type& res, const key_type& key_)
 {
-	int lo = 0;
-	int hi = n() - 1;
 	shptr<node_type> self( this_node() );
 
+	bool found = false;
+	int pos = locate(key_, found);
+	assert(pos >= 0);
+	res.node(self).found(found).pos(pos).key(key_);
+	return found;
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+int BTreeNode<B_, KeyTraits, TTraits, Compare>::locate(const key_type& key_, bool& found) const
+{
+	found = false;
+
+	/* a node read optimistically can be caught halfway through a change */
+	int n_ = n();
+	if ((n_ < 0) || (n_ > (2 * B - 1)))
+		return -1;
+
+	int lo = 0;
+	int hi = n_ - 1;
+
 	while (hi >= lo)
 	{
 		int m = (hi + lo) / 2;
 		assert(m >= 0);
-		assert(m < n());
+		assert(m < n_);
 
-		if (key_ < key(m))
+		int cmp = KeyTraits::compare(key_, key(m));
+		if (cmp < 0)
 			hi = m - 1;
-		else if (key_ > key(m))
+		else if (cmp > 0)
 			lo = m + 1;
 		else
 		{
 			// found!
-			if (leaf())
-				res.node(self).found(true).pos(m).key(key_);
-			else
-				res.node(self).found(true).pos(m + 1).key(key_);    // internal nodes handled differently
-			return true;
+			found = true;
+			return leaf() ? m : (m + 1);    // internal nodes handled differently
 		}
 	}
 
 	// not found
-	res.node(self).found(false).pos(lo).key(key_);
-	return false;
+	return lo;
 }
 
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
@@ -214,13 +229,27 @@ void BTreeNode<B_, KeyTraits, TTraits, Compare>::split_child(int i)
 		key(j + 1) = key(j);    // only keys, not values (we are an internal node
 
 	child(i + 1) = z->id();
-	key(i) = z->key(0);
 	// no value, we are an internal node
 	n(n() + 1);
 
-	// keep in y only its first half (B keys)
-	// NOTE: since we keep values only in leafs, we keep B keys and not B-1
-	y->truncate(B);
+	if (y->leaf())
+	{
+		// the separator is a copy of the first key of z
+		key(i) = z->key(0);
+
+		// keep in y only its first half (B keys)
+		// NOTE: since we keep values only in leafs, we keep B keys and not B-1
+		y->truncate(B);
+	} else
+	{
+		// the median key of an internal node moves up, and y keeps
+		// B-1 keys and B children (the other B children went to z)
+		key(i) = y->key(B - 1);
+		y->truncate(B - 1);
+
+		for (int j = 0; j < B; j++)
+			z->adopt_child(j);
+	}
 
 	node_put(y);
 	node_put(z);
@@ -310,12 +339,226 @@ bool BTreeNode<B_, KeyTraits, TTraits, Compare>::remove(lookup_type& res, const
 		bsearch(res, key_);
 		assert((res.pos() >= 0) && (res.pos() <= n()));
 
+		// make sure the child can lose a key before descending into it
+		// (so no underflow has to be propagated back up)
 		shptr<node_type> child_pos( child_node(res.pos()) );
 		assert(child_pos);
+		if (child_pos->n() < B)
+		{
+			fill_child(res.pos());
+
+			bsearch(res, key_);
+			assert((res.pos() >= 0) && (res.pos() <= n()));
+			child_pos = child_node(res.pos());
+			assert(child_pos);
+		}
 		return child_pos->remove(res, key_);
 	}
 }
 
+/* -- Rebalancing -------------------------------------------------- */
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNode<B_, KeyTraits, TTraits, Compare>::adopt_child(int i)
+{
+	assert(! leaf());
+	assert((i >= 0) && (i <= n()));
+
+	shptr<node_type> child_i( child_node(i) );
+	if (child_i && (child_i->parentId() != id()))
+	{
+		child_i->parentId(id());
+		node_put(child_i);
+	}
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNode<B_, KeyTraits, TTraits, Compare>::fill_child(int i)
+{
+	assert(! leaf());
+	assert((i >= 0) && (i <= n()));
+
+	shptr<node_type> child_i( child_node(i) );
+	assert(child_i);
+
+	// siblings under this same node, reached through the sibling links
+	shptr<node_type> left_( (i > 0) ? child_i->left() : shptr<node_type>() );
+	shptr<node_type> right_( (i < n()) ? child_i->right() : shptr<node_type>() );
+	assert((! left_) || (left_->id() == child(i - 1)));
+	assert((! right_) || (right_->id() == child(i + 1)));
+
+	if (left_ && (left_->n() >= B))
+		borrow_from_left(i);
+	else if (right_ && (right_->n() >= B))
+		borrow_from_right(i);
+	else if (right_)
+		merge_children(i);
+	else if (left_)
+		merge_children(i - 1);
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNode<B_, KeyTraits, TTraits, Compare>::borrow_from_left(int i)
+{
+	assert(! leaf());
+	assert((i > 0) && (i <= n()));
+
+	shptr<node_type> child_i( child_node(i) );
+	shptr<node_type> left_( child_node(i - 1) );
+	assert(child_i && left_);
+	assert(left_->n() > 0);
+	assert(! child_i->full());
+
+	// make room in front of child_i
+	for (int j = child_i->n() - 1; j >= 0; j--)
+	{
+		child_i->key(j + 1) = child_i->key(j);
+		if (child_i->leaf())
+			child_i->value(j + 1) = child_i->value(j);
+	}
+	if (! child_i->leaf())
+	{
+		for (int j = child_i->n(); j >= 0; j--)
+			child_i->child(j + 1) = child_i->child(j);
+	}
+
+	int last = left_->n() - 1;
+	if (child_i->leaf())
+	{
+		// move the last entry of left_, which becomes the new separator
+		child_i->key(0) = left_->key(last);
+		child_i->value(0) = left_->value(last);
+		key(i - 1) = child_i->key(0);
+	} else
+	{
+		// rotate through the separator
+		child_i->key(0) = key(i - 1);
+		child_i->child(0) = left_->child(last + 1);
+		key(i - 1) = left_->key(last);
+	}
+	child_i->n(child_i->n() + 1);
+	left_->truncate(last);
+
+	if (! child_i->leaf())
+		child_i->adopt_child(0);
+
+	node_put(left_);
+	node_put(child_i);
+	shptr<node_type> self( this_node() );
+	node_put(self);
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNode<B_, KeyTraits, TTraits, Compare>::borrow_from_right(int i)
+{
+	assert(! leaf());
+	assert((i >= 0) && (i < n()));
+
+	shptr<node_type> child_i( child_node(i) );
+	shptr<node_type> right_( child_node(i + 1) );
+	assert(child_i && right_);
+	assert(right_->n() > 1);
+	assert(! child_i->full());
+
+	int end = child_i->n();
+	if (child_i->leaf())
+	{
+		// move the first entry of right_
+		child_i->key(end) = right_->key(0);
+		child_i->value(end) = right_->value(0);
+	} else
+	{
+		// rotate through the separator
+		child_i->key(end) = key(i);
+		child_i->child(end + 1) = right_->child(0);
+		key(i) = right_->key(0);
+	}
+	child_i->n(end + 1);
+
+	// shift right_ left by one
+	for (int j = 0; j < (right_->n() - 1); j++)
+	{
+		right_->key(j) = right_->key(j + 1);
+		if (right_->leaf())
+			right_->value(j) = right_->value(j + 1);
+	}
+	if (! right_->leaf())
+	{
+		for (int j = 0; j < right_->n(); j++)
+			right_->child(j) = right_->child(j + 1);
+	}
+	right_->truncate(right_->n() - 1);
+
+	if (child_i->leaf())
+		key(i) = right_->key(0);
+	else
+		child_i->adopt_child(end + 1);
+
+	node_put(right_);
+	node_put(child_i);
+	shptr<node_type> self( this_node() );
+	node_put(self);
+}
+
+template < int B_, typename KeyTraits, typename TTraits, class Compare >
+void BTreeNode<B_, KeyTraits, TTraits, Compare>::merge_children(int i)
+{
+	assert(! leaf());
+	assert((i >= 0) && (i < n()));
+
+	shptr<node_type> child_i( child_node(i) );
+	shptr<node_type> right_( child_node(i + 1) );
+	assert(child_i && right_);
+
+	// append right_ (and, for internal nodes, the separator) to child_i
+	int base = child_i->n();
+	if (! child_i->leaf())
+		child_i->key(base++) = key(i);
+	assert((base + right_->n()) <= (2 * B - 1));
+	for (int j = 0; j < right_->n(); j++)
+	{
+		child_i->key(base + j) = right_->key(j);
+		if (child_i->leaf())
+			child_i->value(base + j) = right_->value(j);
+	}
+	if (! child_i->leaf())
+	{
+		for (int j = 0; j <= right_->n(); j++)
+			child_i->child(base + j) = right_->child(j);
+	}
+	child_i->n(base + right_->n());
+
+	if (! child_i->leaf())
+	{
+		for (int j = base; j <= child_i->n(); j++)
+			child_i->adopt_child(j);
+	}
+
+	// unlink right_ from its level
+	child_i->rightId(right_->rightId());
+	if (right_->hasRight())
+	{
+		shptr<node_type> right_right( right_->right() );
+		assert(right_right);
+		right_right->leftId(child_i->id());
+		node_put(right_right);
+	}
+
+	// drop the separator and right_ from here
+	//   x[i..n-2] := x[i+1..n-1]
+	//   x.child[i+1..n-1] := x.child[i+2..n]
+	for (int j = i; j < (n() - 1); j++)
+		key(j) = key(j + 1);
+	for (int j = i + 1; j < n(); j++)
+		child(j) = child(j + 1);
+	truncate(n() - 1);
+
+	node_put(child_i);
+	node_dispose(right_);
+	shptr<node_type> self( this_node() );
+	node_put(self);
+}
+
 template < int B_, typename KeyTraits, typename TTraits, class Compare >
 inline std::ostream& BTreeNode<B_, KeyTraits, TTraits, Compare>::dotGraph(std::ostream& out)
 {
@@ -26,11 +26,16 @@
 #include <string>
 #include <array>
 #include <vector>
+#include <map>
+#include <set>
+#include <deque>
 #include <functional>
+#include <mutex>
 
 #include <stdint.h>
 #include <assert.h>
 
+#include "config.h"
 #include "LRUCache.h"
 #include "Utils.h"
 
@@ -42,6 +47,36 @@ static const block_id_t BLOCK_ID_INVALID = static_cast<block_id_t>(-1);
 
 inline bool block_id_valid(block_id_t block_id) { return (block_id != BLOCK_ID_INVALID); }
 
+/* block buffers are aligned so that they can be used for direct (unbuffered) I/O */
+inline size_t block_data_alignment(size_t block_size) { return (block_size >= 4096) ? 4096 : ((block_size >= 512) ? 512 : 16); }
+inline char* block_data_alloc(size_t block_size);
+inline void block_data_free(char* data);
+
+template <size_t BLOCKSIZE>
+class Block;
+
+/*
+ * decoded form of a block's content (eg. a B+tree node), owned by the
+ * cached block it was decoded from. See Block::payload().
+ */
+template <size_t BLOCKSIZE>
+class BlockPayload
+{
+public:
+	BlockPayload() {}
+	virtual ~BlockPayload() {}
+
+	/* serializes the decoded content into 'dst', whose data has been zeroed */
+	virtual bool encode(Block<BLOCKSIZE>& dst) = 0;
+
+	/* memory held by the decoded form, in bytes */
+	virtual size_t footprint() const = 0;
+
+private:
+	BlockPayload(const BlockPayload& other);
+	BlockPayload& operator= (const BlockPayload& other);
+};
+
 template <size_t BLOCKSIZE>
 class Block
 {
@@ -49,33 +84,78 @@ public:
 	static const size_t BlockSize = BLOCKSIZE;
 
 	typedef size_t size_type;
+	typedef BlockPayload<BLOCKSIZE> payload_type;
 
-	Block(block_id_t index) :
-			m_index(index), m_dirty(false) { memset(m_data, 0, sizeof(m_data)); }
-	Block(const Block<BLOCKSIZE>& other) : m_index(other.m_index), m_data(other.m_data), m_dirty(other.m_dirty) { }
-	Block& operator= (const Block<BLOCKSIZE>& rhs) { assert(this != &rhs); m_index = rhs.index(); memcpy(m_data, rhs.m_data, sizeof(m_data)); m_dirty = rhs.m_dirty; return *this; }
+	/*
+	 * a cached page is kept in memory in one of these forms:
+	 *   serialized  data only
+	 *   decoded     payload only: it's newer than the data, whose buffer is released
+	 *   both        payload and data, in sync
+	 */
+	typedef enum { PAGE_SERIALIZED, PAGE_DECODED, PAGE_BOTH } page_state;
 
-	virtual ~Block() {}
+	Block(block_id_t index) :
+			m_index(index), m_data(block_data_alloc(BlockSize)), m_owned(true), m_dirty(false),
+			m_payload(NULL), m_stale(false), m_version(0) { memset(m_data, 0, BlockSize); }
+	/* block whose data lives in externally owned memory (eg. a file mapping) */
+	Block(block_id_t index, char* mapped) :
+			m_index(index), m_data(mapped), m_owned(false), m_dirty(false),
+			m_payload(NULL), m_stale(false), m_version(0) { assert(mapped); }
+	Block(const Block<BLOCKSIZE>& other) :
+			m_index(other.m_index), m_data(block_data_alloc(BlockSize)), m_owned(true), m_dirty(other.m_dirty),
+			m_payload(NULL), m_stale(false), m_version(0) { memcpy(m_data, other.data(), BlockSize); }
+	Block& operator= (const Block<BLOCKSIZE>& rhs) { assert(this != &rhs); discard(); m_index = rhs.index(); if (m_data != rhs.m_data) memcpy(m_data, rhs.data(), BlockSize); m_dirty = rhs.m_dirty; m_version++; return *this; }
+
+	virtual ~Block() { delete m_payload; m_payload = NULL; if (m_owned && m_data) block_data_free(m_data); m_data = NULL; }
 
 	block_id_t index() const { return m_index; }
 	block_id_t index(block_id_t value) { block_id_t old = m_index; m_index = value; return old; }
 
-	char* data() { return m_data; }
-	const char* data() const { return m_data; }
+	/* the data of a decoded page is re-encoded on access */
+	char* data() { if (m_stale) sync(); return m_data; }
+	const char* data() const { if (m_stale) const_cast<Block*>(this)->sync(); return m_data; }
 
 	size_type size() const { return BlockSize; }
 
 	bool valid() const { return m_index != BLOCK_ID_INVALID; }
+	bool mapped() const { return ! m_owned; }
 
+	/* dirty: modified in memory and not yet written back to storage */
 	bool dirty() const { return m_dirty; }
 	bool dirty(bool value) { bool old = m_dirty; m_dirty = value; return old; }
 
+	/* -- Decoded payload ------------------------------------------ */
+
+	page_state state() const { return m_payload ? (m_stale ? PAGE_DECODED : PAGE_BOTH) : PAGE_SERIALIZED; }
+	payload_type* payload() const { return m_payload; }
+	/* takes ownership of 'value', which must match the current data */
+	void payload(payload_type* value) { if (value == m_payload) return; discard(); m_payload = value; m_version++; }
+	/* the payload has been modified: the data is stale (its buffer is released) and the page dirty */
+	void modified();
+	/* re-encodes a stale payload into the data */
+	bool sync();
+	/* drops the payload, keeping its content in the data */
+	void detach() { if (m_stale) sync(); delete m_payload; m_payload = NULL; }
+	/* drops the payload and its content, the data is about to be replaced */
+	void discard();
+
+	/* changes whenever the payload or the data behind it are replaced */
+	uint32_t version() const { return m_version; }
+
+	/* memory held by the page (owned data buffer and payload), in bytes */
+	size_type footprint() const { return ((m_owned && m_data) ? BlockSize : 0) + (m_payload ? m_payload->footprint() : 0); }
+
 private:
 	Block();
 
 	block_id_t m_index;
-	char m_data[BlockSize];
+	char* m_data;
+	bool m_owned;
 	bool m_dirty;
+
+	payload_type* m_payload;
+	bool m_stale;
+	uint32_t m_version;
 };
 
 template <size_t BLOCKSIZE>
@@ -83,15 +163,18 @@ class BlockStorage
 {
 public:
 	static const int MAJOR_VERSION = 0;
-	static const int MINOR_VERSION = 1;
+	static const int MINOR_VERSION = 3;			/* 2: free space map and user data, 3: block count */
 	static const size_t MAX_USER_HEADER_LEN = 240;
 
 	static const size_t BlockSize = BLOCKSIZE;
 	typedef Block<BLOCKSIZE> block_t;
 	typedef size_t size_type;
 
+	typedef std::map<block_id_t, block_id_t> free_map_type;	/* first block id -> number of blocks */
+
 	BlockStorage() :
-		m_header_block_id(BLOCK_ID_INVALID) {}
+		m_header_block_id(BLOCK_ID_INVALID),
+		m_ext_block_id(BLOCK_ID_INVALID), m_ext_n_blocks(0) {}
 	virtual ~BlockStorage() { /* call close() from the most derived class, and BEFORE destruction  */ }
 
 	/* -- General I/O ---------------------------------------------- */
@@ -105,6 +188,10 @@ public:
 	virtual bool openHelper() = 0;
 	virtual bool closeHelper() = 0;
 
+	/* closes without writing the header nor the cached blocks back, eg. after a refused open */
+	virtual bool abandon();
+	virtual bool abandonHelper() = 0;
+
 	/* -- Misc ----------------------------------------------------- */
 
 	virtual size_type count() = 0;
@@ -118,6 +205,30 @@ public:
 	void setUserHeader(int uid, const std::string& userHeader) { m_user_header[uid] = userHeader; }
 	std::string getUserHeader(int uid) { return m_user_header[uid]; }
 
+	/*
+	 * user data is the unbounded companion of the user header with the
+	 * same uid: it's stored in blocks of its own, referenced by the header
+	 */
+	void setUserData(int uid, const std::string& userData) { if (static_cast<size_t>(uid) >= m_user_data.size()) m_user_data.resize(uid + 1); m_user_data[uid] = userData; }
+	std::string getUserData(int uid) const { return (static_cast<size_t>(uid) < m_user_data.size()) ? m_user_data[uid] : std::string(); }
+
+	/* -- Free space ----------------------------------------------- */
+
+	/*
+	 * disposed blocks are kept in a map of free extents, coalesced with
+	 * their neighbours, persisted with the header and used by allocId()
+	 * before growing the storage
+	 */
+	const free_map_type& freeMap() const { return m_free; }
+	size_type freeBlocks() const;
+	size_type freeExtents() const { return m_free.size(); }
+
+	/* first fit among the free extents lying wholly below 'limit', used to move data toward the start */
+	block_id_t allocIdBelow(block_id_t limit, int n_blocks = 1);
+
+	/* gives the free blocks at the end of the storage back to the filesystem */
+	virtual bool truncate() = 0;
+
 	/* -- Block I/O ------------------------------------------------ */
 
 	virtual bool hasId(block_id_t block_id) = 0;
@@ -132,12 +243,49 @@ public:
 	virtual bool read(block_t& dst) = 0;
 	virtual bool write(block_t& src) = 0;
 
+	/*
+	 * multi-block I/O on 'n_blocks' consecutive block ids, from/to a
+	 * contiguous buffer of n_blocks * BlockSize bytes. The default
+	 * implementation goes block by block, backends override it to
+	 * transfer the whole span at once.
+	 */
+	virtual bool readRange(block_id_t first_id, int n_blocks, char* dst);
+	virtual bool writeRange(block_id_t first_id, int n_blocks, const char* src);
+
+protected:
+	/*
+	 * the header records count() when it's written, readHeader() hands
+	 * it back here: backends whose file can extend past their last
+	 * allocated block (see MmapBlockStorage) take their count from it
+	 */
+	virtual void headerCount(size_type n_blocks) { UNUSED(n_blocks); }
+
+	/* free space helpers for the allocId()/dispose() implementations */
+	block_id_t allocFree(int n_blocks);
+	bool releaseFree(block_id_t block_id, int count);
+	block_id_t trimFree(block_id_t next_block_id);
+	void clearFree() { m_free.clear(); m_free_by_size.clear(); }
+
+	std::string serializeExtension() const;
+	bool deserializeExtension(const std::string& data);
+
 private:
 	BlockStorage(const BlockStorage& other);
 	BlockStorage& operator= (const BlockStorage& other);
 
+	void insertFree(block_id_t block_id, block_id_t count) { m_free[block_id] = count; m_free_by_size.insert(std::make_pair(count, block_id)); }
+	void eraseFree(typename free_map_type::iterator it) { m_free_by_size.erase(std::make_pair(it->second, it->first)); m_free.erase(it); }
+
 	block_id_t m_header_block_id;
 	std::vector<std::string> m_user_header;
+	std::vector<std::string> m_user_data;
+
+	free_map_type m_free;
+	std::set< std::pair<block_id_t, block_id_t> > m_free_by_size;	/* (number of blocks, first block id) */
+
+	/* blocks holding the header extension (free map and user data) */
+	block_id_t m_ext_block_id;
+	int m_ext_n_blocks;
 };
 
 template <size_t BLOCKSIZE, size_t CACHESIZE>
@@ -158,35 +306,38 @@ public:
 	static const size_type Size = CACHESIZE;
 	static const size_type BlockSize = BLOCKSIZE;
 	static const block_id_t InvalidCacheKey = BLOCK_ID_INVALID;
+	static const size_type MAX_WRITE_BACK_RUN = 256;	/* max blocks per coalesced write */
 
-	LRUBlockCache(storage_ptr_type storage) :
-		base_type(LRUBlockCache::InvalidCacheKey), m_storage(storage) {}
+	LRUBlockCache(storage_ptr_type storage, size_type capacity_ = CACHESIZE) :
+		base_type(LRUBlockCache::InvalidCacheKey, capacity_), m_storage(storage) {}
 
 	bool on_miss(typename base_type::op_type op, const key_type& key, mapped_type& value)
 	{
 		// std::cerr << "block miss id:" << key << " op:" << (int)op << "\n";
 		block_id_t block_id = key;
 		if (m_storage->hasId(block_id)) {
-			/* allocate block object and read block data from disk */
-			block_type* block = new block_type(block_id);
-			if (! block) return false;
 			switch (op)
 			{
 			case base_type::op_get:
-				if (! m_storage->read(*block)) return false;
-				block->dirty(false);
-				value.reset(block);
+				{
+					/* allocate block object and read block data from disk */
+					block_type* block = new block_type(block_id);
+					if (! m_storage->read(*block)) { delete block; return false; }
+					value.reset(block);
+				}
 				break;
 			case base_type::op_set:
+				/* the new value is cached as is */
 				assert(value);
-				*block = *value;
 				break;
 			case base_type::op_sub:
-				//assert(value);
-				bool rv = m_storage->read(*block);
-				assert(rv || block->dirty());
-				value.reset(block);
-				return rv;
+				{
+					/* allocated blocks not written yet are read as zeros */
+					block_type* block = new block_type(block_id);
+					bool rv = m_storage->read(*block);
+					value.reset(block);
+					return rv;
+				}
 				break;
 			}
 			return true;
@@ -200,29 +351,135 @@ public:
 	//bool on_delete(const key_type& key);
 	bool on_eviction(const key_type& key, mapped_type& value)
 	{
-		/* write back block */
+		/*
+		 * write back dirty blocks, clean ones are simply dropped. A block
+		 * failing its write back stays cached and dirty, flush() reports
+		 * it when it fails again.
+		 */
 		/* block_id_t block_id = key; */
 		block_type* block = value.get();
-		if (block)
+		if (block && block->valid() && block->dirty())
 		{
-			if (block->valid())
+			if (! write_back(*block))
 			{
-				bool ok = m_storage->write(*block);
-				assert(ok);
-				// if (ok) block->dirty(false);
+				std::cerr << "can't write back block " << key << ", kept in the cache" << std::endl;
+				return false;
 			}
-			// block->dirty(true);
-			// block->index(BLOCK_ID_INVALID);
-			// value.reset();
 		}
 		return true;
 	}
 
+	/* write back all dirty blocks, sorted by id and coalesced into runs of adjacent blocks */
+	bool flush();
+
+	/* drops all the cached blocks, their changes included, without writing them back */
+	void drop_all();
+
+	/* memory held by the cached pages, serialized or decoded */
+	size_type footprint();
+
+protected:
+	bool cached_dirty(block_id_t block_id);
+	bool write_back(block_type& block);
+	bool write_run(const std::vector<block_type*>& run);
+
 private:
 	storage_ptr_type m_storage;
 };
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
+/* ----------------------------------------------------------------- *
+ *   File I/O engines used by FileBlockStorage                       *
+ * ----------------------------------------------------------------- */
+
+/*
+ * std::fstream based engine: portable, but with a single shared file
+ * position, so that concurrent transfers are serialized.
+ */
+class StreamFileIO
+{
+public:
+	StreamFileIO() {}
+	~StreamFileIO() { if (isOpen()) close(); }
+
+	bool open(const std::string& pathname, size_t block_size, bool& created);
+	bool close();
+	bool isOpen() const { return m_stream.is_open(); }
+
+	ssize_t size();
+	bool read(char* dst, size_t size, uint64_t offset);
+	bool write(const char* src, size_t size, uint64_t offset);
+	bool sync();
+	bool truncate(uint64_t size);
+
+private:
+	StreamFileIO(const StreamFileIO& other);
+	StreamFileIO& operator= (const StreamFileIO& other);
+
+	std::string m_pathname;
+	std::fstream m_stream;
+	std::mutex m_mutex;
+};
+
+#if defined(HAVE_UNISTD_H)
+
+/*
+ * POSIX file descriptor based engine, using positional pread()/pwrite()
+ * at block aligned offsets (no shared file position).
+ * In direct mode the file is opened with O_DIRECT (F_NOCACHE on OS X),
+ * bypassing the kernel page cache, so that the block cache is the only
+ * cache layer. Direct mode silently falls back to buffered I/O when the
+ * block size isn't a multiple of DIRECT_ALIGNMENT or the filesystem
+ * doesn't support it.
+ */
+class PosixFileIO
+{
+public:
+	static const size_t DIRECT_ALIGNMENT = 4096;
+
+	PosixFileIO() : m_fd(-1), m_direct(false), m_direct_active(false) {}
+	~PosixFileIO() { if (isOpen()) close(); }
+
+	bool open(const std::string& pathname, size_t block_size, bool& created);
+	bool close();
+	bool isOpen() const { return m_fd >= 0; }
+
+	ssize_t size();
+	bool read(char* dst, size_t size, uint64_t offset);
+	bool write(const char* src, size_t size, uint64_t offset);
+	bool sync();
+	bool truncate(uint64_t size);
+
+	/* direct mode must be selected before opening the file */
+	bool direct() const { return m_direct; }
+	bool direct(bool value) { bool old = m_direct; assert(! isOpen()); m_direct = value; return old; }
+	bool directActive() const { return m_direct_active; }
+
+	int fd() const { return m_fd; }
+
+private:
+	PosixFileIO(const PosixFileIO& other);
+	PosixFileIO& operator= (const PosixFileIO& other);
+
+	bool aligned(const void* ptr, size_t size, uint64_t offset) const {
+		return ((reinterpret_cast<uintptr_t>(ptr) % DIRECT_ALIGNMENT) == 0) &&
+				((size % DIRECT_ALIGNMENT) == 0) && ((offset % DIRECT_ALIGNMENT) == 0);
+	}
+
+	int m_fd;
+	bool m_direct;
+	bool m_direct_active;
+};
+
+/* positional I/O lets concurrent readers miss in parallel */
+typedef PosixFileIO DefaultFileIO;
+
+#else /* ! defined(HAVE_UNISTD_H) */
+
+typedef StreamFileIO DefaultFileIO;
+
+#endif /* defined(HAVE_UNISTD_H) */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO = DefaultFileIO>
 class FileBlockStorage : public BlockStorage<BLOCKSIZE>
 {
 public:
@@ -233,22 +490,29 @@ public:
 	typedef size_t size_type;
 	typedef ssize_t ssize_type;
 	typedef BlockStorage<BLOCKSIZE> base_type;
+	typedef FileIO file_io_type;
 
 	typedef LRUBlockCache<BLOCKSIZE, CACHE_SIZE> cache_t;
+	typedef std::recursive_mutex cache_mutex_type;
+	typedef std::lock_guard<cache_mutex_type> cache_lock_type;
 
-	FileBlockStorage(const std::string& pathname) :
+	FileBlockStorage(const std::string& pathname, size_type cache_capacity = CACHE_SIZE) :
 		BlockStorage<BLOCKSIZE>(),
-		m_pathname(pathname), m_created(false), m_count(-1), m_next_block_id(BLOCK_ID_INVALID), m_lru(this) {}
+		m_pathname(pathname), m_created(false), m_count(-1), m_next_block_id(BLOCK_ID_INVALID), m_lru(this, cache_capacity),
+		m_cow(false), m_shadow_active(false), m_shadow_end(0), m_shadow_table_id(BLOCK_ID_INVALID), m_shadow_table_n(0),
+		m_shadow_seq(0), m_shadow_slot(0), m_shadow_epoch(0), m_shadow_committed(0) {}
 	~FileBlockStorage(); 	/* call close() before destruction! */
 
 	/* -- General I/O ---------------------------------------------- */
 
-	bool isOpen() const { return m_stream.is_open(); }
+	bool isOpen() const { return m_io.isOpen(); }
 	bool open() { return base_type::open(); }
 	bool close() { return base_type::close(); }
 	bool openHelper();
 	bool closeHelper();
+	bool abandonHelper();
 	bool flush();
+	bool truncate();
 
 	bool created() const { return m_created; }
 
@@ -258,6 +522,69 @@ public:
 
 	const std::string& pathname() const { return m_pathname; }
 
+	file_io_type& io() { return m_io; }
+
+	/* -- Cache ---------------------------------------------------- */
+
+	/* capacity in blocks (CACHE_SIZE by default), it can be changed at any time */
+	size_type cacheCapacity() const { cache_lock_type lock(m_cache_mutex); return m_lru.capacity(); }
+	void cacheCapacity(size_type n_blocks) { cache_lock_type lock(m_cache_mutex); m_lru.capacity(n_blocks); }
+	size_type cacheSize() const { cache_lock_type lock(m_cache_mutex); return m_lru.size(); }
+	size_type cacheFootprint() { cache_lock_type lock(m_cache_mutex); return m_lru.footprint(); }
+
+	/* replacement policy (NULL: LRU), owned by the cache */
+	CachePolicy<block_id_t>* cachePolicy() const { cache_lock_type lock(m_cache_mutex); return m_lru.policy(); }
+	void cachePolicy(CachePolicy<block_id_t>* policy) { cache_lock_type lock(m_cache_mutex); m_lru.policy(policy); }
+	size_type cacheHits() const { cache_lock_type lock(m_cache_mutex); return m_lru.hits(); }
+	size_type cacheMisses() const { cache_lock_type lock(m_cache_mutex); return m_lru.misses(); }
+	void cacheResetStats() { cache_lock_type lock(m_cache_mutex); m_lru.reset_stats(); }
+
+	/* pinned blocks stay cached until unpinned, disposed or closed (pins are counted) */
+	bool pin(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); return m_lru.pin(block_id); }
+	void unpin(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); m_lru.unpin(block_id); }
+	bool pinned(block_id_t block_id) const { cache_lock_type lock(m_cache_mutex); return m_lru.pinned(block_id); }
+	size_type pinnedCount() const { cache_lock_type lock(m_cache_mutex); return m_lru.n_pinned(); }
+
+	/* -- Copy-on-write -------------------------------------------- */
+
+	/*
+	 * in copy-on-write mode (chosen before open(), existing files keep the
+	 * mode they were created in) block ids are logical: a block modified
+	 * since the last commit goes to a fresh physical block, the committed
+	 * one is never overwritten. flush() and close() commit: the page table
+	 * mapping ids to physical blocks is written to fresh blocks as well,
+	 * then the header slot not in use is overwritten with its location and
+	 * a sequence number. open() picks the valid slot with the highest one,
+	 * so a crash rolls the storage back to its last commit. The physical
+	 * blocks replaced are reused once the commit is durable.
+	 */
+	bool copyOnWrite() const { return isOpen() ? m_shadow_active : m_cow; }
+	void copyOnWrite(bool value) { assert(! isOpen()); m_cow = value; }
+	uint64_t commitSeq() const { return m_shadow_seq; }
+
+	/*
+	 * snapshots (copy-on-write mode): snapshot() writes the dirty blocks
+	 * back and freezes the page table as it is, without a commit. The
+	 * image stays readable through snapshotRead() while the storage keeps
+	 * changing. Time is divided in epochs, ended by commits and snapshots:
+	 * a physical block replaced during an epoch is retired with it, and
+	 * reused once neither the committed image nor a snapshot older than
+	 * that epoch is left. Images don't survive close().
+	 */
+	struct Snapshot
+	{
+		uint64_t epoch;
+		std::vector<block_id_t> map;			/* logical -> physical */
+
+		bool hasId(block_id_t block_id) const { return block_id < map.size(); }
+	};
+
+	shptr<Snapshot> snapshot();
+	void releaseSnapshot(const shptr<Snapshot>& image);
+	bool snapshotRead(const Snapshot& image, block_id_t first_id, int n_blocks, char* dst);
+	size_type snapshotCount() { std::lock_guard<std::mutex> lock(m_shadow_mutex); return m_shadow_holders.size(); }
+	size_type retiredCount() { std::lock_guard<std::mutex> lock(m_shadow_mutex); return m_shadow_retired.size(); }
+
 	/* -- Block I/O ------------------------------------------------ */
 
 	bool hasId(block_id_t block_id) { return (block_id != BLOCK_ID_INVALID) && (block_id < nextId()); }
@@ -271,27 +598,308 @@ public:
 	bool read(block_t& dst);
 	bool write(block_t& src);
 
-	/* cached I/O */
+	/* span I/O: a single file transfer, kept coherent with the cache but not populating it */
+	bool readRange(block_id_t first_id, int n_blocks, char* dst);
+	bool writeRange(block_id_t first_id, int n_blocks, const char* src);
+
+	/*
+	 * cached I/O. The cache is the single buffer pool of the storage:
+	 * blocks can carry their decoded payload (see Block), so that a page
+	 * takes a single entry whatever its form.
+	 * claim() returns the cached block of an id whose content is about to
+	 * be entirely replaced, without reading it. cached() doesn't load.
+	 */
 	shptr<block_t> get(block_id_t block_id);
+	shptr<block_t> claim(block_id_t block_id);
+	shptr<block_t> cached(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); shptr<block_t>* p = m_lru.peek(block_id); return p ? *p : shptr<block_t>(); }
 	bool put(const block_t& src);
 
+	/*
+	 * read-ahead: loads into the cache the blocks among 'block_ids' that
+	 * aren't there yet (at most a quarter of its capacity, not to evict
+	 * what they are read for), consecutive ids with a single transfer.
+	 * Returns the number of blocks read.
+	 */
+	static const size_type MAX_READ_AHEAD_RUN = 256;	/* max blocks per transfer */
+
+	size_type prefetch(const std::vector<block_id_t>& block_ids);
+
 protected:
 	void _updateCount();
 
+	/* file transfers of logical blocks, translated in copy-on-write mode */
+	bool ioRead(block_id_t first_id, size_type n_blocks, char* dst);
+	bool ioWrite(block_id_t first_id, size_type n_blocks, const char* src);
+	bool ioReadAt(char* dst, size_t size, uint64_t offset);
+
+	/* -- Shadow paging -------------------------------------------- */
+
+	static const block_id_t SHADOW_SLOTS = 2;		/* physical blocks 0 and 1 */
+	static const uint32_t SHADOW_VERSION = 1;
+
+	bool shadowOpen();
+	bool shadowCommit();
+	bool shadowTruncate();
+	void shadowRelease(block_id_t block_id, int count);
+	void shadowRetire(block_id_t physical_id);
+	void shadowNextEpoch();
+	void shadowReclaim();
+	block_id_t shadowAllocRun(size_type n_blocks);
+	bool shadowRead(const block_id_t* physical, size_type n_blocks, char* dst);
+	bool shadowReadSlot(block_id_t slot, uint64_t& seq, block_id_t& table_id, size_type& table_n, size_type& n_entries, uint32_t& table_crc);
+
 private:
 	FileBlockStorage();
 	FileBlockStorage(const FileBlockStorage& other);
 	FileBlockStorage& operator= (const FileBlockStorage& other);
 
 	std::string m_pathname;
-	std::fstream m_stream;
+	file_io_type m_io;
 	bool m_created;
 	ssize_t m_count;
 	block_id_t m_next_block_id;
 
+	/* guards the cache: concurrent readers share it, misses are read outside of the lock */
+	mutable cache_mutex_type m_cache_mutex;
 	cache_t m_lru;
+
+	/* copy-on-write state, guarded by its own mutex (taken after the cache one) */
+	bool m_cow;
+	bool m_shadow_active;
+	std::mutex m_shadow_mutex;
+	std::vector<block_id_t> m_shadow_map;			/* logical -> physical */
+	std::vector<bool> m_shadow_fresh;				/* remapped during the current epoch */
+	std::set<block_id_t> m_shadow_free;				/* physical blocks available */
+	std::deque< std::pair<uint64_t, block_id_t> > m_shadow_retired;	/* replaced, with their epoch */
+	block_id_t m_shadow_end;						/* physical blocks in the file */
+	block_id_t m_shadow_table_id;					/* committed page table */
+	size_type m_shadow_table_n;
+	uint64_t m_shadow_seq;
+	block_id_t m_shadow_slot;
+	uint64_t m_shadow_epoch;
+	uint64_t m_shadow_committed;					/* epoch of the committed image */
+	std::multiset<uint64_t> m_shadow_holders;		/* epochs of the live snapshots */
+};
+
+#if defined(HAVE_SYS_MMAN_H)
+
+template <size_t BLOCKSIZE>
+class MmapBlockStorage;
+
+/*
+ * keeps the block objects handed out by MmapBlockStorage::get(), so that
+ * decoded payloads survive between accesses. The data is the mapping
+ * itself: stale payloads are re-encoded in place on eviction.
+ */
+template <size_t BLOCKSIZE, size_t CACHESIZE>
+class LRUMappedBlockCache : public LRUCache< CACHESIZE, block_id_t, shptr< Block<BLOCKSIZE> > >
+{
+public:
+	typedef block_id_t key_type;
+	typedef Block<BLOCKSIZE> block_type;
+	typedef shptr<block_type> block_ptr_type;
+	typedef block_ptr_type mapped_type;
+	typedef std::pair<key_type, mapped_type> value_type;
+	typedef LRUCache< CACHESIZE, block_id_t, shptr<block_type> > base_type;
+	typedef typename base_type::size_type size_type;
+
+	typedef MmapBlockStorage<BLOCKSIZE>* storage_ptr_type;
+
+	static const block_id_t InvalidCacheKey = BLOCK_ID_INVALID;
+
+	LRUMappedBlockCache(storage_ptr_type storage, size_type capacity_ = CACHESIZE) :
+		base_type(LRUMappedBlockCache::InvalidCacheKey, capacity_), m_storage(storage) {}
+
+	bool on_miss(typename base_type::op_type op, const key_type& key, mapped_type& value)
+	{
+		if (op == base_type::op_set)
+			return true;
+		char* addr = m_storage->hasId(key) ? m_storage->address(key) : NULL;
+		if (! addr)
+			return false;
+		value.reset(new block_type(key, addr));
+		return true;
+	}
+	bool on_eviction(const key_type& key, mapped_type& value)
+	{
+		UNUSED(key);
+		return value ? value->sync() : true;
+	}
+
+	/* drops all the cached blocks, leaving the stale payloads out of the mapping */
+	void drop_all()
+	{
+		std::vector<value_type> items;
+		this->values(items);
+
+		typename std::vector<value_type>::iterator it;
+		for (it = items.begin(); it != items.end(); ++it)
+			if (it->second)
+				it->second->discard();
+		this->evict_all();
+	}
+
+	/* re-encodes the stale payloads into the mapping, keeping them cached */
+	bool sync()
+	{
+		std::vector<value_type> items;
+		this->values(items);
+
+		bool ok = true;
+		typename std::vector<value_type>::iterator it;
+		for (it = items.begin(); it != items.end(); ++it)
+			if (it->second && (! it->second->sync()))
+				ok = false;
+		return ok;
+	}
+
+	/* memory held by the decoded payloads (the data is the mapping) */
+	size_type footprint()
+	{
+		std::vector<value_type> items;
+		this->values(items);
+
+		size_type n = 0;
+		typename std::vector<value_type>::iterator it;
+		for (it = items.begin(); it != items.end(); ++it)
+			if (it->second)
+				n += it->second->footprint();
+		return n;
+	}
+
+private:
+	storage_ptr_type m_storage;
+};
+
+/*
+ * MmapBlockStorage maps the file in memory, one mapping per extent of
+ * 'extent_blocks' blocks. The file grows an extent at a time and existing
+ * mappings are never moved, so get() can hand out blocks that point
+ * straight into the mapping and stay valid until close().
+ * The kernel page cache is the only cache layer. The block count is
+ * kept in the header (written by flush() and close()), not taken from
+ * the file size: after a crash the file still spans the whole extent.
+ */
+template <size_t BLOCKSIZE>
+class MmapBlockStorage : public BlockStorage<BLOCKSIZE>
+{
+public:
+	static const size_t BlockSize = BLOCKSIZE;
+	static const size_t DEFAULT_EXTENT_SIZE = 64 * 1024 * 1024;
+
+	typedef Block<BLOCKSIZE> block_t;
+	typedef size_t size_type;
+	typedef ssize_t ssize_type;
+	typedef BlockStorage<BLOCKSIZE> base_type;
+
+	/* blocks handed out and kept along with their decoded payloads */
+	static const size_t PAGE_CACHE_SIZE = 1024;
+	typedef LRUMappedBlockCache<BLOCKSIZE, PAGE_CACHE_SIZE> cache_t;
+	typedef std::recursive_mutex cache_mutex_type;
+	typedef std::lock_guard<cache_mutex_type> cache_lock_type;
+
+	MmapBlockStorage(const std::string& pathname, size_type extent_blocks = (DEFAULT_EXTENT_SIZE / BLOCKSIZE), size_type cache_capacity = PAGE_CACHE_SIZE) :
+		BlockStorage<BLOCKSIZE>(),
+		m_pathname(pathname), m_fd(-1), m_created(false),
+		m_extent_blocks(extent_blocks > 0 ? extent_blocks : 1), m_next_block_id(0), m_found_size(0), m_pages(this, cache_capacity) {}
+	~MmapBlockStorage(); 	/* call close() before destruction! */
+
+	/* -- General I/O ---------------------------------------------- */
+
+	bool isOpen() const { return m_fd >= 0; }
+	bool open() { return base_type::open(); }
+	bool close() { return base_type::close(); }
+	bool openHelper();
+	bool closeHelper();
+	bool abandonHelper();
+	bool flush();
+	bool truncate();
+
+	bool created() const { return m_created; }
+
+	/* -- Misc ----------------------------------------------------- */
+
+	size_type count() { return isOpen() ? static_cast<size_type>(m_next_block_id) : 0; }
+
+	const std::string& pathname() const { return m_pathname; }
+
+	size_type extentBlocks() const { return m_extent_blocks; }
+	size_type mappedBlocks() const { return m_extents.size() * m_extent_blocks; }
+
+	/* -- Cache ---------------------------------------------------- */
+
+	/* capacity in blocks of the page cache (PAGE_CACHE_SIZE by default), it can be changed at any time */
+	size_type cacheCapacity() const { cache_lock_type lock(m_cache_mutex); return m_pages.capacity(); }
+	void cacheCapacity(size_type n_blocks) { cache_lock_type lock(m_cache_mutex); m_pages.capacity(n_blocks); }
+	size_type cacheSize() const { cache_lock_type lock(m_cache_mutex); return m_pages.size(); }
+	size_type cacheFootprint() { cache_lock_type lock(m_cache_mutex); return m_pages.footprint(); }
+
+	/* replacement policy (NULL: LRU), owned by the cache */
+	CachePolicy<block_id_t>* cachePolicy() const { cache_lock_type lock(m_cache_mutex); return m_pages.policy(); }
+	void cachePolicy(CachePolicy<block_id_t>* policy) { cache_lock_type lock(m_cache_mutex); m_pages.policy(policy); }
+	size_type cacheHits() const { cache_lock_type lock(m_cache_mutex); return m_pages.hits(); }
+	size_type cacheMisses() const { cache_lock_type lock(m_cache_mutex); return m_pages.misses(); }
+	void cacheResetStats() { cache_lock_type lock(m_cache_mutex); m_pages.reset_stats(); }
+
+	/* pinned blocks stay cached until unpinned, disposed or closed (pins are counted) */
+	bool pin(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); return m_pages.pin(block_id); }
+	void unpin(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); m_pages.unpin(block_id); }
+	bool pinned(block_id_t block_id) const { cache_lock_type lock(m_cache_mutex); return m_pages.pinned(block_id); }
+	size_type pinnedCount() const { cache_lock_type lock(m_cache_mutex); return m_pages.n_pinned(); }
+
+	/* -- Block I/O ------------------------------------------------ */
+
+	bool hasId(block_id_t block_id) { return (block_id != BLOCK_ID_INVALID) && (block_id < nextId()); }
+
+	block_id_t nextId() { return isOpen() ? m_next_block_id : 0; }
+	block_id_t allocId(int n_blocks = 1);
+	block_id_t firstId() { return 0; }
+
+	bool dispose(block_id_t block_id, int count = 1);
+
+	bool read(block_t& dst);
+	bool write(block_t& src);
+
+	bool readRange(block_id_t first_id, int n_blocks, char* dst);
+	bool writeRange(block_id_t first_id, int n_blocks, const char* src);
+
+	/* mapped I/O */
+	char* address(block_id_t block_id);
+	shptr<block_t> get(block_id_t block_id);
+	shptr<block_t> claim(block_id_t block_id) { return get(block_id); }
+	shptr<block_t> cached(block_id_t block_id) { cache_lock_type lock(m_cache_mutex); shptr<block_t>* p = m_pages.peek(block_id); return p ? *p : shptr<block_t>(); }
+	bool put(const block_t& src);
+
+	/* read-ahead: asks the kernel to page the blocks in, returns how many */
+	size_type prefetch(const std::vector<block_id_t>& block_ids);
+
+protected:
+	void headerCount(size_type n_blocks);
+
+	bool mapExtents(size_type n_blocks);
+	void unmapExtents();
+	void forget(block_id_t block_id, size_type count);
+
+private:
+	MmapBlockStorage();
+	MmapBlockStorage(const MmapBlockStorage& other);
+	MmapBlockStorage& operator= (const MmapBlockStorage& other);
+
+	std::string m_pathname;
+	int m_fd;
+	bool m_created;
+	size_type m_extent_blocks;
+	block_id_t m_next_block_id;
+	off_t m_found_size;						/* file size before the extents were mapped */
+	std::vector<char*> m_extents;
+
+	/* guards the page cache, shared by concurrent readers */
+	mutable cache_mutex_type m_cache_mutex;
+	cache_t m_pages;
 };
 
+#endif /* defined(HAVE_SYS_MMAN_H) */
+
 } /* end of namespace milliways */
 
 #include "BlockStorage.impl.hpp"
@@ -25,11 +25,118 @@
 #include "Seriously.h"
 #include "Utils.h"
 
+#include <new>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(HAVE_UNISTD_H)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+
 #ifndef MILLIWAYS_BLOCKSTORAGE_IMPL_H
 //#define MILLIWAYS_BLOCKSTORAGE_IMPL_H
 
 namespace milliways {
 
+/* ----------------------------------------------------------------- *
+ *   Block                                                           *
+ * ----------------------------------------------------------------- */
+
+inline char* block_data_alloc(size_t block_size)
+{
+#if defined(_MSC_VER)
+	char* data = static_cast<char*>(_aligned_malloc(block_size, block_data_alignment(block_size)));
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, block_data_alignment(block_size), block_size) != 0)
+		ptr = NULL;
+	char* data = static_cast<char*>(ptr);
+#endif
+	if (! data)
+		throw std::bad_alloc();
+	return data;
+}
+
+inline void block_data_free(char* data)
+{
+#if defined(_MSC_VER)
+	_aligned_free(data);
+#else
+	free(data);
+#endif
+}
+
+/* ----------------------------------------------------------------- *
+ *   Block                                                           *
+ * ----------------------------------------------------------------- */
+
+template <size_t BLOCKSIZE>
+void Block<BLOCKSIZE>::modified()
+{
+	assert(m_payload);
+	m_stale = true;
+	m_dirty = true;
+	m_version++;
+
+	/* the payload is the only copy now (mapped data can't be released) */
+	if (m_owned && m_data)
+	{
+		block_data_free(m_data);
+		m_data = NULL;
+	}
+}
+
+template <size_t BLOCKSIZE>
+bool Block<BLOCKSIZE>::sync()
+{
+	if (! m_stale)
+		return true;
+
+	assert(m_payload);
+	if (! m_data)
+	{
+		assert(m_owned);
+		m_data = block_data_alloc(BlockSize);
+	}
+	memset(m_data, 0, BlockSize);
+
+	m_stale = false;		/* before encoding, that goes through data() */
+	bool ok = m_payload->encode(*this);
+	assert(ok);
+	// std::cerr << "Block::sync(" << m_index << ") <- " << (ok ? "OK" : "NO") << std::endl;
+	return ok;
+}
+
+template <size_t BLOCKSIZE>
+void Block<BLOCKSIZE>::discard()
+{
+	if (! m_payload)
+		return;
+
+	delete m_payload;
+	m_payload = NULL;
+	if (m_stale)
+	{
+		m_stale = false;
+		if (! m_data)
+		{
+			assert(m_owned);
+			m_data = block_data_alloc(BlockSize);
+			memset(m_data, 0, BlockSize);
+		}
+	}
+	m_version++;
+}
+
 /* ----------------------------------------------------------------- *
  *   BlockStorage                                                    *
  * ----------------------------------------------------------------- */
@@ -50,13 +157,21 @@ bool BlockStorage<BLOCKSIZE>::open()
 
 	assert(isOpen());
 
+	clearFree();
+	m_ext_block_id = BLOCK_ID_INVALID;
+	m_ext_n_blocks = 0;
+
 	if (created())
 		m_header_block_id = allocId();
 	else
 		m_header_block_id = firstId();
 
-	if (! created())
-		return readHeader() && isOpen();
+	if ((! created()) && (! readHeader()))
+	{
+		/* left as found */
+		abandon();
+		return false;
+	}
 	return isOpen();
 }
 
@@ -73,6 +188,15 @@ bool BlockStorage<BLOCKSIZE>::close()
 	return writeHeader() && closeHelper();
 }
 
+template <size_t BLOCKSIZE>
+bool BlockStorage<BLOCKSIZE>::abandon()
+{
+	if (! isOpen())
+		return true;
+
+	return abandonHelper();
+}
+
 /* -- Header --------------------------------------------------- */
 
 template <typename T>
@@ -115,6 +239,44 @@ bool BlockStorage<BLOCKSIZE>::readHeader()
 	}
 	assert(! packer.error());
 
+	clearFree();
+	m_user_data.clear();
+	m_ext_block_id = BLOCK_ID_INVALID;
+	m_ext_n_blocks = 0;
+
+	if (v_minor >= 2)
+	{
+		uint32_t v_ext_block_id, v_ext_n_blocks;
+		uint64_t v_ext_size;
+
+		packer >> v_ext_block_id >> v_ext_n_blocks >> v_ext_size;
+		if (packer.error())
+			return false;
+
+		if (block_id_valid(static_cast<block_id_t>(v_ext_block_id)) && (v_ext_n_blocks > 0))
+		{
+			if (v_ext_size > (static_cast<uint64_t>(v_ext_n_blocks) * BlockSize))
+				return false;
+			std::string extension(static_cast<size_t>(v_ext_n_blocks) * BlockSize, '\0');
+			if (! readRange(static_cast<block_id_t>(v_ext_block_id), static_cast<int>(v_ext_n_blocks), &extension[0]))
+				return false;
+			extension.resize(static_cast<size_t>(v_ext_size));
+			if (! deserializeExtension(extension))
+				return false;
+			m_ext_block_id = static_cast<block_id_t>(v_ext_block_id);
+			m_ext_n_blocks = static_cast<int>(v_ext_n_blocks);
+		}
+	}
+
+	if (v_minor >= 3)
+	{
+		uint32_t v_count;
+		packer >> v_count;
+		if (packer.error())
+			return false;
+		headerCount(static_cast<size_type>(v_count));
+	}
+
 	return true;
 }
 
@@ -152,6 +314,51 @@ bool BlockStorage<BLOCKSIZE>::writeHeader()
 	if (packer.error())
 		return false;
 
+	/*
+	 * the header extension (free map and user data) goes to freshly
+	 * allocated blocks, the previous ones are released only afterwards,
+	 * so the header on disk keeps pointing to a valid extension
+	 */
+	block_id_t old_ext_block_id = m_ext_block_id;
+	int old_ext_n_blocks = m_ext_n_blocks;
+	m_ext_block_id = BLOCK_ID_INVALID;
+	m_ext_n_blocks = 0;
+
+	std::string extension = serializeExtension();
+	bool has_user_data = (extension.size() > (2 * sizeof(uint32_t)));
+	if ((! m_free.empty()) || block_id_valid(old_ext_block_id) || has_user_data)
+	{
+		/* releasing the old extension adds at most one extent */
+		size_t max_size = extension.size() + 2 * sizeof(uint32_t);
+		int n_blocks = static_cast<int>((max_size + BlockSize - 1) / BlockSize);
+
+		/* lowest free extent first, so the extension doesn't pin the end of the storage */
+		m_ext_block_id = allocIdBelow(BLOCK_ID_INVALID, n_blocks);
+		if (! block_id_valid(m_ext_block_id))
+			m_ext_block_id = allocId(n_blocks);
+		if (! block_id_valid(m_ext_block_id))
+			return false;
+		m_ext_n_blocks = n_blocks;
+
+		if (block_id_valid(old_ext_block_id))
+			releaseFree(old_ext_block_id, old_ext_n_blocks);
+
+		extension = serializeExtension();
+		assert(extension.size() <= max_size);
+		size_t ext_size = extension.size();
+		extension.resize(static_cast<size_t>(n_blocks) * BlockSize, '\0');
+		if (! writeRange(m_ext_block_id, n_blocks, extension.data()))
+			return false;
+		extension.resize(ext_size);
+	}
+
+	/* the count once the extension is allocated */
+	packer << static_cast<uint32_t>(m_ext_block_id) << static_cast<uint32_t>(m_ext_n_blocks) <<
+			static_cast<uint64_t>(extension.size()) << static_cast<uint32_t>(count());
+	assert(! packer.error());
+	if (packer.error())
+		return false;
+
 	assert(packer.size() <= headerBlock.size());
 	memcpy(headerBlock.data(), packer.data(), packer.size());
 
@@ -162,6 +369,206 @@ bool BlockStorage<BLOCKSIZE>::writeHeader()
 	return true;
 }
 
+template <size_t BLOCKSIZE>
+std::string BlockStorage<BLOCKSIZE>::serializeExtension() const
+{
+	/*
+	 * [ n-extents | (first-id, count) ... | n-user-data | (uid, data) ... ]
+	 */
+	uint32_t n_user_data = 0;
+	size_t size = sizeof(uint32_t) + m_free.size() * 2 * sizeof(uint32_t) + sizeof(uint32_t);
+	std::vector<std::string>::const_iterator u_it;
+	for (u_it = m_user_data.begin(); u_it != m_user_data.end(); ++u_it)
+	{
+		if (u_it->empty())
+			continue;
+		size += sizeof(int32_t) + seriously::Traits<std::string>::serializedsize(*u_it);
+		n_user_data++;
+	}
+
+	std::string data(size, '\0');
+	char* dstp = &data[0];
+	size_t avail = data.size();
+
+	seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(m_free.size()));
+	typename free_map_type::const_iterator it;
+	for (it = m_free.begin(); it != m_free.end(); ++it)
+	{
+		seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(it->first));
+		seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(it->second));
+	}
+
+	seriously::Traits<uint32_t>::serialize(dstp, avail, n_user_data);
+	int32_t uid = 0;
+	for (u_it = m_user_data.begin(); u_it != m_user_data.end(); ++u_it, ++uid)
+	{
+		if (u_it->empty())
+			continue;
+		seriously::Traits<int32_t>::serialize(dstp, avail, uid);
+		seriously::Traits<std::string>::serialize(dstp, avail, *u_it);
+	}
+	assert(avail == 0);
+
+	return data;
+}
+
+template <size_t BLOCKSIZE>
+bool BlockStorage<BLOCKSIZE>::deserializeExtension(const std::string& data)
+{
+	const char* srcp = data.data();
+	size_t avail = data.size();
+
+	clearFree();
+	m_user_data.clear();
+
+	uint32_t v_n_extents = 0;
+	if (seriously::Traits<uint32_t>::deserialize(srcp, avail, v_n_extents) < 0)
+		return false;
+	for (uint32_t i = 0; i < v_n_extents; i++)
+	{
+		uint32_t v_block_id, v_count;
+		if (seriously::Traits<uint32_t>::deserialize(srcp, avail, v_block_id) < 0)
+			return false;
+		if (seriously::Traits<uint32_t>::deserialize(srcp, avail, v_count) < 0)
+			return false;
+		if (! releaseFree(static_cast<block_id_t>(v_block_id), static_cast<int>(v_count)))
+			return false;
+	}
+
+	uint32_t v_n_user_data = 0;
+	if (seriously::Traits<uint32_t>::deserialize(srcp, avail, v_n_user_data) < 0)
+		return false;
+	for (uint32_t i = 0; i < v_n_user_data; i++)
+	{
+		int32_t v_uid;
+		std::string v_user_data;
+		if (seriously::Traits<int32_t>::deserialize(srcp, avail, v_uid) < 0)
+			return false;
+		if (seriously::Traits<std::string>::deserialize(srcp, avail, v_user_data) < 0)
+			return false;
+		if (v_uid < 0)
+			return false;
+		setUserData(v_uid, v_user_data);
+	}
+
+	return true;
+}
+
+/* -- Free space ----------------------------------------------- */
+
+template <size_t BLOCKSIZE>
+typename BlockStorage<BLOCKSIZE>::size_type BlockStorage<BLOCKSIZE>::freeBlocks() const
+{
+	size_type n = 0;
+	typename free_map_type::const_iterator it;
+	for (it = m_free.begin(); it != m_free.end(); ++it)
+		n += static_cast<size_type>(it->second);
+	return n;
+}
+
+template <size_t BLOCKSIZE>
+block_id_t BlockStorage<BLOCKSIZE>::allocFree(int n_blocks)
+{
+	if ((n_blocks <= 0) || m_free_by_size.empty())
+		return BLOCK_ID_INVALID;
+
+	/* best fit: the smallest extent large enough */
+	typename std::set< std::pair<block_id_t, block_id_t> >::iterator s_it =
+			m_free_by_size.lower_bound(std::make_pair(static_cast<block_id_t>(n_blocks), static_cast<block_id_t>(0)));
+	if (s_it == m_free_by_size.end())
+		return BLOCK_ID_INVALID;
+
+	block_id_t count = s_it->first;
+	block_id_t block_id = s_it->second;
+	typename free_map_type::iterator it = m_free.find(block_id);
+	assert(it != m_free.end());
+	eraseFree(it);
+
+	if (count > static_cast<block_id_t>(n_blocks))
+		insertFree(block_id + n_blocks, count - n_blocks);
+
+	// std::cerr << "BS::allocFree(" << n_blocks << ") -> " << block_id << std::endl;
+	return block_id;
+}
+
+template <size_t BLOCKSIZE>
+bool BlockStorage<BLOCKSIZE>::releaseFree(block_id_t block_id, int count)
+{
+	if ((! block_id_valid(block_id)) || (count <= 0))
+		return false;
+
+	block_id_t first_id = block_id;
+	block_id_t n = static_cast<block_id_t>(count);
+
+	typename free_map_type::iterator next = m_free.lower_bound(first_id);
+	if ((next != m_free.end()) && (next->first < (first_id + n)))
+		return false;		/* already free */
+
+	if (next != m_free.begin())
+	{
+		typename free_map_type::iterator prev = next;
+		--prev;
+		if ((prev->first + prev->second) > first_id)
+			return false;	/* already free */
+		if ((prev->first + prev->second) == first_id)
+		{
+			first_id = prev->first;
+			n += prev->second;
+			eraseFree(prev);
+		}
+	}
+
+	if ((next != m_free.end()) && (next->first == (block_id + count)))
+	{
+		n += next->second;
+		eraseFree(next);
+	}
+
+	insertFree(first_id, n);
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+block_id_t BlockStorage<BLOCKSIZE>::allocIdBelow(block_id_t limit, int n_blocks)
+{
+	if (n_blocks <= 0)
+		return BLOCK_ID_INVALID;
+
+	/* first fit, in block order */
+	typename free_map_type::iterator it;
+	for (it = m_free.begin(); (it != m_free.end()) && ((it->first + static_cast<block_id_t>(n_blocks)) <= limit); ++it)
+	{
+		if (it->second < static_cast<block_id_t>(n_blocks))
+			continue;
+
+		block_id_t block_id = it->first;
+		block_id_t count = it->second;
+		eraseFree(it);
+		if (count > static_cast<block_id_t>(n_blocks))
+			insertFree(block_id + n_blocks, count - n_blocks);
+
+		// std::cerr << "BS::allocIdBelow(" << limit << ", " << n_blocks << ") -> " << block_id << std::endl;
+		return block_id;
+	}
+	return BLOCK_ID_INVALID;
+}
+
+template <size_t BLOCKSIZE>
+block_id_t BlockStorage<BLOCKSIZE>::trimFree(block_id_t next_block_id)
+{
+	/* drop the free extents at the end of the storage */
+	while (! m_free.empty())
+	{
+		typename free_map_type::iterator last = m_free.end();
+		--last;
+		if ((last->first + last->second) != next_block_id)
+			break;
+		next_block_id = last->first;
+		eraseFree(last);
+	}
+	return next_block_id;
+}
+
 /* -- Block I/O ------------------------------------------------ */
 
 template <size_t BLOCKSIZE>
@@ -187,6 +594,40 @@ bool BlockStorage<BLOCKSIZE>::dispose(block_t& block)
 	return true;
 }
 
+template <size_t BLOCKSIZE>
+bool BlockStorage<BLOCKSIZE>::readRange(block_id_t first_id, int n_blocks, char* dst)
+{
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(dst);
+
+	block_t block(first_id);
+	for (int i = 0; i < n_blocks; i++)
+	{
+		block.index(first_id + i);
+		if (! read(block))
+			return false;
+		memcpy(dst + static_cast<size_t>(i) * BlockSize, block.data(), BlockSize);
+	}
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+bool BlockStorage<BLOCKSIZE>::writeRange(block_id_t first_id, int n_blocks, const char* src)
+{
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(src);
+
+	block_t block(first_id);
+	for (int i = 0; i < n_blocks; i++)
+	{
+		block.index(first_id + i);
+		memcpy(block.data(), src + static_cast<size_t>(i) * BlockSize, BlockSize);
+		if (! write(block))
+			return false;
+	}
+	return true;
+}
+
 /* ----------------------------------------------------------------- *
  *   LRUBlockCache                                                   *
  * ----------------------------------------------------------------- */
@@ -200,268 +641,1899 @@ const typename LRUBlockCache<BLOCKSIZE, CACHESIZE>::size_type LRUBlockCache<BLOC
 template < size_t BLOCKSIZE, size_t CACHESIZE >
 const block_id_t LRUBlockCache<BLOCKSIZE, CACHESIZE>::InvalidCacheKey;
 
-/* ----------------------------------------------------------------- *
- *   FileBlockStorage                                                *
- * ----------------------------------------------------------------- */
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+const typename LRUBlockCache<BLOCKSIZE, CACHESIZE>::size_type LRUBlockCache<BLOCKSIZE, CACHESIZE>::MAX_WRITE_BACK_RUN;
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::~FileBlockStorage()
+template <typename BlockT>
+inline bool block_index_less(const BlockT* a, const BlockT* b)
 {
-	/* call close() from the most derived class */
-	if (isOpen())
-	{
-		std::cerr << std::endl << "WARNING: FileBlockStorage still open at destruction time. Call close() *BEFORE* destruction!." << std::endl << std::endl;
-		close();
-	}
-	assert(! isOpen());
+	return a->index() < b->index();
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::openHelper()
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+bool LRUBlockCache<BLOCKSIZE, CACHESIZE>::flush()
 {
-	if (isOpen())
-		return true;
+	std::vector<value_type> items;
+	this->values(items);
 
-	assert(! isOpen());
-	m_stream.open(m_pathname.c_str(), std::fstream::binary | std::fstream::in | std::fstream::out);
-	if (m_stream.is_open())
-	{
-		m_created = false;
-	} else if (! m_stream.is_open())
+	std::vector<block_type*> dirty;
+	typename std::vector<value_type>::iterator it;
+	for (it = items.begin(); it != items.end(); ++it)
 	{
-		std::cerr << "file '" << m_pathname << "' doesn't exist. Creating..." << std::endl;
-		m_stream.open(m_pathname.c_str(), std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc);
-		m_created = true;
+		block_type* block = it->second.get();
+		if (block && block->valid() && block->dirty())
+			dirty.push_back(block);
 	}
+	if (dirty.empty())
+		return true;
 
-	assert(m_stream.is_open());
+	std::sort(dirty.begin(), dirty.end(), block_index_less<block_type>);
 
-	m_count = -1;
+	bool ok = true;
+	std::vector<block_type*> run;
+	typename std::vector<block_type*>::iterator b_it;
+	for (b_it = dirty.begin(); b_it != dirty.end(); ++b_it)
+	{
+		block_type* block = *b_it;
+		if ((! run.empty()) &&
+			((run.back()->index() + 1 != block->index()) || (run.size() >= MAX_WRITE_BACK_RUN)))
+		{
+			if (! write_run(run))
+				ok = false;
+			run.clear();
+		}
+		run.push_back(block);
+	}
+	if (! write_run(run))
+		ok = false;
 
-	return isOpen();
+	// std::cerr << "LRUBlockCache::flush() wrote " << dirty.size() << " blocks" << std::endl;
+	return ok;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::closeHelper()
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+void LRUBlockCache<BLOCKSIZE, CACHESIZE>::drop_all()
 {
-	// std::cerr << "FBS::closeHelper()" << std::endl;
-	assert(isOpen());
-
-	m_lru.evict_all();
-
-	m_stream.close();
+	std::vector<value_type> items;
+	this->values(items);
 
-	m_created = false;
-	m_count = -1;
+	/* clean blocks are simply dropped by the eviction */
+	typename std::vector<value_type>::iterator it;
+	for (it = items.begin(); it != items.end(); ++it)
+	{
+		if (it->second)
+		{
+			it->second->discard();
+			it->second->dirty(false);
+		}
+	}
+	this->evict_all();
+}
 
-	return true;
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+typename LRUBlockCache<BLOCKSIZE, CACHESIZE>::size_type LRUBlockCache<BLOCKSIZE, CACHESIZE>::footprint()
+{
+	std::vector<value_type> items;
+	this->values(items);
+
+	size_type n = 0;
+	typename std::vector<value_type>::iterator it;
+	for (it = items.begin(); it != items.end(); ++it)
+		if (it->second)
+			n += it->second->footprint();
+	return n;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::flush()
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+bool LRUBlockCache<BLOCKSIZE, CACHESIZE>::cached_dirty(block_id_t block_id)
 {
-	// TODO: flush cache
+	if (! block_id_valid(block_id))
+		return false;
+	mapped_type* cached = this->peek(block_id);
+	return cached && (*cached) && (*cached)->dirty();
+}
 
-	return true;
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+bool LRUBlockCache<BLOCKSIZE, CACHESIZE>::write_back(block_type& block)
+{
+	/* take along the dirty cached neighbours, so that they end up in the same write */
+	block_id_t first_id = block.index();
+	block_id_t last_id = block.index();
+	while ((first_id > 0) && ((last_id - first_id + 1) < MAX_WRITE_BACK_RUN) && cached_dirty(first_id - 1))
+		first_id--;
+	while (((last_id - first_id + 1) < MAX_WRITE_BACK_RUN) && cached_dirty(last_id + 1))
+		last_id++;
+
+	std::vector<block_type*> run;
+	for (block_id_t block_id = first_id; block_id <= last_id; block_id++)
+		run.push_back((block_id == block.index()) ? &block : this->peek(block_id)->get());
+	return write_run(run);
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::size_type FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::count()
+template < size_t BLOCKSIZE, size_t CACHESIZE >
+bool LRUBlockCache<BLOCKSIZE, CACHESIZE>::write_run(const std::vector<block_type*>& run)
 {
-	if (! isOpen())
-		return 0;
+	if (run.empty())
+		return true;
 
-	if (m_count < 0)
-		_updateCount();
+	bool ok;
+	if (run.size() == 1)
+	{
+		ok = m_storage->write(*run.front());
+	} else
+	{
+		size_t n_blocks = run.size();
+		char* buffer = block_data_alloc(n_blocks * BlockSize);
+		for (size_t i = 0; i < n_blocks; i++)
+		{
+			assert(run[i]->index() == run.front()->index() + i);
+			memcpy(buffer + i * BlockSize, run[i]->data(), BlockSize);
+		}
+		ok = m_storage->writeRange(run.front()->index(), static_cast<int>(n_blocks), buffer);
+		block_data_free(buffer);
+	}
 
-	assert(m_count >= 0);
-	return static_cast<size_type>(m_count);
+	if (ok)
+	{
+		typename std::vector<block_type*>::const_iterator it;
+		for (it = run.begin(); it != run.end(); ++it)
+			(*it)->dirty(false);
+	}
+	return ok;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-void FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::_updateCount()
-{
-	if (! isOpen())
-		return;
+/* ----------------------------------------------------------------- *
+ *   StreamFileIO                                                    *
+ * ----------------------------------------------------------------- */
 
-	assert(m_stream.is_open());
+inline bool StreamFileIO::open(const std::string& pathname, size_t block_size, bool& created)
+{
+	UNUSED(block_size);
 
-	m_stream.seekg(0, std::ios_base::end);
-	std::ifstream::pos_type pos = m_stream.tellg();
-	assert(pos != static_cast<std::ifstream::pos_type>(-1));
-	assert((pos % BlockSize) == 0);
-	m_count = static_cast<ssize_t>(pos / BlockSize);
-//	std::cout << "block count:" << m_count << std::endl;
-
-	if (m_next_block_id == BLOCK_ID_INVALID)
-		m_next_block_id = static_cast<block_id_t>(m_count);
-}
-
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::nextId()
-{
-	if (! isOpen())
-		return 0;
+	if (isOpen())
+		return true;
 
-	if (m_next_block_id == BLOCK_ID_INVALID)
-		_updateCount();
+	m_pathname = pathname;
+	m_stream.open(pathname.c_str(), std::fstream::binary | std::fstream::in | std::fstream::out);
+	if (m_stream.is_open())
+	{
+		created = false;
+	} else
+	{
+		std::cerr << "file '" << pathname << "' doesn't exist. Creating..." << std::endl;
+		m_stream.open(pathname.c_str(), std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc);
+		created = true;
+	}
 
-	assert(m_next_block_id != BLOCK_ID_INVALID);
-	return m_next_block_id;
+	return isOpen();
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::allocId(int n_blocks)
+inline bool StreamFileIO::close()
 {
-	// std::cerr << "FBS::allocId(" << n_blocks << ")" << std::endl;
-	// block_id_t block_id = m_next_block_id;
-	// if (block_id == BLOCK_ID_INVALID)
-	// 	block_id = static_cast<block_id_t>(count());
-	block_id_t block_id = nextId();
-	m_next_block_id = block_id + n_blocks;
-	return block_id;
+	m_stream.close();
+	return true;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::dispose(block_id_t block_id, int count)
+inline ssize_t StreamFileIO::size()
 {
-	if (block_id == BLOCK_ID_INVALID)
-		return false;
-
-	assert(block_id != BLOCK_ID_INVALID);
-
-	nextId();	// force update of m_next_block_id if necessary
-	if (m_next_block_id == (block_id + count))
-		m_next_block_id -= count;
-
-	return true;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.seekg(0, std::ios_base::end);
+	std::ifstream::pos_type pos = m_stream.tellg();
+	if (pos == static_cast<std::ifstream::pos_type>(-1))
+		return -1;
+	return static_cast<ssize_t>(pos);
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::read(block_t& dst)
+inline bool StreamFileIO::read(char* dst, size_t size, uint64_t offset)
 {
-	// std::cerr << "bs.read(" << dst.index() << ")" << std::endl;
-	assert(dst.index() != BLOCK_ID_INVALID);
-
-	size_t pos = dst.index() * BlockSize;
-
+	/* seek and transfer go together */
+	std::lock_guard<std::mutex> lock(m_mutex);
 	try {
-		m_stream.seekg(static_cast<std::streamoff>(pos));
+		m_stream.seekg(static_cast<std::streamoff>(offset));
 	} catch (std::ios::failure) {
 		assert(false);
 		return false;
 	}
 
 	try {
-		m_stream.read(dst.data(), BlockSize);
+		m_stream.read(dst, size);
 	} catch (std::ios_base::failure& e) {
-		std::cerr << "error reading block " << dst.index() << ":" << e.what() << std::endl;
+		std::cerr << "error reading at offset " << offset << ":" << e.what() << std::endl;
 		assert(false);
 		return false;
 	}
 
 	if (m_stream.fail())
 	{
-		// std::cerr << "can't read block " << dst.index() << "\n";
-		dst.dirty(true);
 		m_stream.clear();
-		// std::cerr << "FBS::read() failure" << std::endl;
 		return false;
-	} else
-		dst.dirty(false);
-
-	// std::cerr << "FBS::read(" << dst.index() << ") block dump:" << std::endl << s_hexdump(dst.data(), 128) << std::endl;
-
-//	if (m_stream.fail())
-//	{
-//		std::cerr << "stream fail reading block " << dst.index() << ", error: " << strerror(errno) << std::endl;
-//		assert(false);
-//		return false;
-//	}
+	}
 
-	assert(! m_stream.fail());
 	return true;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::write(block_t& src)
+inline bool StreamFileIO::write(const char* src, size_t size, uint64_t offset)
 {
-	// std::cerr << "bs.write(" << src.index() << ")" << std::endl;
-	assert(src.index() != BLOCK_ID_INVALID);
-
-	size_t pos = src.index() * BlockSize;
-
+	std::lock_guard<std::mutex> lock(m_mutex);
 	try {
-		m_stream.seekp(static_cast<std::streamoff>(pos));
+		m_stream.seekp(static_cast<std::streamoff>(offset));
 	} catch (std::ios::failure& e) {
-		std::cerr << "error writing (seeking) block " << src.index() << ":" << e.what() << std::endl;
-		src.dirty(true);
-		assert(false);
+		std::cerr << "error seeking at offset " << offset << ":" << e.what() << std::endl;
 		return false;
 	}
 
 	try {
-		m_stream.write(src.data(), BlockSize);
+		m_stream.write(src, size);
 	} catch (std::ios_base::failure& e) {
-		std::cerr << "error writing block " << src.index() << ":" << e.what() << std::endl;
-		src.dirty(true);
-		assert(false);
+		std::cerr << "error writing at offset " << offset << ":" << e.what() << std::endl;
 		return false;
 	}
 
 	if (m_stream.fail())
 	{
-		std::cerr << "stream fail writing block " << src.index() << ", error: " << strerror(errno) << std::endl;
-		src.dirty(true);
-		assert(false);
+		std::cerr << "stream fail writing at offset " << offset << ", error: " << strerror(errno) << std::endl;
+		m_stream.clear();
 		return false;
+	}
+
+	return true;
+}
+
+inline bool StreamFileIO::sync()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.flush();
+	return ! m_stream.fail();
+}
+
+inline bool StreamFileIO::truncate(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.flush();
+#if defined(HAVE_UNISTD_H)
+	return (::truncate(m_pathname.c_str(), static_cast<off_t>(size)) == 0);
+#else
+	/* no portable way to shrink a stream: the file keeps its size */
+	UNUSED(size);
+	return false;
+#endif
+}
+
+#if defined(HAVE_UNISTD_H)
+
+/* ----------------------------------------------------------------- *
+ *   PosixFileIO                                                     *
+ * ----------------------------------------------------------------- */
+
+inline bool PosixFileIO::open(const std::string& pathname, size_t block_size, bool& created)
+{
+	if (isOpen())
+		return true;
+
+	int flags = O_RDWR;
+	m_direct_active = false;
+#if defined(O_DIRECT)
+	if (m_direct && ((block_size % DIRECT_ALIGNMENT) == 0))
+	{
+		flags |= O_DIRECT;
+		m_direct_active = true;
+	}
+#endif
+
+	m_fd = ::open(pathname.c_str(), flags);
+	if ((m_fd < 0) && m_direct_active && (errno == EINVAL))
+	{
+		/* filesystem doesn't support O_DIRECT */
+		flags &= ~O_DIRECT;
+		m_direct_active = false;
+		m_fd = ::open(pathname.c_str(), flags);
+	}
+	if (m_fd >= 0)
+	{
+		created = false;
 	} else
-		src.dirty(false);
+	{
+		std::cerr << "file '" << pathname << "' doesn't exist. Creating..." << std::endl;
+		m_fd = ::open(pathname.c_str(), flags | O_CREAT | O_TRUNC, 0644);
+		if ((m_fd < 0) && m_direct_active && (errno == EINVAL))
+		{
+			flags &= ~O_DIRECT;
+			m_direct_active = false;
+			m_fd = ::open(pathname.c_str(), flags | O_CREAT | O_TRUNC, 0644);
+		}
+		created = true;
+	}
+
+	if (m_fd < 0)
+	{
+		std::cerr << "can't open '" << pathname << "', error: " << strerror(errno) << std::endl;
+		m_direct_active = false;
+		return false;
+	}
 
-	assert(! m_stream.fail());
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+	if (m_direct && ((block_size % DIRECT_ALIGNMENT) == 0))
+		m_direct_active = (fcntl(m_fd, F_NOCACHE, 1) != -1);
+#endif
 
-	pos += BlockSize;
-	if (pos >= (m_count * BlockSize))
-		m_count = static_cast<ssize_t>(pos / BlockSize);
+	return isOpen();
+}
 
-	// std::cerr << "FBS::write(" << src.index() << ") block dump:" << std::endl << s_hexdump(src.data(), 128) << std::endl;
-	return true;
+inline bool PosixFileIO::close()
+{
+	if (! isOpen())
+		return true;
+	bool ok = (::close(m_fd) == 0);
+	m_fd = -1;
+	m_direct_active = false;
+	return ok;
 }
 
-/* cached I/O */
+inline ssize_t PosixFileIO::size()
+{
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+		return -1;
+	return static_cast<ssize_t>(st.st_size);
+}
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-shptr<typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::block_t> FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::get(block_id_t block_id)
+inline bool PosixFileIO::read(char* dst, size_t size, uint64_t offset)
 {
-	// std::cerr << "bs.get(" << block_id << ")\n";
-	return m_lru[block_id];
+	if (m_direct_active && (! aligned(dst, size, offset)))
+	{
+		/* bounce through an aligned buffer */
+		char* bounce = block_data_alloc(size);
+		bool ok = read(bounce, size, offset);
+		if (ok)
+			memcpy(dst, bounce, size);
+		block_data_free(bounce);
+		return ok;
+	}
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = pread(m_fd, dst + done, size - done, static_cast<off_t>(offset + done));
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			std::cerr << "error reading at offset " << (offset + done) << ", error: " << strerror(errno) << std::endl;
+			return false;
+		}
+		if (n == 0)
+			return false;		/* EOF */
+		done += static_cast<size_t>(n);
+	}
+	return true;
 }
 
-template <size_t BLOCKSIZE, int CACHE_SIZE>
-bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE>::put(const block_t& src)
+inline bool PosixFileIO::write(const char* src, size_t size, uint64_t offset)
 {
-	// std::cerr << "bs.put(" << src.index() << ")\n";
-	shptr<block_t> cached( m_lru[src.index()] );
-	if (cached)
+	if (m_direct_active && (! aligned(src, size, offset)))
+	{
+		char* bounce = block_data_alloc(size);
+		memcpy(bounce, src, size);
+		bool ok = write(bounce, size, offset);
+		block_data_free(bounce);
+		return ok;
+	}
+
+	size_t done = 0;
+	while (done < size)
 	{
-		if (cached.get() != &src)
+		ssize_t n = pwrite(m_fd, src + done, size - done, static_cast<off_t>(offset + done));
+		if (n < 0)
 		{
-			assert(cached->index() == src.index());
-			*cached = src;
-			assert(src.dirty() == (*cached).dirty());
+			if (errno == EINTR)
+				continue;
+			std::cerr << "error writing at offset " << (offset + done) << ", error: " << strerror(errno) << std::endl;
+			return false;
 		}
+		done += static_cast<size_t>(n);
+	}
+	return true;
+}
+
+inline bool PosixFileIO::sync()
+{
+	return (fsync(m_fd) == 0);
+}
+
+inline bool PosixFileIO::truncate(uint64_t size)
+{
+	return (ftruncate(m_fd, static_cast<off_t>(size)) == 0);
+}
+
+#endif /* defined(HAVE_UNISTD_H) */
+
+/* ----------------------------------------------------------------- *
+ *   FileBlockStorage                                                *
+ * ----------------------------------------------------------------- */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+const block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::SHADOW_SLOTS;
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+const uint32_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::SHADOW_VERSION;
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::~FileBlockStorage()
+{
+	/* call close() from the most derived class */
+	if (isOpen())
+	{
+		std::cerr << std::endl << "WARNING: FileBlockStorage still open at destruction time. Call close() *BEFORE* destruction!." << std::endl << std::endl;
+		close();
+	}
+	assert(! isOpen());
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::openHelper()
+{
+	if (isOpen())
 		return true;
+
+	assert(! isOpen());
+	if (! m_io.open(m_pathname, BlockSize, m_created))
+		return false;
+
+	assert(m_io.isOpen());
+
+	m_count = -1;
+
+	if (! shadowOpen())
+	{
+		m_io.close();
+		m_created = false;
+		return false;
+	}
+
+	return isOpen();
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::closeHelper()
+{
+	// std::cerr << "FBS::closeHelper()" << std::endl;
+	assert(isOpen());
+
+	/* sorted write back first, so that the eviction only drops clean blocks */
+	cache_lock_type lock(m_cache_mutex);
+	bool ok = m_lru.flush();
+	if (m_shadow_active && (! shadowCommit()))
+		ok = false;
+	m_lru.evict_all();
+
+	m_io.close();
+
+	m_created = false;
+	m_count = -1;
+	m_shadow_active = false;
+
+	return ok;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::abandonHelper()
+{
+	assert(isOpen());
+
+	/* no write back, no commit: blocks written to shadow slots are never referenced */
+	cache_lock_type lock(m_cache_mutex);
+	m_lru.drop_all();
+
+	m_io.close();
+
+	m_created = false;
+	m_count = -1;
+	m_shadow_active = false;
+
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::flush()
+{
+	if (! isOpen())
+		return false;
+
+	cache_lock_type lock(m_cache_mutex);
+	bool ok = m_lru.flush();
+	if (! this->writeHeader())
+		ok = false;
+	if (m_shadow_active)
+	{
+		/* a failed write back mustn't be committed */
+		if ((! ok) || (! shadowCommit()))
+			ok = false;
+	} else if (! m_io.sync())
+		ok = false;
+	return ok;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::truncate()
+{
+	if (! isOpen())
+		return false;
+
+	/*
+	 * disposed blocks are already out of the cache. The header goes out
+	 * after the trim, so that its free map doesn't refer past the new end
+	 * of file (its extension could land at the end, hence the final size).
+	 * Rewriting the header releases the old extension, which can free the
+	 * tail once more: repeat until nothing is left to trim.
+	 */
+	bool ok = true;
+	block_id_t next_id;
+	do
+	{
+		next_id = m_next_block_id;
+		m_next_block_id = this->trimFree(next_id);
+		ok = this->writeHeader();
+	} while (ok && (m_next_block_id != next_id));
+	if (m_shadow_active)
+	{
+		if (! shadowTruncate())
+			ok = false;
+	} else if (! m_io.truncate(static_cast<uint64_t>(m_next_block_id) * BlockSize))
+		ok = false;
+	m_count = -1;
+	return ok;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::size_type FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::count()
+{
+	if (! isOpen())
+		return 0;
+
+	if (m_count < 0)
+		_updateCount();
+
+	assert(m_count >= 0);
+	return static_cast<size_type>(m_count);
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::_updateCount()
+{
+	if (! isOpen())
+		return;
+
+	assert(m_io.isOpen());
+
+	if (m_shadow_active)
+	{
+		/* the logical blocks written so far */
+		std::lock_guard<std::mutex> lock(m_shadow_mutex);
+		m_count = static_cast<ssize_t>(m_shadow_map.size());
 	} else
 	{
-		block_id_t bid = src.index();
-		shptr<block_t> src_ptr( new block_t(bid) );
-		*src_ptr = src;
-		return m_lru.set(bid, src_ptr) ? true : false;
+		ssize_t file_size = m_io.size();
+		assert(file_size >= 0);
+		assert((file_size % BlockSize) == 0);
+		m_count = static_cast<ssize_t>(file_size / BlockSize);
 	}
+//	std::cout << "block count:" << m_count << std::endl;
 
-	return false;
+	if (m_next_block_id == BLOCK_ID_INVALID)
+		m_next_block_id = static_cast<block_id_t>(m_count);
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::nextId()
+{
+	if (! isOpen())
+		return 0;
+
+	if (m_next_block_id == BLOCK_ID_INVALID)
+		_updateCount();
+
+	assert(m_next_block_id != BLOCK_ID_INVALID);
+	return m_next_block_id;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::allocId(int n_blocks)
+{
+	// std::cerr << "FBS::allocId(" << n_blocks << ")" << std::endl;
+	// block_id_t block_id = m_next_block_id;
+	// if (block_id == BLOCK_ID_INVALID)
+	// 	block_id = static_cast<block_id_t>(count());
+	block_id_t block_id = this->allocFree(n_blocks);
+	if (block_id_valid(block_id))
+		return block_id;
+
+	block_id = nextId();
+	m_next_block_id = block_id + n_blocks;
+	return block_id;
 }
 
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::dispose(block_id_t block_id, int count)
+{
+	if (block_id == BLOCK_ID_INVALID)
+		return false;
+
+	assert(block_id != BLOCK_ID_INVALID);
+
+	if ((block_id + count) > nextId())
+		return false;
+
+	/* disposed blocks don't need to be written back */
+	{
+		cache_lock_type lock(m_cache_mutex);
+		for (int i = 0; i < count; i++)
+		{
+			block_id_t cached_id = block_id + i;
+			if (m_lru.peek(cached_id))
+				m_lru.del(cached_id);
+		}
+	}
+
+	if (m_shadow_active)
+		shadowRelease(block_id, count);
+
+	/* the file doesn't shrink, the blocks are reused by allocId() */
+	return this->releaseFree(block_id, count);
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::read(block_t& dst)
+{
+	// std::cerr << "bs.read(" << dst.index() << ")" << std::endl;
+	assert(dst.index() != BLOCK_ID_INVALID);
+
+	if (! ioRead(dst.index(), 1, dst.data()))
+	{
+		// std::cerr << "can't read block " << dst.index() << "\n";
+		return false;
+	} else
+		dst.dirty(false);
+
+	// std::cerr << "FBS::read(" << dst.index() << ") block dump:" << std::endl << s_hexdump(dst.data(), 128) << std::endl;
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::write(block_t& src)
+{
+	// std::cerr << "bs.write(" << src.index() << ")" << std::endl;
+	assert(src.index() != BLOCK_ID_INVALID);
+
+	if (! ioWrite(src.index(), 1, src.data()))
+	{
+		std::cerr << "error writing block " << src.index() << std::endl;
+		src.dirty(true);
+		return false;
+	} else
+		src.dirty(false);
+
+	cache_lock_type lock(m_cache_mutex);
+	count();	// force update of m_count if necessary
+	uint64_t pos = (static_cast<uint64_t>(src.index()) + 1) * BlockSize;
+	if (pos >= (static_cast<uint64_t>(m_count) * BlockSize))
+		m_count = static_cast<ssize_t>(pos / BlockSize);
+
+	// std::cerr << "FBS::write(" << src.index() << ") block dump:" << std::endl << s_hexdump(src.data(), 128) << std::endl;
+	return true;
+}
+
+/* span I/O */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::readRange(block_id_t first_id, int n_blocks, char* dst)
+{
+	// std::cerr << "bs.readRange(" << first_id << ", " << n_blocks << ")" << std::endl;
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(dst);
+
+	if (n_blocks <= 0)
+		return true;
+	if (! hasId(first_id + n_blocks - 1))
+		return false;
+
+	/*
+	 * cached blocks can be newer than their on-disk image. When none of
+	 * them is dirty the file is current, and can be read without holding
+	 * the cache (readers never dirty blocks).
+	 */
+	std::unique_lock<cache_mutex_type> lock(m_cache_mutex);
+	size_type n_total = static_cast<size_type>(n_blocks);
+	bool coherent = true;
+	for (size_type i = 0; coherent && (i < n_total); i++)
+	{
+		shptr<block_t>* cached = m_lru.peek(first_id + static_cast<block_id_t>(i));
+		if (cached && (*cached) && (*cached)->dirty())
+			coherent = false;
+	}
+
+	/* allocated blocks past the end of file haven't been written yet */
+	size_type n_on_disk = 0;
+	size_type on_disk = count();
+	if (first_id < on_disk)
+		n_on_disk = min(n_total, on_disk - first_id);
+
+	if (coherent)
+		lock.unlock();
+	bool ok = true;
+	if (n_on_disk > 0)
+		ok = ioRead(first_id, n_on_disk, dst);
+	if (n_on_disk < n_total)
+		memset(dst + n_on_disk * BlockSize, 0, (n_total - n_on_disk) * BlockSize);
+	if (coherent)
+		return ok;
+
+	for (size_type i = 0; ok && (i < n_total); i++)
+	{
+		shptr<block_t>* cached = m_lru.peek(first_id + static_cast<block_id_t>(i));
+		if (cached && (*cached))
+			memcpy(dst + i * BlockSize, (*cached)->data(), BlockSize);
+	}
+
+	return ok;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::writeRange(block_id_t first_id, int n_blocks, const char* src)
+{
+	// std::cerr << "bs.writeRange(" << first_id << ", " << n_blocks << ")" << std::endl;
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(src);
+
+	if (n_blocks <= 0)
+		return true;
+
+	size_type n_total = static_cast<size_type>(n_blocks);
+	uint64_t pos = static_cast<uint64_t>(first_id) * BlockSize;
+
+	cache_lock_type lock(m_cache_mutex);
+	count();	// force update of m_count if necessary
+	if (! ioWrite(first_id, n_total, src))
+	{
+		std::cerr << "error writing blocks " << first_id << "-" << (first_id + n_blocks - 1) << std::endl;
+		return false;
+	}
+
+	pos += n_total * BlockSize;
+	if (pos >= (static_cast<uint64_t>(m_count) * BlockSize))
+		m_count = static_cast<ssize_t>(pos / BlockSize);
+
+	/* keep cached copies coherent, or their eviction would overwrite the span */
+	for (size_type i = 0; i < n_total; i++)
+	{
+		shptr<block_t>* cached = m_lru.peek(first_id + static_cast<block_id_t>(i));
+		if (cached && (*cached))
+		{
+			/* a payload only survives the write back of its own encoding */
+			if ((! (*cached)->payload()) || (memcmp((*cached)->data(), src + i * BlockSize, BlockSize) != 0))
+			{
+				(*cached)->discard();
+				memcpy((*cached)->data(), src + i * BlockSize, BlockSize);
+			}
+			(*cached)->dirty(false);
+		}
+	}
+
+	return true;
+}
+
+/* cached I/O */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+shptr<typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::block_t> FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::get(block_id_t block_id)
+{
+	// std::cerr << "bs.get(" << block_id << ")\n";
+	{
+		cache_lock_type lock(m_cache_mutex);
+		shptr<block_t>* cached = m_lru.lookup(block_id);
+		if (cached)
+			return *cached;
+		if (! hasId(block_id))
+			return shptr<block_t>();
+	}
+
+	/*
+	 * a miss is read without holding the cache, other readers keep hitting
+	 * it meanwhile. Allocated blocks not written yet are read as zeros,
+	 * a block that can't be read isn't cached.
+	 */
+	shptr<block_t> block( new block_t(block_id) );
+	if (! read(*block))
+		return shptr<block_t>();
+
+	cache_lock_type lock(m_cache_mutex);
+	shptr<block_t>* cached = m_lru.peek(block_id);
+	if (cached && (*cached))
+		return *cached;						/* loaded by another thread meanwhile */
+	m_lru.set(block_id, block);
+	return block;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::size_type FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::prefetch(const std::vector<block_id_t>& block_ids)
+{
+	// std::cerr << "bs.prefetch(" << block_ids.size() << ")\n";
+	std::vector<block_id_t> missing;
+	{
+		cache_lock_type lock(m_cache_mutex);
+		size_type limit = m_lru.capacity() / 4;
+		if (limit < 1)
+			limit = 1;
+		size_type on_disk = count();
+		for (size_type i = 0; (i < block_ids.size()) && (missing.size() < limit); i++)
+		{
+			block_id_t block_id = block_ids[i];
+			if ((block_id != BLOCK_ID_INVALID) && (block_id < on_disk) && (! m_lru.peek(block_id)))
+				missing.push_back(block_id);
+		}
+	}
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+	/* like get(), the file is read without holding the cache */
+	size_type n_read = 0;
+	std::vector<char> buffer;
+	size_type i = 0;
+	while (i < missing.size())
+	{
+		size_type n_run = 1;
+		while ((i + n_run < missing.size()) && (n_run < MAX_READ_AHEAD_RUN) && (missing[i + n_run] == missing[i] + n_run))
+			n_run++;
+
+		buffer.resize(n_run * BlockSize);
+		if (! ioRead(missing[i], n_run, &buffer[0]))
+			break;
+
+		cache_lock_type lock(m_cache_mutex);
+		for (size_type k = 0; k < n_run; k++)
+		{
+			block_id_t block_id = missing[i + k];
+			if (m_lru.peek(block_id))
+				continue;					/* loaded by another thread meanwhile */
+			shptr<block_t> block( new block_t(block_id) );
+			memcpy(block->data(), &buffer[k * BlockSize], BlockSize);
+			block->dirty(false);
+			m_lru.set(block_id, block);
+			n_read++;
+		}
+		i += n_run;
+	}
+	return n_read;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+shptr<typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::block_t> FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::claim(block_id_t block_id)
+{
+	// std::cerr << "bs.claim(" << block_id << ")\n";
+	cache_lock_type lock(m_cache_mutex);
+	if (! hasId(block_id))
+		return shptr<block_t>();
+	if (m_lru.peek(block_id))
+		return m_lru[block_id];
+
+	/* its content is about to be replaced: no need to read it from disk */
+	shptr<block_t> block( new block_t(block_id) );
+	block->dirty(true);
+	m_lru.set(block_id, block);
+	return block;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::put(const block_t& src)
+{
+	// std::cerr << "bs.put(" << src.index() << ")\n";
+	block_id_t bid = src.index();
+	cache_lock_type lock(m_cache_mutex);
+	if (m_lru.peek(bid))
+	{
+		shptr<block_t> cached( m_lru[bid] );		/* refreshes recency */
+		if (cached)
+		{
+			if (cached.get() != &src)
+			{
+				assert(cached->index() == bid);
+				/* rewriting identical contents doesn't make a clean block dirty */
+				if (cached->dirty() || (memcmp(cached->data(), src.data(), BlockSize) != 0))
+				{
+					*cached = src;
+					cached->dirty(true);
+				}
+			} else
+				cached->dirty(true);				/* modified in place */
+			return true;
+		}
+	}
+
+	/* not cached: no need to read it from disk, it's entirely replaced */
+	shptr<block_t> src_ptr( new block_t(bid) );
+	*src_ptr = src;
+	src_ptr->dirty(true);
+	return m_lru.set(bid, src_ptr) ? true : false;
+}
+
+/* file transfers */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::ioRead(block_id_t first_id, size_type n_blocks, char* dst)
+{
+	if (! m_shadow_active)
+		return ioReadAt(dst, n_blocks * BlockSize, static_cast<uint64_t>(first_id) * BlockSize);
+
+	std::vector<block_id_t> physical(n_blocks, BLOCK_ID_INVALID);
+	{
+		std::lock_guard<std::mutex> lock(m_shadow_mutex);
+		for (size_type i = 0; i < n_blocks; i++)
+		{
+			block_id_t logical_id = first_id + static_cast<block_id_t>(i);
+			if (logical_id < m_shadow_map.size())
+				physical[i] = m_shadow_map[logical_id];
+		}
+	}
+
+	return shadowRead(&physical[0], n_blocks, dst);
+}
+
+/*
+ * blocks allocated but not written yet lie past the end of the file and
+ * read as zeros, any other failure is an error
+ */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::ioReadAt(char* dst, size_t size, uint64_t offset)
+{
+	if (m_io.read(dst, size, offset))
+		return true;
+
+	ssize_t file_size = m_io.size();
+	if ((file_size < 0) || ((offset + size) <= static_cast<uint64_t>(file_size)))
+		return false;
+
+	size_t avail = (offset < static_cast<uint64_t>(file_size)) ? static_cast<size_t>(static_cast<uint64_t>(file_size) - offset) : 0;
+	if ((avail > 0) && (! m_io.read(dst, avail, offset)))
+		return false;
+	memset(dst + avail, 0, size - avail);
+	return true;
+}
+
+/* physically contiguous runs are read at once, unmapped blocks were never written */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowRead(const block_id_t* physical, size_type n_blocks, char* dst)
+{
+	size_type i = 0;
+	while (i < n_blocks)
+	{
+		size_type j = i + 1;
+		if (block_id_valid(physical[i]))
+		{
+			while ((j < n_blocks) && (physical[j] == physical[i] + (j - i)))
+				j++;
+			if (! ioReadAt(dst + i * BlockSize, (j - i) * BlockSize, static_cast<uint64_t>(physical[i]) * BlockSize))
+				return false;
+		} else
+		{
+			while ((j < n_blocks) && (! block_id_valid(physical[j])))
+				j++;
+			memset(dst + i * BlockSize, 0, (j - i) * BlockSize);
+		}
+		i = j;
+	}
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::ioWrite(block_id_t first_id, size_type n_blocks, const char* src)
+{
+	if (! m_shadow_active)
+		return m_io.write(src, n_blocks * BlockSize, static_cast<uint64_t>(first_id) * BlockSize);
+
+	/*
+	 * blocks already remapped during this epoch are rewritten in place,
+	 * the others get a single fresh run. The page table changes only
+	 * once the data is written: a failed write leaves the old mapping.
+	 */
+	std::vector<block_id_t> physical(n_blocks, BLOCK_ID_INVALID);
+	std::vector<bool> remapped(n_blocks, false);
+	{
+		std::lock_guard<std::mutex> lock(m_shadow_mutex);
+		size_type n_committed = 0;
+		for (size_type i = 0; i < n_blocks; i++)
+		{
+			block_id_t logical_id = first_id + static_cast<block_id_t>(i);
+			if ((logical_id < m_shadow_fresh.size()) && m_shadow_fresh[logical_id])
+				physical[i] = m_shadow_map[logical_id];
+			else
+			{
+				remapped[i] = true;
+				n_committed++;
+			}
+		}
+		block_id_t fresh_id = (n_committed > 0) ? shadowAllocRun(n_committed) : BLOCK_ID_INVALID;
+		for (size_type i = 0; i < n_blocks; i++)
+			if (remapped[i])
+				physical[i] = fresh_id++;
+	}
+
+	bool ok = true;
+	size_type i = 0;
+	while (ok && (i < n_blocks))
+	{
+		size_type j = i + 1;
+		while ((j < n_blocks) && (physical[j] == physical[i] + (j - i)))
+			j++;
+		ok = m_io.write(src + i * BlockSize, (j - i) * BlockSize, static_cast<uint64_t>(physical[i]) * BlockSize);
+		i = j;
+	}
+
+	std::lock_guard<std::mutex> lock(m_shadow_mutex);
+	if (! ok)
+	{
+		/* the fresh blocks weren't referenced yet */
+		for (size_type k = 0; k < n_blocks; k++)
+			if (remapped[k])
+				m_shadow_free.insert(physical[k]);
+		return false;
+	}
+
+	size_type n_logical = static_cast<size_type>(first_id) + n_blocks;
+	if (n_logical > m_shadow_map.size())
+	{
+		m_shadow_map.resize(n_logical, BLOCK_ID_INVALID);
+		m_shadow_fresh.resize(n_logical, false);
+	}
+	for (size_type k = 0; k < n_blocks; k++)
+	{
+		if (! remapped[k])
+			continue;
+		block_id_t logical_id = first_id + static_cast<block_id_t>(k);
+		if (block_id_valid(m_shadow_map[logical_id]))
+			shadowRetire(m_shadow_map[logical_id]);
+		m_shadow_map[logical_id] = physical[k];
+		m_shadow_fresh[logical_id] = true;
+	}
+	return true;
+}
+
+/* -- Shadow paging -------------------------------------------- */
+
+/*
+ * physical layout: blocks 0 and 1 are the two header slots, any other
+ * block holds a logical block or a part of a page table. A slot holds
+ * the magic, the sequence number of its commit and the location, size
+ * and checksum of its page table (an array of physical ids indexed by
+ * logical id), and ends with the checksum of the slot itself.
+ * The free physical blocks aren't stored: they are those referenced by
+ * neither the page table nor the table itself.
+ */
+
+#define MILLIWAYS_SHADOW_MAGIC "MWSHADOW"
+#define MILLIWAYS_SHADOW_MAGIC_LEN 8
+
+inline void shadow_put32(char* dst, uint32_t value)
+{
+	uint32_t nvalue = htonl(value);
+	memcpy(dst, &nvalue, sizeof(nvalue));
+}
+
+inline uint32_t shadow_get32(const char* src)
+{
+	uint32_t nvalue;
+	memcpy(&nvalue, src, sizeof(nvalue));
+	return ntohl(nvalue);
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowReadSlot(block_id_t slot, uint64_t& seq, block_id_t& table_id, size_type& table_n, size_type& n_entries, uint32_t& table_crc)
+{
+	if ((static_cast<uint64_t>(slot) + 1) * BlockSize > static_cast<uint64_t>(m_io.size()))
+		return false;
+
+	block_t slotBlock(slot);
+	char* p = slotBlock.data();
+	if (! m_io.read(p, BlockSize, static_cast<uint64_t>(slot) * BlockSize))
+		return false;
+
+	if (memcmp(p, MILLIWAYS_SHADOW_MAGIC, MILLIWAYS_SHADOW_MAGIC_LEN) != 0)
+		return false;
+	if (crc32(p, BlockSize - sizeof(uint32_t)) != shadow_get32(p + BlockSize - sizeof(uint32_t)))
+	{
+		// std::cerr << "torn header slot " << slot << std::endl;
+		return false;
+	}
+	p += MILLIWAYS_SHADOW_MAGIC_LEN;
+	if ((shadow_get32(p) != SHADOW_VERSION) || (shadow_get32(p + 4) != BlockSize))
+		return false;
+	seq = (static_cast<uint64_t>(shadow_get32(p + 8)) << 32) | shadow_get32(p + 12);
+	table_id = static_cast<block_id_t>(shadow_get32(p + 16));
+	table_n = static_cast<size_type>(shadow_get32(p + 20));
+	n_entries = static_cast<size_type>(shadow_get32(p + 24));
+	table_crc = shadow_get32(p + 28);
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowOpen()
+{
+	m_shadow_active = false;
+	m_shadow_map.clear();
+	m_shadow_fresh.clear();
+	m_shadow_free.clear();
+	m_shadow_retired.clear();
+	m_shadow_holders.clear();
+	m_shadow_table_id = BLOCK_ID_INVALID;
+	m_shadow_table_n = 0;
+	m_shadow_seq = 0;
+
+	if (m_created)
+	{
+		if (! m_cow)
+			return true;
+
+		/* an empty first commit, so that the file is recognized from now on */
+		m_shadow_active = true;
+		m_shadow_end = SHADOW_SLOTS;
+		m_shadow_slot = SHADOW_SLOTS - 1;
+		return shadowCommit();
+	}
+
+	/* the most recent valid slot: the other one may have been torn by a crash */
+	uint64_t seq = 0;
+	block_id_t table_id = BLOCK_ID_INVALID;
+	size_type table_n = 0, n_entries = 0;
+	uint32_t table_crc = 0;
+	bool found = false;
+	for (block_id_t slot = 0; slot < SHADOW_SLOTS; slot++)
+	{
+		uint64_t s_seq;
+		block_id_t s_table_id;
+		size_type s_table_n, s_n_entries;
+		uint32_t s_table_crc;
+		if (shadowReadSlot(slot, s_seq, s_table_id, s_table_n, s_n_entries, s_table_crc) && ((! found) || (s_seq > seq)))
+		{
+			found = true;
+			m_shadow_slot = slot;
+			seq = s_seq;
+			table_id = s_table_id;
+			table_n = s_table_n;
+			n_entries = s_n_entries;
+			table_crc = s_table_crc;
+		}
+	}
+	if (! found)
+	{
+		if (m_cow)
+			std::cerr << "ERROR: '" << m_pathname << "' is not a copy-on-write storage" << std::endl;
+		return (! m_cow);
+	}
+
+	ssize_t file_size = m_io.size();
+	assert(file_size >= 0);
+	m_shadow_end = std::max(SHADOW_SLOTS, static_cast<block_id_t>(file_size / BlockSize));
+	if ((n_entries * sizeof(uint32_t)) > (table_n * BlockSize))
+		return false;
+
+	std::string table(table_n * BlockSize, '\0');
+	if (table_n > 0)
+	{
+		if ((table_id < SHADOW_SLOTS) || ((table_id + table_n) > m_shadow_end))
+			return false;
+		if (! m_io.read(&table[0], table.size(), static_cast<uint64_t>(table_id) * BlockSize))
+			return false;
+	}
+	if (crc32(table.data(), n_entries * sizeof(uint32_t)) != table_crc)
+	{
+		std::cerr << "ERROR: '" << m_pathname << "' has a corrupted page table" << std::endl;
+		return false;
+	}
+
+	/* anything neither mapped nor part of the table is free, blocks written after the commit included */
+	std::vector<bool> used(m_shadow_end, false);
+	for (size_type i = 0; i < table_n; i++)
+		used[table_id + i] = true;
+	m_shadow_map.resize(n_entries, BLOCK_ID_INVALID);
+	m_shadow_fresh.resize(n_entries, false);
+	for (size_type i = 0; i < n_entries; i++)
+	{
+		block_id_t physical_id = static_cast<block_id_t>(shadow_get32(table.data() + i * sizeof(uint32_t)));
+		if (block_id_valid(physical_id))
+		{
+			if ((physical_id < SHADOW_SLOTS) || (physical_id >= m_shadow_end) || used[physical_id])
+				return false;
+			used[physical_id] = true;
+		}
+		m_shadow_map[i] = physical_id;
+	}
+	for (block_id_t physical_id = SHADOW_SLOTS; physical_id < m_shadow_end; physical_id++)
+		if (! used[physical_id])
+			m_shadow_free.insert(physical_id);
+
+	m_shadow_table_id = table_id;
+	m_shadow_table_n = table_n;
+	m_shadow_seq = seq;
+	m_shadow_active = true;
+	m_shadow_committed = m_shadow_epoch;
+	shadowNextEpoch();
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowCommit()
+{
+	assert(m_shadow_active);
+	std::lock_guard<std::mutex> lock(m_shadow_mutex);
+
+	/* the trailing unmapped ids don't need entries */
+	size_type n_entries = m_shadow_map.size();
+	while ((n_entries > 0) && (! block_id_valid(m_shadow_map[n_entries - 1])))
+		n_entries--;
+	size_type table_n = (n_entries * sizeof(uint32_t) + BlockSize - 1) / BlockSize;
+
+	std::string table(table_n * BlockSize, '\0');
+	for (size_type i = 0; i < n_entries; i++)
+		shadow_put32(&table[i * sizeof(uint32_t)], static_cast<uint32_t>(m_shadow_map[i]));
+	uint32_t table_crc = crc32(table.data(), n_entries * sizeof(uint32_t));
+
+	/* the committed table is still referenced by the slot in use */
+	block_id_t table_id = BLOCK_ID_INVALID;
+	if (table_n > 0)
+	{
+		table_id = shadowAllocRun(table_n);
+		if (! m_io.write(table.data(), table.size(), static_cast<uint64_t>(table_id) * BlockSize))
+		{
+			for (size_type i = 0; i < table_n; i++)
+				m_shadow_free.insert(table_id + static_cast<block_id_t>(i));
+			return false;
+		}
+	}
+
+	/* everything the new slot refers to must be durable before the slot itself */
+	if (! m_io.sync())
+		return false;
+
+	block_t slotBlock(0);
+	char* p = slotBlock.data();
+	memset(p, 0, BlockSize);
+	memcpy(p, MILLIWAYS_SHADOW_MAGIC, MILLIWAYS_SHADOW_MAGIC_LEN);
+	p += MILLIWAYS_SHADOW_MAGIC_LEN;
+	uint64_t seq = m_shadow_seq + 1;
+	shadow_put32(p, SHADOW_VERSION);
+	shadow_put32(p + 4, static_cast<uint32_t>(BlockSize));
+	shadow_put32(p + 8, static_cast<uint32_t>(seq >> 32));
+	shadow_put32(p + 12, static_cast<uint32_t>(seq & 0xffffffffU));
+	shadow_put32(p + 16, static_cast<uint32_t>(table_id));
+	shadow_put32(p + 20, static_cast<uint32_t>(table_n));
+	shadow_put32(p + 24, static_cast<uint32_t>(n_entries));
+	shadow_put32(p + 28, table_crc);
+	p = slotBlock.data();
+	shadow_put32(p + BlockSize - sizeof(uint32_t), crc32(p, BlockSize - sizeof(uint32_t)));
+
+	block_id_t slot = (m_shadow_slot + 1) % SHADOW_SLOTS;
+	if (! m_io.write(p, BlockSize, static_cast<uint64_t>(slot) * BlockSize))
+		return false;
+	if (! m_io.sync())
+		return false;
+	// std::cerr << "FBS::shadowCommit() seq:" << seq << " slot:" << slot << " entries:" << n_entries << " retired:" << m_shadow_retired.size() << std::endl;
+
+	/* the previous image is gone: its table and the blocks it alone kept can be reused */
+	for (size_type i = 0; i < m_shadow_table_n; i++)
+		m_shadow_free.insert(m_shadow_table_id + static_cast<block_id_t>(i));
+	m_shadow_table_id = table_id;
+	m_shadow_table_n = table_n;
+	m_shadow_seq = seq;
+	m_shadow_slot = slot;
+	m_shadow_committed = m_shadow_epoch;
+	shadowNextEpoch();
+	shadowReclaim();
+	return true;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowTruncate()
+{
+	assert(m_shadow_active);
+	std::lock_guard<std::mutex> lock(m_shadow_mutex);
+
+	/* the ids past the end have been disposed, thus unmapped already */
+	if (m_shadow_map.size() > m_next_block_id)
+	{
+		m_shadow_map.resize(m_next_block_id);
+		m_shadow_fresh.resize(m_next_block_id);
+	}
+
+	/* only free blocks can go, committed ones are still needed until the next commit */
+	block_id_t end = m_shadow_end;
+	while ((! m_shadow_free.empty()) && (*m_shadow_free.rbegin() == (end - 1)))
+	{
+		m_shadow_free.erase(end - 1);
+		end--;
+	}
+	if (end == m_shadow_end)
+		return true;
+	m_shadow_end = end;
+	return m_io.truncate(static_cast<uint64_t>(m_shadow_end) * BlockSize);
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowRelease(block_id_t block_id, int count)
+{
+	std::lock_guard<std::mutex> lock(m_shadow_mutex);
+	for (int i = 0; i < count; i++)
+	{
+		block_id_t logical_id = block_id + i;
+		if ((logical_id >= m_shadow_map.size()) || (! block_id_valid(m_shadow_map[logical_id])))
+			continue;
+
+		/* a block remapped during this epoch isn't part of any image */
+		if (m_shadow_fresh[logical_id])
+			m_shadow_free.insert(m_shadow_map[logical_id]);
+		else
+			shadowRetire(m_shadow_map[logical_id]);
+		m_shadow_map[logical_id] = BLOCK_ID_INVALID;
+		m_shadow_fresh[logical_id] = false;
+	}
+}
+
+/* epochs (m_shadow_mutex held) */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowRetire(block_id_t physical_id)
+{
+	m_shadow_retired.push_back(std::make_pair(m_shadow_epoch, physical_id));
+}
+
+/* the images taken so far are frozen: later writes go to fresh blocks */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowNextEpoch()
+{
+	m_shadow_epoch++;
+	m_shadow_fresh.assign(m_shadow_fresh.size(), false);
+}
+
+/* a block retired during an epoch is still part of the images taken before it ended */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowReclaim()
+{
+	uint64_t oldest = m_shadow_committed;
+	if ((! m_shadow_holders.empty()) && (*m_shadow_holders.begin() < oldest))
+		oldest = *m_shadow_holders.begin();
+	while ((! m_shadow_retired.empty()) && (m_shadow_retired.front().first <= oldest))
+	{
+		m_shadow_free.insert(m_shadow_retired.front().second);
+		m_shadow_retired.pop_front();
+	}
+}
+
+/* first fit among the free physical blocks, or past the end of the file (m_shadow_mutex held) */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+block_id_t FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::shadowAllocRun(size_type n_blocks)
+{
+	assert(n_blocks > 0);
+
+	block_id_t run_id = BLOCK_ID_INVALID;
+	size_type run_n = 0;
+	std::set<block_id_t>::iterator it;
+	for (it = m_shadow_free.begin(); it != m_shadow_free.end(); ++it)
+	{
+		if ((run_n > 0) && (*it == run_id + run_n))
+			run_n++;
+		else
+		{
+			run_id = *it;
+			run_n = 1;
+		}
+		if (run_n == n_blocks)
+			break;
+	}
+
+	/* a free run reaching the end of the file can be extended */
+	if ((run_n < n_blocks) && ((run_n == 0) || ((run_id + run_n) != m_shadow_end)))
+	{
+		run_id = m_shadow_end;
+		run_n = 0;
+	}
+	for (size_type i = 0; i < run_n; i++)
+		m_shadow_free.erase(run_id + static_cast<block_id_t>(i));
+	if (run_n < n_blocks)
+		m_shadow_end = run_id + static_cast<block_id_t>(n_blocks);
+	return run_id;
+}
+
+/* -- Snapshots ----------------------------------------------- */
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+shptr<typename FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::Snapshot> FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::snapshot()
+{
+	if (! m_shadow_active)
+		return shptr<Snapshot>();
+
+	/* the image has to be complete on file */
+	cache_lock_type lock(m_cache_mutex);
+	if (! m_lru.flush())
+		return shptr<Snapshot>();
+
+	std::lock_guard<std::mutex> shadow_lock(m_shadow_mutex);
+	shptr<Snapshot> image( new Snapshot() );
+	image->epoch = m_shadow_epoch;
+	image->map = m_shadow_map;
+	m_shadow_holders.insert(image->epoch);
+	shadowNextEpoch();
+	// std::cerr << "FBS::snapshot() epoch:" << image->epoch << " blocks:" << image->map.size() << std::endl;
+	return image;
+}
+
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+void FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::releaseSnapshot(const shptr<Snapshot>& image)
+{
+	if (! image)
+		return;
+
+	/* images taken before a close() are already gone */
+	std::lock_guard<std::mutex> lock(m_shadow_mutex);
+	std::multiset<uint64_t>::iterator it = m_shadow_holders.find(image->epoch);
+	if (it == m_shadow_holders.end())
+		return;
+	m_shadow_holders.erase(it);
+	shadowReclaim();
+}
+
+/* the blocks of an image are never written, nor reused while it's held: no lock needed */
+template <size_t BLOCKSIZE, int CACHE_SIZE, class FileIO>
+bool FileBlockStorage<BLOCKSIZE, CACHE_SIZE, FileIO>::snapshotRead(const Snapshot& image, block_id_t first_id, int n_blocks, char* dst)
+{
+	assert(dst);
+	if (n_blocks <= 0)
+		return true;
+	if ((! isOpen()) || (static_cast<size_type>(first_id) + n_blocks > image.map.size()))
+		return false;
+
+	return shadowRead(&image.map[first_id], static_cast<size_type>(n_blocks), dst);
+}
+
+#if defined(HAVE_SYS_MMAN_H)
+
+/* ----------------------------------------------------------------- *
+ *   MmapBlockStorage                                                *
+ * ----------------------------------------------------------------- */
+
+template <size_t BLOCKSIZE, size_t CACHESIZE>
+const block_id_t LRUMappedBlockCache<BLOCKSIZE, CACHESIZE>::InvalidCacheKey;
+
+template <size_t BLOCKSIZE>
+const size_t MmapBlockStorage<BLOCKSIZE>::DEFAULT_EXTENT_SIZE;
+
+template <size_t BLOCKSIZE>
+const size_t MmapBlockStorage<BLOCKSIZE>::PAGE_CACHE_SIZE;
+
+template <size_t BLOCKSIZE>
+MmapBlockStorage<BLOCKSIZE>::~MmapBlockStorage()
+{
+	/* call close() from the most derived class */
+	if (isOpen())
+	{
+		std::cerr << std::endl << "WARNING: MmapBlockStorage still open at destruction time. Call close() *BEFORE* destruction!." << std::endl << std::endl;
+		close();
+	}
+	assert(! isOpen());
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::openHelper()
+{
+	if (isOpen())
+		return true;
+
+	assert(! isOpen());
+	m_fd = ::open(m_pathname.c_str(), O_RDWR);
+	if (m_fd >= 0)
+	{
+		m_created = false;
+	} else
+	{
+		std::cerr << "file '" << m_pathname << "' doesn't exist. Creating..." << std::endl;
+		m_fd = ::open(m_pathname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		m_created = true;
+	}
+
+	if (m_fd < 0)
+	{
+		std::cerr << "can't open '" << m_pathname << "', error: " << strerror(errno) << std::endl;
+		m_created = false;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	assert((st.st_size % BlockSize) == 0);
+	m_found_size = st.st_size;
+	/* an upper bound after a crash, the header has the count (see headerCount()) */
+	m_next_block_id = static_cast<block_id_t>(st.st_size / BlockSize);
+
+	if (! mapExtents(m_next_block_id))
+	{
+		unmapExtents();
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+
+	return isOpen();
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::closeHelper()
+{
+	assert(isOpen());
+
+	/* stale payloads go back into the mapping before it goes away */
+	cache_lock_type lock(m_cache_mutex);
+	m_pages.evict_all();
+	unmapExtents();
+
+	/* drop the unused tail of the last extent */
+	bool ok = (ftruncate(m_fd, static_cast<off_t>(m_next_block_id) * BlockSize) == 0);
+
+	::close(m_fd);
+	m_fd = -1;
+
+	m_created = false;
+	m_next_block_id = 0;
+
+	return ok;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::abandonHelper()
+{
+	assert(isOpen());
+
+	/* stale payloads are dropped, and the file gets back the size it was found with */
+	cache_lock_type lock(m_cache_mutex);
+	m_pages.drop_all();
+	unmapExtents();
+
+	bool ok = (ftruncate(m_fd, m_found_size) == 0);
+
+	::close(m_fd);
+	m_fd = -1;
+
+	m_created = false;
+	m_next_block_id = 0;
+
+	return ok;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::flush()
+{
+	if (! isOpen())
+		return false;
+
+	cache_lock_type lock(m_cache_mutex);
+	bool ok = this->writeHeader();
+	if (! m_pages.sync())
+		ok = false;
+	size_t extent_size = m_extent_blocks * BlockSize;
+	std::vector<char*>::iterator it;
+	for (it = m_extents.begin(); it != m_extents.end(); ++it)
+		if (msync(*it, extent_size, MS_SYNC) != 0)
+			ok = false;
+	return ok;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::truncate()
+{
+	if (! isOpen())
+		return false;
+
+	/* the mappings stay in place, the file is cut to m_next_block_id at close */
+	bool ok = true;
+	block_id_t next_id;
+	do
+	{
+		next_id = m_next_block_id;
+		m_next_block_id = this->trimFree(next_id);
+		ok = this->writeHeader();
+	} while (ok && (m_next_block_id != next_id));
+	return ok;
+}
+
+template <size_t BLOCKSIZE>
+void MmapBlockStorage<BLOCKSIZE>::headerCount(size_type n_blocks)
+{
+	/* the file size includes the padding of the last extent, unless closed cleanly */
+	if (n_blocks < static_cast<size_type>(m_next_block_id))
+		m_next_block_id = static_cast<block_id_t>(n_blocks);
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::mapExtents(size_type n_blocks)
+{
+	size_t extent_size = m_extent_blocks * BlockSize;
+
+	while (mappedBlocks() < n_blocks)
+	{
+		off_t offset = static_cast<off_t>(m_extents.size()) * static_cast<off_t>(extent_size);
+
+		/* grow the file to cover the whole extent */
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+			return false;
+		if (st.st_size < static_cast<off_t>(offset + extent_size))
+		{
+			if (ftruncate(m_fd, static_cast<off_t>(offset + extent_size)) != 0)
+			{
+				std::cerr << "can't grow '" << m_pathname << "', error: " << strerror(errno) << std::endl;
+				return false;
+			}
+		}
+
+		void* addr = mmap(NULL, extent_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+		if (addr == MAP_FAILED)
+		{
+			std::cerr << "can't map '" << m_pathname << "', error: " << strerror(errno) << std::endl;
+			return false;
+		}
+		m_extents.push_back(static_cast<char*>(addr));
+	}
+
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+void MmapBlockStorage<BLOCKSIZE>::unmapExtents()
+{
+	size_t extent_size = m_extent_blocks * BlockSize;
+	std::vector<char*>::iterator it;
+	for (it = m_extents.begin(); it != m_extents.end(); ++it)
+		munmap(*it, extent_size);
+	m_extents.clear();
+}
+
+template <size_t BLOCKSIZE>
+block_id_t MmapBlockStorage<BLOCKSIZE>::allocId(int n_blocks)
+{
+	block_id_t block_id = this->allocFree(n_blocks);
+	if (block_id_valid(block_id))
+		return block_id;
+
+	block_id = nextId();
+	if (! mapExtents(block_id + n_blocks))
+		return BLOCK_ID_INVALID;
+	m_next_block_id = block_id + n_blocks;
+	return block_id;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::dispose(block_id_t block_id, int count)
+{
+	if (block_id == BLOCK_ID_INVALID)
+		return false;
+
+	assert(block_id != BLOCK_ID_INVALID);
+
+	if ((block_id + count) > nextId())
+		return false;
+
+	/* disposed blocks don't need their payloads any more */
+	forget(block_id, static_cast<size_type>(count));
+
+	if (! this->releaseFree(block_id, count))
+		return false;
+
+	/* the file is truncated to m_next_block_id at close, so free blocks at the end can go */
+	m_next_block_id = this->trimFree(m_next_block_id);
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+void MmapBlockStorage<BLOCKSIZE>::forget(block_id_t block_id, size_type count)
+{
+	cache_lock_type lock(m_cache_mutex);
+	for (size_type i = 0; i < count; i++)
+	{
+		block_id_t cached_id = block_id + static_cast<block_id_t>(i);
+		shptr<block_t>* cached = m_pages.peek(cached_id);
+		if (cached)
+		{
+			if (*cached)
+				(*cached)->discard();
+			m_pages.del(cached_id);
+		}
+	}
+}
+
+template <size_t BLOCKSIZE>
+char* MmapBlockStorage<BLOCKSIZE>::address(block_id_t block_id)
+{
+	if ((block_id == BLOCK_ID_INVALID) || (block_id >= mappedBlocks()))
+		return NULL;
+	return m_extents[block_id / m_extent_blocks] + (block_id % m_extent_blocks) * BlockSize;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::read(block_t& dst)
+{
+	assert(dst.index() != BLOCK_ID_INVALID);
+
+	const char* src = hasId(dst.index()) ? address(dst.index()) : NULL;
+	if (! src)
+		return false;
+
+	/* a stale payload is newer than the mapping */
+	cache_lock_type lock(m_cache_mutex);
+	shptr<block_t>* cached = m_pages.peek(dst.index());
+	if (cached && (*cached))
+		(*cached)->sync();
+
+	if (dst.data() != src)
+		memcpy(dst.data(), src, BlockSize);
+	dst.dirty(false);
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::write(block_t& src)
+{
+	assert(src.index() != BLOCK_ID_INVALID);
+
+	block_id_t block_id = src.index();
+	if (! mapExtents(block_id + 1))
+	{
+		src.dirty(true);
+		return false;
+	}
+
+	char* dst = address(block_id);
+	assert(dst);
+	if (src.data() != dst)
+	{
+		/* the cached page (if any) gets replaced, along with its payload */
+		cache_lock_type lock(m_cache_mutex);
+		shptr<block_t>* cached = m_pages.peek(block_id);
+		if (cached && (*cached) && (cached->get() != &src))
+			(*cached)->discard();
+		memcpy(dst, src.data(), BlockSize);
+	}
+	src.dirty(false);
+
+	if (block_id >= m_next_block_id)
+		m_next_block_id = block_id + 1;
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::readRange(block_id_t first_id, int n_blocks, char* dst)
+{
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(dst);
+
+	if (n_blocks <= 0)
+		return true;
+	if (! hasId(first_id + n_blocks - 1))
+		return false;
+
+	/* stale payloads are newer than the mapping */
+	cache_lock_type lock(m_cache_mutex);
+	size_type n_total = static_cast<size_type>(n_blocks);
+	for (size_type i = 0; i < n_total; i++)
+	{
+		shptr<block_t>* cached = m_pages.peek(first_id + static_cast<block_id_t>(i));
+		if (cached && (*cached))
+			(*cached)->sync();
+	}
+
+	/* copy extent by extent, mappings aren't contiguous in memory */
+	size_type done = 0;
+	while (done < n_total)
+	{
+		block_id_t block_id = first_id + static_cast<block_id_t>(done);
+		size_type chunk = min(n_total - done, m_extent_blocks - (block_id % m_extent_blocks));
+		const char* src = address(block_id);
+		assert(src);
+		memcpy(dst + done * BlockSize, src, chunk * BlockSize);
+		done += chunk;
+	}
+	return true;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::writeRange(block_id_t first_id, int n_blocks, const char* src)
+{
+	assert(first_id != BLOCK_ID_INVALID);
+	assert(src);
+
+	if (n_blocks <= 0)
+		return true;
+
+	size_type n_total = static_cast<size_type>(n_blocks);
+	if (! mapExtents(first_id + n_total))
+		return false;
+
+	/* the span replaces the content of the cached pages */
+	cache_lock_type lock(m_cache_mutex);
+	for (size_type i = 0; i < n_total; i++)
+	{
+		shptr<block_t>* cached = m_pages.peek(first_id + static_cast<block_id_t>(i));
+		if (cached && (*cached))
+			(*cached)->discard();
+	}
+
+	size_type done = 0;
+	while (done < n_total)
+	{
+		block_id_t block_id = first_id + static_cast<block_id_t>(done);
+		size_type chunk = min(n_total - done, m_extent_blocks - (block_id % m_extent_blocks));
+		char* dst = address(block_id);
+		assert(dst);
+		memcpy(dst, src + done * BlockSize, chunk * BlockSize);
+		done += chunk;
+	}
+
+	if ((first_id + n_total) > m_next_block_id)
+		m_next_block_id = static_cast<block_id_t>(first_id + n_total);
+	return true;
+}
+
+/* mapped I/O */
+
+template <size_t BLOCKSIZE>
+shptr<typename MmapBlockStorage<BLOCKSIZE>::block_t> MmapBlockStorage<BLOCKSIZE>::get(block_id_t block_id)
+{
+	if (! hasId(block_id))
+		return shptr<block_t>();
+
+	/* pages point into the mapping, a miss doesn't do any I/O */
+	cache_lock_type lock(m_cache_mutex);
+	return m_pages[block_id];
+}
+
+template <size_t BLOCKSIZE>
+typename MmapBlockStorage<BLOCKSIZE>::size_type MmapBlockStorage<BLOCKSIZE>::prefetch(const std::vector<block_id_t>& block_ids)
+{
+	static const uintptr_t page_mask = ~static_cast<uintptr_t>(sysconf(_SC_PAGESIZE) - 1);
+
+	size_type n_advised = 0;
+	for (size_type i = 0; i < block_ids.size(); i++)
+	{
+		char* address_ = hasId(block_ids[i]) ? address(block_ids[i]) : NULL;
+		if (! address_)
+			continue;
+		char* start = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(address_) & page_mask);
+		if (madvise(start, (address_ - start) + BlockSize, MADV_WILLNEED) == 0)
+			n_advised++;
+	}
+	return n_advised;
+}
+
+template <size_t BLOCKSIZE>
+bool MmapBlockStorage<BLOCKSIZE>::put(const block_t& src)
+{
+	if (! hasId(src.index()))
+		return false;
+
+	char* dst = address(src.index());
+	assert(dst);
+	if (src.data() != dst)
+	{
+		cache_lock_type lock(m_cache_mutex);
+		shptr<block_t>* cached = m_pages.peek(src.index());
+		if (cached && (*cached) && (cached->get() != &src))
+			(*cached)->discard();
+		memcpy(dst, src.data(), BlockSize);
+	}
+	return true;
+}
+
+#endif /* defined(HAVE_SYS_MMAN_H) */
+
 } /* end of namespace milliways */
 
 #endif /* MILLIWAYS_BLOCKSTORAGE_IMPL_H */
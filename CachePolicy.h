@@ -0,0 +1,171 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_CACHEPOLICY_H
+#define MILLIWAYS_CACHEPOLICY_H
+
+#include <vector>
+#include <unordered_map>
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "ordered_map.h"
+
+namespace milliways {
+
+/*
+ * A CachePolicy decides which entry an LRUCache evicts next. Without a
+ * policy the cache is a plain LRU (its own ordered_map is the recency
+ * list); plain LRU is not scan resistant, since one pass over many keys
+ * flushes the whole cache, so hot entries can be protected with one of
+ * the policies below.
+ *
+ * The cache notifies the policy of every key entering (inserted()),
+ * being hit (accessed()) and being deleted (removed()); when it needs
+ * room it asks for a victim(), that the policy forgets before returning.
+ */
+template <typename Key>
+class CachePolicy
+{
+public:
+	typedef Key key_type;
+	typedef size_t size_type;
+
+	CachePolicy() : m_capacity(1) {}
+	virtual ~CachePolicy() {}
+
+	virtual const char* name() const = 0;
+
+	virtual void inserted(const key_type& key) = 0;
+	virtual void accessed(const key_type& key) = 0;
+	virtual void removed(const key_type& key) = 0;
+	virtual bool victim(key_type& key) = 0;
+	virtual void clear() = 0;
+
+	size_type capacity() const { return m_capacity; }
+	virtual void capacity(size_type value) { m_capacity = (value > 0) ? value : 1; }
+
+protected:
+	size_type m_capacity;
+
+private:
+	CachePolicy(const CachePolicy& other);
+	CachePolicy& operator= (const CachePolicy& rhs);
+};
+
+/* -- 2Q --------------------------------------------------------- */
+
+/*
+ * Full 2Q (Johnson & Shasha). New keys enter the A1in FIFO, where further
+ * hits don't count (they're correlated references, like the many reads of
+ * one leaf during a scan). Keys evicted from A1in are remembered in the
+ * A1out ghost FIFO; a key that misses while still in A1out has proven to
+ * be reused and goes to Am, a regular LRU. A scan only churns A1in.
+ */
+template <typename Key>
+class TwoQueuePolicy : public CachePolicy<Key>
+{
+public:
+	typedef CachePolicy<Key> base_type;
+	typedef typename base_type::key_type key_type;
+	typedef typename base_type::size_type size_type;
+
+	/* A1in and A1out sizes, as fractions of the capacity (in percent) */
+	static const int KIN_PERCENT = 25;
+	static const int KOUT_PERCENT = 50;
+
+	TwoQueuePolicy() : base_type(), m_kin(1), m_kout(1) {}
+
+	const char* name() const { return "2Q"; }
+
+	void inserted(const key_type& key);
+	void accessed(const key_type& key);
+	void removed(const key_type& key);
+	bool victim(key_type& key);
+	void clear() { m_a1in.clear(); m_a1out.clear(); m_am.clear(); }
+
+	void capacity(size_type value);
+
+	size_type a1in_size() const { return m_a1in.size(); }
+	size_type a1out_size() const { return m_a1out.size(); }
+	size_type am_size() const { return m_am.size(); }
+
+private:
+	typedef ordered_map<key_type, char> queue_type;
+
+	queue_type m_a1in;
+	queue_type m_a1out;
+	queue_type m_am;
+	size_type m_kin;
+	size_type m_kout;
+};
+
+/* -- CLOCK ------------------------------------------------------ */
+
+/*
+ * CLOCK (second chance): keys sit on a ring of slots with a reference
+ * bit, set on hits and cleared by the sweeping hand, that evicts the
+ * first key found unreferenced. Hits only flip a bit, so it's cheaper
+ * than LRU, and new keys enter unreferenced, so one-touch keys of a scan
+ * are the first to go.
+ */
+template <typename Key>
+class ClockPolicy : public CachePolicy<Key>
+{
+public:
+	typedef CachePolicy<Key> base_type;
+	typedef typename base_type::key_type key_type;
+	typedef typename base_type::size_type size_type;
+
+	ClockPolicy() : base_type(), m_hand(0) {}
+
+	const char* name() const { return "CLOCK"; }
+
+	void inserted(const key_type& key);
+	void accessed(const key_type& key);
+	void removed(const key_type& key);
+	bool victim(key_type& key);
+	void clear() { m_slots.clear(); m_free.clear(); m_index.clear(); m_hand = 0; }
+
+private:
+	struct slot_type
+	{
+		slot_type() : key(), referenced(false), used(false) {}
+		slot_type(const key_type& key_) : key(key_), referenced(false), used(true) {}
+
+		key_type key;
+		bool referenced;
+		bool used;
+	};
+
+	void release(size_type slot);
+
+	std::vector<slot_type> m_slots;
+	std::vector<size_type> m_free;
+	std::unordered_map<key_type, size_type> m_index;
+	size_type m_hand;
+};
+
+} /* end of namespace milliways */
+
+#include "CachePolicy.impl.hpp"
+
+#endif /* MILLIWAYS_CACHEPOLICY_H */
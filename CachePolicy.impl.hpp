@@ -0,0 +1,183 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_CACHEPOLICY_H
+#include "CachePolicy.h"
+#endif
+
+#ifndef MILLIWAYS_CACHEPOLICY_IMPL_H
+#define MILLIWAYS_CACHEPOLICY_IMPL_H
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   TwoQueuePolicy                                                  *
+ * ----------------------------------------------------------------- */
+
+template <typename Key>
+void TwoQueuePolicy<Key>::capacity(size_type value)
+{
+	base_type::capacity(value);
+	m_kin = (this->m_capacity * KIN_PERCENT) / 100;
+	if (m_kin < 1)
+		m_kin = 1;
+	m_kout = (this->m_capacity * KOUT_PERCENT) / 100;
+	if (m_kout < 1)
+		m_kout = 1;
+	while (m_a1out.size() > m_kout)
+		m_a1out.pop_front();
+}
+
+template <typename Key>
+void TwoQueuePolicy<Key>::inserted(const key_type& key)
+{
+	typename queue_type::iterator it = m_a1out.find(key);
+	if (it != m_a1out.end())
+	{
+		// seen recently enough: it's a reused key
+		m_a1out.pop(key);
+		m_am.set(key, 0);
+	} else
+		m_a1in.set(key, 0);
+}
+
+template <typename Key>
+void TwoQueuePolicy<Key>::accessed(const key_type& key)
+{
+	// hits in A1in are left alone (correlated references)
+	typename queue_type::iterator it = m_am.find(key);
+	if (it != m_am.end())
+		m_am.move_to_back(it);
+}
+
+template <typename Key>
+void TwoQueuePolicy<Key>::removed(const key_type& key)
+{
+	if (m_am.has(key))
+		m_am.pop(key);
+	else if (m_a1in.has(key))
+		m_a1in.pop(key);
+}
+
+template <typename Key>
+bool TwoQueuePolicy<Key>::victim(key_type& key)
+{
+	if ((! m_a1in.empty()) && ((m_a1in.size() > m_kin) || m_am.empty()))
+	{
+		key = m_a1in.pop_front().first;
+		m_a1out.set(key, 0);
+		if (m_a1out.size() > m_kout)
+			m_a1out.pop_front();
+		return true;
+	}
+	if (! m_am.empty())
+	{
+		key = m_am.pop_front().first;
+		return true;
+	}
+	return false;
+}
+
+/* ----------------------------------------------------------------- *
+ *   ClockPolicy                                                     *
+ * ----------------------------------------------------------------- */
+
+template <typename Key>
+void ClockPolicy<Key>::inserted(const key_type& key)
+{
+	assert(m_index.find(key) == m_index.end());
+
+	size_type slot;
+	if (! m_free.empty())
+	{
+		slot = m_free.back();
+		m_free.pop_back();
+		m_slots[slot] = slot_type(key);
+	} else
+	{
+		slot = m_slots.size();
+		m_slots.push_back(slot_type(key));
+	}
+	m_index[key] = slot;
+}
+
+template <typename Key>
+void ClockPolicy<Key>::accessed(const key_type& key)
+{
+	typename std::unordered_map<key_type, size_type>::const_iterator it = m_index.find(key);
+	if (it != m_index.end())
+		m_slots[it->second].referenced = true;
+}
+
+template <typename Key>
+void ClockPolicy<Key>::removed(const key_type& key)
+{
+	typename std::unordered_map<key_type, size_type>::iterator it = m_index.find(key);
+	if (it != m_index.end())
+	{
+		size_type slot = it->second;
+		m_index.erase(it);
+		release(slot);
+	}
+}
+
+template <typename Key>
+bool ClockPolicy<Key>::victim(key_type& key)
+{
+	if (m_index.empty())
+		return false;
+
+	// at most two turns: the first one may only clear reference bits
+	size_type n_slots = m_slots.size();
+	for (size_type step = 0; step < 2 * n_slots + 1; step++)
+	{
+		if (m_hand >= n_slots)
+			m_hand = 0;
+		slot_type& slot = m_slots[m_hand];
+		if (slot.used)
+		{
+			if (slot.referenced)
+				slot.referenced = false;
+			else
+			{
+				key = slot.key;
+				m_index.erase(key);
+				release(m_hand);
+				m_hand++;
+				return true;
+			}
+		}
+		m_hand++;
+	}
+	assert(false);
+	return false;
+}
+
+template <typename Key>
+void ClockPolicy<Key>::release(size_type slot)
+{
+	assert(slot < m_slots.size());
+	m_slots[slot] = slot_type();
+	m_free.push_back(slot);
+}
+
+} /* end of namespace milliways */
+
+#endif /* MILLIWAYS_CACHEPOLICY_IMPL_H */
@@ -0,0 +1,132 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_FIXEDKEY_H
+#define MILLIWAYS_FIXEDKEY_H
+
+#include <iostream>
+#include <string>
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "Seriously.h"
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   FixedKey                                                        *
+ * ----------------------------------------------------------------- */
+
+/*
+ * a string of at most N bytes kept inline, so that an array of keys is a
+ * single contiguous buffer without heap allocations. The first 8 bytes are
+ * kept as a big-endian integer (zero padded), the rest in a byte array:
+ * most comparisons are settled by a single integer compare, before looking
+ * at the remaining bytes. Orders like std::string.
+ */
+template <size_t N>
+class FixedKey
+{
+public:
+	static const size_t MaxSize = N;
+	static const size_t PrefixSize = sizeof(uint64_t);
+
+	static_assert(N <= 255, "FixedKey length is kept in a byte: N can't exceed 255");
+
+	typedef FixedKey<N> self_type;
+
+	FixedKey() : m_prefix(0), m_length(0) {}
+	FixedKey(const std::string& value) : m_prefix(0), m_length(0) { assign(value.data(), value.length()); }
+	FixedKey(const char* value) : m_prefix(0), m_length(0) { assign(value, strlen(value)); }
+	FixedKey(const char* value, size_t length_) : m_prefix(0), m_length(0) { assign(value, length_); }
+	FixedKey(const FixedKey& other) : m_prefix(other.m_prefix), m_length(other.m_length) { memcpy(m_tail, other.m_tail, tailLength()); }
+	FixedKey& operator= (const FixedKey& other) { m_prefix = other.m_prefix; m_length = other.m_length; memcpy(m_tail, other.m_tail, tailLength()); return *this; }
+	FixedKey& operator= (const std::string& value) { assign(value.data(), value.length()); return *this; }
+
+	void assign(const char* value, size_t length_);
+
+	size_t size() const { return m_length; }
+	size_t length() const { return m_length; }
+	bool empty() const { return m_length == 0; }
+
+	/* copies the length() bytes of the key to dst */
+	void copy(char* dst) const;
+
+	std::string str() const { std::string s(m_length, '\0'); if (m_length > 0) copy(&s[0]); return s; }
+	operator std::string() const { return str(); }
+
+	int compare(const FixedKey& other) const;
+
+	bool operator== (const FixedKey& rhs) const { return (m_prefix == rhs.m_prefix) && (m_length == rhs.m_length) && (memcmp(m_tail, rhs.m_tail, tailLength()) == 0); }
+	bool operator!= (const FixedKey& rhs) const { return ! (*this == rhs); }
+	bool operator< (const FixedKey& rhs) const { return compare(rhs) < 0; }
+	bool operator> (const FixedKey& rhs) const { return compare(rhs) > 0; }
+	bool operator<= (const FixedKey& rhs) const { return compare(rhs) <= 0; }
+	bool operator>= (const FixedKey& rhs) const { return compare(rhs) >= 0; }
+
+private:
+	static const size_t TailSize = (N > PrefixSize) ? (N - PrefixSize) : 1;
+
+	size_t tailLength() const { return (m_length > PrefixSize) ? (m_length - PrefixSize) : 0; }
+
+	uint64_t m_prefix;
+	uint8_t m_length;
+	char m_tail[TailSize];
+};
+
+template <size_t N>
+inline std::ostream& operator<< (std::ostream& out, const FixedKey<N>& value)
+{
+	return out << value.str();
+}
+
+} /* end of namespace milliways */
+
+namespace seriously {
+
+/* same wire format as std::string (length + bytes) */
+template <size_t N>
+struct Traits< milliways::FixedKey<N> >
+{
+	typedef milliways::FixedKey<N> type;
+	typedef type serialized_type;
+	enum { Size = sizeof(type) };
+	enum { SerializedSize = -1 };
+
+	static ssize_t serialize(char*& dst, size_t& avail, const type& v);
+	static ssize_t deserialize(const char*& src, size_t& avail, type& v);
+
+	static size_t size(const type& value)    { return value.size(); }
+	static size_t maxsize(const type& value) { UNUSED(value); return N; }
+	static size_t serializedsize(const type& value) { return (sizeof(uint32_t) + value.size()); }
+
+	static bool valid(const type& value)     { UNUSED(value); return true; }
+
+	static int compare(const type& a, const type& b) { return a.compare(b); }
+};
+
+} /* end of namespace seriously */
+
+#include "FixedKey.impl.hpp"
+
+#endif /* MILLIWAYS_FIXEDKEY_H */
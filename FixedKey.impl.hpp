@@ -0,0 +1,127 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_FIXEDKEY_H
+#include "FixedKey.h"
+#endif
+
+#ifndef MILLIWAYS_FIXEDKEY_IMPL_H
+#define MILLIWAYS_FIXEDKEY_IMPL_H
+
+namespace milliways {
+
+/* -- FixedKey ----------------------------------------------------- */
+
+template <size_t N>
+inline void FixedKey<N>::assign(const char* value, size_t length_)
+{
+	assert(length_ <= N);
+	if (length_ > N)
+		length_ = N;
+	m_length = static_cast<uint8_t>(length_);
+
+	m_prefix = 0;
+	for (size_t i = 0; i < PrefixSize; i++)
+	{
+		m_prefix <<= 8;
+		if (i < length_)
+			m_prefix |= static_cast<uint8_t>(value[i]);
+	}
+	if (length_ > PrefixSize)
+		memcpy(m_tail, value + PrefixSize, length_ - PrefixSize);
+}
+
+template <size_t N>
+inline void FixedKey<N>::copy(char* dst) const
+{
+	size_t n_prefix = (m_length < PrefixSize) ? m_length : PrefixSize;
+	for (size_t i = 0; i < n_prefix; i++)
+		dst[i] = static_cast<char>((m_prefix >> (8 * (PrefixSize - 1 - i))) & 0xff);
+	memcpy(dst + n_prefix, m_tail, tailLength());
+}
+
+template <size_t N>
+inline int FixedKey<N>::compare(const FixedKey& other) const
+{
+	/* different (zero padded) prefixes already give the std::string order */
+	int cmp = (m_prefix > other.m_prefix) - (m_prefix < other.m_prefix);
+	if (cmp != 0)
+		return cmp;
+
+	size_t n = (m_length < other.m_length) ? m_length : other.m_length;
+	if (n > PrefixSize)
+	{
+		cmp = memcmp(m_tail, other.m_tail, n - PrefixSize);
+		if (cmp != 0)
+			return cmp;
+	}
+	return (m_length > other.m_length) - (m_length < other.m_length);
+}
+
+} /* end of namespace milliways */
+
+namespace seriously {
+
+template <size_t N>
+inline ssize_t Traits< milliways::FixedKey<N> >::serialize(char*& dst, size_t& avail, const type& v)
+{
+	char* dstp = dst;
+	size_t initial_avail = avail;
+
+	uint32_t s_len = static_cast<uint32_t>(v.length());
+
+	if ((4 + s_len) > avail)
+		return -1;
+	assert((4 + s_len) <= avail);
+
+	Traits<uint32_t>::serialize(dstp, avail, s_len);
+
+	v.copy(dstp);
+	dstp += s_len;
+	avail -= s_len;
+
+	dst = dstp;
+	return (initial_avail - avail);
+}
+
+template <size_t N>
+inline ssize_t Traits< milliways::FixedKey<N> >::deserialize(const char*& src, size_t& avail, type& v)
+{
+	const char* srcp = src;
+	size_t initial_avail = avail;
+
+	uint32_t s_len = 0;
+	if (Traits<uint32_t>::deserialize(srcp, avail, s_len) < 0)
+		return -1;
+
+	if ((avail < s_len) || (s_len > N))
+		return -1;
+
+	v.assign(srcp, s_len);
+	srcp += s_len;
+	avail -= s_len;
+
+	src = srcp;
+	return (initial_avail - avail);
+}
+
+} /* end of namespace seriously */
+
+#endif /* MILLIWAYS_FIXEDKEY_IMPL_H */
@@ -24,23 +24,31 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <functional>
+#include <chrono>
 
 #include <stdint.h>
 #include <assert.h>
 
 #include "Seriously.h"
 #include "BlockStorage.h"
+#include "FixedKey.h"
 #include "BTreeCommon.h"
 #include "BTreeNode.h"
 #include "BTree.h"
 #include "BTreeFileStorage.h"
+#include "RWLock.h"
+#include "WriteAheadLog.h"
+#include "WriteBatch.h"
 
 namespace milliways {
 
 static const size_t KV_BLOCKSIZE = MILLIWAYS_DEFAULT_BLOCK_SIZE;			/* default: 4096 */
 static const int KV_BLOCK_CACHESIZE = MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE;	/* default: 8192 */
-static const int KV_NODE_CACHESIZE = MILLIWAYS_DEFAULT_NODE_CACHE_SIZE;		/* default: 1024 */
 static const int KV_B = MILLIWAYS_DEFAULT_B_FACTOR;							/* default: 73   */
 
 typedef uint16_t serialized_data_offset_type;
@@ -267,13 +275,15 @@ public:
 	static const int MINOR_VERSION = 1;
 
 	static const size_t BLOCKSIZE = KV_BLOCKSIZE;
-	static const int NODE_CACHESIZE = KV_NODE_CACHESIZE;
 	static const int BLOCK_CACHESIZE = KV_BLOCK_CACHESIZE;
 	static const int B = KV_B;
 	static const int KEY_HASH_SIZE = 20;
 
 	static const int KEY_MAX_SIZE = 20;
 
+	/* a memory budget never shrinks the block cache below this */
+	static const size_t MIN_CACHE_BLOCKS = 64;
+
 	/*
 	 * we use our B+Tree to map a hash of the original key to a value-locator
 	 * (DataLocator struct above). So from the BTree point of view, its key is
@@ -284,7 +294,8 @@ public:
 	 * Alternative:
 	 *   1st 2 bytes + 4-bytes length + 128-bit MurmurHash3 (16 bytes) + last 2 bytes == 24 bytes
 	 */
-	typedef seriously::Traits<std::string> key_traits;
+	typedef FixedKey<KEY_MAX_SIZE> key_type;
+	typedef seriously::Traits<key_type> key_traits;
 	typedef seriously::Traits<DataLocator> mapped_traits;
 	typedef BTree< B, key_traits, mapped_traits > kv_tree_type;
 	typedef BTreeFileStorage< BLOCKSIZE, B, key_traits, mapped_traits > kv_tree_storage_type;
@@ -328,7 +339,7 @@ public:
 		Search& locator(const SizedLocator& locator) { m_value_loc = locator; return *this; }
 
 		bool found() const { return m_lookup.found(); }
-		const std::string& key() const { return m_lookup.key(); }
+		std::string key() const { return m_lookup.key().str(); }
 		shptr<kv_tree_node_type> node() const { return m_lookup.node(); }
 		int pos() const { return m_lookup.pos(); }
 		node_id_t nodeId() const { return m_lookup.nodeId(); }
@@ -369,11 +380,12 @@ public:
 	};
 
 	KeyValueStore(block_storage_type* blockstorage);
-	~KeyValueStore();
+	virtual ~KeyValueStore();
 
 	bool isOpen() const;
 	bool open();
 	bool close();
+	bool flush();
 
 	bool has(const std::string& key);
 	bool find(const std::string& key, Search& result);
@@ -383,24 +395,163 @@ public:
 	std::string get(const std::string& key);
 	bool put(const std::string& key, const std::string& value, bool overwrite = true);
 	bool rename(const std::string& old_key, const std::string& new_key);
+	bool remove(const std::string& key);
+
+	/*
+	 * bulk_put() stores a batch of key-value pairs (the last one wins on
+	 * duplicate keys). On an empty store the values are written in key order
+	 * and the key tree is built bottom-up with BTree::bulk_load(), nodes
+	 * filled up to 'fill_factor'; otherwise the pairs are put one by one.
+	 */
+	bool bulk_put(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor = 1.0);
+
+	/*
+	 * apply() runs the operations of a batch as a unit: readers see the
+	 * store before or after it, and the log holds it as a single record.
+	 * The batch is logged first, the small values that need new space go
+	 * to free fragments or are packed with the large ones into one region,
+	 * written in one go, then the tree is updated in key order. A failure
+	 * undoes the tree changes and drops the log record, leaving the store
+	 * as it was. Removing a missing key is not an error.
+	 */
+	bool apply(const WriteBatch& batch);
+
+	/* -- Free space ----------------------------------------------- */
+
+	size_t freeFragments() const { return m_free_fragments.size(); }
+	size_t freeFragmentBytes() const;
+
+	/* -- Compaction ----------------------------------------------- */
+
+	/*
+	 * compact() moves the live value envelopes and tree nodes lying past
+	 * the size the storage would have if packed into free space below it,
+	 * then gives the freed tail of the file back to the filesystem.
+	 * With a positive time slice it returns after about that long and
+	 * the next call resumes the pass where it stopped. Iterators and
+	 * Search results obtained before a call are invalidated by it.
+	 */
+	struct CompactReport
+	{
+		CompactReport() :
+			done(false), values_moved(0), nodes_moved(0), bytes_moved(0), reclaimed_bytes(0), elapsed_ms(0.0) {}
+
+		bool done;					/* pass completed and file truncated */
+		size_t values_moved;
+		size_t nodes_moved;
+		uint64_t bytes_moved;		/* value envelopes and nodes copied */
+		uint64_t reclaimed_bytes;	/* file size reduction */
+		double elapsed_ms;
+	};
+
+	bool compact(CompactReport& report, int time_slice_ms = 0);	/* 0: run the whole pass */
+	CompactReport compact(int time_slice_ms = 0) { CompactReport report; compact(report, time_slice_ms); return report; }
+	bool compacting() const { return m_compact_active; }
+
+	/* -- Memory budget -------------------------------------------- */
+
+	/*
+	 * the block cache is the single buffer pool of the store: it holds
+	 * value blocks and tree nodes, serialized or decoded. memoryBudget()
+	 * caps it in bytes (0: no budget, the capacity is left alone). The
+	 * capacity in blocks follows from the current average cost of a
+	 * cached page, that depends on the mix of nodes and values, and it's
+	 * re-evaluated by rebalance() (also called by open() and flush()).
+	 */
+	size_t memoryBudget() const { return m_memory_budget; }
+	void memoryBudget(size_t bytes) { m_memory_budget = bytes; rebalance(); }
+	size_t memoryFootprint() { assert(m_blockstorage); return m_blockstorage->cacheFootprint(); }
+	void rebalance();
+
+	/* -- Write-ahead log ------------------------------------------ */
+
+	/*
+	 * with a log attached (before open(), the store takes ownership)
+	 * put(), remove(), rename() and bulk_put() append their records
+	 * before changing the store (dropping them again if the change fails)
+	 * and commit them once the store lock is released, so that concurrent
+	 * writers share the sync. The block storage is put in copy-on-write
+	 * mode: the pages changed since the last checkpoint, written back or
+	 * not, never replace the committed ones (no steal), so a crash finds
+	 * the store as of that checkpoint and the records that follow it.
+	 * flush() and close() are checkpoints: the store is committed, then
+	 * the log emptied. open() replays the records a crash left in the
+	 * log; if that fails, the log is closed and kept for the next open(),
+	 * and writes fail meanwhile.
+	 */
+	WriteAheadLog* wal() const { return m_wal; }
+	void wal(WriteAheadLog* log);
 
 	/* -- Iteration ------------------------------------------------ */
 
+	/*
+	 * iterators read the leaves ahead of them in batches: on entering a
+	 * leaf with no read-ahead left, its next readAhead() siblings (found
+	 * in the parent node, then in the parent's own siblings) are loaded
+	 * with a single prefetch() of the block storage, that reads
+	 * consecutive blocks with one transfer. 0 disables it.
+	 */
+	static const int DEFAULT_READ_AHEAD = 16;
+
+	int readAhead() const { return m_read_ahead; }
+	void readAhead(int n_leaves) { m_read_ahead = (n_leaves > 0) ? n_leaves : 0; }
+
 	iterator begin() { return iterator(this); }
 	iterator end() { return iterator(this, /* forward */ true, /* end */ true); }
 
 	iterator rbegin() { return iterator(this, /* forward */ false); }
 	iterator rend() { return iterator(this, /* forward */ false, /* end */ true); }
 
+	/* -- Range queries -------------------------------------------- */
+
+	/*
+	 * lower_bound() seeks the first key not less than 'key' straight down
+	 * the tree (BTreeNode::bsearch() on node views), the returned forward
+	 * iterator then follows the leaf chain: only the path to the first
+	 * leaf and the leaves in range are visited. scan() calls 'callback'
+	 * for the keys in [start, end) (an empty end: up to the last key),
+	 * prefix_scan() for the keys starting with 'prefix', until it returns
+	 * false. Both return the number of keys it has been called for.
+	 * The callback isn't called with the store lock held: each key is
+	 * copied under the lock into a buffer of the scan, reused from key
+	 * to key (see base_iterator::keyData()), so the bytes are valid
+	 * during the call only.
+	 */
+	typedef std::function<bool (const char* key, size_t length)> scan_callback_type;
+
+	iterator lower_bound(const std::string& key);
+	size_t scan(const std::string& start, const std::string& end, const scan_callback_type& callback) { return scan_helper(lower_bound(start), end, std::string(), callback); }
+	size_t prefix_scan(const std::string& prefix, const scan_callback_type& callback) { return scan_helper(lower_bound(prefix), std::string(), prefix, callback); }
+	std::vector<std::string> prefix_scan(const std::string& prefix);
+
+	/* -- Snapshots ------------------------------------------------ */
+
+	/*
+	 * snapshot() returns a read-only handle on the store as it is, that
+	 * later writes don't change: lookups and iterators of the handle read
+	 * the blocks of a frozen image of the storage, outside of the store
+	 * lock, so long scans neither block writers nor see their splits.
+	 * It needs a block storage in copy-on-write mode (a null handle
+	 * otherwise, see FileBlockStorage::snapshot()): the blocks replaced
+	 * meanwhile are reclaimed once the handles on older images are gone.
+	 * Handles must be dropped before the store is closed.
+	 */
+	class Snapshot;
+	shptr<Snapshot> snapshot();
+
+	/*
+	 * iterates over the keys by walking the leaf level through read-only
+	 * node views (see BTreeFileStorage::node_view()), so that no tree node
+	 * is materialized just for being visited
+	 */
 	class base_iterator
 	{
 	public:
 		typedef KeyValueStore kv_type;
 		typedef base_iterator self_type;
 		typedef XTYPENAME kv_type::kv_tree_type kv_tree_type;
-		typedef XTYPENAME kv_type::kv_tree_node_type kv_tree_node_type;
-		typedef XTYPENAME kv_type::kv_tree_lookup_type kv_tree_lookup_type;
-		typedef XTYPENAME kv_type::kv_tree_iterator_type kv_tree_iterator_type;
+		typedef XTYPENAME kv_type::kv_tree_storage_type kv_tree_storage_type;
+		typedef XTYPENAME kv_tree_storage_type::node_view_type node_view_type;
 		typedef std::string value_type;
 		typedef value_type& reference;
 		typedef const value_type& const_reference;
@@ -409,54 +560,80 @@ public:
 		typedef std::forward_iterator_tag iterator_category;
 		typedef int difference_type;
 
-		base_iterator() : m_kv(NULL), m_tree(NULL), m_forward(true), m_end(true) {}
-		base_iterator(kv_type* kv, bool forward_ = true, bool end_ = false) : m_kv(kv), m_tree(NULL), m_forward(forward_), m_end(end_) { m_tree = m_kv->kv_tree(); kv_tree_iterator_type it(m_tree, m_tree->root(), forward_, end_); m_tree_it = it; rewind(end_); }
-		base_iterator(const base_iterator& other) : m_kv(other.m_kv), m_tree(other.m_tree), m_tree_it(other.m_tree_it), m_forward(other.m_forward), m_end(other.m_end), m_current_key(other.m_current_key) { }
-		base_iterator& operator= (const base_iterator& other) { m_kv = other.m_kv; m_tree = other.m_tree; m_tree_it = other.m_tree_it; m_forward = other.m_forward; m_end = other.m_end; m_current_key = other.m_current_key; return *this; }
+		base_iterator() : m_kv(NULL), m_tree(NULL), m_storage(NULL), m_snapshot(NULL), m_pos(-1), m_forward(true), m_end(true), m_ahead(0), m_key_id(NODE_ID_INVALID), m_key_pos(-1) {}
+		base_iterator(kv_type* kv, bool forward_ = true, bool end_ = false) : m_kv(kv), m_tree(NULL), m_storage(NULL), m_snapshot(NULL), m_pos(-1), m_forward(forward_), m_end(end_), m_ahead(0), m_key_id(NODE_ID_INVALID), m_key_pos(-1) { m_tree = m_kv->kv_tree(); m_storage = m_kv->kv_tree_storage(); rewind(end_); }
+		base_iterator(Snapshot* snapshot_, bool forward_ = true, bool end_ = false);
+		base_iterator(const base_iterator& other) : m_kv(other.m_kv), m_tree(other.m_tree), m_storage(other.m_storage), m_snapshot(other.m_snapshot), m_view(other.m_view), m_pos(other.m_pos), m_forward(other.m_forward), m_end(other.m_end), m_ahead(other.m_ahead), m_current_key(other.m_current_key), m_key_id(other.m_key_id), m_key_pos(other.m_key_pos) { }
+		base_iterator& operator= (const base_iterator& other) { m_kv = other.m_kv; m_tree = other.m_tree; m_storage = other.m_storage; m_snapshot = other.m_snapshot; m_view = other.m_view; m_pos = other.m_pos; m_forward = other.m_forward; m_end = other.m_end; m_ahead = other.m_ahead; m_current_key = other.m_current_key; m_key_id = other.m_key_id; m_key_pos = other.m_key_pos; return *this; }
 
 		self_type& operator++() { next(); return *this; }
 		self_type& operator++(int junk) { next(); return *this; }
 		self_type& operator--() { prev(); return *this; }
 		self_type& operator--(int junk) { prev(); return *this; }
-		// reference operator*() { m_current_key = (*m_tree_it).key(); return m_current_key; }
-		const_reference operator*() const { m_current_key = (*m_tree_it).key(); return m_current_key; }
-		// pointer operator->() { m_current_key = (*m_tree_it).key(); return &m_current_key; }
-		const_pointer operator->() const { m_current_key = (*m_tree_it).key(); return &m_current_key; }
+		/* dereferencing copies the key, once per position (see keyData()) */
+		// reference operator*() { return key(); }
+		const_reference operator*() const { return key(); }
+		// pointer operator->() { return &key(); }
+		const_pointer operator->() const { return &key(); }
 		bool operator== (const self_type& rhs) {
-			return (m_kv == rhs.m_kv) && (m_tree == rhs.m_tree) &&
+			return (m_kv == rhs.m_kv) && (m_tree == rhs.m_tree) && (m_snapshot == rhs.m_snapshot) &&
 					((end() && rhs.end()) ||
-					 ((m_forward == rhs.m_forward) && (m_end == rhs.m_end) && (m_tree_it == rhs.m_tree_it))); }
+					 ((m_forward == rhs.m_forward) && (m_end == rhs.m_end) && (m_view.id() == rhs.m_view.id()) && (m_pos == rhs.m_pos))); }
 		bool operator!= (const self_type& rhs) { return (! (*this == rhs)); }
 
-		operator bool() const { return (! end()) && m_tree_it; }
+		operator bool() const { return (! end()) && m_view.valid(); }
 
-		self_type& rewind(bool end_) { m_tree_it.rewind(end_); return *this; }
-		bool next() { return m_tree_it.next(); }
-		bool prev() { return m_tree_it.prev(); }
+		self_type& rewind(bool end_);
+		self_type& seek(const std::string& key);		/* forward, from the first key not less than 'key' */
+		bool next() { return step(m_forward); }
+		bool prev() { return step(! m_forward); }
 
 		kv_type* kv() const { return m_kv; }
-		const_reference key() const { m_current_key = (*m_tree_it).key(); return m_current_key; }
+		const_reference key() const;
+
+		/*
+		 * the key at the current position, copied under the store lock
+		 * into the buffer key() returns (writers change leaves in place):
+		 * valid until the iterator moves, and copied once per position.
+		 */
+		bool keyData(const char*& bytes, size_t& length) const;
+
 		bool forward() const { return m_forward; }
 		bool backward() const { return (! m_forward); }
-		bool end() const { return m_end || (m_tree_it.end()); }
+		bool end() const { return m_end; }
 
 	protected:
+		bool step(bool rightward);
+		bool settle(bool rightward);
+		void readAhead(bool rightward);
+
+		/* snapshot iterators read the frozen image, without locking the store */
+		RWLock* lock() const { return m_snapshot ? NULL : &m_kv->m_lock; }
+		bool load(node_id_t node_id);
+
 		kv_type* m_kv;
 		kv_tree_type* m_tree;
-		mutable kv_tree_iterator_type m_tree_it;
+		kv_tree_storage_type* m_storage;
+		Snapshot* m_snapshot;
+		node_view_type m_view;
+		int m_pos;
 		bool m_forward;
 		bool m_end;
+		int m_ahead;					/* leaves read ahead, not reached yet */
 		mutable std::string m_current_key;
+		mutable node_id_t m_key_id;		/* position m_current_key was copied from */
+		mutable int m_key_pos;
 	};
 
 	class iterator : public base_iterator
 	{
 	public:
 		iterator(kv_type* kv, bool forward_ = true, bool end_ = false) : base_iterator(kv, forward_, end_) {}
+		iterator(Snapshot* snapshot_, bool forward_ = true, bool end_ = false) : base_iterator(snapshot_, forward_, end_) {}
 		iterator(const iterator& other) : base_iterator(other) {}
 
-		reference operator*() { m_current_key = (*m_tree_it).key(); return m_current_key; }
-		pointer operator->() { m_current_key = (*m_tree_it).key(); return &m_current_key; }
+		reference operator*() { key(); return m_current_key; }
+		pointer operator->() { key(); return &m_current_key; }
 	};
 
 	class const_iterator : public base_iterator
@@ -466,9 +643,53 @@ public:
 		const_iterator(const const_iterator& other) : base_iterator(other) {}
 	};
 
+	class Snapshot
+	{
+	public:
+		typedef XTYPENAME block_storage_type::Snapshot image_type;
+		typedef XTYPENAME kv_tree_storage_type::node_view_type node_view_type;
+
+		~Snapshot() { m_kv->m_blockstorage->releaseSnapshot(m_image); }
+
+		KeyValueStore* kv() const { return m_kv; }
+		node_id_t rootId() const { return m_root_id; }
+
+		bool has(const std::string& key);
+		bool get(const std::string& key, std::string& value);
+		std::string get(const std::string& key) { std::string value; get(key, value); return value; }
+
+		iterator begin() { return iterator(this); }
+		iterator end() { return iterator(this, /* forward */ true, /* end */ true); }
+
+		iterator rbegin() { return iterator(this, /* forward */ false); }
+		iterator rend() { return iterator(this, /* forward */ false, /* end */ true); }
+
+		iterator lower_bound(const std::string& key) { iterator it(this, /* forward */ true, /* end */ true); it.seek(key); return it; }
+		size_t scan(const std::string& start, const std::string& end, const scan_callback_type& callback) { return scan_helper(lower_bound(start), end, std::string(), callback); }
+		size_t prefix_scan(const std::string& prefix, const scan_callback_type& callback) { return scan_helper(lower_bound(prefix), std::string(), prefix, callback); }
+
+		/* uncached, the views hold their own copy of the block */
+		bool node_view(node_id_t node_id, node_view_type& view);
+
+	private:
+		friend class KeyValueStore;
+
+		Snapshot(KeyValueStore* kv, const shptr<image_type>& image, node_id_t root_id) :
+			m_kv(kv), m_image(image), m_root_id(root_id) {}
+		Snapshot(const Snapshot& other);
+		Snapshot& operator= (const Snapshot& other);
+
+		bool find(const std::string& key, DataLocator& head_pos);
+
+		KeyValueStore* m_kv;
+		shptr<image_type> m_image;
+		node_id_t m_root_id;
+	};
+
 	friend class base_iterator;
 	friend class iterator;
 	friend class const_iterator;
+	friend class Snapshot;
 
 protected:
 	bool find(const std::string& key, DataLocator& data_pos);
@@ -476,10 +697,53 @@ protected:
 
 	bool read(std::string& dst, SizedLocator& location);
 	bool write(const std::string& src, SizedLocator& location);
+	bool store_value(const std::string& value, DataLocator& head);
+
+	/* called with m_lock held */
+	bool put_helper(const std::string& key, const std::string& value, bool overwrite);
+	bool rename_helper(const std::string& old_key, const std::string& new_key);
+	bool remove_helper(const std::string& key);
+	bool bulk_put_helper(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor, uint64_t& lsn);
+	bool apply_helper(const WriteBatch& batch);
+
+	/* asked before each tree change of a batch, refusing fails (and rolls back) the batch */
+	virtual bool apply_continue(size_t n_applied) { UNUSED(n_applied); return true; }
+
+	static size_t scan_helper(iterator it, const std::string& end, const std::string& prefix, const scan_callback_type& callback);
 
 	bool alloc_value_envelope(SizedLocator& dst);
+	bool alloc_region(size_t size, SizedLocator& dst);
 	size_t size_in_blocks(size_t size);
 
+	/* -- Free space ----------------------------------------------- */
+
+	bool alloc_fragment(SizedLocator& dst, block_id_t limit = BLOCK_ID_INVALID);
+	void release_space(const SizedLocator& location);
+	void release_fragment(block_id_t block_id, size_t offset, size_t size);
+	void insert_fragment(const DataLocator& location, size_t size) { m_free_fragments[location] = size; m_free_fragments_by_size.insert(std::make_pair(size, location)); }
+	void erase_fragment(std::map<DataLocator, size_t>::iterator it) { m_free_fragments_by_size.erase(std::make_pair(it->second, it->first)); m_free_fragments.erase(it); }
+	std::string free_space_serialize() const;
+	bool free_space_deserialize(const std::string& data);
+
+	/* -- Compaction ----------------------------------------------- */
+
+	bool alloc_envelope_below(SizedLocator& dst, block_id_t limit);
+	bool compact_step(CompactReport& report);
+	bool compact_node(shptr<kv_tree_node_type>& node, const shptr<kv_tree_node_type>& parent, int pos, CompactReport& report);
+	bool compact_value(shptr<kv_tree_node_type>& leaf, int pos, CompactReport& report);
+	bool compact_finish(CompactReport& report);
+	void release_next_location() { if (m_next_location.valid()) release_space(m_next_location); m_next_location.invalidate(); m_next_location.size(0); }
+
+	/* -- Write-ahead log ------------------------------------------ */
+
+	bool log_append(WriteAheadLog::RecordType type, const std::string& first, const std::string& second, uint64_t& lsn) {
+		return (! m_wal) || m_wal->append(type, first, second, lsn); }
+	bool log_commit(uint64_t lsn) { return (! m_wal) || m_wal->commit(lsn); }
+	uint64_t log_mark() const { return m_wal ? m_wal->appendedLsn() : 0; }
+	bool log_rollback(uint64_t mark) { return (! m_wal) || m_wal->rollback(mark); }
+	bool log_replay();
+	bool log_checkpoint();
+
 	/* -- Header I/O ----------------------------------------------- */
 
 	bool header_write();
@@ -491,10 +755,13 @@ protected:
 	bool block_dispose(block_id_t block_id, int count = 1) { assert(m_blockstorage); return m_blockstorage->dispose(block_id, count); }
 	shptr<block_type> block_get(block_id_t block_id) { assert(m_blockstorage); return m_blockstorage->get(block_id); }
 	bool block_put(const block_type& src) { assert(m_blockstorage); return m_blockstorage->put(src); }
+	bool block_read_range(block_id_t first_id, int n_blocks, char* dst) { assert(m_blockstorage); return m_blockstorage->readRange(first_id, n_blocks, dst); }
+	bool block_write_range(block_id_t first_id, int n_blocks, const char* src) { assert(m_blockstorage); return m_blockstorage->writeRange(first_id, n_blocks, src); }
 
 	/* -- Tree access ---------------------------------------------- */
 
 	kv_tree_type* kv_tree() { return m_kv_tree; }
+	kv_tree_storage_type* kv_tree_storage() { return m_storage; }
 
 private:
 	KeyValueStore();
@@ -524,7 +791,37 @@ private:
 	block_id_t m_first_block_id;
 	SizedLocator m_next_location;
 
+	/*
+	 * Space of released envelopes: whole blocks go back to the block
+	 * storage, the partial block pieces are kept here as fragments
+	 * (coalesced with their neighbours in the same block) and reused
+	 * for small values. They are persisted as the user data of the kv
+	 * header.
+	 */
+	std::map<DataLocator, size_t> m_free_fragments;
+	std::set< std::pair<size_t, DataLocator> > m_free_fragments_by_size;
+
+	/*
+	 * Compaction pass in progress: everything at or past the boundary
+	 * block moves below it, sweeping the keys in order from the first
+	 * one >= m_compact_key.
+	 */
+	bool m_compact_active;
+	block_id_t m_compact_boundary;
+	key_type m_compact_key;
+
 	int m_kv_header_uid;
+
+	size_t m_memory_budget;
+	int m_read_ahead;
+
+	WriteAheadLog* m_wal;
+
+	/*
+	 * lookups (has(), find(), get(), iteration) share the lock and run
+	 * concurrently, the other public methods take it exclusively
+	 */
+	mutable RWLock m_lock;
 };
 
 inline std::ostream& operator<< ( std::ostream& out, const KeyValueStore::iterator& value )
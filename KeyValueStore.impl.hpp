@@ -153,7 +153,11 @@ namespace milliways {
 inline KeyValueStore::KeyValueStore(block_storage_type* blockstorage) :
 	m_blockstorage(blockstorage), m_storage(NULL), m_kv_tree(NULL),
 	m_first_block_id(BLOCK_ID_INVALID),
-	m_kv_header_uid(-1)
+	m_compact_active(false), m_compact_boundary(BLOCK_ID_INVALID),
+	m_kv_header_uid(-1),
+	m_memory_budget(0),
+	m_read_ahead(DEFAULT_READ_AHEAD),
+	m_wal(NULL)
 {
 	int max_B = BTreeFileStorage_Compute_Max_B< BLOCKSIZE, KEY_MAX_SIZE + 4, mapped_traits >();
 
@@ -185,6 +189,12 @@ inline KeyValueStore::~KeyValueStore()
 		m_storage = NULL;
 	}
 
+	if (m_wal)
+	{
+		delete m_wal;
+		m_wal = NULL;
+	}
+
 	assert(! m_storage);
 	assert(! m_kv_tree);
 }
@@ -197,34 +207,101 @@ inline bool KeyValueStore::isOpen() const
 
 inline bool KeyValueStore::open()
 {
+	WriteGuard guard(m_lock);
 	assert(m_kv_tree);
 	if (isOpen())
 		return true;
 	bool ok = m_kv_tree->open();
+	if (! ok)
+		return false;
+	m_free_fragments.clear();
+	m_free_fragments_by_size.clear();
+	m_compact_active = false;
 	if (m_kv_tree->storage()->created())
 		header_write();
-	else
-		header_read();
+	else if (! header_read())
+	{
+		/* a damaged header or free space map: the store isn't opened, nor rewritten */
+		m_free_fragments.clear();
+		m_free_fragments_by_size.clear();
+		m_kv_tree->storage()->abandonHelper();
+		return false;
+	}
+	rebalance();
+	if (ok && m_wal && (! log_replay()))
+	{
+		/* kept for the next open(): without a log the store takes no writes */
+		m_wal->close();
+		ok = false;
+	}
 	return ok;
 }
 
 inline bool KeyValueStore::close()
 {
+	WriteGuard guard(m_lock);
 	assert(m_kv_tree);
 	if (! isOpen())
 		return true;
-	header_write();
-	return m_kv_tree->close();
+	m_compact_active = false;
+	bool ok = true;
+	if (m_wal)
+	{
+		ok = log_checkpoint();
+		if (! m_wal->close())
+			ok = false;
+	} else
+		header_write();
+	if (! m_kv_tree->close())
+		ok = false;
+	return ok;
+}
+
+inline bool KeyValueStore::flush()
+{
+	WriteGuard guard(m_lock);
+	assert(m_kv_tree);
+	if (! isOpen())
+		return false;
+	bool ok = log_checkpoint();
+	rebalance();
+	return ok;
+}
+
+inline void KeyValueStore::rebalance()
+{
+	WriteGuard guard(m_lock);
+	assert(m_blockstorage);
+	if (m_memory_budget == 0)
+		return;
+
+	/* average cost of a cached page: a block, or a decoded node */
+	size_t page_cost = BLOCKSIZE;
+	size_t n_cached = m_blockstorage->cacheSize();
+	if (n_cached > 0)
+	{
+		size_t footprint = m_blockstorage->cacheFootprint();
+		if (footprint > 0)
+			page_cost = (footprint + n_cached - 1) / n_cached;
+	}
+
+	size_t capacity = m_memory_budget / page_cost;
+	if (capacity < MIN_CACHE_BLOCKS)
+		capacity = MIN_CACHE_BLOCKS;
+	// std::cerr << "KV::rebalance() budget:" << m_memory_budget << " page cost:" << page_cost << " capacity:" << capacity << std::endl;
+	m_blockstorage->cacheCapacity(capacity);
 }
 
 inline bool KeyValueStore::has(const std::string& key)
 {
+	ReadGuard guard(m_lock);
 	DataLocator head_pos;
 	return find(key, head_pos);
 }
 
 inline bool KeyValueStore::find(const std::string& key, Search& result)
 {
+	ReadGuard guard(m_lock);
 	if (key.length() > KEY_MAX_SIZE)
 	{
 		result.invalidate();
@@ -235,21 +312,21 @@ inline bool KeyValueStore::find(const std::string& key, Search& result)
 	assert(m_kv_tree);
 	assert(m_kv_tree->isOpen());
 
-	// do we have this key?
+	// do we have this key? (read-only: the tree nodes on the way are not materialized)
 	kv_tree_lookup_type& where = result.lookup();
-	if (m_kv_tree->search(where, key))
+	DataLocator head_pos;
+	where.nodeReset().pos(-1).key(key);
+	if (m_kv_tree->find(key, head_pos))
 	{
-		assert(where.found());
+		where.found(true);
 
-		shptr<kv_tree_node_type> node( where.node() );
-		assert(node);
-
-		result.dataLocator(node->value(where.pos()));
+		result.dataLocator(head_pos);
 		result.envelope_size(0);
 		assert(result.locator().valid());
 		assert(result.valid());
 	} else
 	{
+		where.found(false);
 		result.invalidate();
 		return false;
 	}
@@ -308,6 +385,7 @@ inline bool KeyValueStore::find(const std::string& key, Search& result)
 
 inline bool KeyValueStore::get(const std::string& key, std::string& value)
 {
+	ReadGuard guard(m_lock);
 	if (key.length() > KEY_MAX_SIZE)
 		return false;
 	assert(key.length() <= KEY_MAX_SIZE);
@@ -336,6 +414,7 @@ inline bool KeyValueStore::get(const std::string& key, std::string& value)
 
 inline bool KeyValueStore::get(Search& result, std::string& value, ssize_t partial)
 {
+	ReadGuard guard(m_lock);
 	if (! result.found())
 		return false;
 
@@ -366,6 +445,25 @@ inline std::string KeyValueStore::get(const std::string& key)
 }
 
 inline bool KeyValueStore::rename(const std::string& old_key, const std::string& new_key)
+{
+	uint64_t lsn = 0;
+	{
+		WriteGuard guard(m_lock);
+		if ((old_key.length() > KEY_MAX_SIZE) || (new_key.length() > KEY_MAX_SIZE))
+			return false;
+		uint64_t mark = log_mark();
+		if (! log_append(WriteAheadLog::RECORD_RENAME, old_key, new_key, lsn))
+			return false;
+		if (! rename_helper(old_key, new_key))
+		{
+			log_rollback(mark);
+			return false;
+		}
+	}
+	return log_commit(lsn);
+}
+
+inline bool KeyValueStore::rename_helper(const std::string& old_key, const std::string& new_key)
 {
 	if ((old_key.length() > KEY_MAX_SIZE) || (new_key.length() > KEY_MAX_SIZE))
 		return false;
@@ -388,7 +486,76 @@ inline bool KeyValueStore::rename(const std::string& old_key, const std::string&
 	return true;
 }
 
+inline bool KeyValueStore::remove(const std::string& key)
+{
+	uint64_t lsn = 0;
+	{
+		WriteGuard guard(m_lock);
+		if (key.length() > KEY_MAX_SIZE)
+			return false;
+		uint64_t mark = log_mark();
+		if (! log_append(WriteAheadLog::RECORD_REMOVE, key, std::string(), lsn))
+			return false;
+		if (! remove_helper(key))
+		{
+			log_rollback(mark);
+			return false;
+		}
+	}
+	return log_commit(lsn);
+}
+
+inline bool KeyValueStore::remove_helper(const std::string& key)
+{
+	if (key.length() > KEY_MAX_SIZE)
+		return false;
+	assert(key.length() <= KEY_MAX_SIZE);
+
+	Search result;
+	if (! find(key, result))
+		return false;
+
+	assert(result.valid());
+	assert(result.found());
+
+	/* the whole envelope (value length + contents) is returned for reuse */
+	SizedLocator released(result.locator());
+
+	assert(m_kv_tree);
+	kv_tree_lookup_type where;
+	if (! m_kv_tree->remove(where, key))
+		return false;
+
+	release_space(released);
+	return true;
+}
+
 inline bool KeyValueStore::put(const std::string& key, const std::string& value, bool overwrite)
+{
+	uint64_t lsn = 0;
+	{
+		WriteGuard guard(m_lock);
+		if (key.length() > KEY_MAX_SIZE)
+			return false;
+
+		/* replayed records overwrite: a put that wouldn't isn't logged */
+		Search result;
+		if ((! overwrite) && find(key, result))
+			return false;
+
+		uint64_t mark = log_mark();
+		if (! log_append(WriteAheadLog::RECORD_PUT, key, value, lsn))
+			return false;
+		if (! put_helper(key, value, overwrite))
+		{
+			log_rollback(mark);
+			return false;
+		}
+	}
+	return log_commit(lsn);
+}
+
+inline bool KeyValueStore::put_helper(const std::string& key, const std::string& value, bool overwrite)
 {
 	if (key.length() > KEY_MAX_SIZE)
 		return false;
@@ -399,6 +566,7 @@ inline bool KeyValueStore::put(const std::string& key, const std::string& value,
 
 	shptr<block_type> head_block;
 	bool do_allocate = true;
+	SizedLocator released;		/* space of the old value no longer needed */
 
 	if (present)
 	{
@@ -410,6 +578,14 @@ inline bool KeyValueStore::put(const std::string& key, const std::string& value,
 			return false;
 
 		do_allocate = (value.length() > result.contents_size()) ? true : false;
+		if (do_allocate)
+		{
+			released = result.locator();
+		} else if (value.length() < result.contents_size())
+		{
+			released = result.contentsLocator();
+			released.consume(value.length());
+		}
 	} else
 	{
 		/* not present */
@@ -442,6 +618,7 @@ inline bool KeyValueStore::put(const std::string& key, const std::string& value,
 	size_t avail = static_cast<size_t>(BLOCKSIZE - result.offset());
 	serialized_value_size_type v_value_length = static_cast<serialized_value_size_type>(value.length());
 	seriously::Traits<serialized_value_size_type>::serialize(dstp, avail, v_value_length);
+	block_put(*head_block);
 
 	// write value string
 	SizedLocator contents_loc(result.contentsLocator());
@@ -452,19 +629,465 @@ inline bool KeyValueStore::put(const std::string& key, const std::string& value,
 	if (do_allocate)
 	{
 		assert(m_kv_tree);
-		if (present)
+		assert((! present) || overwrite);
+		if (ok)
+			ok = present ? m_kv_tree->update(key, result.headDataLocator()) : m_kv_tree->insert(key, result.headDataLocator());
+		if (! ok)
+		{
+			/* the tree doesn't point to the new envelope: give it back, the old one stays */
+			release_space(result.locator());
+			return false;
+		}
+	}
+
+	if (ok)
+		release_space(released);
+
+	return ok;
+}
+
+inline bool KeyValueStore::bulk_put(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor)
+{
+	uint64_t lsn = 0;
+	{
+		WriteGuard guard(m_lock);
+		if (! bulk_put_helper(items, fill_factor, lsn))
+			return false;
+	}
+	return log_commit(lsn);
+}
+
+inline bool KeyValueStore::bulk_put_helper(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor, uint64_t& lsn)
+{
+	typedef std::vector< std::pair<std::string, std::string> > items_type;
+
+	struct L {
+		const items_type& m_items;
+		L(const items_type& items_) : m_items(items_) {}
+		bool operator() (size_t a, size_t b) const { return m_items[a].first < m_items[b].first; }
+	};
+
+	/* key order, keeping only the last of equal keys */
+	std::vector<size_t> order;
+	order.reserve(items.size());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (items[i].first.length() > KEY_MAX_SIZE)
+			return false;
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), L(items));
+
+	std::vector<size_t> unique;
+	unique.reserve(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		if (((i + 1) < order.size()) && (items[order[i]].first == items[order[i + 1]].first))
+			continue;
+		unique.push_back(order[i]);
+	}
+
+	/* the records go first, those of the pairs not stored are dropped */
+	assert(m_kv_tree);
+	uint64_t mark = log_mark();
+	if (! m_kv_tree->empty())
+	{
+		std::vector<size_t>::const_iterator it;
+		for (it = unique.begin(); it != unique.end(); ++it)
 		{
-			assert(overwrite);
-			if (! m_kv_tree->update(key, result.headDataLocator()))
+			mark = log_mark();
+			if (! log_append(WriteAheadLog::RECORD_PUT, items[*it].first, items[*it].second, lsn))
 				return false;
-		} else
+			if (! put_helper(items[*it].first, items[*it].second, /* overwrite */ true))
+			{
+				log_rollback(mark);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::vector<size_t>::const_iterator it;
+	for (it = unique.begin(); it != unique.end(); ++it)
+	{
+		if (! log_append(WriteAheadLog::RECORD_PUT, items[*it].first, items[*it].second, lsn))
+		{
+			log_rollback(mark);
+			return false;
+		}
+	}
+
+	/* on failure the envelopes already stored go back to the free space */
+	std::vector< std::pair<std::string, DataLocator> > entries;
+	std::vector<SizedLocator> envelopes;
+	entries.reserve(unique.size());
+	envelopes.reserve(unique.size());
+	bool ok = true;
+	for (it = unique.begin(); ok && (it != unique.end()); ++it)
+	{
+		DataLocator head;
+		ok = store_value(items[*it].second, head);
+		if (ok)
+		{
+			entries.push_back(std::make_pair(items[*it].first, head));
+			envelopes.push_back(SizedLocator(head, sizeof(serialized_value_size_type) + items[*it].second.length()));
+		}
+	}
+
+	if (ok)
+		ok = m_kv_tree->bulk_load(entries.begin(), entries.end(), fill_factor);
+	if (! ok)
+	{
+		for (size_t i = 0; i < envelopes.size(); i++)
+			release_space(envelopes[i]);
+		log_rollback(mark);
+		return false;
+	}
+	return true;
+}
+
+inline bool KeyValueStore::apply(const WriteBatch& batch)
+{
+	uint64_t lsn = 0;
+	{
+		WriteGuard guard(m_lock);
+		for (size_t i = 0; i < batch.size(); i++)
 		{
-			if (! m_kv_tree->insert(key, result.headDataLocator()))
+			if (batch.ops()[i].key.length() > KEY_MAX_SIZE)
 				return false;
 		}
+
+		/* logged first, dropped again if rolled back */
+		uint64_t mark = log_mark();
+		if (! log_append(WriteAheadLog::RECORD_BATCH, batch.serialize(), std::string(), lsn))
+			return false;
+		if (! apply_helper(batch))
+		{
+			log_rollback(mark);
+			return false;
+		}
 	}
+	return log_commit(lsn);
+}
 
-	return ok;
+/*
+ * all or nothing: the space replaced is released only once the whole
+ * batch went through, on failure the tree changes are undone in reverse
+ * order and the new space released
+ */
+inline bool KeyValueStore::apply_helper(const WriteBatch& batch)
+{
+	typedef WriteBatch::ops_type ops_type;
+
+	struct L {
+		const ops_type& m_ops;
+		L(const ops_type& ops_) : m_ops(ops_) {}
+		bool operator() (size_t a, size_t b) const { return m_ops[a].key < m_ops[b].key; }
+	};
+
+	/* a value written into the region (or a free fragment), in place of the old envelope if any */
+	struct Slot {
+		Slot(size_t op_, size_t offset_, bool present_, const SizedLocator& old_) :
+			op(op_), offset(offset_), present(present_), old(old_) {}
+
+		size_t op;
+		size_t offset;
+		bool present;
+		SizedLocator old;
+		SizedLocator fragment;		/* valid: stored there, not in the region */
+	};
+
+	/* how to take back a tree change */
+	struct Undo {
+		enum Kind { INSERTED, UPDATED, REMOVED, REWRITTEN };
+
+		Undo(Kind kind_, size_t op_, const DataLocator& head_) : kind(kind_), op(op_), head(head_) {}
+
+		Kind kind;
+		size_t op;
+		DataLocator head;			/* UPDATED, REMOVED: the old one */
+		std::string value;			/* REWRITTEN: the old value */
+	};
+
+	const ops_type& ops = batch.ops();
+
+	/* key order, keeping only the last operation on each key */
+	std::vector<size_t> order;
+	order.reserve(ops.size());
+	for (size_t i = 0; i < ops.size(); i++)
+	{
+		if (ops[i].key.length() > KEY_MAX_SIZE)
+			return false;
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), L(ops));
+
+	std::vector<size_t> unique;
+	unique.reserve(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		if (((i + 1) < order.size()) && (ops[order[i]].key == ops[order[i + 1]].key))
+			continue;
+		unique.push_back(order[i]);
+	}
+
+	assert(m_kv_tree);
+	assert(m_kv_tree->isOpen());
+
+	/*
+	 * lay out the envelopes that don't fit their old one: the large ones
+	 * back to back, then the small ones, larger first, best-fit in the
+	 * free fragments, else first-fit in the blocks after the large ones,
+	 * since they never straddle a block boundary
+	 */
+	std::vector<Slot> slots;
+	std::vector<char> in_place(ops.size(), 0);
+	std::vector<size_t> small;
+	size_t region_size = 0;
+	std::vector<size_t>::const_iterator it;
+	for (it = unique.begin(); it != unique.end(); ++it)
+	{
+		const WriteBatch::Op& op = ops[*it];
+		if (op.type != WriteBatch::OP_PUT)
+			continue;
+
+		Search result;
+		bool present = find(op.key, result);
+		if (present && (op.value.length() <= result.contents_size()))
+		{
+			in_place[*it] = 1;
+			continue;
+		}
+
+		size_t amount = sizeof(serialized_value_size_type) + op.value.length();
+		slots.push_back(Slot(*it, 0, present, present ? result.locator() : SizedLocator()));
+		if (amount <= BLOCKSIZE)
+		{
+			small.push_back(slots.size() - 1);
+			continue;
+		}
+		slots.back().offset = region_size;
+		region_size += amount;
+	}
+
+	struct LargerFirst {
+		const std::vector<Slot>& m_slots;
+		const ops_type& m_ops;
+		LargerFirst(const std::vector<Slot>& slots_, const ops_type& ops_) : m_slots(slots_), m_ops(ops_) {}
+		bool operator() (size_t a, size_t b) const { return m_ops[m_slots[a].op].value.length() > m_ops[m_slots[b].op].value.length(); }
+	};
+	std::stable_sort(small.begin(), small.end(), LargerFirst(slots, ops));
+
+	size_t first_block = region_size / BLOCKSIZE;
+	std::vector<size_t> block_used;				/* from first_block on */
+	if ((region_size % BLOCKSIZE) != 0)
+		block_used.push_back(region_size % BLOCKSIZE);
+	for (std::vector<size_t>::const_iterator sm_it = small.begin(); sm_it != small.end(); ++sm_it)
+	{
+		Slot& slot = slots[*sm_it];
+		size_t amount = sizeof(serialized_value_size_type) + ops[slot.op].value.length();
+		SizedLocator fragment;
+		fragment.envelope_size(amount);
+		if (alloc_fragment(fragment))
+		{
+			slot.fragment = fragment;
+			continue;
+		}
+
+		size_t b = 0;
+		while ((b < block_used.size()) && ((block_used[b] + amount) > BLOCKSIZE))
+			b++;
+		if (b == block_used.size())
+			block_used.push_back(0);
+		slot.offset = (first_block + b) * BLOCKSIZE + block_used[b];
+		block_used[b] += amount;
+		if ((slot.offset + amount) > region_size)
+			region_size = slot.offset + amount;
+	}
+
+	/* nothing in the tree changed yet, the new space is all there is to give back */
+	SizedLocator region;
+	bool ok = true;
+	if (region_size > 0)
+		ok = alloc_region(region_size, region);
+
+	std::vector<Slot>::const_iterator s_it;
+	if (ok && (region_size > 0))
+	{
+		std::string image(region_size, '\0');
+		for (s_it = slots.begin(); s_it != slots.end(); ++s_it)
+		{
+			if (s_it->fragment.valid())
+				continue;
+			const std::string& value = ops[s_it->op].value;
+			char *dstp = &image[s_it->offset];
+			size_t avail = sizeof(serialized_value_size_type);
+			seriously::Traits<serialized_value_size_type>::serialize(dstp, avail, static_cast<serialized_value_size_type>(value.length()));
+			memcpy(&image[s_it->offset + sizeof(serialized_value_size_type)], value.data(), value.length());
+		}
+
+		SizedLocator dst(region);
+		ok = write(image, dst);
+	}
+	for (s_it = slots.begin(); ok && (s_it != slots.end()); ++s_it)
+	{
+		if (! s_it->fragment.valid())
+			continue;
+		const std::string& value = ops[s_it->op].value;
+		std::string envelope(sizeof(serialized_value_size_type) + value.length(), '\0');
+		char *dstp = &envelope[0];
+		size_t avail = sizeof(serialized_value_size_type);
+		seriously::Traits<serialized_value_size_type>::serialize(dstp, avail, static_cast<serialized_value_size_type>(value.length()));
+		memcpy(&envelope[sizeof(serialized_value_size_type)], value.data(), value.length());
+		SizedLocator dst(s_it->fragment);
+		ok = write(envelope, dst);
+	}
+
+	/* the tree, in key order */
+	std::vector<Undo> undo;
+	std::vector<SizedLocator> replaced;			/* released once all went through */
+	size_t next_slot = 0;
+	for (it = unique.begin(); ok && (it != unique.end()); ++it)
+	{
+		const WriteBatch::Op& op = ops[*it];
+		if (! apply_continue(undo.size()))
+		{
+			ok = false;
+			break;
+		}
+
+		kv_tree_lookup_type where;
+		if (op.type == WriteBatch::OP_REMOVE)
+		{
+			Search result;
+			if (! find(op.key, result))
+				continue;
+			if (! m_kv_tree->remove(where, op.key))
+				ok = false;
+			else
+			{
+				undo.push_back(Undo(Undo::REMOVED, *it, result.headDataLocator()));
+				replaced.push_back(result.locator());
+			}
+		} else if (in_place[*it])
+		{
+			/* rewritten where it is: undone by writing the old value back */
+			Search result;
+			std::string old_value;
+			SizedLocator contents_loc;
+			if (find(op.key, result))
+				contents_loc = result.contentsLocator();
+			if ((! result.found()) || (! read(old_value, contents_loc)) || (! put_helper(op.key, op.value, /* overwrite */ true)))
+				ok = false;
+			else
+			{
+				undo.push_back(Undo(Undo::REWRITTEN, *it, result.headDataLocator()));
+				undo.back().value.swap(old_value);
+			}
+		} else
+		{
+			assert(next_slot < slots.size());
+			const Slot& s = slots[next_slot++];
+			assert(s.op == *it);
+			DataLocator head = s.fragment.valid() ? s.fragment.dataLocator() :
+					DataLocator(region.dataLocator(), static_cast<DataLocator::offset_t>(s.offset));
+			if (! (s.present ? m_kv_tree->update(op.key, head) : m_kv_tree->insert(op.key, head)))
+				ok = false;
+			else
+			{
+				undo.push_back(Undo(s.present ? Undo::UPDATED : Undo::INSERTED, *it, s.old.dataLocator()));
+				replaced.push_back(s.old);
+			}
+		}
+	}
+
+	if (! ok)
+	{
+		std::vector<Undo>::const_reverse_iterator u_it;
+		for (u_it = undo.rbegin(); u_it != undo.rend(); ++u_it)
+		{
+			const std::string& key = ops[u_it->op].key;
+			kv_tree_lookup_type where;
+			switch (u_it->kind)
+			{
+			case Undo::INSERTED:
+				m_kv_tree->remove(where, key);
+				break;
+			case Undo::UPDATED:
+				m_kv_tree->update(key, u_it->head);
+				break;
+			case Undo::REMOVED:
+				m_kv_tree->insert(key, u_it->head);
+				break;
+			case Undo::REWRITTEN:
+				put_helper(key, u_it->value, /* overwrite */ true);
+				break;
+			}
+		}
+
+		release_space(region);
+		for (s_it = slots.begin(); s_it != slots.end(); ++s_it)
+			release_space(s_it->fragment);
+		return false;
+	}
+
+	for (size_t i = 0; i < replaced.size(); i++)
+		release_space(replaced[i]);
+
+	/* the gaps between the envelopes in the region are free space */
+	if (region_size > 0)
+	{
+		std::vector< std::pair<size_t, size_t> > extents;
+		extents.reserve(slots.size());
+		for (s_it = slots.begin(); s_it != slots.end(); ++s_it)
+		{
+			if (! s_it->fragment.valid())
+				extents.push_back(std::make_pair(s_it->offset, s_it->offset + sizeof(serialized_value_size_type) + ops[s_it->op].value.length()));
+		}
+		std::sort(extents.begin(), extents.end());
+
+		size_t cursor = 0;
+		std::vector< std::pair<size_t, size_t> >::const_iterator e_it;
+		for (e_it = extents.begin(); e_it != extents.end(); ++e_it)
+		{
+			if (e_it->first > cursor)
+			{
+				SizedLocator gap(region.dataLocator(), e_it->first - cursor);
+				gap.delta(static_cast<DataLocator::offset_t>(cursor));
+				release_space(gap);
+			}
+			cursor = e_it->second;
+		}
+	}
+	return true;
+}
+
+inline bool KeyValueStore::store_value(const std::string& value, DataLocator& head)
+{
+	/* a new envelope: value length, then contents */
+	Search result;
+	result.contents_size(value.length());
+	alloc_value_envelope(result.locator());
+	if (! result.locator().valid())
+		return false;
+
+	shptr<block_type> head_block( block_get(result.block_id()) );
+	assert(head_block);
+	char *dstp = head_block->data() + result.offset();
+	size_t avail = static_cast<size_t>(BLOCKSIZE - result.offset());
+	serialized_value_size_type v_value_length = static_cast<serialized_value_size_type>(value.length());
+	seriously::Traits<serialized_value_size_type>::serialize(dstp, avail, v_value_length);
+	block_put(*head_block);
+
+	SizedLocator contents_loc(result.contentsLocator());
+	if (! write(value, contents_loc))
+	{
+		release_space(result.locator());
+		return false;
+	}
+
+	head = result.headDataLocator();
+	return true;
 }
 
 inline bool KeyValueStore::find(const std::string& key, DataLocator& data_pos)
@@ -480,15 +1103,8 @@ inline bool KeyValueStore::find(const std::string& key, DataLocator& data_pos)
 	assert(key.size() <= KEY_MAX_SIZE);
 
 	// do we have this key?
-	kv_tree_lookup_type where;
-	if (m_kv_tree->search(where, key))
+	if (m_kv_tree->find(key, data_pos))
 	{
-		assert(where.found());
-
-		shptr<kv_tree_node_type> node( where.node() );
-		assert(node);
-
-		data_pos = node->value(where.pos());
 		assert(data_pos.valid());
 		return true;
 	}
@@ -510,15 +1126,10 @@ inline bool KeyValueStore::find(const std::string& key, SizedLocator& sized_pos)
 	assert(m_kv_tree->isOpen());
 
 	// do we have this key?
-	kv_tree_lookup_type where;
-	if (m_kv_tree->search(where, key))
+	DataLocator head_pos;
+	if (m_kv_tree->find(key, head_pos))
 	{
-		assert(where.found());
-
-		shptr<kv_tree_node_type> node( where.node() );
-		assert(node);
-
-		sized_pos.dataLocator(node->value(where.pos()));
+		sized_pos.dataLocator(head_pos);
 		sized_pos.envelope_size(0);
 		assert(sized_pos.valid());
 	} else
@@ -605,10 +1216,28 @@ inline bool KeyValueStore::read(std::string& dst, SizedLocator& location)
 	shptr<block_type> src_block;
 	//uint32_t    dst_offset   = 0;
 	size_t      nread        = 0;
+	bool        ok           = true;
 
 	while (src_rem > 0)
 	{
 		assert(src_rem > 0);
+		if ((src_offset == 0) && (src_rem >= BLOCKSIZE))
+		{
+			/* whole blocks: stream them in with a single read, bypassing the block cache */
+			int n_blocks = static_cast<int>(src_rem / BLOCKSIZE);
+			size_t amount = static_cast<size_t>(n_blocks) * BLOCKSIZE;
+			if (! block_read_range(src_block_id, n_blocks, dstp))
+			{
+				ok = false;
+				break;
+			}
+			dstp         += amount;
+			src_rem      -= amount;
+			nread        += amount;
+			src_block_id += n_blocks;
+			src_block.reset();
+			continue;
+		}
 		if ((! src_block) || (src_block->index() != src_block_id))
 			src_block = block_get(src_block_id);
 		assert(src_block);
@@ -629,8 +1258,15 @@ inline bool KeyValueStore::read(std::string& dst, SizedLocator& location)
 		}
 	}
 	*dstp = '\0';
-	assert(src_rem == 0);
 
+	if (! ok)
+	{
+		if (dst_data != fast_data)
+			delete[] dst_data;
+		return false;
+	}
+
+	assert(src_rem == 0);
 	assert(nread >= length);
 
 	dst.reserve(nread);
@@ -671,6 +1307,22 @@ inline bool KeyValueStore::write(const std::string& src, SizedLocator& location)
 		assert(src_rem > 0);
 		assert(dst_avail > 0);
 
+		if ((dst_offset == 0) && (min(src_rem, dst_avail) >= BLOCKSIZE))
+		{
+			/* whole blocks: stream them out with a single write, bypassing the block cache */
+			int n_blocks = static_cast<int>(min(src_rem, dst_avail) / BLOCKSIZE);
+			size_t amount = static_cast<size_t>(n_blocks) * BLOCKSIZE;
+			if (! block_write_range(dst_block_id, n_blocks, srcp))
+				return false;
+			srcp         += amount;
+			src_rem      -= amount;
+			dst_avail    -= amount;
+			nwritten     += amount;
+			dst_block_id += n_blocks;
+			dst_block.reset();
+			continue;
+		}
+
 		if ((! dst_block) || (dst_block->index() != dst_block_id))
 			dst_block = block_get(dst_block_id);
 		assert(dst_block);
@@ -705,8 +1357,26 @@ inline bool KeyValueStore::write(const std::string& src, SizedLocator& location)
 inline bool KeyValueStore::alloc_value_envelope(SizedLocator& dst)
 {
 	size_t amount = dst.envelope_size();
+
+	/* small values first try to fit in released space */
+	if ((amount <= BLOCKSIZE) && alloc_fragment(dst))
+		return true;
+
+	/* small values never straddle a block boundary */
+	if (m_next_location.valid() && (amount <= BLOCKSIZE) && (m_next_location.size() >= amount) &&
+		((m_next_location.uoffset() + amount) > BLOCKSIZE))
+	{
+		SizedLocator skipped(m_next_location.dataLocator(), BLOCKSIZE - m_next_location.uoffset());
+		m_next_location.consume(skipped.size());
+		release_space(skipped);
+	}
+
 	if ((! m_next_location.valid()) || (m_next_location.size() < amount))
 	{
+		/* don't leak what's left of the current span */
+		if (m_next_location.valid() && (m_next_location.size() > 0))
+			release_space(m_next_location);
+
 		size_t n_blocks = size_in_blocks(amount);
 		assert((n_blocks * BLOCKSIZE) >= amount);
 		m_next_location.block_id(block_alloc_id(n_blocks));
@@ -738,11 +1408,854 @@ inline bool KeyValueStore::alloc_value_envelope(SizedLocator& dst)
 	return true;
 }
 
+/* a span for many envelopes: within a block when it fits one, else starting on a fresh block */
+inline bool KeyValueStore::alloc_region(size_t size, SizedLocator& dst)
+{
+	if (size <= BLOCKSIZE)
+	{
+		dst.envelope_size(size);
+		return alloc_value_envelope(dst);
+	}
+
+	/* don't leak what's left of the current span */
+	release_next_location();
+
+	size_t n_blocks = size_in_blocks(size);
+	block_id_t block_id = block_alloc_id(static_cast<int>(n_blocks));
+	if (! block_id_valid(block_id))
+		return false;
+	if (! block_id_valid(m_first_block_id))
+		m_first_block_id = block_id;
+
+	dst = SizedLocator(block_id, 0, size);
+
+	/* the tail of the last block serves the next values */
+	m_next_location = SizedLocator(block_id, 0, n_blocks * BLOCKSIZE);
+	m_next_location.consume(size);
+	return true;
+}
+
 inline size_t KeyValueStore::size_in_blocks(size_t size)
 {
 	return ((size + BLOCKSIZE - 1) / BLOCKSIZE);
 }
 
+/* -- Iteration ------------------------------------------------ */
+
+inline KeyValueStore::base_iterator::base_iterator(Snapshot* snapshot_, bool forward_, bool end_) :
+	m_kv(NULL), m_tree(NULL), m_storage(NULL), m_snapshot(snapshot_), m_pos(-1), m_forward(forward_), m_end(end_), m_ahead(0),
+	m_key_id(NODE_ID_INVALID), m_key_pos(-1)
+{
+	assert(m_snapshot);
+	m_kv = m_snapshot->kv();
+	m_tree = m_kv->kv_tree();
+	m_storage = m_kv->kv_tree_storage();
+	rewind(end_);
+}
+
+inline bool KeyValueStore::base_iterator::load(node_id_t node_id)
+{
+	/* the copied key belongs to the block being replaced */
+	m_key_id = NODE_ID_INVALID;
+	if (m_snapshot)
+		return m_snapshot->node_view(node_id, m_view);
+	return m_storage->node_view(node_id, m_view);
+}
+
+inline KeyValueStore::base_iterator& KeyValueStore::base_iterator::rewind(bool end_)
+{
+	m_view.reset();
+	m_pos = -1;
+	m_ahead = 0;
+
+	if (end_ || m_end || (! m_kv) || (! m_storage))
+	{
+		m_end = true;
+		return *this;
+	}
+
+	/* iterators walk the tree as readers, between writes */
+	ReadGuard guard(lock());
+	if (! load(m_snapshot ? m_snapshot->rootId() : m_tree->rootId()))
+	{
+		m_view.reset();
+		m_end = true;
+		return *this;
+	}
+
+	/* go down to the leftmost (rightmost) leaf */
+	while (! m_view.leaf())
+	{
+		node_id_t child_id = m_view.child(m_forward ? 0 : m_view.n());
+		if ((! node_id_valid(child_id)) || (! load(child_id)))
+		{
+			m_view.reset();
+			m_end = true;
+			return *this;
+		}
+	}
+
+	m_end = false;
+	settle(m_forward);
+	return *this;
+}
+
+inline KeyValueStore::base_iterator& KeyValueStore::base_iterator::seek(const std::string& key)
+{
+	m_view.reset();
+	m_pos = -1;
+	m_forward = true;
+	m_end = true;
+	m_ahead = 0;
+
+	if ((! m_kv) || (! m_storage))
+		return *this;
+
+	/* stored keys are never longer than KEY_MAX_SIZE */
+	bool truncated = (key.length() > KEY_MAX_SIZE);
+	const key_type key_(key.data(), truncated ? KEY_MAX_SIZE : key.length());
+	{
+		ReadGuard guard(lock());
+
+		/* the path a lookup takes, down to the leaf that holds the key or would */
+		int pos = -1;
+		node_id_t node_id = m_snapshot ? m_snapshot->rootId() : m_tree->rootId();
+		while (load(node_id))
+		{
+			m_view.bsearch(key_, pos);
+			if (m_view.leaf())
+				break;
+			node_id = m_view.child(pos);
+		}
+		if (! m_view.valid())
+			return *this;
+
+		m_end = false;
+		if (pos < m_view.n())
+		{
+			m_pos = pos;
+			readAhead(true);
+		} else
+		{
+			/* past the last key of its leaf: the first one of the next leaf */
+			if ((! m_view.hasRight()) || (! load(m_view.rightId())))
+				m_view.reset();
+			settle(true);
+		}
+	}
+
+	/* a truncated key can only be matched by its prefix, that's less than the whole key */
+	while (truncated && (! end()) && (this->key() < key))
+		next();
+	return *this;
+}
+
+inline bool KeyValueStore::base_iterator::step(bool rightward)
+{
+	if (m_end || (! m_view.valid()))
+		return false;             /* stop iteration */
+
+	ReadGuard guard(lock());
+	if (rightward)
+	{
+		if (++m_pos < m_view.n())
+			return true;
+		if ((! m_view.hasRight()) || (! load(m_view.rightId())))
+			m_view.reset();
+	} else
+	{
+		if (--m_pos >= 0)
+			return true;
+		if ((! m_view.hasLeft()) || (! load(m_view.leftId())))
+			m_view.reset();
+	}
+	return settle(rightward);
+}
+
+/* skip empty leaves (only an empty root can be one) and position on the first key met */
+inline bool KeyValueStore::base_iterator::settle(bool rightward)
+{
+	while (m_view.valid() && (m_view.n() == 0))
+	{
+		node_id_t next_id = rightward ? m_view.rightId() : m_view.leftId();
+		if ((! node_id_valid(next_id)) || (! load(next_id)))
+			m_view.reset();
+	}
+
+	if (! m_view.valid())
+	{
+		m_pos = -1;
+		m_end = true;
+		return false;
+	}
+
+	m_pos = rightward ? 0 : (m_view.n() - 1);
+	readAhead(rightward);
+	return true;
+}
+
+/* entering a leaf: once the leaves read ahead are used up, read its next siblings */
+inline void KeyValueStore::base_iterator::readAhead(bool rightward)
+{
+	if ((m_ahead > 0) && (--m_ahead > 0))
+		return;
+
+	/* snapshots are read uncached */
+	int n_ahead = m_kv->readAhead();
+	if (m_snapshot || (n_ahead <= 0) || (! node_id_valid(m_view.parentId())))
+		return;
+
+	node_view_type parent;
+	if ((! m_storage->node_view(m_view.parentId(), parent)) || parent.leaf())
+		return;
+	int pos = 0;
+	while ((pos <= parent.n()) && (parent.child(pos) != m_view.id()))
+		pos++;
+	if (pos > parent.n())
+		return;
+
+	/* past the last child, on with the children of the parent's sibling */
+	std::vector<node_id_t> node_ids;
+	while (static_cast<int>(node_ids.size()) < n_ahead)
+	{
+		pos += rightward ? 1 : -1;
+		if ((pos < 0) || (pos > parent.n()))
+		{
+			node_id_t uncle_id = rightward ? parent.rightId() : parent.leftId();
+			if ((! node_id_valid(uncle_id)) || (! m_storage->node_view(uncle_id, parent)) || parent.leaf())
+				break;
+			pos = rightward ? -1 : (parent.n() + 1);
+			continue;
+		}
+		node_ids.push_back(parent.child(pos));
+	}
+	if (node_ids.empty())
+		return;
+	m_storage->prefetch(node_ids);
+	m_ahead = static_cast<int>(node_ids.size());
+}
+
+inline KeyValueStore::base_iterator::const_reference KeyValueStore::base_iterator::key() const
+{
+	const char* bytes = NULL;
+	size_t length = 0;
+	if (! keyData(bytes, length))
+	{
+		m_current_key.clear();
+		m_key_id = NODE_ID_INVALID;
+	}
+	return m_current_key;
+}
+
+inline bool KeyValueStore::base_iterator::keyData(const char*& bytes, size_t& length) const
+{
+	if (end() || (! m_view.valid()))
+		return false;
+
+	/* still at the position the key was copied from */
+	if ((m_view.id() != m_key_id) || (m_pos != m_key_pos))
+	{
+		/* writers change leaves in place and release their data: copy under the store lock */
+		ReadGuard guard(lock());
+		const char* src = NULL;
+		size_t src_length = 0;
+		if (m_view.keyData(m_pos, src, src_length))
+			m_current_key.assign(src, src_length);
+		else
+		{
+			/* a node materialized by the tree keeps its keys decoded */
+			key_type key_;
+			if (! m_view.key(m_pos, key_))
+				return false;
+			m_current_key.resize(key_.size());
+			if (key_.size() > 0)
+				key_.copy(&m_current_key[0]);
+		}
+		m_key_id = m_view.id();
+		m_key_pos = m_pos;
+	}
+	bytes = m_current_key.data();
+	length = m_current_key.size();
+	return true;
+}
+
+/* -- Range queries -------------------------------------------- */
+
+inline KeyValueStore::iterator KeyValueStore::lower_bound(const std::string& key)
+{
+	iterator it(this, /* forward */ true, /* end */ true);
+	it.seek(key);
+	return it;
+}
+
+inline std::vector<std::string> KeyValueStore::prefix_scan(const std::string& prefix)
+{
+	std::vector<std::string> keys;
+	prefix_scan(prefix, [&keys](const char* key, size_t length) { keys.push_back(std::string(key, length)); return true; });
+	return keys;
+}
+
+/* the keys from 'it' on, before 'end' (if not empty) and starting with 'prefix', as copied by the iterator */
+inline size_t KeyValueStore::scan_helper(iterator it, const std::string& end, const std::string& prefix, const scan_callback_type& callback)
+{
+	size_t n = 0;
+	for (; ! it.end(); ++it)
+	{
+		const char* bytes = NULL;
+		size_t length = 0;
+		if (! it.keyData(bytes, length))
+			break;
+		if ((! end.empty()) && (end.compare(0, end.size(), bytes, length) <= 0))
+			break;
+		if ((length < prefix.size()) || (prefix.compare(0, prefix.size(), bytes, prefix.size()) != 0))
+			break;
+		n++;
+		if (! callback(bytes, length))
+			break;
+	}
+	return n;
+}
+
+/* -- Snapshots ------------------------------------------------ */
+
+inline shptr<KeyValueStore::Snapshot> KeyValueStore::snapshot()
+{
+	/* no writer in the middle while the image is written back and frozen */
+	WriteGuard guard(m_lock);
+	assert(m_blockstorage);
+	assert(m_kv_tree);
+	if (! isOpen())
+		return shptr<Snapshot>();
+
+	shptr<Snapshot::image_type> image( m_blockstorage->snapshot() );
+	if (! image)
+		return shptr<Snapshot>();
+	return shptr<Snapshot>( new Snapshot(this, image, m_kv_tree->rootId()) );
+}
+
+inline bool KeyValueStore::Snapshot::node_view(node_id_t node_id, node_view_type& view)
+{
+	block_id_t block_id = static_cast<block_id_t>(node_id);
+	if ((! node_id_valid(node_id)) || (! m_image->hasId(block_id)))
+	{
+		view.reset();
+		return false;
+	}
+
+	shptr<block_type> block( new block_type(block_id) );
+	if (! m_kv->m_blockstorage->snapshotRead(*m_image, block_id, 1, block->data()))
+	{
+		view.reset();
+		return false;
+	}
+	return view.reset(block);
+}
+
+inline bool KeyValueStore::Snapshot::find(const std::string& key, DataLocator& head_pos)
+{
+	if (key.length() > KEY_MAX_SIZE)
+		return false;
+
+	const key_type key_(key);
+	node_view_type view;
+	node_id_t node_id = m_root_id;
+	while (node_view(node_id, view))
+	{
+		int pos = -1;
+		bool found = view.bsearch(key_, pos);
+		if (view.leaf())
+			return found && view.value(pos, head_pos);
+		node_id = view.child(pos);
+	}
+	return false;
+}
+
+inline bool KeyValueStore::Snapshot::has(const std::string& key)
+{
+	DataLocator head_pos;
+	return find(key, head_pos);
+}
+
+inline bool KeyValueStore::Snapshot::get(const std::string& key, std::string& value)
+{
+	value.clear();
+
+	DataLocator head_pos;
+	if (! find(key, head_pos))
+		return false;
+	assert(head_pos.valid());
+
+	/* the envelope [ value-length | value ] starts in the head block, and can span the next ones */
+	block_id_t first_id = head_pos.block_id();
+	size_t offset = head_pos.uoffset();
+	block_type head(first_id);
+	if (! m_kv->m_blockstorage->snapshotRead(*m_image, first_id, 1, head.data()))
+		return false;
+
+	const char* srcp = head.data() + offset;
+	size_t avail = BLOCKSIZE - offset;
+	serialized_value_size_type v_value_length = 0;
+	if (seriously::Traits<serialized_value_size_type>::deserialize(srcp, avail, v_value_length) < 0)
+		return false;
+
+	size_t contents_offset = offset + sizeof(serialized_value_size_type);
+	size_t n_blocks = m_kv->size_in_blocks(contents_offset + v_value_length);
+	if (n_blocks <= 1)
+	{
+		value.assign(head.data() + contents_offset, v_value_length);
+		return true;
+	}
+
+	std::string buffer(n_blocks * BLOCKSIZE, '\0');
+	memcpy(&buffer[0], head.data(), BLOCKSIZE);
+	if (! m_kv->m_blockstorage->snapshotRead(*m_image, first_id + 1, static_cast<int>(n_blocks - 1), &buffer[BLOCKSIZE]))
+		return false;
+	value.assign(buffer.data() + contents_offset, v_value_length);
+	return true;
+}
+
+/* -- Free space ----------------------------------------------- */
+
+inline size_t KeyValueStore::freeFragmentBytes() const
+{
+	ReadGuard guard(m_lock);
+	size_t n = 0;
+	std::map<DataLocator, size_t>::const_iterator it;
+	for (it = m_free_fragments.begin(); it != m_free_fragments.end(); ++it)
+		n += it->second;
+	return n;
+}
+
+inline bool KeyValueStore::alloc_fragment(SizedLocator& dst, block_id_t limit)
+{
+	size_t amount = dst.envelope_size();
+
+	/* best fit, among the fragments in blocks below 'limit' */
+	std::set< std::pair<size_t, DataLocator> >::iterator s_it =
+			m_free_fragments_by_size.lower_bound(std::make_pair(amount, DataLocator(0, 0)));
+	while ((s_it != m_free_fragments_by_size.end()) && (s_it->second.block_id() >= limit))
+		++s_it;
+	if (s_it == m_free_fragments_by_size.end())
+		return false;
+
+	size_t size = s_it->first;
+	DataLocator location = s_it->second;
+	assert(size >= amount);
+	assert(location.uoffset() + size <= BLOCKSIZE);
+
+	std::map<DataLocator, size_t>::iterator it = m_free_fragments.find(location);
+	assert(it != m_free_fragments.end());
+	erase_fragment(it);
+
+	if (size > amount)
+		insert_fragment(DataLocator(location.block_id(), location.offset() + amount), size - amount);
+
+	// std::cerr << "KV::alloc_fragment(" << amount << ") -> " << location << std::endl;
+	dst.block_id(location.block_id());
+	dst.offset(location.offset());
+	return true;
+}
+
+inline void KeyValueStore::release_space(const SizedLocator& location)
+{
+	if ((! location.valid()) || (location.size() == 0))
+		return;
+
+	SizedLocator loc(location);
+	loc.normalize();
+
+	uint64_t start = static_cast<uint64_t>(loc.block_id()) * BLOCKSIZE + loc.uoffset();
+	uint64_t end = start + loc.size();
+
+	/* whole blocks go back to the block storage, partial ones become fragments */
+	uint64_t first_whole = (start + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint64_t last_whole = end / BLOCKSIZE;			/* exclusive */
+	if (last_whole > first_whole)
+	{
+		block_dispose(static_cast<block_id_t>(first_whole), static_cast<int>(last_whole - first_whole));
+		if (start < (first_whole * BLOCKSIZE))
+			release_fragment(loc.block_id(), loc.uoffset(), static_cast<size_t>(first_whole * BLOCKSIZE - start));
+		if (end > (last_whole * BLOCKSIZE))
+			release_fragment(static_cast<block_id_t>(last_whole), 0, static_cast<size_t>(end - last_whole * BLOCKSIZE));
+	} else
+	{
+		uint64_t boundary = (start / BLOCKSIZE + 1) * BLOCKSIZE;
+		if (end > boundary)
+		{
+			release_fragment(loc.block_id(), loc.uoffset(), static_cast<size_t>(boundary - start));
+			release_fragment(static_cast<block_id_t>(boundary / BLOCKSIZE), 0, static_cast<size_t>(end - boundary));
+		} else
+			release_fragment(loc.block_id(), loc.uoffset(), loc.size());
+	}
+}
+
+inline void KeyValueStore::release_fragment(block_id_t block_id, size_t offset, size_t size)
+{
+	assert(offset + size <= BLOCKSIZE);
+	if (size == 0)
+		return;
+
+	DataLocator location(block_id, static_cast<DataLocator::offset_t>(offset));
+	size_t end = offset + size;
+
+	/* coalesce with the adjacent fragments of the same block */
+	std::map<DataLocator, size_t>::iterator next = m_free_fragments.lower_bound(location);
+	if (next != m_free_fragments.begin())
+	{
+		std::map<DataLocator, size_t>::iterator prev = next;
+		--prev;
+		if ((prev->first.block_id() == block_id) &&
+			(static_cast<size_t>(prev->first.offset()) + prev->second == offset))
+		{
+			location = prev->first;
+			size += prev->second;
+			erase_fragment(prev);
+		}
+	}
+	if ((next != m_free_fragments.end()) && (next->first.block_id() == block_id) &&
+		(static_cast<size_t>(next->first.offset()) == end))
+	{
+		size += next->second;
+		erase_fragment(next);
+	}
+
+	if (size == BLOCKSIZE)
+	{
+		/* the whole block is free */
+		assert(location.offset() == 0);
+		block_dispose(block_id);
+		return;
+	}
+
+	insert_fragment(location, size);
+}
+
+inline std::string KeyValueStore::free_space_serialize() const
+{
+	typedef seriously::Traits<SizedLocator> sized_locator_traits;
+
+	if (m_free_fragments.empty())
+		return std::string();
+
+	std::string data(sizeof(uint32_t) + m_free_fragments.size() * sized_locator_traits::SerializedSize, '\0');
+	char* dstp = &data[0];
+	size_t avail = data.size();
+
+	seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(m_free_fragments.size()));
+	std::map<DataLocator, size_t>::const_iterator it;
+	for (it = m_free_fragments.begin(); it != m_free_fragments.end(); ++it)
+		sized_locator_traits::serialize(dstp, avail, SizedLocator(it->first, it->second));
+	assert(avail == 0);
+
+	return data;
+}
+
+inline bool KeyValueStore::free_space_deserialize(const std::string& data)
+{
+	typedef seriously::Traits<SizedLocator> sized_locator_traits;
+
+	m_free_fragments.clear();
+	m_free_fragments_by_size.clear();
+
+	if (data.empty())
+		return true;
+
+	const char* srcp = data.data();
+	size_t avail = data.size();
+
+	uint32_t v_n_fragments = 0;
+	if (seriously::Traits<uint32_t>::deserialize(srcp, avail, v_n_fragments) < 0)
+		return false;
+	for (uint32_t i = 0; i < v_n_fragments; i++)
+	{
+		SizedLocator v_fragment;
+		if (sized_locator_traits::deserialize(srcp, avail, v_fragment) < 0)
+			return false;
+		insert_fragment(v_fragment.dataLocator(), v_fragment.size());
+	}
+	return true;
+}
+
+/* -- Compaction ----------------------------------------------- */
+
+inline bool KeyValueStore::compact(CompactReport& report, int time_slice_ms)
+{
+	WriteGuard guard(m_lock);
+	typedef std::chrono::steady_clock clock_type;
+
+	report = CompactReport();
+	if (! isOpen())
+		return false;
+
+	assert(m_blockstorage);
+	clock_type::time_point start = clock_type::now();
+	clock_type::time_point deadline = start + std::chrono::milliseconds(time_slice_ms);
+	size_t initial_blocks = m_blockstorage->count();
+
+	if (! m_compact_active)
+	{
+		/* what's left of the current span is free space like the rest */
+		release_next_location();
+
+		/* the size of the storage if all the blocks in use were packed */
+		m_compact_boundary = static_cast<block_id_t>(m_blockstorage->nextId() - m_blockstorage->freeBlocks());
+		m_compact_key = key_type();
+		m_compact_active = true;
+	}
+
+	bool ok = true;
+	while (m_compact_active)
+	{
+		if (! compact_step(report))
+		{
+			m_compact_active = false;
+			ok = false;
+			break;
+		}
+		if ((time_slice_ms > 0) && (clock_type::now() >= deadline))
+			break;
+	}
+
+	if (ok && (! m_compact_active))
+		ok = compact_finish(report);
+
+	size_t final_blocks = m_blockstorage->count();
+	if (final_blocks < initial_blocks)
+		report.reclaimed_bytes = static_cast<uint64_t>(initial_blocks - final_blocks) * BLOCKSIZE;
+	report.elapsed_ms = std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+
+	// std::cerr << "KV::compact() values:" << report.values_moved << " nodes:" << report.nodes_moved <<
+	// 	" reclaimed:" << report.reclaimed_bytes << " ms:" << report.elapsed_ms << (report.done ? " DONE" : "") << std::endl;
+	return ok;
+}
+
+inline bool KeyValueStore::alloc_envelope_below(SizedLocator& dst, block_id_t limit)
+{
+	size_t amount = dst.envelope_size();
+
+	if ((amount <= BLOCKSIZE) && alloc_fragment(dst, limit))
+		return true;
+
+	int n_blocks = static_cast<int>(size_in_blocks(amount));
+	block_id_t block_id = m_blockstorage->allocIdBelow(limit, n_blocks);
+	if (! block_id_valid(block_id))
+		return false;
+
+	dst.block_id(block_id);
+	dst.offset(0);
+
+	/* the unused end of the last block becomes a fragment */
+	size_t slack = static_cast<size_t>(n_blocks) * BLOCKSIZE - amount;
+	if (slack > 0)
+		release_fragment(block_id + n_blocks - 1, BLOCKSIZE - slack, slack);
+	return true;
+}
+
+inline bool KeyValueStore::compact_step(CompactReport& report)
+{
+	assert(m_kv_tree);
+	const block_id_t boundary = m_compact_boundary;
+
+	/*
+	 * down to the leaf holding the first key >= m_compact_key. All the
+	 * children of the nodes on the path move, so that the leaves left
+	 * empty by removals, which no key leads to, move too.
+	 */
+	shptr<kv_tree_node_type> node( m_kv_tree->root() );
+	assert(node);
+	if (! compact_node(node, shptr<kv_tree_node_type>(), -1, report))
+		return false;
+	while (! node->leaf())
+	{
+		for (int i = 0; i <= node->n(); i++)
+		{
+			if ((! node->hasChild(i)) || (static_cast<block_id_t>(node->child(i)) < boundary))
+				continue;
+			shptr<kv_tree_node_type> child( node->child_node(i) );
+			if ((! child) || (! compact_node(child, node, i, report)))
+				return false;
+		}
+
+		kv_tree_lookup_type where;
+		node->bsearch(where, m_compact_key);
+		node = node->child_node(where.pos());
+		if (! node)
+			return false;
+	}
+
+	kv_tree_lookup_type where;
+	node->bsearch(where, m_compact_key);
+	for (int i = where.pos(); i < node->n(); i++)
+	{
+		if (! compact_value(node, i, report))
+			return false;
+	}
+
+	/* resume from the next leaf with keys, if any */
+	shptr<kv_tree_node_type> next( node->right() );
+	while (next && next->empty())
+		next = next->right();
+	if (next)
+		m_compact_key = next->key(0);
+	else
+		m_compact_active = false;
+	return true;
+}
+
+inline bool KeyValueStore::compact_node(shptr<kv_tree_node_type>& node, const shptr<kv_tree_node_type>& parent, int pos, CompactReport& report)
+{
+	const block_id_t boundary = m_compact_boundary;
+
+	if (static_cast<block_id_t>(node->id()) < boundary)
+		return true;
+
+	block_id_t new_id = m_blockstorage->allocIdBelow(boundary);
+	if (! block_id_valid(new_id))
+		return true;			/* no room left below the boundary, it stays */
+
+	node = m_kv_tree->node_relocate(node, parent, pos, static_cast<node_id_t>(new_id));
+	if (! node)
+		return false;
+
+	report.nodes_moved++;
+	report.bytes_moved += BLOCKSIZE;
+	return true;
+}
+
+inline bool KeyValueStore::compact_value(shptr<kv_tree_node_type>& leaf, int pos, CompactReport& report)
+{
+	const block_id_t boundary = m_compact_boundary;
+
+	SizedLocator src(leaf->value(pos), 0);
+	assert(src.valid());
+
+	shptr<block_type> head_block( block_get(src.block_id()) );
+	if (! head_block)
+		return false;
+	const char* srcp = head_block->data() + src.offset();
+	size_t avail = BLOCKSIZE - src.uoffset();
+	serialized_value_size_type v_value_length = 0;
+	if (seriously::Traits<serialized_value_size_type>::deserialize(srcp, avail, v_value_length) < 0)
+		return false;
+	head_block.reset();
+	src.contents_size(static_cast<SizedLocator::size_type>(v_value_length));
+
+	/* only envelopes reaching past the boundary move */
+	uint64_t end = static_cast<uint64_t>(src.block_id()) * BLOCKSIZE + src.uoffset() + src.envelope_size();
+	if (end <= static_cast<uint64_t>(boundary) * BLOCKSIZE)
+		return true;
+
+	SizedLocator dst(src);
+	if (! alloc_envelope_below(dst, boundary))
+		return true;			/* no room left below the boundary, it stays */
+
+	std::string envelope;
+	SizedLocator from(src);
+	SizedLocator to(dst);
+	if ((! read(envelope, from)) || (! write(envelope, to)))
+	{
+		release_space(dst);
+		return false;
+	}
+
+	leaf->value(pos) = dst.dataLocator();
+	m_kv_tree->node_put(leaf);
+	release_space(src);
+
+	report.values_moved++;
+	report.bytes_moved += src.envelope_size();
+	return true;
+}
+
+inline bool KeyValueStore::compact_finish(CompactReport& report)
+{
+	/* puts between time slices may have started a new span */
+	release_next_location();
+
+	bool ok = flush();
+	if (! m_blockstorage->truncate())
+		ok = false;
+	report.done = true;
+	return ok;
+}
+
+/* -- Write-ahead log ------------------------------------------ */
+
+inline void KeyValueStore::wal(WriteAheadLog* log)
+{
+	WriteGuard guard(m_lock);
+	assert(! isOpen());
+	if (m_wal && (m_wal != log))
+		delete m_wal;
+	m_wal = log;
+
+	/* no steal: the committed pages stay as of the last checkpoint */
+	assert(m_blockstorage);
+	if (m_wal && (! m_blockstorage->isOpen()))
+		m_blockstorage->copyOnWrite(true);
+}
+
+/*
+ * redo the records left by a crash, over the store as of the checkpoint
+ * that preceded them (see wal()). A previous replay that failed can have
+ * committed part of their effects: puts overwrite, removes and renames
+ * of keys no longer there are skipped. On failure the log is kept.
+ */
+inline bool KeyValueStore::log_replay()
+{
+	assert(m_wal);
+	if (! m_wal->open())
+		return false;
+
+	std::vector<WriteAheadLog::Record> records;
+	if (! m_wal->read(records))
+		return false;
+	if (records.empty())
+		return true;
+
+	// std::cerr << "KV::log_replay() records:" << records.size() << std::endl;
+	bool ok = true;
+	std::vector<WriteAheadLog::Record>::const_iterator it;
+	for (it = records.begin(); ok && (it != records.end()); ++it)
+	{
+		switch (it->type)
+		{
+		case WriteAheadLog::RECORD_PUT:
+			if (! put_helper(it->first, it->second, /* overwrite */ true))
+				ok = false;
+			break;
+		case WriteAheadLog::RECORD_REMOVE:
+			remove_helper(it->first);
+			break;
+		case WriteAheadLog::RECORD_RENAME:
+			rename_helper(it->first, it->second);
+			break;
+		case WriteAheadLog::RECORD_BATCH:
+			{
+				WriteBatch batch;
+				if ((! batch.deserialize(it->first)) || (! apply_helper(batch)))
+					ok = false;
+			}
+			break;
+		}
+	}
+
+	if (ok && (! log_checkpoint()))
+		ok = false;
+	return ok;
+}
+
+/* the store is made durable first, only then its log is dropped */
+inline bool KeyValueStore::log_checkpoint()
+{
+	assert(m_kv_tree);
+	header_write();
+	bool ok = m_kv_tree->flush();
+	if (ok && m_wal && m_wal->isOpen())
+		ok = m_wal->reset();
+	return ok;
+}
+
 /* -- Header I/O ----------------------------------------------- */
 
 #define MAX_USER_HEADER 240
@@ -766,6 +2279,7 @@ inline bool KeyValueStore::header_write()
 
 	std::string userHeader(packer.data(), packer.size());
 	m_blockstorage->setUserHeader(m_kv_header_uid, userHeader);
+	m_blockstorage->setUserData(m_kv_header_uid, free_space_serialize());
 
 	// std::cerr << "-> KV WRITE VER:" << MAJOR_VERSION << "." << MINOR_VERSION << " BLOCKSIZE:" << BLOCKSIZE <<
 	// 	" B:" << B << std::endl;
@@ -824,7 +2338,7 @@ inline bool KeyValueStore::header_read()
 	m_next_location.offset(v_offset);
 	m_next_location.size(v_avail);
 
-	return true;
+	return free_space_deserialize(m_blockstorage->getUserData(m_kv_header_uid));
 }
 
 } /* end of namespace milliways */
@@ -27,17 +27,27 @@
 #include <map>
 #include <deque>
 #include <functional>
+#include <unordered_map>
 
 #include <stdint.h>
 #include <assert.h>
 
 #include "config.h"
 #include "ordered_map.h"
+#include "CachePolicy.h"
 
 namespace milliways {
 
 static const int LRUCACHE_L1_CACHE_SIZE = 16;
 
+/*
+ * SIZE is the default capacity: it can be given at construction and
+ * changed at runtime with capacity()
+ * The replacement policy is LRU, unless a CachePolicy is installed with
+ * policy() (see CachePolicy.h)
+ * Pinned entries are never evicted (but still deleted by del()): when all
+ * the entries are pinned the cache grows over its capacity.
+ */
 template <size_t SIZE, typename Key, typename T>
 class LRUCache
 {
@@ -47,6 +57,7 @@ public:
 	typedef std::pair<Key, T> value_type;
 	typedef ordered_map<key_type, mapped_type> ordered_map_type;
 	typedef typename ordered_map<key_type, mapped_type>::size_type size_type;
+	typedef CachePolicy<key_type> policy_type;
 
 	static const size_type Size = SIZE;
 	static const int L1_SIZE = LRUCACHE_L1_CACHE_SIZE;
@@ -54,33 +65,50 @@ public:
 	typedef enum { op_get, op_set, op_sub } op_type;
 
 	// LRUCache();
-	LRUCache(const key_type& invalid);
-	virtual ~LRUCache() { /* call evict_all() in final destructor */ evict_all(); }
+	LRUCache(const key_type& invalid, size_type capacity_ = SIZE);
+	virtual ~LRUCache() { /* call evict_all() in final destructor */ evict_all(); delete m_policy; }
 
 	virtual bool on_miss(op_type op, const key_type& key, mapped_type& value);
 	virtual bool on_set(const key_type& key, const mapped_type& value);
 	virtual bool on_delete(const key_type& key);
-	virtual bool on_eviction(const key_type& key, mapped_type& value);
+	virtual bool on_eviction(const key_type& key, mapped_type& value);		/* false: keep it cached */
 
 	bool empty() const { return m_omap.empty(); }
 	size_type size() const { return m_omap.size(); }
-	size_type max_size() const { return Size; }
+	size_type max_size() const { return m_capacity; }
 
-	void clear() { clear_l1(); m_omap.clear(); }
+	size_type capacity() const { return m_capacity; }
+	void capacity(size_type value);		/* evicts the least recently used items that don't fit */
+
+	policy_type* policy() const { return m_policy; }
+	void policy(policy_type* value);	/* takes ownership, NULL: plain LRU */
+
+	bool pin(const key_type& key);		/* pins a cached entry (pins are counted) */
+	void unpin(const key_type& key);
+	bool pinned(const key_type& key) const { return (! m_pins.empty()) && (m_pins.count(key) > 0); }
+	size_type n_pinned() const { return m_pins.size(); }
+
+	size_type hits() const { return m_hits; }
+	size_type misses() const { return m_misses; }
+	void reset_stats() { m_hits = 0; m_misses = 0; }
+
+	void clear() { clear_l1(); m_omap.clear(); m_pins.clear(); if (m_policy) m_policy->clear(); }
 	void clear_l1();
 
 	bool has(key_type& key) const { return m_omap.has(key); }
 	bool get(mapped_type& dst, key_type& key);
 	bool set(key_type& key, mapped_type& value);
 	bool del(key_type& key);
+	mapped_type* peek(const key_type& key);		/* lookup without touching recency nor calling on_miss() */
+	mapped_type* lookup(const key_type& key);	/* lookup touching recency (a hit), without calling on_miss() */
 
 	size_type count(const key_type& key) const { return m_omap.count(key); }
 	mapped_type& operator[](const key_type& key);
 
-	void evict(bool force = false);     // evict the LRU item
+	void evict(bool force = false);     // evict the LRU item (or the policy victim)
 	void evict_all();
 
-	value_type pop();                   // pop LRU item and return it
+	value_type pop();                   // pop LRU item (or the policy victim) and return it
 
 	key_type invalid_key() const { return m_invalid_key; }
 	void invalid_key(const key_type& value) { m_invalid_key = value; }
@@ -105,12 +133,23 @@ private:
 	LRUCache(const LRUCache<SIZE, Key, T>& other);
 	LRUCache& operator= (const LRUCache<SIZE, Key, T>& rhs);
 
+	void touch(typename ordered_map_type::iterator it);
+	void touch_l1(const key_type& key);
+	void inserted(const key_type& key);
+	bool pop_victim(value_type& item, bool ignore_pins);
+	bool evict_one(bool ignore_pins);
+
 	mutable key_type m_l1_key[L1_SIZE];
 	mutable mapped_type* m_l1_mapped[L1_SIZE];
 	mutable int m_l1_last;
 
 	ordered_map<key_type, mapped_type> m_omap;
 	key_type m_invalid_key;
+	size_type m_capacity;
+	policy_type* m_policy;
+	std::unordered_map<key_type, size_type> m_pins;
+	size_type m_hits;
+	size_type m_misses;
 };
 
 } /* end of namespace milliways */
@@ -35,8 +35,9 @@ namespace milliways {
 // }
 
 template <size_t SIZE, typename Key, typename T>
-LRUCache<SIZE, Key, T>::LRUCache(const key_type& invalid) :
-	m_l1_last(-1), m_invalid_key(invalid)
+LRUCache<SIZE, Key, T>::LRUCache(const key_type& invalid, size_type capacity_) :
+	m_l1_last(-1), m_invalid_key(invalid), m_capacity(capacity_ > 0 ? capacity_ : 1),
+	m_policy(NULL), m_hits(0), m_misses(0)
 {
 	clear_l1();
 }
@@ -72,22 +73,19 @@ bool LRUCache<SIZE, Key, T>::get(mapped_type& dst, key_type& key)
 		if (key == m_l1_key[i])
 		{
 			assert(m_l1_mapped[i]);
+			touch_l1(key);
 			dst = *m_l1_mapped[i];
 			return true;
 		}
 
-	typename ordered_map<key_type, mapped_type>::const_iterator it = m_omap.find(key);
+	typename ordered_map_type::iterator it = m_omap.find(key);
 
 	if (it != m_omap.end())
 	{
-		// fetch from its place...
-		typename ordered_map<key_type, mapped_type>::value_type item = m_omap.pop(key);
-		assert(item.first == key);
+		// move to the most recently used end (O(1), 'it' stays valid)
+		touch(it);
 
-		// ...and re-insert at top
-		m_omap[key] = item.second;
-
-		mapped_type* mptr = &m_omap[key];
+		mapped_type* mptr = &it->second;
 
 		m_l1_last = (m_l1_last + 1) % L1_SIZE;
 		m_l1_key[m_l1_last] = key;
@@ -99,15 +97,16 @@ bool LRUCache<SIZE, Key, T>::get(mapped_type& dst, key_type& key)
 	{
 		// miss - use overridable function
 
-		if (m_omap.size() >= Size)
+		if (m_omap.size() >= m_capacity)
 			evict();
-		assert(m_omap.size() < Size);
 
+		m_misses++;
 		mapped_type value;
 		bool success = on_miss(op_get, key, value);
 		if (success)
 		{
 			m_omap[key] = value;
+			inserted(key);
 
 			mapped_type* mptr = &m_omap[key];
 
@@ -129,39 +128,35 @@ bool LRUCache<SIZE, Key, T>::set(key_type& key, mapped_type& value)
 		if (key == m_l1_key[i])
 		{
 			assert(m_l1_mapped[i]);
+			touch_l1(key);
 			(*m_l1_mapped[i]) = value;
 			return true;
 		}
 
-	typename ordered_map<key_type, mapped_type>::const_iterator it = m_omap.find(key);
+	typename ordered_map_type::iterator it = m_omap.find(key);
 
+	mapped_type* mptr = NULL;
 	if (it != m_omap.end())
 	{
-		// remove existing from its place...
-		typename ordered_map<key_type, mapped_type>::value_type item = m_omap.pop(key);
-		assert(item.first == key);
-
-		for (int i = 0; i < L1_SIZE; i++)
-			if (item.first == m_l1_key[i])
-			{
-				invalidate_key(m_l1_key[i]);
-				m_l1_mapped[i] = NULL;
-				// break;
-			}
+		// move existing to the most recently used end and overwrite it
+		touch(it);
+		mptr = &it->second;
+		*mptr = value;
 	} else
 	{
-		if (m_omap.size() >= Size)
+		if (m_omap.size() >= m_capacity)
 			evict();
-		assert(m_omap.size() < Size);
 
+		m_misses++;
 		/* bool success = */ on_miss(op_set, key, value);
+
+		mptr = &m_omap[key];
+		inserted(key);
+		*mptr = value;
 	}
 
-	m_omap[key] = value;
 	on_set(key, value);
 
-	mapped_type* mptr = &m_omap[key];
-
 	m_l1_last = (m_l1_last + 1) % L1_SIZE;
 	m_l1_key[m_l1_last] = key;
 	m_l1_mapped[m_l1_last] = mptr;
@@ -180,12 +175,14 @@ bool LRUCache<SIZE, Key, T>::del(key_type& key)
 			// break;
 		}
 
-	typename ordered_map<key_type, mapped_type>::const_iterator it = m_omap.find(key);
-
-	if (it != m_omap.end())
+	if (m_omap.has(key))
 	{
 		// remove existing from its place...
 		/* typename ordered_map<key_type, mapped_type>::value_type item = */ m_omap.pop(key);
+		if (! m_pins.empty())
+			m_pins.erase(key);
+		if (m_policy)
+			m_policy->removed(key);
 		on_delete(key);
 		return true;
 	}
@@ -193,6 +190,41 @@ bool LRUCache<SIZE, Key, T>::del(key_type& key)
 	return false;
 }
 
+template <size_t SIZE, typename Key, typename T>
+T* LRUCache<SIZE, Key, T>::peek(const key_type& key)
+{
+	typename ordered_map_type::iterator it = m_omap.find(key);
+	if (it != m_omap.end())
+		return &it->second;
+	return NULL;
+}
+
+template <size_t SIZE, typename Key, typename T>
+T* LRUCache<SIZE, Key, T>::lookup(const key_type& key)
+{
+	for (int i = 0; i < L1_SIZE; i++)
+		if (key == m_l1_key[i])
+		{
+			assert(m_l1_mapped[i]);
+			touch_l1(key);
+			return m_l1_mapped[i];
+		}
+
+	typename ordered_map_type::iterator it = m_omap.find(key);
+	if (it == m_omap.end())
+		return NULL;
+
+	touch(it);
+
+	mapped_type* mptr = &it->second;
+
+	m_l1_last = (m_l1_last + 1) % L1_SIZE;
+	m_l1_key[m_l1_last] = key;
+	m_l1_mapped[m_l1_last] = mptr;
+
+	return mptr;
+}
+
 template <size_t SIZE, typename Key, typename T>
 T& LRUCache<SIZE, Key, T>::operator[](const key_type& key)
 {
@@ -200,21 +232,18 @@ T& LRUCache<SIZE, Key, T>::operator[](const key_type& key)
 		if (key == m_l1_key[i])
 		{
 			assert(m_l1_mapped[i]);
+			touch_l1(key);
 			return (*m_l1_mapped[i]);
 		}
 
-	typename ordered_map<key_type, mapped_type>::const_iterator it = m_omap.find(key);
+	typename ordered_map_type::iterator it = m_omap.find(key);
 
 	if (it != m_omap.end())
 	{
-		// fetch from its place...
-		typename ordered_map<key_type, mapped_type>::value_type item = m_omap.pop(key);
-		assert(item.first == key);
-
-		// ...and re-insert at top
-		m_omap[key] = item.second;
+		// move to the most recently used end (O(1), 'it' stays valid)
+		touch(it);
 
-		mapped_type* mptr = &m_omap[key];
+		mapped_type* mptr = &it->second;
 
 		m_l1_last = (m_l1_last + 1) % L1_SIZE;
 		m_l1_key[m_l1_last] = key;
@@ -225,15 +254,16 @@ T& LRUCache<SIZE, Key, T>::operator[](const key_type& key)
 	{
 		// miss - use overridable function
 
-		if (m_omap.size() >= Size)
+		if (m_omap.size() >= m_capacity)
 			evict();
-		assert(m_omap.size() < Size);
 
+		m_misses++;
 		mapped_type value;
 
 		/* bool success = */ on_miss(op_sub, key, value);
 
 		m_omap[key] = value;
+		inserted(key);
 
 		mapped_type* mptr = &m_omap[key];
 
@@ -253,21 +283,65 @@ void LRUCache<SIZE, Key, T>::evict(bool force)
 
 	assert(m_omap.size() > 0);
 
-	if ((m_omap.size() >= Size) || force)
+	if ((m_omap.size() >= m_capacity) || force)
+		evict_one(/* ignore_pins */ false);
+}
+
+template <size_t SIZE, typename Key, typename T>
+bool LRUCache<SIZE, Key, T>::evict_one(bool ignore_pins)
+{
+	typename ordered_map<key_type, mapped_type>::value_type item;
+	if (! pop_victim(item, ignore_pins))
+		return false;
+
+	bool evicted = on_eviction(item.first, item.second);
+
+	for (int i = 0; i < L1_SIZE; i++)
+		if (item.first == m_l1_key[i])
+		{
+			invalidate_key(m_l1_key[i]);
+			m_l1_mapped[i] = NULL;
+			assert(! m_l1_mapped[i]);
+			// break;
+		}
+
+	/* a refused eviction keeps the item, as the most recent one (unless evicting everything) */
+	if ((! evicted) && (! ignore_pins))
 	{
-		// remove oldest (FIFO)
-		typename ordered_map<key_type, mapped_type>::value_type item = m_omap.pop_front();
+		m_omap[item.first] = item.second;
+		inserted(item.first);
+		return false;
+	}
+	return true;
+}
 
-		on_eviction(item.first, item.second);
+template <size_t SIZE, typename Key, typename T>
+void LRUCache<SIZE, Key, T>::capacity(size_type value)
+{
+	m_capacity = (value > 0) ? value : 1;
+	if (m_policy)
+		m_policy->capacity(m_capacity);
+	while ((m_omap.size() > m_capacity) && evict_one(/* ignore_pins */ false))
+		;
+}
 
-		for (int i = 0; i < L1_SIZE; i++)
-			if (item.first == m_l1_key[i])
-			{
-				invalidate_key(m_l1_key[i]);
-				m_l1_mapped[i] = NULL;
-				assert(! m_l1_mapped[i]);
-				// break;
-			}
+template <size_t SIZE, typename Key, typename T>
+void LRUCache<SIZE, Key, T>::policy(policy_type* value)
+{
+	if (value == m_policy)
+		return;
+
+	delete m_policy;
+	m_policy = value;
+	if (m_policy)
+	{
+		// the new policy starts from the current entries, oldest first
+		m_policy->clear();
+		m_policy->capacity(m_capacity);
+		typename ordered_map_type::const_iterator it;
+		for (it = m_omap.begin(); it != m_omap.end(); ++it)
+			if (! pinned(it->first))
+				m_policy->inserted(it->first);
 	}
 }
 
@@ -277,7 +351,39 @@ void LRUCache<SIZE, Key, T>::evict_all()
 	clear_l1();
 
 	while (m_omap.size() > 0)
-		evict(/* force */ true);
+		evict_one(/* ignore_pins */ true);
+
+	// don't carry the pins nor the history of a flushed cache
+	m_pins.clear();
+	if (m_policy)
+		m_policy->clear();
+}
+
+template <size_t SIZE, typename Key, typename T>
+bool LRUCache<SIZE, Key, T>::pin(const key_type& key)
+{
+	if (! m_omap.has(key))
+		return false;
+
+	size_type& count = m_pins[key];
+	if ((count++ == 0) && m_policy)
+		m_policy->removed(key);		/* out of the policy reach while pinned */
+	return true;
+}
+
+template <size_t SIZE, typename Key, typename T>
+void LRUCache<SIZE, Key, T>::unpin(const key_type& key)
+{
+	typename std::unordered_map<key_type, size_type>::iterator it = m_pins.find(key);
+	if (it == m_pins.end())
+		return;
+
+	if (--it->second == 0)
+	{
+		m_pins.erase(it);
+		if (m_policy && m_omap.has(key))
+			m_policy->inserted(key);
+	}
 }
 
 template <size_t SIZE, typename Key, typename T>
@@ -299,8 +405,9 @@ typename std::pair<Key, T> LRUCache<SIZE, Key, T>::pop()
 
 	assert(m_omap.size() > 0);
 
-	// remove oldest (FIFO)
-	typename ordered_map<key_type, mapped_type>::value_type item = m_omap.pop_front();
+	typename ordered_map<key_type, mapped_type>::value_type item;
+	if (! pop_victim(item, /* ignore_pins */ false))
+		return std::pair<Key, T>();
 
 	on_eviction(item.first, item.second);
 
@@ -315,6 +422,71 @@ typename std::pair<Key, T> LRUCache<SIZE, Key, T>::pop()
 	return std::pair<Key, T>(item.first, item.second);
 }
 
+template <size_t SIZE, typename Key, typename T>
+inline void LRUCache<SIZE, Key, T>::touch(typename ordered_map_type::iterator it)
+{
+	m_hits++;
+	if (m_policy)
+		m_policy->accessed(it->first);
+	else
+		m_omap.move_to_back(it);
+}
+
+template <size_t SIZE, typename Key, typename T>
+inline void LRUCache<SIZE, Key, T>::touch_l1(const key_type& key)
+{
+	// L1 hits don't refresh the LRU order, but policies may need to see them
+	m_hits++;
+	if (m_policy)
+		m_policy->accessed(key);
+}
+
+template <size_t SIZE, typename Key, typename T>
+inline void LRUCache<SIZE, Key, T>::inserted(const key_type& key)
+{
+	if (m_policy)
+		m_policy->inserted(key);
+}
+
+template <size_t SIZE, typename Key, typename T>
+bool LRUCache<SIZE, Key, T>::pop_victim(value_type& item, bool ignore_pins)
+{
+	if (m_omap.size() <= 0)
+		return false;
+
+	if (m_policy)
+	{
+		// pinned keys are out of the policy
+		key_type key;
+		if (m_policy->victim(key))
+		{
+			assert(m_omap.has(key));
+			if (m_omap.has(key))
+			{
+				item = m_omap.pop(key);
+				return true;
+			}
+		}
+		if (! ignore_pins)
+			return false;
+	}
+
+	// remove oldest (FIFO), pinned entries go back to the recent end
+	size_type n_left = m_omap.size();
+	typename ordered_map_type::iterator it = m_omap.begin();
+	while ((! ignore_pins) && pinned(it->first))
+	{
+		if (--n_left == 0)
+			return false;
+		m_omap.move_to_back(it);
+		it = m_omap.begin();
+	}
+	if (! m_pins.empty())
+		m_pins.erase(it->first);
+	item = m_omap.pop_front();
+	return true;
+}
+
 } /* end of namespace milliways */
 
 #endif /* MILLIWAYS_LRUCACHE_IMPL_H */
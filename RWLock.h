@@ -0,0 +1,133 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_RWLOCK_H
+#define MILLIWAYS_RWLOCK_H
+
+#include <atomic>
+#include <thread>
+
+#include <stdint.h>
+#include <assert.h>
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   RWLock                                                          *
+ * ----------------------------------------------------------------- */
+
+/*
+ * readers-writer lock for many short read sections: shared locking is a
+ * single atomic increment, contended acquisitions spin and yield.
+ * Re-entrant: a reader can take the shared lock again, and the writer can
+ * take both the exclusive and the shared lock again (so that public methods
+ * can call each other). There's no writer preference (a reader waiting on
+ * a writer could deadlock against its own outer shared lock), so a steady
+ * stream of readers can delay a writer.
+ */
+class RWLock
+{
+public:
+	RWLock() : m_state(0), m_owner(), m_depth(0) {}
+
+	void lock_shared();
+	void unlock_shared();
+	void lock();
+	void unlock();
+
+	bool owned() const { return m_owner.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+
+private:
+	RWLock(const RWLock& other);
+	RWLock& operator= (const RWLock& rhs);
+
+	std::atomic<int32_t> m_state;				/* readers count, -1: writer */
+	std::atomic<std::thread::id> m_owner;		/* writer thread */
+	int m_depth;								/* writer re-entrancy */
+};
+
+class ReadGuard
+{
+public:
+	explicit ReadGuard(RWLock& lock) : m_lock(&lock) { m_lock->lock_shared(); }
+	explicit ReadGuard(RWLock* lock) : m_lock(lock) { if (m_lock) m_lock->lock_shared(); }		/* NULL: nothing to lock */
+	~ReadGuard() { if (m_lock) m_lock->unlock_shared(); }
+
+private:
+	ReadGuard(const ReadGuard& other);
+	ReadGuard& operator= (const ReadGuard& rhs);
+
+	RWLock* m_lock;
+};
+
+class WriteGuard
+{
+public:
+	explicit WriteGuard(RWLock& lock) : m_lock(lock) { m_lock.lock(); }
+	~WriteGuard() { m_lock.unlock(); }
+
+private:
+	WriteGuard(const WriteGuard& other);
+	WriteGuard& operator= (const WriteGuard& rhs);
+
+	RWLock& m_lock;
+};
+
+/* ----------------------------------------------------------------- *
+ *   OptLock                                                         *
+ * ----------------------------------------------------------------- */
+
+/*
+ * optimistic lock, for optimistic lock coupling: writers take it
+ * exclusively, readers don't take it at all. A reader notes the version
+ * before reading the data it protects and validates it afterwards: if it
+ * changed (or was locked) what has been read may be inconsistent, and the
+ * reader restarts. The version is odd while locked, and each unlock moves
+ * it on. Not re-entrant.
+ */
+class OptLock
+{
+public:
+	OptLock() : m_version(0) {}
+
+	/* readers: false (no version) while a writer holds the lock */
+	bool read_begin(uint64_t& version) const;
+	bool validate(uint64_t version) const;
+
+	/* writers: try_upgrade() locks only if the version is still 'version' */
+	bool try_upgrade(uint64_t version);
+	bool try_lock();
+	void lock();
+	void unlock();
+
+	bool locked() const { return (m_version.load(std::memory_order_relaxed) & 1) != 0; }
+
+private:
+	OptLock(const OptLock& other);
+	OptLock& operator= (const OptLock& rhs);
+
+	std::atomic<uint64_t> m_version;
+};
+
+} /* end of namespace milliways */
+
+#include "RWLock.impl.hpp"
+
+#endif /* MILLIWAYS_RWLOCK_H */
@@ -0,0 +1,139 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_RWLOCK_H
+#include "RWLock.h"
+#endif
+
+#ifndef MILLIWAYS_RWLOCK_IMPL_H
+#define MILLIWAYS_RWLOCK_IMPL_H
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   RWLock                                                          *
+ * ----------------------------------------------------------------- */
+
+inline void RWLock::lock_shared()
+{
+	if (owned())
+	{
+		m_depth++;
+		return;
+	}
+
+	for (;;)
+	{
+		int32_t state = m_state.load(std::memory_order_relaxed);
+		if ((state >= 0) && m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed))
+			return;
+		if (state < 0)
+			std::this_thread::yield();
+	}
+}
+
+inline void RWLock::unlock_shared()
+{
+	if (owned())
+	{
+		assert(m_depth > 1);
+		m_depth--;
+		return;
+	}
+
+	int32_t old = m_state.fetch_sub(1, std::memory_order_release);
+	assert(old > 0);
+	(void) old;
+}
+
+inline void RWLock::lock()
+{
+	if (owned())
+	{
+		m_depth++;
+		return;
+	}
+
+	for (;;)
+	{
+		int32_t state = 0;
+		if (m_state.compare_exchange_weak(state, -1, std::memory_order_acquire, std::memory_order_relaxed))
+			break;
+		std::this_thread::yield();
+	}
+	m_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+	m_depth = 1;
+}
+
+inline void RWLock::unlock()
+{
+	assert(owned());
+	assert(m_depth > 0);
+	if (--m_depth > 0)
+		return;
+
+	m_owner.store(std::thread::id(), std::memory_order_relaxed);
+	m_state.store(0, std::memory_order_release);
+}
+
+/* ----------------------------------------------------------------- *
+ *   OptLock                                                         *
+ * ----------------------------------------------------------------- */
+
+inline bool OptLock::read_begin(uint64_t& version) const
+{
+	version = m_version.load(std::memory_order_acquire);
+	return (version & 1) == 0;
+}
+
+inline bool OptLock::validate(uint64_t version) const
+{
+	/* the reads of the protected data can't move past the check */
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return m_version.load(std::memory_order_relaxed) == version;
+}
+
+inline bool OptLock::try_upgrade(uint64_t version)
+{
+	assert((version & 1) == 0);
+	return m_version.compare_exchange_strong(version, version + 1, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+inline bool OptLock::try_lock()
+{
+	uint64_t version = m_version.load(std::memory_order_relaxed);
+	return ((version & 1) == 0) && try_upgrade(version);
+}
+
+inline void OptLock::lock()
+{
+	while (! try_lock())
+		std::this_thread::yield();
+}
+
+inline void OptLock::unlock()
+{
+	assert(locked());
+	m_version.fetch_add(1, std::memory_order_release);
+}
+
+} /* end of namespace milliways */
+
+#endif /* MILLIWAYS_RWLOCK_IMPL_H */
@@ -0,0 +1,203 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_SHARDEDKEYVALUESTORE_H
+#define MILLIWAYS_SHARDEDKEYVALUESTORE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "KeyValueStore.h"
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   ShardedKeyValueStore                                            *
+ * ----------------------------------------------------------------- */
+
+/*
+ * spreads the keys over N independent KeyValueStore shards, each with
+ * its own file, block cache and lock, by a hash of the key. Operations
+ * on keys of different shards don't contend, open(), flush() and close()
+ * run on the shards in parallel, and iteration merges the shards back
+ * into key order.
+ * The shard of a key is fixed by the number of shards: a store must be
+ * reopened with the same count.
+ */
+class ShardedKeyValueStore
+{
+public:
+	typedef KeyValueStore kv_type;
+	typedef XTYPENAME kv_type::block_storage_type block_storage_type;
+	typedef XTYPENAME kv_type::Search Search;
+	typedef XTYPENAME kv_type::CompactReport CompactReport;
+
+	static const int MAX_SHARDS = 256;
+
+	class iterator;
+
+	ShardedKeyValueStore(const std::string& basename, int n_shards, size_t cache_blocks = KV_BLOCK_CACHESIZE);
+	~ShardedKeyValueStore();
+
+	static std::string shardPathname(const std::string& basename, int shard_);
+
+	int shards() const { return static_cast<int>(m_shards.size()); }
+	int shardOf(const std::string& key) const;
+	kv_type* shard(int shard_) { assert((shard_ >= 0) && (shard_ < shards())); return m_shards[shard_]; }
+	kv_type* shard(const std::string& key) { return shard(shardOf(key)); }
+
+	bool isOpen() const;
+	bool open();
+	bool close();
+	bool flush();
+
+	bool has(const std::string& key) { return shard(key)->has(key); }
+	bool find(const std::string& key, Search& result) { return shard(key)->find(key, result); }
+	Search find(const std::string& key) { Search result; find(key, result); return result; }
+	bool get(const std::string& key, std::string& value) { return shard(key)->get(key, value); }
+	std::string get(const std::string& key) { return shard(key)->get(key); }
+	bool put(const std::string& key, const std::string& value, bool overwrite = true) { return shard(key)->put(key, value, overwrite); }
+
+	/*
+	 * an existing 'new_key' is never replaced. Across shards the value is
+	 * copied, then the old key removed: not atomic, a crash in between
+	 * leaves both keys, and readers can see both meanwhile.
+	 */
+	bool rename(const std::string& old_key, const std::string& new_key);
+	bool remove(const std::string& key) { return shard(key)->remove(key); }
+
+	/* partitions the pairs and bulk-loads the shards in parallel */
+	bool bulk_put(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor = 1.0);
+
+	/* splits the batch by shard: each part is applied atomically, the whole batch is not */
+	bool apply(const WriteBatch& batch);
+
+	/* -- Free space ----------------------------------------------- */
+
+	size_t freeFragments() const;
+	size_t freeFragmentBytes() const;
+
+	/* -- Compaction ----------------------------------------------- */
+
+	/* compacts the shards one after the other, the time slice is shared */
+	bool compact(CompactReport& report, int time_slice_ms = 0);
+	CompactReport compact(int time_slice_ms = 0) { CompactReport report; compact(report, time_slice_ms); return report; }
+	bool compacting() const;
+
+	/* -- Memory budget -------------------------------------------- */
+
+	/* the budget is split evenly among the shards */
+	size_t memoryBudget() const { return m_memory_budget; }
+	void memoryBudget(size_t bytes);
+	size_t memoryFootprint();
+
+	/* -- Iteration ------------------------------------------------ */
+
+	iterator begin() { return iterator(this); }
+	iterator end() { return iterator(this, /* forward */ true, /* end */ true); }
+
+	iterator rbegin() { return iterator(this, /* forward */ false); }
+	iterator rend() { return iterator(this, /* forward */ false, /* end */ true); }
+
+	/*
+	 * k-way merge of the shard iterators: each step yields the smallest
+	 * (largest, going backward) of the shards' current keys. Keys are
+	 * unique across the shards, so there are no ties.
+	 */
+	class iterator
+	{
+	public:
+		typedef ShardedKeyValueStore kv_type;
+		typedef iterator self_type;
+		typedef XTYPENAME KeyValueStore::iterator shard_iterator_type;
+		typedef std::string value_type;
+		typedef const value_type& const_reference;
+		typedef const value_type* const_pointer;
+		typedef std::forward_iterator_tag iterator_category;
+		typedef int difference_type;
+
+		iterator(kv_type* kv, bool forward_ = true, bool end_ = false);
+		iterator(const iterator& other) : m_kv(other.m_kv), m_its(other.m_its), m_current(other.m_current), m_forward(other.m_forward) {}
+		iterator& operator= (const iterator& other) { m_kv = other.m_kv; m_its = other.m_its; m_current = other.m_current; m_forward = other.m_forward; return *this; }
+
+		self_type& operator++() { next(); return *this; }
+		self_type& operator++(int junk) { next(); return *this; }
+		const_reference operator*() const { return key(); }
+		const_pointer operator->() const { return &key(); }
+		bool operator== (const self_type& rhs) const {
+			return (m_kv == rhs.m_kv) &&
+					((end() && rhs.end()) ||
+					 ((m_forward == rhs.m_forward) && (m_current == rhs.m_current) && (m_its[m_current] == rhs.m_its[rhs.m_current]))); }
+		bool operator!= (const self_type& rhs) const { return (! (*this == rhs)); }
+
+		operator bool() const { return (! end()); }
+
+		bool next();
+
+		kv_type* kv() const { return m_kv; }
+		const_reference key() const { static const std::string s_empty; return end() ? s_empty : *m_its[m_current]; }
+		int shard() const { return m_current; }
+		bool forward() const { return m_forward; }
+		bool backward() const { return (! m_forward); }
+		bool end() const { return (m_current < 0); }
+
+	protected:
+		void settle();
+
+		kv_type* m_kv;
+		mutable std::vector<shard_iterator_type> m_its;
+		int m_current;
+		bool m_forward;
+	};
+
+	friend class iterator;
+
+protected:
+	/* runs 'method' on every shard, each in its own thread */
+	bool parallel(bool (kv_type::*method)());
+
+private:
+	ShardedKeyValueStore();
+	ShardedKeyValueStore(const ShardedKeyValueStore& other);
+	ShardedKeyValueStore& operator= (const ShardedKeyValueStore& other);
+
+	std::vector<kv_type*> m_shards;
+	std::vector<block_storage_type*> m_blockstorages;	/* owned, a KeyValueStore doesn't delete its storage */
+	size_t m_memory_budget;
+
+	/* shards before this one already completed the current compaction pass */
+	int m_compact_next;
+};
+
+inline std::ostream& operator<< ( std::ostream& out, const ShardedKeyValueStore::iterator& value )
+{
+	out << "<ShardedKeyValueStore::iterator " << (value.forward() ? "forward" : "backward") << " " << (value.end() ? "END " : "") << "shard:" << value.shard() << " key:'" << value.key() << "'>";
+	return out;
+}
+
+} /* end of namespace milliways */
+
+#include "ShardedKeyValueStore.impl.hpp"
+
+#endif /* MILLIWAYS_SHARDEDKEYVALUESTORE_H */
@@ -0,0 +1,379 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_SHARDEDKEYVALUESTORE_H
+#include "ShardedKeyValueStore.h"
+#endif
+
+#ifndef MILLIWAYS_SHARDEDKEYVALUESTORE_IMPL_H
+//#define MILLIWAYS_SHARDEDKEYVALUESTORE_IMPL_H
+
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   ShardedKeyValueStore                                            *
+ * ----------------------------------------------------------------- */
+
+inline ShardedKeyValueStore::ShardedKeyValueStore(const std::string& basename, int n_shards, size_t cache_blocks) :
+		m_memory_budget(0), m_compact_next(0)
+{
+	assert((n_shards > 0) && (n_shards <= MAX_SHARDS));
+
+	m_shards.reserve(n_shards);
+	m_blockstorages.reserve(n_shards);
+	for (int i = 0; i < n_shards; i++)
+	{
+		m_blockstorages.push_back(new block_storage_type(shardPathname(basename, i), cache_blocks));
+		m_shards.push_back(new kv_type(m_blockstorages.back()));
+	}
+}
+
+inline ShardedKeyValueStore::~ShardedKeyValueStore()
+{
+	close();
+
+	/* the shards close their storage: deleted after them */
+	for (size_t i = 0; i < m_shards.size(); i++)
+	{
+		delete m_shards[i];
+		m_shards[i] = NULL;
+	}
+	m_shards.clear();
+
+	for (size_t i = 0; i < m_blockstorages.size(); i++)
+	{
+		delete m_blockstorages[i];
+		m_blockstorages[i] = NULL;
+	}
+	m_blockstorages.clear();
+}
+
+inline std::string ShardedKeyValueStore::shardPathname(const std::string& basename, int shard_)
+{
+	std::ostringstream ss;
+	ss << basename << "." << std::setfill('0') << std::setw(3) << shard_;
+	return ss.str();
+}
+
+/* FNV-1a: the placement is persistent, so the hash must not change across platforms or builds */
+inline int ShardedKeyValueStore::shardOf(const std::string& key) const
+{
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < key.length(); i++)
+	{
+		hash ^= static_cast<uint32_t>(static_cast<unsigned char>(key[i]));
+		hash *= 16777619U;
+	}
+	return static_cast<int>(hash % static_cast<uint32_t>(m_shards.size()));
+}
+
+inline bool ShardedKeyValueStore::isOpen() const
+{
+	for (size_t i = 0; i < m_shards.size(); i++)
+		if (! m_shards[i]->isOpen())
+			return false;
+	return (! m_shards.empty());
+}
+
+inline bool ShardedKeyValueStore::open()
+{
+	if (! parallel(&kv_type::open))
+	{
+		/* all or none: the shards that did open are closed again */
+		parallel(&kv_type::close);
+		return false;
+	}
+	if (m_memory_budget > 0)
+		memoryBudget(m_memory_budget);
+	return true;
+}
+
+inline bool ShardedKeyValueStore::close()
+{
+	m_compact_next = 0;
+	return parallel(&kv_type::close);
+}
+
+inline bool ShardedKeyValueStore::flush()
+{
+	return parallel(&kv_type::flush);
+}
+
+inline bool ShardedKeyValueStore::parallel(bool (kv_type::*method)())
+{
+	int n_shards = shards();
+	if (n_shards == 1)
+		return (m_shards[0]->*method)();
+
+	struct L {
+		static void run(kv_type* kv, bool (kv_type::*method_)(), char* result)
+		{
+			*result = (kv->*method_)() ? 1 : 0;
+		}
+	};
+
+	std::vector<char> results(n_shards, 0);
+	std::vector<std::thread> threads;
+	threads.reserve(n_shards);
+	for (int i = 0; i < n_shards; i++)
+		threads.push_back(std::thread(&L::run, m_shards[i], method, &results[i]));
+
+	bool ok = true;
+	for (int i = 0; i < n_shards; i++)
+	{
+		threads[i].join();
+		if (! results[i])
+			ok = false;
+	}
+	return ok;
+}
+
+inline bool ShardedKeyValueStore::rename(const std::string& old_key, const std::string& new_key)
+{
+	kv_type* src = shard(old_key);
+	kv_type* dst = shard(new_key);
+	if (src == dst)
+		return src->rename(old_key, new_key);
+
+	/* across shards the value moves: copy it, then drop the old key */
+	if ((old_key.length() > kv_type::KEY_MAX_SIZE) || (new_key.length() > kv_type::KEY_MAX_SIZE))
+		return false;
+
+	std::string value;
+	if (! src->get(old_key, value))
+		return false;
+	if (! dst->put(new_key, value, /* overwrite */ false))
+		return false;
+	if (! src->remove(old_key))
+	{
+		dst->remove(new_key);
+		return false;
+	}
+	return true;
+}
+
+inline bool ShardedKeyValueStore::bulk_put(const std::vector< std::pair<std::string, std::string> >& items, double fill_factor)
+{
+	typedef std::vector< std::pair<std::string, std::string> > items_type;
+
+	int n_shards = shards();
+	std::vector<items_type> parts(n_shards);
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (items[i].first.length() > kv_type::KEY_MAX_SIZE)
+			return false;
+		parts[shardOf(items[i].first)].push_back(items[i]);
+	}
+
+	struct L {
+		static void run(kv_type* kv, const items_type* part, double fill_factor_, char* result)
+		{
+			*result = kv->bulk_put(*part, fill_factor_) ? 1 : 0;
+		}
+	};
+
+	std::vector<char> results(n_shards, 0);
+	std::vector<std::thread> threads;
+	threads.reserve(n_shards);
+	for (int i = 0; i < n_shards; i++)
+		threads.push_back(std::thread(&L::run, m_shards[i], &parts[i], fill_factor, &results[i]));
+
+	bool ok = true;
+	for (int i = 0; i < n_shards; i++)
+	{
+		threads[i].join();
+		if (! results[i])
+			ok = false;
+	}
+	return ok;
+}
+
+inline bool ShardedKeyValueStore::apply(const WriteBatch& batch)
+{
+	int n_shards = shards();
+	std::vector<WriteBatch> parts(n_shards);
+	WriteBatch::ops_type::const_iterator it;
+	for (it = batch.ops().begin(); it != batch.ops().end(); ++it)
+	{
+		if (it->key.length() > kv_type::KEY_MAX_SIZE)
+			return false;
+		WriteBatch& part = parts[shardOf(it->key)];
+		if (it->type == WriteBatch::OP_PUT)
+			part.put(it->key, it->value);
+		else
+			part.remove(it->key);
+	}
+
+	bool ok = true;
+	for (int i = 0; i < n_shards; i++)
+	{
+		if ((! parts[i].empty()) && (! m_shards[i]->apply(parts[i])))
+			ok = false;
+	}
+	return ok;
+}
+
+/* -- Free space ----------------------------------------------- */
+
+inline size_t ShardedKeyValueStore::freeFragments() const
+{
+	size_t count = 0;
+	for (size_t i = 0; i < m_shards.size(); i++)
+		count += m_shards[i]->freeFragments();
+	return count;
+}
+
+inline size_t ShardedKeyValueStore::freeFragmentBytes() const
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < m_shards.size(); i++)
+		bytes += m_shards[i]->freeFragmentBytes();
+	return bytes;
+}
+
+/* -- Compaction ----------------------------------------------- */
+
+inline bool ShardedKeyValueStore::compact(CompactReport& report, int time_slice_ms)
+{
+	typedef std::chrono::steady_clock clock_type;
+
+	report = CompactReport();
+	if (! isOpen())
+		return false;
+
+	clock_type::time_point start = clock_type::now();
+	clock_type::time_point deadline = start + std::chrono::milliseconds(time_slice_ms);
+
+	bool ok = true;
+	while (m_compact_next < shards())
+	{
+		int slice = 0;
+		if (time_slice_ms > 0)
+		{
+			slice = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now()).count());
+			if (slice <= 0)
+				break;
+		}
+
+		CompactReport shard_report;
+		if (! m_shards[m_compact_next]->compact(shard_report, slice))
+			ok = false;
+		report.values_moved += shard_report.values_moved;
+		report.nodes_moved += shard_report.nodes_moved;
+		report.bytes_moved += shard_report.bytes_moved;
+		report.reclaimed_bytes += shard_report.reclaimed_bytes;
+
+		if (! ok)
+			break;
+		if (! shard_report.done)
+			break;
+		m_compact_next++;
+	}
+
+	if ((! ok) || (m_compact_next >= shards()))
+	{
+		report.done = ok;
+		m_compact_next = 0;
+	}
+	report.elapsed_ms = std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+	return ok;
+}
+
+inline bool ShardedKeyValueStore::compacting() const
+{
+	if (m_compact_next > 0)
+		return true;
+	for (size_t i = 0; i < m_shards.size(); i++)
+		if (m_shards[i]->compacting())
+			return true;
+	return false;
+}
+
+/* -- Memory budget -------------------------------------------- */
+
+inline void ShardedKeyValueStore::memoryBudget(size_t bytes)
+{
+	m_memory_budget = bytes;
+	size_t shard_budget = bytes / m_shards.size();
+	if ((bytes > 0) && (shard_budget == 0))
+		shard_budget = 1;
+	for (size_t i = 0; i < m_shards.size(); i++)
+		m_shards[i]->memoryBudget(shard_budget);
+}
+
+inline size_t ShardedKeyValueStore::memoryFootprint()
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < m_shards.size(); i++)
+		bytes += m_shards[i]->memoryFootprint();
+	return bytes;
+}
+
+/* -- Iteration ------------------------------------------------ */
+
+inline ShardedKeyValueStore::iterator::iterator(kv_type* kv, bool forward_, bool end_) :
+		m_kv(kv), m_current(-1), m_forward(forward_)
+{
+	if (end_)
+		return;
+
+	m_its.reserve(m_kv->shards());
+	for (int i = 0; i < m_kv->shards(); i++)
+		m_its.push_back(m_forward ? m_kv->shard(i)->begin() : m_kv->shard(i)->rbegin());
+	settle();
+}
+
+inline bool ShardedKeyValueStore::iterator::next()
+{
+	if (end())
+		return false;             /* stop iteration */
+
+	++m_its[m_current];
+	settle();
+	return (! end());
+}
+
+/* position on the shard holding the next key in order */
+inline void ShardedKeyValueStore::iterator::settle()
+{
+	m_current = -1;
+	for (int i = 0; i < static_cast<int>(m_its.size()); i++)
+	{
+		if (m_its[i].end())
+			continue;
+		if (m_current < 0)
+		{
+			m_current = i;
+			continue;
+		}
+		int cmp = (*m_its[i]).compare(*m_its[m_current]);
+		if (m_forward ? (cmp < 0) : (cmp > 0))
+			m_current = i;
+	}
+}
+
+} /* end of namespace milliways */
+
+#endif /* MILLIWAYS_SHARDEDKEYVALUESTORE_IMPL_H */
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <stdint.h>
 #include <assert.h>
 
 #include "config.h"
@@ -76,6 +77,10 @@ while( 0 )
 
 #endif
 
+#ifndef UNUSED
+#define UNUSED(expr) do { (void)(expr); } while (0)
+#endif
+
 
 namespace milliways {
 
@@ -86,6 +91,9 @@ std::string s_hexdump(const void* ptr, int buflen);
 std::string hexify(const std::string& input);
 std::string dehexify(const std::string& input);
 
+/* CRC-32 (IEEE 802.3), 'crc' continues a previous run */
+uint32_t crc32(const void* ptr, size_t size, uint32_t crc = 0);
+
 /* ----------------------------------------------------------------- *
  *   shptr<T>                                                        *
  * ----------------------------------------------------------------- */
@@ -175,6 +175,31 @@ inline std::string dehexify(const std::string& input)
 	return output;
 }
 
+inline uint32_t crc32(const void* ptr, size_t size, uint32_t crc)
+{
+	struct Table {
+		uint32_t entries[256];
+
+		Table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+				entries[i] = c;
+			}
+		}
+	};
+	static const Table table;
+
+	const unsigned char *buf = (const unsigned char*) ptr;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table.entries[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
 /* ----------------------------------------------------------------- *
  *   shptr<T>                                                        *
  * ----------------------------------------------------------------- */
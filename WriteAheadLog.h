@@ -0,0 +1,170 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_WRITEAHEADLOG_H
+#define MILLIWAYS_WRITEAHEADLOG_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "Utils.h"
+#include "Seriously.h"
+#include "BlockStorage.h"
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   WriteAheadLog                                                   *
+ * ----------------------------------------------------------------- */
+
+/*
+ * append-only log of logical records (put, remove, rename, batch), each one
+ * framed as:
+ *
+ *   uint32 payload size | uint32 CRC-32 of the payload | payload
+ *   payload: uint8 type | string first | string second
+ *
+ * Replay stops at the first truncated or corrupted record (the torn tail
+ * of a crash) and cuts the file there.
+ *
+ * Records are positioned by a log sequence number (LSN), the number of
+ * bytes appended since the log was created: append() returns the LSN of
+ * the end of the record, commit() makes it durable according to the sync
+ * policy. Commits are grouped: the first committer waiting syncs
+ * everything appended so far, the others wait for that sync instead of
+ * issuing their own, so a single fsync covers all the writers that
+ * arrived meanwhile. With SYNC_PERIODIC a background thread, running
+ * while the log is open, also syncs the records left behind by writers
+ * that stopped committing, at most an interval after they were appended.
+ * reset() empties the log, once its records are durable elsewhere (a
+ * checkpoint). rollback() drops the last records, those of an operation
+ * that failed once logged.
+ */
+class WriteAheadLog
+{
+public:
+	typedef DefaultFileIO file_io_type;
+	typedef std::chrono::steady_clock clock_type;
+
+	enum SyncPolicy
+	{
+		SYNC_ALWAYS = 0,	/* commit() returns when the record is on disk */
+		SYNC_PERIODIC,		/* sync when the interval elapsed since the last one, in the background if idle */
+		SYNC_NEVER			/* only at checkpoints, records can be lost on a crash */
+	};
+
+	enum RecordType
+	{
+		RECORD_PUT = 1,		/* key, value */
+		RECORD_REMOVE = 2,	/* key */
+		RECORD_RENAME = 3,	/* old key, new key */
+		RECORD_BATCH = 4	/* serialized WriteBatch */
+	};
+
+	struct Record
+	{
+		Record() : type(RECORD_PUT) {}
+		Record(RecordType type_, const std::string& first_, const std::string& second_) :
+			type(type_), first(first_), second(second_) {}
+
+		RecordType type;
+		std::string first;
+		std::string second;
+	};
+
+	static const size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+	WriteAheadLog(const std::string& pathname, SyncPolicy policy = SYNC_ALWAYS, int interval_ms = 0);
+	~WriteAheadLog();
+
+	const std::string& pathname() const { return m_pathname; }
+
+	bool isOpen() const { return m_io.isOpen(); }
+	bool open();
+	bool close();
+
+	/* -- Sync policy ---------------------------------------------- */
+
+	SyncPolicy syncPolicy() const { return m_policy; }
+	int syncInterval() const { return m_interval_ms; }
+	void syncPolicy(SyncPolicy policy, int interval_ms = 0) { std::lock_guard<std::mutex> lock(m_mutex); m_policy = policy; m_interval_ms = interval_ms; m_wakeup.notify_all(); }
+
+	/* -- Logging -------------------------------------------------- */
+
+	bool append(RecordType type, const std::string& first, const std::string& second, uint64_t& lsn);
+	bool commit(uint64_t lsn);
+	bool sync() { return commit_helper(appendedLsn()); }
+	bool reset();
+	bool rollback(uint64_t lsn);	/* back to an appendedLsn() value, records after it are dropped */
+
+	/* reads back the valid records, dropping a torn tail */
+	bool read(std::vector<Record>& records);
+
+	/* -- Statistics ----------------------------------------------- */
+
+	uint64_t appendedLsn() const { std::lock_guard<std::mutex> lock(m_mutex); return m_appended_lsn; }
+	uint64_t syncedLsn() const { std::lock_guard<std::mutex> lock(m_mutex); return m_synced_lsn; }
+	size_t records() const { std::lock_guard<std::mutex> lock(m_mutex); return m_n_records; }		/* appended, rolled back ones included */
+	size_t syncs() const { std::lock_guard<std::mutex> lock(m_mutex); return m_n_syncs; }
+
+protected:
+	bool commit_helper(uint64_t lsn);
+	void syncer();
+
+private:
+	WriteAheadLog();
+	WriteAheadLog(const WriteAheadLog& other);
+	WriteAheadLog& operator= (const WriteAheadLog& other);
+
+	std::string m_pathname;
+	file_io_type m_io;
+
+	SyncPolicy m_policy;
+	int m_interval_ms;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_synced;
+	bool m_syncing;					/* a committer is syncing, the others wait */
+	uint64_t m_base_lsn;			/* LSN of the start of the file */
+	uint64_t m_appended_lsn;
+	uint64_t m_synced_lsn;
+	clock_type::time_point m_last_sync;
+
+	std::thread m_syncer;			/* periodic syncs, while open */
+	std::condition_variable m_wakeup;
+	bool m_stopping;
+
+	size_t m_n_records;
+	size_t m_n_syncs;
+};
+
+} /* end of namespace milliways */
+
+#include "WriteAheadLog.impl.hpp"
+
+#endif /* MILLIWAYS_WRITEAHEADLOG_H */
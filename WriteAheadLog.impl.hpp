@@ -0,0 +1,298 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_WRITEAHEADLOG_H
+#include "WriteAheadLog.h"
+#endif
+
+#ifndef MILLIWAYS_WRITEAHEADLOG_IMPL_H
+//#define MILLIWAYS_WRITEAHEADLOG_IMPL_H
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   WriteAheadLog                                                   *
+ * ----------------------------------------------------------------- */
+
+inline WriteAheadLog::WriteAheadLog(const std::string& pathname, SyncPolicy policy, int interval_ms) :
+	m_pathname(pathname), m_policy(policy), m_interval_ms(interval_ms),
+	m_syncing(false), m_base_lsn(0), m_appended_lsn(0), m_synced_lsn(0), m_last_sync(clock_type::now()),
+	m_stopping(false), m_n_records(0), m_n_syncs(0)
+{
+}
+
+inline WriteAheadLog::~WriteAheadLog()
+{
+	close();
+}
+
+inline bool WriteAheadLog::open()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (isOpen())
+		return true;
+
+	bool created = false;
+	if (! m_io.open(m_pathname, /* block_size */ 1, created))
+		return false;
+
+	ssize_t size = m_io.size();
+	if (size < 0)
+	{
+		m_io.close();
+		return false;
+	}
+
+	/* what is already in the file is taken as durable */
+	m_base_lsn = 0;
+	m_appended_lsn = static_cast<uint64_t>(size);
+	m_synced_lsn = m_appended_lsn;
+	m_last_sync = clock_type::now();
+	m_stopping = false;
+	m_syncer = std::thread(&WriteAheadLog::syncer, this);
+	return true;
+}
+
+inline bool WriteAheadLog::close()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_syncing)
+			m_synced.wait(lock);
+		if (! isOpen())
+			return true;
+		m_stopping = true;
+		m_wakeup.notify_all();
+	}
+	if (m_syncer.joinable())
+		m_syncer.join();
+
+	bool ok = commit_helper(appendedLsn());
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_io.close();
+	return ok;
+}
+
+/* -- Logging -------------------------------------------------- */
+
+inline bool WriteAheadLog::append(RecordType type, const std::string& first, const std::string& second, uint64_t& lsn)
+{
+	size_t payload_size = sizeof(uint8_t) +
+			seriously::Traits<std::string>::serializedsize(first) +
+			seriously::Traits<std::string>::serializedsize(second);
+	std::string buffer(RECORD_HEADER_SIZE + payload_size, '\0');
+
+	char* dstp = &buffer[RECORD_HEADER_SIZE];
+	size_t avail = payload_size;
+	seriously::Traits<uint8_t>::serialize(dstp, avail, static_cast<uint8_t>(type));
+	seriously::Traits<std::string>::serialize(dstp, avail, first);
+	seriously::Traits<std::string>::serialize(dstp, avail, second);
+	assert(avail == 0);
+
+	uint32_t crc = crc32(buffer.data() + RECORD_HEADER_SIZE, payload_size);
+	dstp = &buffer[0];
+	avail = RECORD_HEADER_SIZE;
+	seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(payload_size));
+	seriously::Traits<uint32_t>::serialize(dstp, avail, crc);
+	assert(avail == 0);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (! isOpen())
+		return false;
+	if (! m_io.write(buffer.data(), buffer.size(), m_appended_lsn - m_base_lsn))
+		return false;
+	m_appended_lsn += buffer.size();
+	m_n_records++;
+	lsn = m_appended_lsn;
+	return true;
+}
+
+inline bool WriteAheadLog::commit(uint64_t lsn)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_synced_lsn >= lsn)
+			return true;
+		if (m_policy == SYNC_NEVER)
+			return true;
+		if ((m_policy == SYNC_PERIODIC) && ((clock_type::now() - m_last_sync) < std::chrono::milliseconds(m_interval_ms)))
+			return true;
+	}
+	return commit_helper(lsn);
+}
+
+/* group commit: one sync covers everything appended before it started */
+inline bool WriteAheadLog::commit_helper(uint64_t lsn)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_synced_lsn < lsn)
+	{
+		if (m_syncing)
+		{
+			m_synced.wait(lock);
+			continue;
+		}
+
+		m_syncing = true;
+		uint64_t target = m_appended_lsn;
+		lock.unlock();
+		bool ok = m_io.sync();
+		lock.lock();
+		m_syncing = false;
+		if (ok)
+		{
+			if (target > m_synced_lsn)
+				m_synced_lsn = target;
+			m_last_sync = clock_type::now();
+			m_n_syncs++;
+		}
+		m_synced.notify_all();
+		if (! ok)
+			return false;
+	}
+	return true;
+}
+
+/* the periodic policy doesn't depend on commits: records left unsynced are synced an interval later */
+inline void WriteAheadLog::syncer()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (! m_stopping)
+	{
+		if ((m_policy != SYNC_PERIODIC) || (m_interval_ms <= 0))
+		{
+			m_wakeup.wait(lock);
+			continue;
+		}
+
+		clock_type::duration interval = std::chrono::milliseconds(m_interval_ms);
+		clock_type::time_point due = m_last_sync + interval;
+		if ((m_synced_lsn >= m_appended_lsn) || (clock_type::now() < due))
+		{
+			m_wakeup.wait_until(lock, (m_synced_lsn >= m_appended_lsn) ? (clock_type::now() + interval) : due);
+			continue;
+		}
+
+		uint64_t target = m_appended_lsn;
+		lock.unlock();
+		commit_helper(target);
+		lock.lock();
+	}
+}
+
+inline bool WriteAheadLog::reset()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_syncing)
+		m_synced.wait(lock);
+	if (! isOpen())
+		return false;
+
+	bool ok = m_io.truncate(0);
+	if (! m_io.sync())
+		ok = false;
+	m_base_lsn = m_appended_lsn;
+	m_synced_lsn = m_appended_lsn;
+	m_last_sync = clock_type::now();
+	m_synced.notify_all();
+	return ok;
+}
+
+/* the records were appended after 'lsn' by the store lock holder: nobody waits for them */
+inline bool WriteAheadLog::rollback(uint64_t lsn)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_syncing)
+		m_synced.wait(lock);
+	if ((! isOpen()) || (lsn < m_base_lsn) || (lsn > m_appended_lsn))
+		return false;
+	if (lsn == m_appended_lsn)
+		return true;
+
+	/* synced records are on disk: they have to be gone from it too */
+	bool ok = m_io.truncate(lsn - m_base_lsn);
+	if (m_synced_lsn > lsn)
+	{
+		if (! m_io.sync())
+			ok = false;
+		m_synced_lsn = lsn;
+	}
+	m_appended_lsn = lsn;
+	return ok;
+}
+
+inline bool WriteAheadLog::read(std::vector<Record>& records)
+{
+	records.clear();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (! isOpen())
+		return false;
+
+	ssize_t size = m_io.size();
+	if (size < 0)
+		return false;
+	std::string data(static_cast<size_t>(size), '\0');
+	if ((size > 0) && (! m_io.read(&data[0], data.size(), 0)))
+		return false;
+
+	size_t offset = 0;
+	while ((offset + RECORD_HEADER_SIZE) <= data.size())
+	{
+		const char* srcp = data.data() + offset;
+		size_t avail = RECORD_HEADER_SIZE;
+		uint32_t payload_size = 0, crc = 0;
+		seriously::Traits<uint32_t>::deserialize(srcp, avail, payload_size);
+		seriously::Traits<uint32_t>::deserialize(srcp, avail, crc);
+		if (payload_size > (data.size() - offset - RECORD_HEADER_SIZE))
+			break;
+		if (crc32(srcp, payload_size) != crc)
+			break;
+
+		avail = payload_size;
+		uint8_t type = 0;
+		Record record;
+		if ((seriously::Traits<uint8_t>::deserialize(srcp, avail, type) < 0) ||
+			(seriously::Traits<std::string>::deserialize(srcp, avail, record.first) < 0) ||
+			(seriously::Traits<std::string>::deserialize(srcp, avail, record.second) < 0))
+			break;
+		if ((type < RECORD_PUT) || (type > RECORD_BATCH))
+			break;
+		record.type = static_cast<RecordType>(type);
+		records.push_back(record);
+
+		offset += RECORD_HEADER_SIZE + payload_size;
+	}
+
+	bool ok = true;
+	if (offset < data.size())
+	{
+		// std::cerr << "WAL::read() dropping torn tail at " << offset << " of " << data.size() << std::endl;
+		ok = m_io.truncate(offset) && m_io.sync();
+	}
+	m_appended_lsn = m_base_lsn + offset;
+	m_synced_lsn = m_appended_lsn;
+	return ok;
+}
+
+} /* end of namespace milliways */
+
+#endif /* MILLIWAYS_WRITEAHEADLOG_IMPL_H */
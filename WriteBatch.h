@@ -0,0 +1,95 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_WRITEBATCH_H
+#define MILLIWAYS_WRITEBATCH_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "Utils.h"
+#include "Seriously.h"
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   WriteBatch                                                      *
+ * ----------------------------------------------------------------- */
+
+/*
+ * a set of puts and removes to be applied together by
+ * KeyValueStore::apply(). When the same key appears more than once the
+ * last operation wins.
+ */
+class WriteBatch
+{
+public:
+	enum OpType
+	{
+		OP_PUT = 1,
+		OP_REMOVE = 2
+	};
+
+	struct Op
+	{
+		Op() : type(OP_PUT) {}
+		Op(OpType type_, const std::string& key_, const std::string& value_) :
+			type(type_), key(key_), value(value_) {}
+
+		OpType type;
+		std::string key;
+		std::string value;
+	};
+
+	typedef std::vector<Op> ops_type;
+
+	WriteBatch() {}
+
+	WriteBatch& put(const std::string& key, const std::string& value) { m_ops.push_back(Op(OP_PUT, key, value)); return *this; }
+	WriteBatch& remove(const std::string& key) { m_ops.push_back(Op(OP_REMOVE, key, std::string())); return *this; }
+	void clear() { m_ops.clear(); }
+
+	size_t size() const { return m_ops.size(); }
+	bool empty() const { return m_ops.empty(); }
+	const ops_type& ops() const { return m_ops; }
+
+	/* [ n-ops | (type, key, value) ... ] */
+	std::string serialize() const;
+	bool deserialize(const std::string& data);
+
+private:
+	ops_type m_ops;
+};
+
+inline std::ostream& operator<< (std::ostream& out, const WriteBatch& value)
+{
+	out << "<WriteBatch ops:" << value.size() << ">";
+	return out;
+}
+
+} /* end of namespace milliways */
+
+#include "WriteBatch.impl.hpp"
+
+#endif /* MILLIWAYS_WRITEBATCH_H */
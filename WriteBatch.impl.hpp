@@ -0,0 +1,93 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#ifndef MILLIWAYS_WRITEBATCH_H
+#include "WriteBatch.h"
+#endif
+
+#ifndef MILLIWAYS_WRITEBATCH_IMPL_H
+//#define MILLIWAYS_WRITEBATCH_IMPL_H
+
+namespace milliways {
+
+/* ----------------------------------------------------------------- *
+ *   WriteBatch                                                      *
+ * ----------------------------------------------------------------- */
+
+inline std::string WriteBatch::serialize() const
+{
+	size_t size = sizeof(uint32_t);
+	ops_type::const_iterator it;
+	for (it = m_ops.begin(); it != m_ops.end(); ++it)
+		size += sizeof(uint8_t) + seriously::Traits<std::string>::serializedsize(it->key) +
+				seriously::Traits<std::string>::serializedsize(it->value);
+
+	std::string data(size, '\0');
+	char* dstp = &data[0];
+	size_t avail = data.size();
+
+	seriously::Traits<uint32_t>::serialize(dstp, avail, static_cast<uint32_t>(m_ops.size()));
+	for (it = m_ops.begin(); it != m_ops.end(); ++it)
+	{
+		seriously::Traits<uint8_t>::serialize(dstp, avail, static_cast<uint8_t>(it->type));
+		seriously::Traits<std::string>::serialize(dstp, avail, it->key);
+		seriously::Traits<std::string>::serialize(dstp, avail, it->value);
+	}
+	assert(avail == 0);
+
+	return data;
+}
+
+inline bool WriteBatch::deserialize(const std::string& data)
+{
+	m_ops.clear();
+
+	const char* srcp = data.data();
+	size_t avail = data.size();
+
+	uint32_t n_ops = 0;
+	if (seriously::Traits<uint32_t>::deserialize(srcp, avail, n_ops) < 0)
+		return false;
+
+	for (uint32_t i = 0; i < n_ops; i++)
+	{
+		uint8_t type = 0;
+		Op op;
+		if ((seriously::Traits<uint8_t>::deserialize(srcp, avail, type) < 0) ||
+			(seriously::Traits<std::string>::deserialize(srcp, avail, op.key) < 0) ||
+			(seriously::Traits<std::string>::deserialize(srcp, avail, op.value) < 0))
+		{
+			m_ops.clear();
+			return false;
+		}
+		if ((type != OP_PUT) && (type != OP_REMOVE))
+		{
+			m_ops.clear();
+			return false;
+		}
+		op.type = static_cast<OpType>(type);
+		m_ops.push_back(op);
+	}
+	return (avail == 0);
+}
+
+} /* end of namespace milliways */
+
+#endif /* MILLIWAYS_WRITEBATCH_IMPL_H */
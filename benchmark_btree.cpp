@@ -0,0 +1,178 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#include <iostream>
+#include <vector>
+#include <thread>
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef _MSC_VER
+#include <sys/time.h>
+#else
+#include <Windows.h>
+
+/* FILETIME of Jan 1 1970 00:00:00. */
+static const unsigned __int64 epoch = ((unsigned __int64) 116444736000000000ULL);
+
+/*
+ * timezone information is stored outside the kernel so tzp isn't used anymore.
+ *
+ * Note: this function is not for Win32 high precision timing purpose. See
+ * elapsed_time().
+ */
+int
+gettimeofday(struct timeval * tp, struct timezone * tzp)
+{
+    FILETIME    file_time;
+    SYSTEMTIME  system_time;
+    ULARGE_INTEGER ularge;
+
+    GetSystemTime(&system_time);
+    SystemTimeToFileTime(&system_time, &file_time);
+    ularge.LowPart = file_time.dwLowDateTime;
+    ularge.HighPart = file_time.dwHighDateTime;
+
+    tp->tv_sec = (long) ((ularge.QuadPart - epoch) / 10000000L);
+    tp->tv_usec = (long) (system_time.wMilliseconds * 1000);
+
+    return 0;
+}
+#endif
+
+#include "Seriously.h"
+#include "BTreeNode.h"
+#include "BTree.h"
+
+/* ----------------------------------------------------------------- *
+ *   PROTOTYPES                                                      *
+ * ----------------------------------------------------------------- */
+
+static inline void chrono_start();
+static inline double chrono_stop();
+
+static void benchmark_1();
+
+int main(int argc, char* argv[]);
+
+
+/* ----------------------------------------------------------------- *
+ *   UTILITY FUNCTIONS                                               *
+ * ----------------------------------------------------------------- */
+
+static struct timeval chrono_tm_start, chrono_tm_end;
+
+static inline void chrono_start()
+{
+    gettimeofday(&chrono_tm_start, NULL);
+}
+
+static inline double chrono_stop()
+{
+    gettimeofday(&chrono_tm_end, NULL);
+
+    double ms = static_cast<double>(
+    	((static_cast<int64_t>(1000LL) * static_cast<int64_t>(chrono_tm_end.tv_sec - chrono_tm_start.tv_sec)) +
+    	 (static_cast<int64_t>(chrono_tm_end.tv_usec - chrono_tm_start.tv_usec) / static_cast<int64_t>(1000LL)))
+    	);
+    chrono_tm_start = chrono_tm_end;
+    return ms;
+}
+
+
+/* ----------------------------------------------------------------- *
+ *   BENCHMARKS                                                      *
+ * ----------------------------------------------------------------- */
+
+/*
+ * Optimistic lock coupling on an in-memory tree: each thread puts its
+ * own interleaved slice of the keys (so writers keep meeting in the
+ * same leaves), then all threads look up every key. Only the memory
+ * storage allows concurrent node I/O, file-backed trees aren't measured.
+ */
+static const int OLC_KEYS = 1000000;
+static const int OLC_MAX_THREADS = 32;
+
+static void benchmark_1()
+{
+	typedef milliways::BTree<64, seriously::Traits<int32_t>, seriously::Traits<int32_t> > btree_t;		/* BTreeMemoryStorage */
+
+	struct L
+	{
+		static void put(btree_t* tree, int start, int stride)
+		{
+			for (int i = start; i < OLC_KEYS; i += stride)
+			{
+				bool ok = tree->concurrent_put(i, i);
+				assert(ok);
+				(void) ok;
+			}
+		}
+
+		static void find(btree_t* tree, int start)
+		{
+			int32_t value;
+			for (int j = 0; j < OLC_KEYS; j++)
+			{
+				int i = (start + j) % OLC_KEYS;
+				bool ok = tree->concurrent_find(i, value);
+				assert(ok && (value == i));
+				(void) ok;
+			}
+		}
+	};
+
+	for (int n_threads = 1; n_threads <= OLC_MAX_THREADS; n_threads *= 2)
+	{
+		btree_t tree;
+
+		chrono_start();
+		std::vector<std::thread> threads;
+		for (int t = 0; t < n_threads; t++)
+			threads.push_back(std::thread(&L::put, &tree, t, n_threads));
+		for (int t = 0; t < n_threads; t++)
+			threads[t].join();
+		double elapsed = chrono_stop();
+
+		std::cout << "# CONCURRENT PUT (memory storage, " << n_threads << " threads): " <<
+				(elapsed > 0 ? 1000.0 * static_cast<double>(OLC_KEYS) / elapsed : 0.0) << " puts/s" << std::endl;
+
+		threads.clear();
+		chrono_start();
+		for (int t = 0; t < n_threads; t++)
+			threads.push_back(std::thread(&L::find, &tree, t * (OLC_KEYS / n_threads)));
+		for (int t = 0; t < n_threads; t++)
+			threads[t].join();
+		elapsed = chrono_stop();
+
+		size_t n_finds = static_cast<size_t>(OLC_KEYS) * static_cast<size_t>(n_threads);
+		std::cout << "# CONCURRENT FIND (memory storage, " << n_threads << " threads): " <<
+				(elapsed > 0 ? 1000.0 * static_cast<double>(n_finds) / elapsed : 0.0) << " finds/s" << std::endl;
+
+		tree.close();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	benchmark_1();
+}
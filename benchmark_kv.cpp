@@ -22,6 +22,8 @@
 #include <fstream>
 #include <string>
 #include <stdexcept>
+#include <vector>
+#include <thread>
 
 #include <stdint.h>
 #include <string.h>
@@ -31,7 +33,6 @@
 #include <sys/time.h>
 #else
 #include <Windows.h>
-#endif
 
 /* FILETIME of Jan 1 1970 00:00:00. */
 static const unsigned __int64 epoch = ((unsigned __int64) 116444736000000000ULL);
@@ -59,6 +60,7 @@ gettimeofday(struct timeval * tp, struct timezone * tzp)
 
     return 0;
 }
+#endif
 
 #include "KeyValueStore.h"
 
@@ -81,6 +83,11 @@ static inline void chrono_start();
 static inline double chrono_stop();
 
 static void benchmark_1();
+static void benchmark_2();
+static void benchmark_3();
+static void benchmark_4();
+static void benchmark_5();
+static void benchmark_6();
 
 int main(int argc, char* argv[]);
 
@@ -188,18 +195,14 @@ static inline double chrono_stop()
 
 static const int MAX_WORDS = 1000000;
 
-static void benchmark_1()
+static void load_words(std::vector<std::string>& words)
 {
-	typedef milliways::KeyValueStore kv_t;
-	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
-
 	const std::string words_pathname("./benchmark_1_words");
 
 	std::ifstream f(words_pathname.c_str());
 	if(!f.is_open())
         throw std::domain_error("Unable to load words input file: " + words_pathname);
 
-	std::vector<std::string> words;
     std::string line;
     int n = 0;
     while (std::getline(f, line)) {
@@ -216,6 +219,15 @@ static void benchmark_1()
         }
     }
     f.close();
+}
+
+static void benchmark_1()
+{
+	typedef milliways::KeyValueStore kv_t;
+	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
+
+	std::vector<std::string> words;
+	load_words(words);
 
 	const std::string kv_pathname("/tmp/benchmark_kv_1");
 
@@ -241,6 +253,7 @@ static void benchmark_1()
     		std::cerr << "failed word #:" << i << " word:" << word << std::endl;
     	}
     	assert(ok);
+    	(void) ok;
     	i++;
 	}
 	double w_elapsed = chrono_stop();
@@ -249,11 +262,428 @@ static void benchmark_1()
 	double w_wps = 1000.0 * static_cast<double>(nwords) / w_elapsed;
 	std::cout << "# " << nwords << " words. PUT: " <<  w_wps << " words/s" << std::endl;
 
+	chrono_start();
+	std::string value;
+	for (it = words.begin(); it != words.end(); ++it)
+	{
+		bool ok = kv.get(*it, value);
+		assert(ok && (value == *it));
+		(void) ok;
+	}
+	double r_elapsed = chrono_stop();
+
+	double r_wps = 1000.0 * static_cast<double>(nwords) / r_elapsed;
+	std::cout << "# " << nwords << " words. GET: " <<  r_wps << " words/s" << std::endl;
+
+	chrono_start();
+	size_t n_iterated = 0;
+	for (kv_t::iterator k_it = kv.begin(); k_it != kv.end(); ++k_it)
+		n_iterated++;
+	double i_elapsed = chrono_stop();
+
+	double i_wps = 1000.0 * static_cast<double>(n_iterated) / (i_elapsed > 0 ? i_elapsed : 1.0);
+	std::cout << "# " << n_iterated << " keys. ITERATE: " <<  i_wps << " keys/s" << std::endl;
+
 	kv.close();
 	std::remove(kv_pathname.c_str());
+
+	// same words, loaded in one go
+
+	std::vector< std::pair<std::string, std::string> > items;
+	items.reserve(words.size());
+	for (it = words.begin(); it != words.end(); ++it)
+		items.push_back(std::make_pair(*it, *it));
+
+	bs = new kv_blockstorage_t(kv_pathname);
+	kv_t bulk_kv(bs);
+
+	bulk_kv.open();
+	assert(bulk_kv.isOpen());
+
+	chrono_start();
+	bool ok = bulk_kv.bulk_put(items);
+	assert(ok);
+	(void) ok;
+	double b_elapsed = chrono_stop();
+
+	double b_wps = 1000.0 * static_cast<double>(nwords) / b_elapsed;
+	std::cout << "# " << nwords << " words. BULK PUT: " <<  b_wps << " words/s" << std::endl;
+
+	bulk_kv.close();
+	std::remove(kv_pathname.c_str());
+}
+
+/*
+ * point lookups on a small hot set, interleaved with full scans of the
+ * store (keys and values), with a block cache much smaller than the store:
+ * the hot set fits in the cache, but between two lookups of the same hot
+ * key the scan goes through more blocks than the cache holds. Compares
+ * the hit ratios of the replacement policies.
+ */
+static const int SCAN_WORDS = 50000;
+static const size_t SCAN_VALUE_SIZE = 1000;
+static const size_t SCAN_CACHE_BLOCKS = 1024;
+static const int SCAN_PASSES = 2;
+static const int HOT_KEYS = 128;
+static const int HOT_LOOKUP_EVERY = 32;
+
+static void benchmark_2()
+{
+	typedef milliways::KeyValueStore kv_t;
+	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
+	typedef milliways::CachePolicy<milliways::block_id_t> policy_t;
+
+	std::vector<std::string> words;
+	load_words(words);
+	if (words.size() > static_cast<size_t>(SCAN_WORDS))
+		words.resize(SCAN_WORDS);
+
+	std::vector< std::pair<std::string, std::string> > items;
+	items.reserve(words.size());
+	std::vector<std::string>::const_iterator it;
+	for (it = words.begin(); it != words.end(); ++it)
+	{
+		std::string value(*it);
+		value.resize(SCAN_VALUE_SIZE, '.');
+		items.push_back(std::make_pair(*it, value));
+	}
+
+	const std::string kv_pathname("/tmp/benchmark_kv_2");
+
+	std::remove(kv_pathname.c_str());
+	{
+		kv_t kv(new kv_blockstorage_t(kv_pathname));
+		kv.open();
+		assert(kv.isOpen());
+		bool ok = kv.bulk_put(items);
+		assert(ok);
+		(void) ok;
+		kv.close();
+	}
+
+	std::vector<std::string> hot;
+	for (int i = 0; i < HOT_KEYS; i++)
+		hot.push_back(words[rand_int(0, static_cast<int>(words.size()) - 1)]);
+
+	for (int p = 0; p < 3; p++)
+	{
+		kv_blockstorage_t* bs = new kv_blockstorage_t(kv_pathname, SCAN_CACHE_BLOCKS);
+		kv_t kv(bs);
+		kv.open();
+		assert(kv.isOpen());
+
+		policy_t* policy = NULL;
+		if (p == 1)
+			policy = new milliways::TwoQueuePolicy<milliways::block_id_t>();
+		else if (p == 2)
+			policy = new milliways::ClockPolicy<milliways::block_id_t>();
+		bs->cachePolicy(policy);
+		const char* policy_name = policy ? policy->name() : "LRU";
+
+		std::string value;
+
+		// warm up the hot set (twice, so that it counts as reused)
+		for (int round = 0; round < 2; round++)
+			for (int i = 0; i < HOT_KEYS; i++)
+				kv.get(hot[i], value);
+		bs->cacheResetStats();
+
+		size_t n_scanned = 0, n_hot = 0, n_hot_hits = 0;
+		chrono_start();
+		for (int pass = 0; pass < SCAN_PASSES; pass++)
+		{
+			for (kv_t::iterator k_it = kv.begin(); k_it != kv.end(); ++k_it)
+			{
+				kv.get(*k_it, value);
+				if ((++n_scanned % HOT_LOOKUP_EVERY) == 0)
+				{
+					size_t misses = bs->cacheMisses();
+					bool ok = kv.get(hot[n_hot % HOT_KEYS], value);
+					assert(ok);
+					(void) ok;
+					if (bs->cacheMisses() == misses)
+						n_hot_hits++;
+					n_hot++;
+				}
+			}
+		}
+		double elapsed = chrono_stop();
+
+		double hits = static_cast<double>(bs->cacheHits());
+		double lookups = hits + static_cast<double>(bs->cacheMisses());
+		std::cout << "# SCAN + HOT LOOKUPS (" << SCAN_CACHE_BLOCKS << " blocks, " << policy_name << "): " <<
+				"hit ratio: " << (lookups > 0 ? hits / lookups : 0.0) <<
+				" hot lookup hit ratio: " << (n_hot > 0 ? static_cast<double>(n_hot_hits) / static_cast<double>(n_hot) : 0.0) <<
+				" (" << (elapsed > 0 ? 1000.0 * static_cast<double>(n_scanned + n_hot) / elapsed : 0.0) << " ops/s)" << std::endl;
+
+		kv.close();
+	}
+
+	std::remove(kv_pathname.c_str());
+}
+
+/*
+ * point lookups of all the keys from a growing number of threads, with
+ * each thread starting from a different key. With a small block cache the
+ * readers keep missing, and the misses are read in parallel.
+ */
+static const int CONCURRENT_WORDS = 50000;
+static const int CONCURRENT_MAX_THREADS = 8;
+static const size_t CONCURRENT_SMALL_CACHE_BLOCKS = 256;
+
+static void benchmark_3()
+{
+	typedef milliways::KeyValueStore kv_t;
+	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
+
+	struct Reader
+	{
+		Reader(kv_t* kv_, const std::vector<std::string>* words_, size_t start_) :
+			kv(kv_), words(words_), start(start_) {}
+
+		void operator()()
+		{
+			std::string value;
+			size_t n = words->size();
+			for (size_t i = 0; i < n; i++)
+			{
+				const std::string& word = (*words)[(start + i) % n];
+				bool ok = kv->get(word, value);
+				assert(ok && (value == word));
+				(void) ok;
+			}
+		}
+
+		kv_t* kv;
+		const std::vector<std::string>* words;
+		size_t start;
+	};
+
+	std::vector<std::string> words;
+	load_words(words);
+	if (words.size() > static_cast<size_t>(CONCURRENT_WORDS))
+		words.resize(CONCURRENT_WORDS);
+
+	std::vector< std::pair<std::string, std::string> > items;
+	items.reserve(words.size());
+	std::vector<std::string>::const_iterator it;
+	for (it = words.begin(); it != words.end(); ++it)
+		items.push_back(std::make_pair(*it, *it));
+
+	const std::string kv_pathname("/tmp/benchmark_kv_3");
+
+	std::remove(kv_pathname.c_str());
+	{
+		kv_t kv(new kv_blockstorage_t(kv_pathname));
+		kv.open();
+		assert(kv.isOpen());
+		bool ok = kv.bulk_put(items);
+		assert(ok);
+		(void) ok;
+		kv.close();
+	}
+
+	for (int c = 0; c < 2; c++)
+	{
+		size_t cache_blocks = (c == 0) ? static_cast<size_t>(milliways::KV_BLOCK_CACHESIZE) : CONCURRENT_SMALL_CACHE_BLOCKS;
+
+		for (int n_threads = 1; n_threads <= CONCURRENT_MAX_THREADS; n_threads *= 2)
+		{
+			kv_t kv(new kv_blockstorage_t(kv_pathname, cache_blocks));
+			kv.open();
+			assert(kv.isOpen());
+
+			chrono_start();
+			std::vector<std::thread> readers;
+			for (int t = 0; t < n_threads; t++)
+				readers.push_back(std::thread(Reader(&kv, &words, t * words.size() / n_threads)));
+			for (int t = 0; t < n_threads; t++)
+				readers[t].join();
+			double elapsed = chrono_stop();
+
+			size_t n_gets = words.size() * static_cast<size_t>(n_threads);
+			std::cout << "# CONCURRENT GET (" << cache_blocks << " blocks, " << n_threads << " threads): " <<
+					(elapsed > 0 ? 1000.0 * static_cast<double>(n_gets) / elapsed : 0.0) << " gets/s" << std::endl;
+
+			kv.close();
+		}
+	}
+
+	std::remove(kv_pathname.c_str());
+}
+
+/*
+ * puts from a few writer threads with a write-ahead log under each sync
+ * policy: with SYNC_ALWAYS the writers that arrive while a sync is in
+ * flight are committed together by the next one.
+ */
+static const int WAL_PUTS = 2000;
+static const int WAL_THREADS = 4;
+
+static void benchmark_4()
+{
+	typedef milliways::KeyValueStore kv_t;
+	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
+	typedef milliways::WriteAheadLog wal_t;
+
+	struct Writer
+	{
+		Writer(kv_t* kv_, int thread_) : kv(kv_), thread(thread_) {}
+
+		void operator()()
+		{
+			for (int i = thread; i < WAL_PUTS; i += WAL_THREADS)
+			{
+				std::string key = "wal-" + std::to_string(i);
+				bool ok = kv->put(key, key);
+				assert(ok);
+				(void) ok;
+			}
+		}
+
+		kv_t* kv;
+		int thread;
+	};
+
+	const std::string kv_pathname("/tmp/benchmark_kv_4");
+	const std::string wal_pathname("/tmp/benchmark_kv_4-wal");
+
+	for (int p = 0; p < 3; p++)
+	{
+		wal_t::SyncPolicy policy = (p == 0) ? wal_t::SYNC_ALWAYS : ((p == 1) ? wal_t::SYNC_PERIODIC : wal_t::SYNC_NEVER);
+		const char* policy_name = (p == 0) ? "always" : ((p == 1) ? "every 10 ms" : "never");
+
+		std::remove(kv_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		kv_t kv(new kv_blockstorage_t(kv_pathname));
+		kv.wal(new wal_t(wal_pathname, policy, 10));
+		kv.open();
+		assert(kv.isOpen());
+
+		chrono_start();
+		std::vector<std::thread> writers;
+		for (int t = 0; t < WAL_THREADS; t++)
+			writers.push_back(std::thread(Writer(&kv, t)));
+		for (int t = 0; t < WAL_THREADS; t++)
+			writers[t].join();
+		double elapsed = chrono_stop();
+
+		std::cout << "# WAL PUT (sync " << policy_name << ", " << WAL_THREADS << " threads): " <<
+				(elapsed > 0 ? 1000.0 * static_cast<double>(WAL_PUTS) / elapsed : 0.0) << " puts/s, " <<
+				kv.wal()->syncs() << " syncs" << std::endl;
+
+		kv.close();
+	}
+
+	std::remove(kv_pathname.c_str());
+	std::remove(wal_pathname.c_str());
+}
+
+/*
+ * the same objects stored one put at a time, then in write batches
+ * (as a push would): sorted tree updates and one value region per batch
+ */
+static const int BATCH_OBJECTS = 50000;
+static const int BATCH_SIZE = 500;
+
+static void benchmark_5()
+{
+	typedef milliways::KeyValueStore kv_t;
+	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
+
+	std::vector< std::pair<std::string, std::string> > objects;
+	objects.reserve(BATCH_OBJECTS);
+	for (int i = 0; i < BATCH_OBJECTS; i++)
+		objects.push_back(std::make_pair(random_string(20), random_string(rand_int(50, 1500))));
+
+	const std::string kv_pathname("/tmp/benchmark_kv_5");
+
+	for (int batched = 0; batched < 2; batched++)
+	{
+		std::remove(kv_pathname.c_str());
+
+		kv_t kv(new kv_blockstorage_t(kv_pathname));
+		kv.open();
+		assert(kv.isOpen());
+
+		chrono_start();
+		if (batched)
+		{
+			milliways::WriteBatch batch;
+			for (int i = 0; i < BATCH_OBJECTS; i++)
+			{
+				batch.put(objects[i].first, objects[i].second);
+				if ((batch.size() == static_cast<size_t>(BATCH_SIZE)) || ((i + 1) == BATCH_OBJECTS))
+				{
+					bool ok = kv.apply(batch);
+					assert(ok);
+					(void) ok;
+					batch.clear();
+				}
+			}
+		} else
+		{
+			for (int i = 0; i < BATCH_OBJECTS; i++)
+			{
+				bool ok = kv.put(objects[i].first, objects[i].second);
+				assert(ok);
+				(void) ok;
+			}
+		}
+		kv.flush();
+		double elapsed = chrono_stop();
+
+		std::cout << "# " << (batched ? "BATCHED PUT (" : "SINGLE PUT (") << BATCH_OBJECTS << " objects): " <<
+				(elapsed > 0 ? 1000.0 * static_cast<double>(BATCH_OBJECTS) / elapsed : 0.0) << " puts/s, " <<
+				kv.freeFragments() << " free fragments (" << kv.freeFragmentBytes() << " bytes)" << std::endl;
+
+		kv.close();
+	}
+
+	std::remove(kv_pathname.c_str());
+}
+
+/* LRU recency updates: hits, updates and evictions on a 100k entries cache */
+static void benchmark_6()
+{
+	static const int N_ENTRIES = 100000;
+	static const int N_OPS = 1000000;
+
+	typedef milliways::LRUCache<N_ENTRIES, int, int> lru_t;
+	lru_t* lru = new lru_t(-1);
+
+	chrono_start();
+	for (int i = 0; i < N_ENTRIES; i++)
+		(*lru)[i] = i;
+	int value = 0;
+	for (int i = 0; i < N_OPS; i++)
+	{
+		int key = rand() % N_ENTRIES;
+		lru->get(value, key);
+	}
+	for (int i = 0; i < N_OPS; i++)
+	{
+		int key = rand() % N_ENTRIES;
+		lru->set(key, key);
+	}
+	for (int i = N_ENTRIES; i < 2 * N_ENTRIES; i++)
+		(*lru)[i] = i;
+	double elapsed = chrono_stop();
+
+	int n_ops = 3 * N_ENTRIES + 2 * N_OPS;
+	std::cout << "# LRU cache (" << N_ENTRIES << " entries): " <<
+			(elapsed > 0 ? 1000.0 * static_cast<double>(n_ops) / elapsed : 0.0) << " ops/s" << std::endl;
+
+	delete lru;
 }
 
 int main(int argc, char* argv[])
 {
 	benchmark_1();
+	benchmark_2();
+	benchmark_3();
+	benchmark_4();
+	benchmark_5();
+	benchmark_6();
 }
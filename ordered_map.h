@@ -17,19 +17,27 @@
 /*  See the License for the specific language governing permissions and      */
 /*  limitations under the License.                                           */
 /*****************************************************************************/
-
 #ifndef MILLIWAYS_ORDERED_MAP_H
 #define MILLIWAYS_ORDERED_MAP_H
 
-#include <map>
 #include <unordered_map>
-#include <deque>
+#include <functional>
+#include <iterator>
 
 #include <stdint.h>
 #include <assert.h>
 
 namespace milliways {
 
+/*
+ * ordered_map keeps its items on an intrusive doubly-linked list (in
+ * insertion order) and indexes the list nodes with a hash map, so that
+ * lookup, insertion, removal of any item and moving an item to the back
+ * of the list are all O(1).
+ * The hash map is keyed by a pointer to the key stored in the node itself,
+ * to avoid storing each key twice.
+ */
+
 template <typename Key, typename T>
 class ordered_map
 {
@@ -37,30 +45,27 @@ public:
 	typedef Key key_type;
 	typedef T mapped_type;
 	typedef std::pair<Key, T> value_type;
-	typedef std::unordered_map<key_type, mapped_type> key_value_map_t;
-	typedef std::deque<key_type> key_vector_t;
-	typedef typename key_value_map_t::size_type size_type;
+	typedef size_t size_type;
 
 	class iterator;
 	class const_iterator;
 
-	ordered_map() {}
-	ordered_map(const ordered_map& other) :
-		m_map(other.m_map), m_keys(other.m_keys) {}
-	ordered_map& operator= (const ordered_map& other)
-		{ m_map = other.m_map; m_keys = other.m_keys; }
+	ordered_map() { m_head.prev = m_head.next = &m_head; }
+	ordered_map(const ordered_map& other);
+	ordered_map& operator= (const ordered_map& other);
+	~ordered_map() { clear(); }
 
 	bool empty() const { return m_map.empty(); }
 	size_type size() const { return m_map.size(); }
 	size_type max_size() const { return m_map.max_size(); }
 
-	void clear() { m_map.clear(); m_keys.clear(); }
+	void clear();
 
-	bool has(const key_type& key) const { return m_map.count(key); }
+	bool has(const key_type& key) const { return m_map.count(&key); }
 	bool get(mapped_type& dst, const key_type& key);
 	void set(const key_type& key, const mapped_type& value);
 
-	size_type count(const key_type& key) const { return m_map.count(key); }
+	size_type count(const key_type& key) const { return m_map.count(&key); }
 	mapped_type& operator[] (const key_type& key);
 
 	value_type pop();            // remove last (LIFO)
@@ -68,11 +73,52 @@ public:
 
 	value_type pop(const key_type& key);
 
-	iterator begin() { return iterator(this, m_keys.begin()); }
-	iterator end() { return iterator(this, m_keys.end()); }
+	iterator begin() { return iterator(this, m_head.next); }
+	iterator end() { return iterator(this, &m_head); }
+	const_iterator begin() const { return const_iterator(this, m_head.next); }
+	const_iterator end() const { return const_iterator(this, &m_head); }
 
 	iterator find(const key_type& key);
+	const_iterator find(const key_type& key) const;
+
+	void move_to_back(iterator it);     // O(1), 'it' stays valid
+	void move_to_front(iterator it);    // O(1), 'it' stays valid
+
+private:
+	struct link_type
+	{
+		link_type* prev;
+		link_type* next;
+	};
+
+	struct node_type : public link_type
+	{
+		node_type(const key_type& key, const mapped_type& value) : item(key, value) {}
+
+		std::pair<const Key, T> item;
+	};
 
+	struct key_ptr_hash
+	{
+		size_t operator() (const key_type* key) const { return std::hash<key_type>()(*key); }
+	};
+
+	struct key_ptr_equal
+	{
+		bool operator() (const key_type* a, const key_type* b) const { return (*a) == (*b); }
+	};
+
+	typedef std::unordered_map<const key_type*, node_type*, key_ptr_hash, key_ptr_equal> key_node_map_t;
+
+	static node_type* as_node(link_type* link) { return static_cast<node_type*>(link); }
+	static const node_type* as_node(const link_type* link) { return static_cast<const node_type*>(link); }
+
+	node_type* insert_back(const key_type& key, const mapped_type& value);
+	void unlink(link_type* link);
+	void link_before(link_type* link, link_type* pos);
+	value_type erase(node_type* node);
+
+public:
 	class iterator
 	{
 	public:
@@ -80,27 +126,29 @@ public:
 		typedef std::pair<const Key, T> value_type;
 		typedef std::pair<const Key, T>& reference;
 		typedef std::pair<const Key, T>* pointer;
-		typedef std::forward_iterator_tag iterator_category;
+		typedef std::bidirectional_iterator_tag iterator_category;
 		typedef int difference_type;
 
-		iterator() { }
-		iterator(ordered_map* parent, typename key_vector_t::iterator it) : m_parent(parent), m_key_it(it) { }
-		iterator(const iterator& other) : m_parent(other.m_parent), m_key_it(other.m_key_it), m_map_it(other.m_map_it) { }
-		iterator& operator= (const iterator& other) { m_parent = other.m_parent; m_key_it = other.m_key_it; m_map_it = other.m_map_it; return *this; }
+		iterator() : m_parent(NULL), m_link(NULL) { }
+		iterator(ordered_map* parent, link_type* link) : m_parent(parent), m_link(link) { }
+		iterator(const iterator& other) : m_parent(other.m_parent), m_link(other.m_link) { }
+		iterator& operator= (const iterator& other) { m_parent = other.m_parent; m_link = other.m_link; return *this; }
 
-		self_type operator++() { self_type i = *this; m_key_it++; return i; }
-		self_type operator++(int junk) { m_key_it++; return *this; }
-		reference operator*() { m_map_it = m_parent->m_map.find((*m_key_it)); return (*m_map_it); }
-		pointer operator->() { m_map_it = m_parent->m_map.find((*m_key_it)); return &(*m_map_it); }
-		bool operator==(const self_type& rhs) { return (m_parent == rhs.m_parent) && (m_key_it == rhs.m_key_it); }
-		bool operator!=(const self_type& rhs) { return (m_parent != rhs.m_parent) || (m_key_it != rhs.m_key_it); }
+		self_type& operator++() { m_link = m_link->next; return *this; }
+		self_type operator++(int junk) { self_type i = *this; m_link = m_link->next; return i; }
+		self_type& operator--() { m_link = m_link->prev; return *this; }
+		self_type operator--(int junk) { self_type i = *this; m_link = m_link->prev; return i; }
+		reference operator*() { return as_node(m_link)->item; }
+		pointer operator->() { return &as_node(m_link)->item; }
+		bool operator==(const self_type& rhs) const { return (m_parent == rhs.m_parent) && (m_link == rhs.m_link); }
+		bool operator!=(const self_type& rhs) const { return (m_parent != rhs.m_parent) || (m_link != rhs.m_link); }
 
-		operator bool() const { return m_key_it != m_parent->m_keys.end(); }
+		operator bool() const { return m_link != &m_parent->m_head; }
 
 	private:
 		ordered_map* m_parent;
-		typename key_vector_t::iterator m_key_it;
-		typename key_value_map_t::iterator m_map_it;
+		link_type* m_link;
+		friend class ordered_map;
 		friend class const_iterator;
 	};
 
@@ -113,34 +161,36 @@ public:
 		typedef const std::pair<const Key, T>& const_reference;
 		typedef std::pair<const Key, T>* pointer;
 		typedef const std::pair<const Key, T>* const_pointer;
-		typedef std::forward_iterator_tag iterator_category;
+		typedef std::bidirectional_iterator_tag iterator_category;
 		typedef int difference_type;
 
-		const_iterator() { }
-		const_iterator(ordered_map* parent, typename key_vector_t::iterator it) : m_parent(parent), m_key_it(it) { }
-		const_iterator(const const_iterator& other) : m_parent(other.m_parent), m_key_it(other.m_key_it), m_map_it(other.m_map_it) { }
-		const_iterator(const iterator& other) : m_parent(other.m_parent), m_key_it(other.m_key_it), m_map_it(other.m_map_it) { }
-		const_iterator& operator= (const const_iterator& other) { m_parent = other.m_parent; m_key_it = other.m_key_it; m_map_it = other.m_map_it; return *this; }
+		const_iterator() : m_parent(NULL), m_link(NULL) { }
+		const_iterator(const ordered_map* parent, const link_type* link) : m_parent(parent), m_link(link) { }
+		const_iterator(const const_iterator& other) : m_parent(other.m_parent), m_link(other.m_link) { }
+		const_iterator(const iterator& other) : m_parent(other.m_parent), m_link(other.m_link) { }
+		const_iterator& operator= (const const_iterator& other) { m_parent = other.m_parent; m_link = other.m_link; return *this; }
 
-		self_type operator++() { self_type i = *this; m_key_it++; return i; }
-		self_type operator++(int junk) { m_key_it++; return *this; }
-		const_reference operator*() { m_map_it = m_parent->m_map.find((*m_key_it)); return (*m_map_it); }
-		const_pointer operator->() { m_map_it = m_parent->m_map.find((*m_key_it)); return &(*m_map_it); }
-		bool operator==(const self_type& rhs) { return (m_parent == rhs.m_parent) && (m_key_it == rhs.m_key_it); }
-		bool operator!=(const self_type& rhs) { return (m_parent != rhs.m_parent) || (m_key_it != rhs.m_key_it); }
+		self_type& operator++() { m_link = m_link->next; return *this; }
+		self_type operator++(int junk) { self_type i = *this; m_link = m_link->next; return i; }
+		self_type& operator--() { m_link = m_link->prev; return *this; }
+		self_type operator--(int junk) { self_type i = *this; m_link = m_link->prev; return i; }
+		const_reference operator*() const { return as_node(m_link)->item; }
+		const_pointer operator->() const { return &as_node(m_link)->item; }
+		bool operator==(const self_type& rhs) const { return (m_parent == rhs.m_parent) && (m_link == rhs.m_link); }
+		bool operator!=(const self_type& rhs) const { return (m_parent != rhs.m_parent) || (m_link != rhs.m_link); }
 
-		operator bool() const { return m_key_it != m_parent->m_keys.end(); }
+		operator bool() const { return m_link != &m_parent->m_head; }
 
 	private:
 		const ordered_map* m_parent;
-		typename key_vector_t::const_iterator m_key_it;
-		typename key_value_map_t::const_iterator m_map_it;
+		const link_type* m_link;
+		friend class ordered_map;
 		friend class iterator;
 	};
 
 private:
-	key_value_map_t m_map;
-	key_vector_t m_keys;
+	link_type m_head;            // list sentinel: m_head.next is the first item, m_head.prev the last
+	key_node_map_t m_map;
 };
 
 } /* end of namespace milliways */
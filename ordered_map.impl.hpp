@@ -17,7 +17,6 @@
 /*  See the License for the specific language governing permissions and      */
 /*  limitations under the License.                                           */
 /*****************************************************************************/
-
 #ifndef MILLIWAYS_ORDERED_MAP_H
 #include "ordered_map.h"
 #endif
@@ -25,22 +24,52 @@
 #ifndef MILLIWAYS_ORDERED_MAP_IMPL_H
 #define MILLIWAYS_ORDERED_MAP_IMPL_H
 
-#include <map>
-#include <deque>
-#include <algorithm>
-
 #include <stdint.h>
 #include <assert.h>
 
 namespace milliways {
 
+template <typename Key, typename T>
+ordered_map<Key, T>::ordered_map(const ordered_map& other)
+{
+	m_head.prev = m_head.next = &m_head;
+	for (const_iterator it = other.begin(); it != other.end(); ++it)
+		insert_back(it->first, it->second);
+}
+
+template <typename Key, typename T>
+ordered_map<Key, T>& ordered_map<Key, T>::operator= (const ordered_map& other)
+{
+	if (this != &other)
+	{
+		clear();
+		for (const_iterator it = other.begin(); it != other.end(); ++it)
+			insert_back(it->first, it->second);
+	}
+	return *this;
+}
+
+template <typename Key, typename T>
+void ordered_map<Key, T>::clear()
+{
+	link_type* link = m_head.next;
+	while (link != &m_head)
+	{
+		link_type* next = link->next;
+		delete as_node(link);
+		link = next;
+	}
+	m_head.prev = m_head.next = &m_head;
+	m_map.clear();
+}
+
 template <typename Key, typename T>
 bool ordered_map<Key, T>::get(T & dst, const Key& key)
 {
-	typename key_value_map_t::const_iterator it = m_map.find(key);
+	typename key_node_map_t::const_iterator it = m_map.find(&key);
 	if (it != m_map.end())
 	{
-		dst = it->second;
+		dst = it->second->item.second;
 		return true;
 	}
 
@@ -50,75 +79,131 @@ bool ordered_map<Key, T>::get(T & dst, const Key& key)
 template <typename Key, typename T>
 void ordered_map<Key, T>::set(const Key& key, const T & value)
 {
-	typename key_value_map_t::const_iterator it = m_map.find(key);
+	typename key_node_map_t::iterator it = m_map.find(&key);
 	if (it == m_map.end())
-		m_keys.push_back(key);
-	m_map[key] = value;
+		insert_back(key, value);
+	else
+		it->second->item.second = value;
 }
 
 template <typename Key, typename T>
 T & ordered_map<Key, T>::operator[](const Key& key)
 {
-	typename key_value_map_t::const_iterator it = m_map.find(key);
+	typename key_node_map_t::iterator it = m_map.find(&key);
 	if (it == m_map.end())
-		m_keys.push_back(key);
-	return m_map[key];
+		return insert_back(key, T())->item.second;
+	return it->second->item.second;
 }
 
 template <typename Key, typename T>
 std::pair<Key, T> ordered_map<Key, T>::pop()
 {
-	Key key = m_keys.back();
-	m_keys.pop_back();
+	assert(! empty());
+	return erase(as_node(m_head.prev));
+}
+
+template <typename Key, typename T>
+std::pair<Key, T> ordered_map<Key, T>::pop_front()
+{
+	assert(! empty());
+	return erase(as_node(m_head.next));
+}
 
-	typename key_value_map_t::iterator it = m_map.find(key);
-	T value = it->second;
+template <typename Key, typename T>
+std::pair<Key, T> ordered_map<Key, T>::pop(const key_type& key)
+{
+	typename key_node_map_t::iterator it = m_map.find(&key);
 
-	m_map.erase(it);
+	if (it != m_map.end())
+		return erase(it->second);
 
-	return std::pair<Key, T>(key, value);
+	return std::pair<Key, T>();
 }
 
 template <typename Key, typename T>
-std::pair<Key, T> ordered_map<Key, T>::pop_front()
+typename ordered_map<Key, T>::iterator ordered_map<Key, T>::find(const key_type& key)
 {
-	Key key = m_keys.front();
-	m_keys.pop_front();
+	typename key_node_map_t::iterator it = m_map.find(&key);
 
-	typename key_value_map_t::iterator it = m_map.find(key);
-	T value = it->second;
+	if (it != m_map.end())
+		return iterator(this, it->second);
+	return end();
+}
 
-	m_map.erase(it);
+template <typename Key, typename T>
+typename ordered_map<Key, T>::const_iterator ordered_map<Key, T>::find(const key_type& key) const
+{
+	typename key_node_map_t::const_iterator it = m_map.find(&key);
 
-	return std::pair<Key, T>(key, value);
+	if (it != m_map.end())
+		return const_iterator(this, it->second);
+	return end();
 }
 
 template <typename Key, typename T>
-std::pair<Key, T> ordered_map<Key, T>::pop(const key_type& key)
+void ordered_map<Key, T>::move_to_back(iterator it)
 {
-	typename key_vector_t::iterator k_it = std::find(m_keys.begin(), m_keys.end(), key);
+	assert(it.m_parent == this);
+	assert(it);
 
-	if (k_it != m_keys.end())
-	{
-		m_keys.erase(k_it);
+	if (it.m_link == m_head.prev)
+		return;
+	unlink(it.m_link);
+	link_before(it.m_link, &m_head);
+}
 
-		typename key_value_map_t::iterator it = m_map.find(key);
-		T value = it->second;
+template <typename Key, typename T>
+void ordered_map<Key, T>::move_to_front(iterator it)
+{
+	assert(it.m_parent == this);
+	assert(it);
 
-		m_map.erase(it);
+	if (it.m_link == m_head.next)
+		return;
+	unlink(it.m_link);
+	link_before(it.m_link, m_head.next);
+}
 
-		return std::pair<Key, T>(key, value);
-	}
+/* -- private helpers ---------------------------------------------- */
 
-	return std::pair<Key, T>();
+template <typename Key, typename T>
+typename ordered_map<Key, T>::node_type* ordered_map<Key, T>::insert_back(const key_type& key, const mapped_type& value)
+{
+	node_type* node = new node_type(key, value);
+	link_before(node, &m_head);
+	m_map[&node->item.first] = node;
+	return node;
 }
 
 template <typename Key, typename T>
-typename ordered_map<Key, T>::iterator ordered_map<Key, T>::find(const key_type& key)
+void ordered_map<Key, T>::unlink(link_type* link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->prev = link->next = NULL;
+}
+
+template <typename Key, typename T>
+void ordered_map<Key, T>::link_before(link_type* link, link_type* pos)
 {
-	typename key_vector_t::iterator k_it = std::find(m_keys.begin(), m_keys.end(), key);
+	link->prev = pos->prev;
+	link->next = pos;
+	pos->prev->next = link;
+	pos->prev = link;
+}
+
+template <typename Key, typename T>
+std::pair<Key, T> ordered_map<Key, T>::erase(node_type* node)
+{
+	assert(node && (node != &m_head));
+
+	std::pair<Key, T> item(node->item.first, node->item.second);
+
+	m_map.erase(&node->item.first);
+	unlink(node);
+	delete node;
 
-	return iterator(this, k_it);
+	return item;
 }
 
 } /* end of namespace milliways */
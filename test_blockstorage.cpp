@@ -0,0 +1,898 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch.hpp"
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+#include "BlockStorage.h"
+
+#define BLOCK_SIZE  4096
+#define CACHE_SIZE  8
+
+template <typename BlockStorageT>
+static void fill_block(BlockStorageT& storage, milliways::block_id_t block_id, char value)
+{
+	typedef XTYPENAME BlockStorageT::block_t block_t;
+
+	milliways::shptr<block_t> block = storage.get(block_id);
+	REQUIRE(block);
+	REQUIRE(block->index() == block_id);
+	memset(block->data(), value, block->size());
+	REQUIRE(storage.put(*block));
+}
+
+template <typename BlockStorageT>
+static bool check_block(BlockStorageT& storage, milliways::block_id_t block_id, char value)
+{
+	typedef XTYPENAME BlockStorageT::block_t block_t;
+
+	milliways::shptr<block_t> block = storage.get(block_id);
+	if (! block)
+		return false;
+	for (size_t i = 0; i < block->size(); i++)
+		if (block->data()[i] != value)
+			return false;
+	return true;
+}
+
+template <typename BlockStorageT>
+static void write_and_read_back(BlockStorageT& storage, const std::string& pathname, int n_blocks)
+{
+	typedef milliways::block_id_t block_id_t;
+
+	std::remove(pathname.c_str());
+
+	{
+		REQUIRE(storage.open());
+		REQUIRE(storage.isOpen());
+		REQUIRE(storage.created());
+
+		int uid = storage.allocUserHeader();
+		storage.setUserHeader(uid, "user header data");
+
+		block_id_t first_id = storage.allocId(n_blocks);
+		REQUIRE(first_id != milliways::BLOCK_ID_INVALID);
+		REQUIRE(storage.hasId(first_id + n_blocks - 1));
+		REQUIRE(! storage.hasId(first_id + n_blocks));
+
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, static_cast<char>('a' + (i % 26)));
+		for (int i = 0; i < n_blocks; i++)
+			REQUIRE(check_block(storage, first_id + i, static_cast<char>('a' + (i % 26))));
+
+		REQUIRE(storage.flush());
+		REQUIRE(storage.close());
+		REQUIRE(! storage.isOpen());
+	}
+
+	{
+		REQUIRE(storage.open());
+		REQUIRE(storage.isOpen());
+		REQUIRE(! storage.created());
+
+		REQUIRE(storage.getUserHeader(0) == "user header data");
+		REQUIRE(storage.count() == static_cast<size_t>(n_blocks + 1));
+
+		int n_ok = 0;
+		for (int i = 0; i < n_blocks; i++)
+			if (check_block(storage, static_cast<block_id_t>(1 + i), static_cast<char>('a' + (i % 26))))
+				n_ok++;
+		REQUIRE(n_ok == n_blocks);
+
+		REQUIRE(storage.close());
+	}
+
+	std::remove(pathname.c_str());
+}
+
+template <typename BlockStorageT>
+static void range_io(BlockStorageT& storage, const std::string& pathname, int n_blocks)
+{
+	typedef milliways::block_id_t block_id_t;
+
+	std::remove(pathname.c_str());
+
+	REQUIRE(storage.open());
+
+	block_id_t first_id = storage.allocId(n_blocks);
+	REQUIRE(first_id != milliways::BLOCK_ID_INVALID);
+
+	std::string src(static_cast<size_t>(n_blocks) * BLOCK_SIZE, '\0');
+	for (int i = 0; i < n_blocks; i++)
+		memset(&src[static_cast<size_t>(i) * BLOCK_SIZE], 'A' + (i % 26), BLOCK_SIZE);
+
+	REQUIRE(storage.writeRange(first_id, n_blocks, src.data()));
+
+	std::string dst(src.size(), '\0');
+	REQUIRE(storage.readRange(first_id, n_blocks, &dst[0]));
+	REQUIRE(dst == src);
+
+	/* blocks reached through get()/put() see the span, and the span sees them */
+	REQUIRE(check_block(storage, first_id + 1, 'B'));
+	fill_block(storage, first_id + 2, 'z');
+	REQUIRE(storage.readRange(first_id, n_blocks, &dst[0]));
+	REQUIRE(dst[2 * BLOCK_SIZE] == 'z');
+	REQUIRE(dst[3 * BLOCK_SIZE - 1] == 'z');
+	REQUIRE(dst[3 * BLOCK_SIZE] == 'D');
+
+	REQUIRE(storage.writeRange(first_id, n_blocks, src.data()));
+	REQUIRE(check_block(storage, first_id + 2, 'C'));
+
+	/* spans can't go past the allocated blocks */
+	REQUIRE(! storage.readRange(first_id, n_blocks + 1, &dst[0]));
+
+	REQUIRE(storage.close());
+
+	REQUIRE(storage.open());
+	REQUIRE(storage.readRange(first_id, n_blocks, &dst[0]));
+	REQUIRE(dst == src);
+	REQUIRE(storage.close());
+
+	std::remove(pathname.c_str());
+}
+
+/* stream engine counting the write calls that reach the file */
+class CountingFileIO : public milliways::StreamFileIO
+{
+public:
+	bool write(const char* src, size_t size, uint64_t offset)
+	{
+		s_n_writes++;
+		s_n_bytes += size;
+		return milliways::StreamFileIO::write(src, size, offset);
+	}
+
+	bool read(char* dst, size_t size, uint64_t offset)
+	{
+		s_n_reads++;
+		return milliways::StreamFileIO::read(dst, size, offset);
+	}
+
+	static void reset() { s_n_writes = 0; s_n_bytes = 0; s_n_reads = 0; }
+
+	static int s_n_writes;
+	static size_t s_n_bytes;
+	static int s_n_reads;
+};
+
+int CountingFileIO::s_n_writes = 0;
+size_t CountingFileIO::s_n_bytes = 0;
+int CountingFileIO::s_n_reads = 0;
+
+/* stream engine whose reads, or span writes, fail on demand (a single block write failing asserts) */
+class FailingFileIO : public milliways::StreamFileIO
+{
+public:
+	bool read(char* dst, size_t size, uint64_t offset)
+	{
+		if (s_failing_reads)
+			return false;
+		return milliways::StreamFileIO::read(dst, size, offset);
+	}
+
+	bool write(const char* src, size_t size, uint64_t offset)
+	{
+		if (s_failing && (size > BLOCK_SIZE))
+			return false;
+		return milliways::StreamFileIO::write(src, size, offset);
+	}
+
+	static bool s_failing;
+	static bool s_failing_reads;
+};
+
+bool FailingFileIO::s_failing = false;
+bool FailingFileIO::s_failing_reads = false;
+
+template <typename BlockStorageT>
+static void free_space(BlockStorageT& storage, const std::string& pathname)
+{
+	typedef milliways::block_id_t block_id_t;
+
+	std::remove(pathname.c_str());
+
+	REQUIRE(storage.open());
+
+	block_id_t first_id = storage.allocId(10);
+	block_id_t last_id = storage.allocId(1);	/* keeps the free blocks away from the end */
+	REQUIRE(storage.freeBlocks() == 0);
+
+	/* adjacent extents are coalesced */
+	REQUIRE(storage.dispose(first_id + 2, 2));
+	REQUIRE(storage.dispose(first_id + 6, 3));
+	REQUIRE(storage.freeExtents() == 2);
+	REQUIRE(storage.dispose(first_id + 4, 2));
+	REQUIRE(storage.freeExtents() == 1);
+	REQUIRE(storage.freeBlocks() == 7);
+
+	/* blocks can't be disposed twice */
+	REQUIRE(! storage.dispose(first_id + 3, 1));
+
+	/* allocations reuse free blocks before growing */
+	block_id_t next_id = storage.allocId(1);
+	REQUIRE(next_id == first_id + 2);
+	REQUIRE(storage.freeBlocks() == 6);
+
+	REQUIRE(storage.close());
+
+	/* the free space map is persisted */
+	REQUIRE(storage.open());
+	REQUIRE(storage.freeBlocks() == 5);		/* one of them holds the free space map itself */
+	block_id_t reused_id = storage.allocId(5);
+	REQUIRE(reused_id > first_id + 2);
+	REQUIRE(reused_id + 5 <= last_id);
+	REQUIRE(storage.freeBlocks() == 0);
+	block_id_t tail_id = storage.allocId(1);
+	REQUIRE(tail_id > last_id);
+
+	/* allocations below a limit take the first extent that fits */
+	REQUIRE(storage.dispose(first_id, 2));
+	REQUIRE(! milliways::block_id_valid(storage.allocIdBelow(first_id + 1, 2)));
+	REQUIRE(storage.allocIdBelow(first_id + 2, 2) == first_id);
+
+	/* free blocks at the end are given back */
+	REQUIRE(storage.dispose(tail_id, 1));
+	REQUIRE(storage.truncate());
+	REQUIRE(storage.nextId() <= tail_id + 1);	/* the header extension can land there */
+	REQUIRE(storage.close());
+
+	std::remove(pathname.c_str());
+}
+
+/* decoded form of a block holding a C string */
+class StringPayload : public milliways::BlockPayload<BLOCK_SIZE>
+{
+public:
+	StringPayload(const std::string& text) : m_text(text) {}
+
+	bool encode(milliways::Block<BLOCK_SIZE>& dst) { strcpy(dst.data(), m_text.c_str()); return true; }
+	size_t footprint() const { return sizeof(*this) + m_text.capacity(); }
+
+	std::string m_text;
+};
+
+template <typename BlockStorageT>
+static void decoded_pages(BlockStorageT& storage, const std::string& pathname)
+{
+	typedef XTYPENAME BlockStorageT::block_t block_t;
+
+	std::remove(pathname.c_str());
+
+	REQUIRE(storage.open());
+
+	milliways::block_id_t block_id = storage.allocId(1);
+	{
+		milliways::shptr<block_t> block = storage.get(block_id);
+		REQUIRE(block);
+		REQUIRE(block->state() == block_t::PAGE_SERIALIZED);
+		strcpy(block->data(), "serialized");
+
+		StringPayload* payload = new StringPayload("serialized");
+		block->payload(payload);
+		REQUIRE(block->state() == block_t::PAGE_BOTH);
+		REQUIRE(storage.get(block_id)->payload() == payload);
+
+		/* a modified payload is the only copy of the page */
+		payload->m_text = "decoded";
+		block->modified();
+		REQUIRE(block->state() == block_t::PAGE_DECODED);
+		REQUIRE(block->dirty());
+		if (! block->mapped())
+			REQUIRE(block->footprint() == payload->footprint());
+
+		/* the data is re-encoded on demand */
+		REQUIRE(std::string(block->data()) == "decoded");
+		REQUIRE(block->state() == block_t::PAGE_BOTH);
+
+		/* and when written back */
+		payload->m_text = "written back";
+		block->modified();
+	}
+	REQUIRE(storage.close());
+
+	REQUIRE(storage.open());
+	{
+		milliways::shptr<block_t> block = storage.get(block_id);
+		REQUIRE(block);
+		REQUIRE(block->state() == block_t::PAGE_SERIALIZED);
+		REQUIRE(std::string(block->data()) == "written back");
+
+		/* span writes replace the payload along with the data */
+		block->payload(new StringPayload("written back"));
+		std::string span(BLOCK_SIZE, '\0');
+		strcpy(&span[0], "span");
+		REQUIRE(storage.writeRange(block_id, 1, span.data()));
+		REQUIRE(block->state() == block_t::PAGE_SERIALIZED);
+		REQUIRE(std::string(storage.get(block_id)->data()) == "span");
+	}
+	REQUIRE(storage.close());
+
+	std::remove(pathname.c_str());
+}
+
+TEST_CASE( "File block storage", "[FileBlockStorage]" ) {
+	typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE> blockstorage_t;
+
+	const std::string test_pathname("./test_blockstorage");
+
+	SECTION( "writes and reads back blocks" ) {
+		blockstorage_t storage(test_pathname);
+		write_and_read_back(storage, test_pathname, 4 * CACHE_SIZE);
+	}
+
+	SECTION( "reads and writes block spans" ) {
+		blockstorage_t storage(test_pathname);
+		range_io(storage, test_pathname, 3 * CACHE_SIZE);
+	}
+
+	SECTION( "reuses disposed blocks" ) {
+		blockstorage_t storage(test_pathname);
+		free_space(storage, test_pathname);
+	}
+
+	SECTION( "caches pages in serialized and decoded form" ) {
+		blockstorage_t storage(test_pathname);
+		decoded_pages(storage, test_pathname);
+	}
+
+	SECTION( "writes back only dirty blocks, coalesced" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, CountingFileIO> counting_blockstorage_t;
+
+		std::remove(test_pathname.c_str());
+
+		counting_blockstorage_t storage(test_pathname);
+		REQUIRE(storage.open());
+
+		milliways::block_id_t first_id = storage.allocId(3 * CACHE_SIZE);
+
+		/* out of order puts end up in a single sorted write */
+		for (int i = CACHE_SIZE - 1; i >= 0; i--)
+			fill_block(storage, first_id + i, static_cast<char>('a' + i));
+
+		CountingFileIO::reset();
+		REQUIRE(storage.flush());
+		REQUIRE(CountingFileIO::s_n_bytes == static_cast<size_t>((CACHE_SIZE + 1) * BLOCK_SIZE));	/* + header */
+		REQUIRE(CountingFileIO::s_n_writes == 2);
+
+		/* clean blocks are dropped silently, rewriting the same contents doesn't dirty them */
+		CountingFileIO::reset();
+		XTYPENAME counting_blockstorage_t::block_t same(first_id + 1);
+		memset(same.data(), 'b', same.size());
+		REQUIRE(storage.put(same));
+		for (int i = CACHE_SIZE; i < 3 * CACHE_SIZE; i++)
+			REQUIRE(check_block(storage, first_id + i, '\0'));
+		REQUIRE(CountingFileIO::s_n_writes == 0);
+
+		/* evicting a dirty block takes its dirty neighbours along */
+		for (int i = 0; i < CACHE_SIZE; i++)
+			fill_block(storage, first_id + CACHE_SIZE + i, 'x');
+		fill_block(storage, first_id, 'y');
+		REQUIRE(CountingFileIO::s_n_writes == 1);
+		REQUIRE(CountingFileIO::s_n_bytes == static_cast<size_t>(CACHE_SIZE * BLOCK_SIZE));
+
+		REQUIRE(storage.close());
+
+		REQUIRE(storage.open());
+		REQUIRE(check_block(storage, first_id, 'y'));
+		for (int i = 1; i < CACHE_SIZE; i++)
+			REQUIRE(check_block(storage, first_id + i, static_cast<char>('a' + i)));
+		for (int i = CACHE_SIZE; i < 2 * CACHE_SIZE; i++)
+			REQUIRE(check_block(storage, first_id + i, 'x'));
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "reads ahead consecutive blocks with one transfer" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, CountingFileIO> counting_blockstorage_t;
+		typedef milliways::block_id_t block_id_t;
+
+		std::remove(test_pathname.c_str());
+
+		counting_blockstorage_t storage(test_pathname);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(32);
+		for (int i = 0; i < 32; i++)
+			fill_block(storage, first_id + i, static_cast<char>('a' + i));
+		REQUIRE(storage.close());
+
+		REQUIRE(storage.open());
+		storage.cacheCapacity(64);
+		CountingFileIO::reset();
+
+		/* unknown ids are skipped, runs are read whole */
+		block_id_t ids[] = { first_id + 6, first_id + 4, first_id + 3, first_id + 5, first_id + 10, first_id + 11, first_id + 20, milliways::BLOCK_ID_INVALID, first_id + 1000 };
+		std::vector<block_id_t> block_ids(ids, ids + sizeof(ids) / sizeof(ids[0]));
+		REQUIRE(storage.prefetch(block_ids) == 7);
+		REQUIRE(CountingFileIO::s_n_reads == 3);
+		for (size_t i = 0; i < 7; i++)
+			REQUIRE(check_block(storage, block_ids[i], static_cast<char>('a' + (block_ids[i] - first_id))));
+		REQUIRE(! storage.cached(first_id + 7));
+		REQUIRE(CountingFileIO::s_n_reads == 3);
+
+		/* cached blocks aren't read again, a quarter of the cache at most */
+		REQUIRE(storage.prefetch(block_ids) == 0);
+		block_ids.clear();
+		for (int i = 0; i < 32; i++)
+			block_ids.push_back(first_id + i);
+		REQUIRE(storage.prefetch(block_ids) == 16);
+		REQUIRE(storage.cached(first_id + 22));
+		REQUIRE(! storage.cached(first_id + 23));
+		REQUIRE(check_block(storage, first_id + 31, static_cast<char>('a' + 31)));
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "keeps dirty blocks cached when their write back fails" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, FailingFileIO> failing_blockstorage_t;
+		typedef milliways::block_id_t block_id_t;
+
+		std::remove(test_pathname.c_str());
+
+		failing_blockstorage_t storage(test_pathname);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(2 * CACHE_SIZE);
+		for (int i = 0; i < CACHE_SIZE; i++)
+			fill_block(storage, first_id + i, 'a');
+
+		/* the eviction writes back the dirty run, which fails: nothing is dropped */
+		FailingFileIO::s_failing = true;
+		REQUIRE(check_block(storage, first_id + CACHE_SIZE, '\0'));
+		for (int i = 0; i < CACHE_SIZE; i++)
+			REQUIRE(storage.cached(first_id + i));
+		REQUIRE(! storage.flush());
+		FailingFileIO::s_failing = false;
+
+		for (int i = 0; i < CACHE_SIZE; i++)
+			REQUIRE(check_block(storage, first_id + i, 'a'));
+		REQUIRE(storage.flush());
+		REQUIRE(storage.close());
+
+		REQUIRE(storage.open());
+		for (int i = 0; i < CACHE_SIZE; i++)
+			REQUIRE(check_block(storage, first_id + i, 'a'));
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "doesn't cache blocks it can't read" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, FailingFileIO> failing_blockstorage_t;
+		typedef milliways::block_id_t block_id_t;
+
+		std::remove(test_pathname.c_str());
+
+		failing_blockstorage_t storage(test_pathname);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(4);
+		for (int i = 0; i < 4; i++)
+			fill_block(storage, first_id + i, 'a');
+		REQUIRE(storage.close());
+
+		REQUIRE(storage.open());
+		block_id_t unwritten_id = storage.allocId(1);
+
+		FailingFileIO::s_failing_reads = true;
+		REQUIRE(! storage.get(first_id));
+		REQUIRE(! storage.cached(first_id));
+		FailingFileIO::s_failing_reads = false;
+
+		/* the next get() reads it again, allocated blocks past the end of the file are zeros */
+		REQUIRE(check_block(storage, first_id, 'a'));
+		REQUIRE(check_block(storage, unwritten_id, '\0'));
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+}
+
+static bool copy_file(const std::string& src_pathname, const std::string& dst_pathname)
+{
+	std::ifstream src(src_pathname.c_str(), std::ifstream::binary);
+	std::ofstream dst(dst_pathname.c_str(), std::ofstream::binary | std::ofstream::trunc);
+	if ((! src.is_open()) || (! dst.is_open()))
+		return false;
+	dst << src.rdbuf();
+	return dst.good();
+}
+
+TEST_CASE( "Copy-on-write file block storage", "[FileBlockStorage][CopyOnWrite]" ) {
+	typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE> blockstorage_t;
+	typedef milliways::block_id_t block_id_t;
+
+	const std::string test_pathname("./test_blockstorage_cow");
+	const std::string crash_pathname("./test_blockstorage_cow.crash");
+
+	SECTION( "writes and reads back blocks" ) {
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		write_and_read_back(storage, test_pathname, 4 * CACHE_SIZE);
+	}
+
+	SECTION( "reads and writes block spans" ) {
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		range_io(storage, test_pathname, 3 * CACHE_SIZE);
+	}
+
+	SECTION( "reuses disposed blocks" ) {
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		free_space(storage, test_pathname);
+	}
+
+	SECTION( "rolls back to the last commit after a crash" ) {
+		const int n_blocks = 4 * CACHE_SIZE;
+
+		std::remove(test_pathname.c_str());
+
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		REQUIRE(storage.open());
+		REQUIRE(storage.copyOnWrite());
+		int uid = storage.allocUserHeader();
+		storage.setUserHeader(uid, "first");
+		block_id_t first_id = storage.allocId(n_blocks);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'a');
+		REQUIRE(storage.flush());
+		uint64_t first_seq = storage.commitSeq();
+
+		/* evictions write the changes out, but not over the committed blocks */
+		storage.setUserHeader(uid, "second");
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'b');
+		REQUIRE(storage.dispose(first_id, 2));
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+
+		{
+			blockstorage_t crashed(crash_pathname);
+			REQUIRE(crashed.open());
+			REQUIRE(crashed.copyOnWrite());
+			REQUIRE(crashed.commitSeq() == first_seq);
+			REQUIRE(crashed.getUserHeader(uid) == "first");
+			for (int i = 0; i < n_blocks; i++)
+				REQUIRE(check_block(crashed, first_id + i, 'a'));
+			REQUIRE(crashed.close());
+		}
+
+		/* once committed, a torn header slot falls back to the previous one */
+		REQUIRE(storage.flush());
+		REQUIRE(storage.commitSeq() == first_seq + 1);
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+
+		{
+			blockstorage_t crashed(crash_pathname);
+			REQUIRE(crashed.open());
+			REQUIRE(crashed.commitSeq() == first_seq + 1);
+			REQUIRE(crashed.getUserHeader(uid) == "second");
+			for (int i = 2; i < n_blocks; i++)
+				REQUIRE(check_block(crashed, first_id + i, 'b'));
+			REQUIRE(crashed.close());
+		}
+
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+		{
+			std::fstream torn(crash_pathname.c_str(), std::fstream::binary | std::fstream::in | std::fstream::out);
+			torn.seekp(static_cast<std::streamoff>((first_seq % 2) * BLOCK_SIZE + 100));
+			torn.write("torn", 4);
+		}
+		{
+			blockstorage_t crashed(crash_pathname);
+			REQUIRE(crashed.open());
+			REQUIRE(crashed.commitSeq() == first_seq);
+			REQUIRE(crashed.getUserHeader(uid) == "first");
+			for (int i = 0; i < n_blocks; i++)
+				REQUIRE(check_block(crashed, first_id + i, 'a'));
+			REQUIRE(crashed.close());
+		}
+
+		REQUIRE(storage.close());
+
+		/* the mode sticks to the file, a plain file can't be opened in it */
+		{
+			blockstorage_t reopened(test_pathname);
+			REQUIRE(reopened.open());
+			REQUIRE(reopened.copyOnWrite());
+			REQUIRE(reopened.getUserHeader(uid) == "second");
+			REQUIRE(reopened.close());
+		}
+
+		std::remove(test_pathname.c_str());
+		{
+			blockstorage_t plain(test_pathname);
+			REQUIRE(plain.open());
+			REQUIRE(! plain.copyOnWrite());
+			REQUIRE(plain.close());
+		}
+		{
+			blockstorage_t cow(test_pathname);
+			cow.copyOnWrite(true);
+			REQUIRE(! cow.open());
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+	}
+
+	SECTION( "keeps the page table when a write back fails" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, FailingFileIO> failing_blockstorage_t;
+		const int n_blocks = CACHE_SIZE / 2;
+
+		std::remove(test_pathname.c_str());
+
+		failing_blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(n_blocks);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'a');
+		REQUIRE(storage.flush());
+		size_t n_retired = storage.retiredCount();
+
+		/* the committed data blocks are neither remapped nor retired */
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'b');
+		FailingFileIO::s_failing = true;
+		REQUIRE(! storage.flush());
+		REQUIRE(! storage.flush());
+		FailingFileIO::s_failing = false;
+		REQUIRE(storage.retiredCount() == n_retired + 1);	/* the header block, written fine */
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+		{
+			failing_blockstorage_t crashed(crash_pathname);
+			REQUIRE(crashed.open());
+			for (int i = 0; i < n_blocks; i++)
+				REQUIRE(check_block(crashed, first_id + i, 'a'));
+			REQUIRE(crashed.close());
+		}
+
+		/* the dirty blocks are still cached, a later flush writes them */
+		ssize_t failed_size = storage.io().size();
+		REQUIRE(storage.flush());
+		REQUIRE(storage.retiredCount() >= n_retired);
+		REQUIRE(storage.close());
+		{
+			failing_blockstorage_t reopened(test_pathname);
+			REQUIRE(reopened.open());
+			for (int i = 0; i < n_blocks; i++)
+				REQUIRE(check_block(reopened, first_id + i, 'b'));
+			REQUIRE(reopened.io().size() <= failed_size + static_cast<ssize_t>((n_blocks + 2) * BLOCK_SIZE));
+			REQUIRE(reopened.close());
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+	}
+
+	SECTION( "snapshots keep their blocks until released" ) {
+		const int n_blocks = 4 * CACHE_SIZE;
+
+		std::remove(test_pathname.c_str());
+
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(n_blocks);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'a');
+
+		/* taken without a commit, dirty blocks included */
+		milliways::shptr<blockstorage_t::Snapshot> first = storage.snapshot();
+		REQUIRE(first);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'b');
+		milliways::shptr<blockstorage_t::Snapshot> second = storage.snapshot();
+		REQUIRE(second);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'c');
+		REQUIRE(storage.dispose(first_id, 1));
+		REQUIRE(storage.flush());
+		REQUIRE(storage.snapshotCount() == 2);
+
+		std::string data(static_cast<size_t>(n_blocks) * BLOCK_SIZE, '\0');
+		REQUIRE(storage.snapshotRead(*first, first_id, n_blocks, &data[0]));
+		REQUIRE(data == std::string(data.size(), 'a'));
+		REQUIRE(storage.snapshotRead(*second, first_id, n_blocks, &data[0]));
+		REQUIRE(data == std::string(data.size(), 'b'));
+		for (int i = 1; i < n_blocks; i++)
+			REQUIRE(check_block(storage, first_id + i, 'c'));
+
+		/* the images are reclaimed oldest first, whatever the release order */
+		size_t n_retired = storage.retiredCount();
+		REQUIRE(n_retired >= static_cast<size_t>(2 * n_blocks));
+		storage.releaseSnapshot(second);
+		second.reset();
+		REQUIRE(storage.retiredCount() == n_retired);
+		REQUIRE(storage.snapshotRead(*first, first_id, n_blocks, &data[0]));
+		REQUIRE(data == std::string(data.size(), 'a'));
+		storage.releaseSnapshot(first);
+		first.reset();
+		REQUIRE(storage.snapshotCount() == 0);
+		REQUIRE(storage.retiredCount() == 0);
+
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "gives the free physical blocks back on truncate" ) {
+		const int n_blocks = 4 * CACHE_SIZE;
+
+		std::remove(test_pathname.c_str());
+
+		blockstorage_t storage(test_pathname);
+		storage.copyOnWrite(true);
+		REQUIRE(storage.open());
+		block_id_t first_id = storage.allocId(n_blocks);
+		for (int i = 0; i < n_blocks; i++)
+			fill_block(storage, first_id + i, 'a');
+		REQUIRE(storage.flush());
+		ssize_t full_size = storage.io().size();
+
+		/* the disposed blocks are released by the next commit */
+		REQUIRE(storage.dispose(first_id + n_blocks / 2, n_blocks / 2));
+		REQUIRE(storage.flush());
+		REQUIRE(storage.truncate());
+		REQUIRE(storage.flush());
+		REQUIRE(storage.truncate());
+		REQUIRE(storage.io().size() < full_size);
+
+		for (int i = 0; i < n_blocks / 2; i++)
+			REQUIRE(check_block(storage, first_id + i, 'a'));
+		REQUIRE(storage.close());
+
+		std::remove(test_pathname.c_str());
+	}
+}
+
+#if defined(HAVE_UNISTD_H)
+
+TEST_CASE( "Positional I/O block storage", "[FileBlockStorage][PosixFileIO]" ) {
+	typedef milliways::FileBlockStorage<BLOCK_SIZE, CACHE_SIZE, milliways::PosixFileIO> blockstorage_t;
+
+	const std::string test_pathname("./test_blockstorage_posix");
+
+	SECTION( "writes and reads back blocks" ) {
+		blockstorage_t storage(test_pathname);
+		REQUIRE(! storage.io().direct());
+		write_and_read_back(storage, test_pathname, 4 * CACHE_SIZE);
+	}
+
+	SECTION( "writes and reads back blocks in direct mode" ) {
+		blockstorage_t storage(test_pathname);
+		storage.io().direct(true);
+		REQUIRE(storage.io().direct());
+		write_and_read_back(storage, test_pathname, 4 * CACHE_SIZE);
+	}
+
+	SECTION( "reads and writes block spans in direct mode" ) {
+		blockstorage_t storage(test_pathname);
+		storage.io().direct(true);
+		range_io(storage, test_pathname, 3 * CACHE_SIZE);
+	}
+}
+
+#endif /* defined(HAVE_UNISTD_H) */
+
+#if defined(HAVE_SYS_MMAN_H)
+
+TEST_CASE( "Memory-mapped block storage", "[MmapBlockStorage]" ) {
+	typedef milliways::MmapBlockStorage<BLOCK_SIZE> blockstorage_t;
+	typedef XTYPENAME blockstorage_t::block_t block_t;
+
+	const std::string test_pathname("./test_blockstorage_mmap");
+
+	SECTION( "writes and reads back blocks across extents" ) {
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 4);
+		write_and_read_back(storage, test_pathname, 4 * CACHE_SIZE);
+	}
+
+	SECTION( "reads and writes block spans across extents" ) {
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 4);
+		range_io(storage, test_pathname, 3 * CACHE_SIZE);
+	}
+
+	SECTION( "reuses disposed blocks" ) {
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 4);
+		free_space(storage, test_pathname);
+	}
+
+	SECTION( "caches pages in serialized and decoded form" ) {
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 4);
+		decoded_pages(storage, test_pathname);
+	}
+
+	SECTION( "hands out blocks pointing into the mapping" ) {
+		std::remove(test_pathname.c_str());
+
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 4);
+		REQUIRE(storage.open());
+
+		milliways::block_id_t block_id = storage.allocId(3);
+		REQUIRE(storage.mappedBlocks() == 4);
+
+		milliways::shptr<block_t> a = storage.get(block_id);
+		milliways::shptr<block_t> b = storage.get(block_id);
+		REQUIRE(a);
+		REQUIRE(b);
+		REQUIRE(a->mapped());
+		REQUIRE(a->data() == b->data());
+		REQUIRE(a->data() == storage.address(block_id));
+
+		strcpy(a->data(), "written in place");
+		REQUIRE(std::string(b->data()) == "written in place");
+
+		/* growing the file maps a new extent without moving the old ones */
+		char* old_address = storage.address(block_id);
+		storage.allocId(10);
+		REQUIRE(storage.mappedBlocks() == 16);
+		REQUIRE(storage.address(block_id) == old_address);
+		REQUIRE(std::string(a->data()) == "written in place");
+
+		REQUIRE(storage.close());
+
+		/* the unused tail of the last extent is dropped at close */
+		FILE* f = fopen(test_pathname.c_str(), "rb");
+		REQUIRE(f);
+		fseek(f, 0, SEEK_END);
+		long file_size = ftell(f);
+		fclose(f);
+		REQUIRE(file_size == static_cast<long>(14 * BLOCK_SIZE));
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "takes the block count from the header after a crash" ) {
+		const std::string crash_pathname("./test_blockstorage_mmap.crash");
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+
+		blockstorage_t storage(test_pathname, /* extent_blocks */ 16);
+		REQUIRE(storage.open());
+		milliways::block_id_t block_id = storage.allocId(5);
+		fill_block(storage, block_id + 4, 'z');
+		REQUIRE(storage.flush());
+		size_t n_blocks = storage.count();
+		REQUIRE(n_blocks < 16);
+
+		/* the file still spans the whole extent when the process dies */
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+		REQUIRE(storage.close());
+
+		blockstorage_t crashed(crash_pathname, /* extent_blocks */ 16);
+		REQUIRE(crashed.open());
+		REQUIRE(crashed.count() == n_blocks);
+		REQUIRE(check_block(crashed, block_id + 4, 'z'));
+		REQUIRE(crashed.allocId(1) == static_cast<milliways::block_id_t>(n_blocks));
+		REQUIRE(crashed.close());
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+	}
+}
+
+#endif /* defined(HAVE_SYS_MMAN_H) */
@@ -21,6 +21,10 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 
+#include <functional>
+#include <sstream>
+#include <fstream>
+
 #include "Seriously.h"
 #include "BTreeNode.h"
 #include "BTree.h"
@@ -29,6 +33,24 @@
 #define B_TEST      4
 #define BLOCK_SIZE  4096
 
+static bool copy_file(const std::string& src_pathname, const std::string& dst_pathname)
+{
+	std::ifstream src(src_pathname.c_str(), std::ifstream::binary);
+	std::ofstream dst(dst_pathname.c_str(), std::ofstream::binary | std::ofstream::trunc);
+	if ((! src.is_open()) || (! dst.is_open()))
+		return false;
+	dst << src.rdbuf();
+	return dst.good();
+}
+
+static std::string file_contents(const std::string& pathname)
+{
+	std::ifstream src(pathname.c_str(), std::ifstream::binary);
+	std::ostringstream contents;
+	contents << src.rdbuf();
+	return contents.str();
+}
+
 TEST_CASE( "BTree File Storage", "[BTreeFileStorage]" ) {
 	typedef milliways::BTree<B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t> > btree_t;
 	typedef milliways::BTreeMemoryStorage<B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t> > btree_mem_st_t;
@@ -100,9 +122,128 @@ TEST_CASE( "BTree File Storage", "[BTreeFileStorage]" ) {
 		std::remove(test_pathname.c_str());
 	}
 
+	/* rewrites the tree header with another format version (-1: none, as before versions) */
+	auto set_header_format = [](const std::string& pathname, int format) -> bool {
+		btree_blockstorage_t bs(pathname);
+		int uid = bs.allocUserHeader();
+		if (! bs.open())
+			return false;
+		std::string header = bs.getUserHeader(uid);
+		seriously::Packer<240> unpacker(header);
+		std::string prefix;
+		uint32_t v_B, v_BLOCKSIZE, v_format;
+		uint64_t v_size, v_root_id;
+		unpacker >> prefix >> v_B >> v_BLOCKSIZE >> v_size >> v_root_id >> v_format;
+
+		seriously::Packer<240> packer;
+		packer << prefix << v_B << v_BLOCKSIZE << v_size << v_root_id;
+		if (format >= 0)
+			packer << static_cast<uint32_t>(format);
+		bs.setUserHeader(uid, std::string(packer.data(), packer.size()));
+		return bs.close() && (prefix == "MWB+TREE");
+	};
+
+	SECTION( "migrates files of an older tree format" ) {
+		const std::string test_pathname("./test_tree");
+		const int n = 300;
+
+		std::remove(test_pathname.c_str());
+		{
+			btree_t tree;
+			btree_fs_t* storage = new btree_fs_t(test_pathname);
+			storage->attach(&tree);
+			REQUIRE(tree.open());
+			for (int i = 0; i < n; i++)
+				tree.insert(std::to_string(i), i);
+			REQUIRE(tree.close());
+			storage->detach();
+			delete storage;
+		}
+
+		/* the tree header as written before the format version */
+		REQUIRE(set_header_format(test_pathname, -1));
+
+		/* migrated on open, then usable as any other tree */
+		{
+			btree_t tree;
+			btree_fs_t* storage = new btree_fs_t(test_pathname);
+			storage->attach(&tree);
+			REQUIRE(tree.open());
+			REQUIRE(storage->format() == btree_fs_t::FORMAT_VERSION);
+			int32_t value = -1;
+			for (int i = 0; i < n; i++)
+			{
+				REQUIRE(tree.find(std::to_string(i), value));
+				REQUIRE(value == i);
+			}
+			XTYPENAME btree_t::lookup_type lookup;
+			for (int i = 0; i < n; i += 2)
+				REQUIRE(tree.remove(lookup, std::to_string(i)));
+			REQUIRE(tree.close());
+			storage->detach();
+			delete storage;
+		}
+		{
+			btree_t tree;
+			btree_fs_t* storage = new btree_fs_t(test_pathname);
+			storage->attach(&tree);
+			REQUIRE(tree.open());
+			REQUIRE(storage->format() == btree_fs_t::FORMAT_VERSION);
+			int32_t value = -1;
+			for (int i = 0; i < n; i++)
+				REQUIRE(tree.find(std::to_string(i), value) == ((i % 2) == 1));
+			REQUIRE(tree.close());
+			storage->detach();
+			delete storage;
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "leaves files of a newer tree format untouched" ) {
+		const std::string test_pathname("./test_tree");
+
+		/* a close would write back the header, and commit a copy-on-write epoch */
+		for (int cow = 0; cow < 2; cow++)
+		{
+			std::remove(test_pathname.c_str());
+			{
+				btree_t tree;
+				btree_fs_t* storage = new btree_fs_t(test_pathname);
+				storage->copyOnWrite(cow == 1);
+				storage->attach(&tree);
+				REQUIRE(tree.open());
+				for (int i = 0; i < 100; i++)
+					tree.insert(std::to_string(i), i);
+				REQUIRE(tree.close());
+				storage->detach();
+				delete storage;
+			}
+			REQUIRE(set_header_format(test_pathname, btree_fs_t::FORMAT_VERSION + 1));
+			std::string before = file_contents(test_pathname);
+			REQUIRE(! before.empty());
+
+			{
+				btree_t tree;
+				btree_fs_t* storage = new btree_fs_t(test_pathname);
+				storage->copyOnWrite(cow == 1);
+				storage->attach(&tree);
+				REQUIRE(! tree.open());
+				REQUIRE(! tree.isOpen());
+				storage->detach();
+				delete storage;
+			}
+			REQUIRE(file_contents(test_pathname) == before);
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
 	SECTION( "can serialize/deserialize a node" ) {
 		btree_node_id_t root_id;
 
+		std::remove("./test_tree_2");
+
 		std::cerr << "CREATE AND WRITE" << std::endl;
 		{
 			btree_t tree;
@@ -246,4 +387,436 @@ TEST_CASE( "BTree File Storage", "[BTreeFileStorage]" ) {
 
 		std::remove(test_pathname.c_str());
 	}
+
+	SECTION( "nodes are cached once, as payloads of their blocks" ) {
+		typedef XTYPENAME btree_fs_t::block_t btree_block_t;
+		typedef XTYPENAME btree_fs_t::node_view_type btree_node_view_t;
+
+		const std::string test_pathname("./test_tree");
+
+		std::remove(test_pathname.c_str());
+
+		btree_t tree;
+
+		btree_blockstorage_t* bs = new btree_blockstorage_t(test_pathname);
+		btree_fs_t* storage = new btree_fs_t(bs);
+		storage->attach(&tree);
+
+		tree.open();
+		REQUIRE(tree.isOpen());
+
+		for (int i = 0; i < 200; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			tree.insert(ss.str(), i);
+		}
+
+		btree_node_ptr_t root = tree.node_get(tree.rootId());
+		REQUIRE(root);
+
+		/* the node replaces the serialized copy in the block cache */
+		milliways::shptr<btree_block_t> block = bs->cached(static_cast<milliways::block_id_t>(root->id()));
+		REQUIRE(block);
+		REQUIRE(block->state() == btree_block_t::PAGE_DECODED);
+		REQUIRE(block->footprint() == sizeof(btree_node_t));
+
+		btree_node_view_t view;
+		REQUIRE(storage->node_view(root->id(), view));
+		REQUIRE(view.materialized());
+
+		/* written back, the page keeps both forms */
+		REQUIRE(storage->flush());
+		REQUIRE(block->state() == btree_block_t::PAGE_BOTH);
+		REQUIRE(! block->dirty());
+
+		/* reads leave it clean, only an update dirties it */
+		XTYPENAME btree_t::lookup_type where;
+		REQUIRE(tree.search(where, "key-100"));
+		REQUIRE(tree.node_get(tree.rootId()) == root);
+		REQUIRE(! block->dirty());
+		REQUIRE(block->state() == btree_block_t::PAGE_BOTH);
+		tree.update("key-100", 1000);
+		REQUIRE(bs->cached(static_cast<milliways::block_id_t>(where.node()->id()))->dirty());
+		REQUIRE(storage->flush());
+
+		/* keys on the heap count too */
+		const std::string long_key = std::string(200, 'z') + "-1";
+		tree.insert(long_key, 1);
+		REQUIRE(tree.search(where, long_key));
+		block = bs->cached(static_cast<milliways::block_id_t>(where.node()->id()));
+		REQUIRE(block);
+		REQUIRE(block->state() == btree_block_t::PAGE_DECODED);
+		REQUIRE(block->footprint() >= sizeof(btree_node_t) + long_key.size());
+
+		tree.close();
+		storage->detach();
+		delete storage;
+		delete bs;
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "node views read blocks in place" ) {
+		typedef XTYPENAME btree_fs_t::node_view_type btree_node_view_t;
+
+		const std::string test_pathname("./test_tree");
+		const int n_keys = 200;
+
+		std::remove(test_pathname.c_str());
+
+		{
+			btree_t tree;
+
+			btree_fs_t* storage = new btree_fs_t(test_pathname);
+			storage->attach(&tree);
+
+			tree.open();
+			REQUIRE(tree.isOpen());
+
+			for (int i = 0; i < n_keys; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				tree.insert(ss.str(), i);
+			}
+
+			/* nodes still cached (and newer than their blocks) */
+			int32_t value = -1;
+			REQUIRE(tree.find("key-17", value));
+			REQUIRE(value == 17);
+			REQUIRE(! tree.find("key-x", value));
+
+			tree.close();
+			storage->detach();
+			delete storage;
+		}
+
+		{
+			btree_t tree;
+
+			btree_fs_t* storage = new btree_fs_t(test_pathname);
+			storage->attach(&tree);
+
+			tree.open();
+			REQUIRE(tree.isOpen());
+
+			/* leaves are read straight from their blocks */
+			btree_node_view_t view;
+			REQUIRE(storage->node_view(tree.rootId(), view));
+			REQUIRE(! view.leaf());
+			while (! view.leaf())
+				REQUIRE(storage->node_view(view.child(0), view));
+			REQUIRE(! view.materialized());
+			REQUIRE(view.n() > 0);
+
+			int n_found = 0;
+			for (int i = 0; i < n_keys; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				int32_t value = -1;
+				if (tree.find(ss.str(), value) && (value == i))
+					n_found++;
+			}
+			REQUIRE(n_found == n_keys);
+
+			/* the view agrees with the materialized node */
+			btree_node_ptr_t node = tree.node_get(view.id());
+			REQUIRE(node);
+			REQUIRE(node->n() == view.n());
+			REQUIRE(node->rightId() == view.rightId());
+			for (int i = 0; i < view.n(); i++)
+			{
+				REQUIRE(node->key(i) == view.key(i));
+				int32_t value = -1;
+				REQUIRE(view.value(i, value));
+				REQUIRE(node->value(i) == value);
+			}
+
+			tree.close();
+			storage->detach();
+			delete storage;
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "the top levels stay pinned in the block cache" ) {
+		typedef XTYPENAME btree_fs_t::node_view_type btree_node_view_t;
+
+		const std::string test_pathname("./test_tree");
+		const int n_keys = 2000;
+
+		std::remove(test_pathname.c_str());
+
+		btree_t tree;
+
+		btree_blockstorage_t* bs = new btree_blockstorage_t(test_pathname, 64);
+		btree_fs_t* storage = new btree_fs_t(bs);
+		storage->attach(&tree);
+		REQUIRE(storage->pinnedLevels() == MILLIWAYS_DEFAULT_PINNED_LEVELS);
+
+		tree.open();
+		REQUIRE(tree.isOpen());
+
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			tree.insert(ss.str(), i);
+		}
+
+		/* the root and its children, not the leaves, whatever the leaf traffic */
+		int n_found = 0;
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			int32_t value = -1;
+			if (tree.find(ss.str(), value) && (value == i))
+				n_found++;
+		}
+		REQUIRE(n_found == n_keys);
+		REQUIRE(bs->cacheSize() <= 64);
+
+		btree_node_view_t view;
+		REQUIRE(storage->node_view(tree.rootId(), view));
+		REQUIRE(! view.leaf());
+		REQUIRE(bs->pinned(static_cast<milliways::block_id_t>(view.id())));
+		for (int i = 0; i <= view.n(); i++)
+			REQUIRE(bs->pinned(static_cast<milliways::block_id_t>(view.child(i))));
+		REQUIRE(storage->pinnedCount() == static_cast<size_t>(view.n() + 2));
+
+		while (! view.leaf())
+			REQUIRE(storage->node_view(view.child(0), view));
+		REQUIRE(! bs->pinned(static_cast<milliways::block_id_t>(view.id())));
+
+		storage->pinnedLevels(1);
+		REQUIRE(storage->pinnedCount() == 1);
+		REQUIRE(bs->pinned(static_cast<milliways::block_id_t>(tree.rootId())));
+
+		storage->pinnedLevels(0);
+		REQUIRE(storage->pinnedCount() == 0);
+		REQUIRE(bs->pinnedCount() == 0);
+
+		tree.close();
+		storage->detach();
+		delete storage;
+		delete bs;
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "in copy-on-write mode a crash rolls back to the last flush" ) {
+		const std::string test_pathname("./test_tree_cow");
+		const std::string crash_pathname("./test_tree_cow.crash");
+		const int n_keys = 2000;
+
+		std::remove(test_pathname.c_str());
+
+		btree_t tree;
+
+		/* a small cache, so that evictions write nodes between the commits */
+		btree_blockstorage_t* bs = new btree_blockstorage_t(test_pathname, 64);
+		btree_fs_t* storage = new btree_fs_t(bs);
+		storage->copyOnWrite(true);
+		storage->attach(&tree);
+
+		tree.open();
+		REQUIRE(tree.isOpen());
+		REQUIRE(storage->copyOnWrite());
+
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			tree.insert(ss.str(), i);
+		}
+		REQUIRE(tree.flush());
+		btree_node_id_t root_id = tree.rootId();
+		size_t n_nodes = tree.size();
+
+		/* the splits reach the file through evictions before the crash */
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i << "-more";
+			tree.insert(ss.str(), n_keys + i);
+		}
+		REQUIRE(tree.size() > n_nodes);
+		REQUIRE(copy_file(test_pathname, crash_pathname));
+
+		tree.close();
+		storage->detach();
+		delete storage;
+		delete bs;
+
+		{
+			btree_t crashed;
+
+			btree_fs_t* crashed_storage = new btree_fs_t(crash_pathname);
+			crashed_storage->attach(&crashed);
+
+			crashed.open();
+			REQUIRE(crashed.isOpen());
+			REQUIRE(crashed.rootId() == root_id);
+			REQUIRE(crashed.size() == n_nodes);
+
+			int n_found = 0;
+			for (int i = 0; i < n_keys; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				int32_t value = -1;
+				if (crashed.find(ss.str(), value) && (value == i))
+					n_found++;
+				ss << "-more";
+				if (crashed.find(ss.str(), value))
+					n_found--;
+			}
+			REQUIRE(n_found == n_keys);
+
+			crashed.close();
+			crashed_storage->detach();
+			delete crashed_storage;
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+	}
+}
+
+template <typename BTreeT, typename BTreeFileStorageT>
+static void insert_reopen_and_search(const std::string& pathname, std::function<typename BTreeFileStorageT::block_storage_t* ()> make_block_storage, int n_keys)
+{
+	typedef typename BTreeT::lookup_type btree_lookup_t;
+	typedef typename BTreeFileStorageT::block_storage_t block_storage_t;
+
+	std::remove(pathname.c_str());
+
+	size_t n_nodes = 0;
+
+	{
+		BTreeT tree;
+
+		block_storage_t* bs = make_block_storage();
+		BTreeFileStorageT* storage = new BTreeFileStorageT(bs);
+		storage->attach(&tree);
+
+		tree.open();
+		REQUIRE(tree.isOpen());
+
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			tree.insert(ss.str(), i);
+		}
+		n_nodes = tree.size();
+		REQUIRE(n_nodes > 1);
+
+		tree.close();
+		storage->detach();
+		delete storage;
+		delete bs;
+	}
+
+	{
+		BTreeT tree;
+
+		block_storage_t* bs = make_block_storage();
+		BTreeFileStorageT* storage = new BTreeFileStorageT(bs);
+		storage->attach(&tree);
+
+		tree.open();
+		REQUIRE(tree.isOpen());
+		REQUIRE(tree.size() == n_nodes);
+
+		int n_found = 0;
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << i;
+			btree_lookup_t lookup;
+			if (tree.search(lookup, ss.str()) && (lookup.node()->value(lookup.pos()) == i))
+				n_found++;
+		}
+		REQUIRE(n_found == n_keys);
+
+		tree.close();
+		storage->detach();
+		delete storage;
+		delete bs;
+	}
+
+	std::remove(pathname.c_str());
+}
+
+TEST_CASE( "BTree File Storage backends", "[BTreeFileStorage]" ) {
+	typedef milliways::BTree<B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t> > btree_t;
+
+	static const int N_KEYS = 2000;
+
+	SECTION( "works on the default engine" ) {
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t> > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_default");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { return new XTYPENAME btree_fs_t::block_storage_t(test_pathname); }, N_KEYS);
+	}
+
+	SECTION( "works on the fstream engine" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, 64, milliways::StreamFileIO> stream_bs_t;
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t>, std::less<std::string>, stream_bs_t > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_stream");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { return new stream_bs_t(test_pathname); }, N_KEYS);
+	}
+
+	SECTION( "works on the default engine in copy-on-write mode" ) {
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t> > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_cow");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { XTYPENAME btree_fs_t::block_storage_t* bs = new XTYPENAME btree_fs_t::block_storage_t(test_pathname); bs->copyOnWrite(true); return bs; }, N_KEYS);
+	}
+
+#if defined(HAVE_UNISTD_H)
+	SECTION( "works on the positional I/O engine" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, 64, milliways::PosixFileIO> posix_bs_t;
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t>, std::less<std::string>, posix_bs_t > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_posix");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { return new posix_bs_t(test_pathname); }, N_KEYS);
+	}
+
+	SECTION( "works on the positional I/O engine in direct mode" ) {
+		typedef milliways::FileBlockStorage<BLOCK_SIZE, 64, milliways::PosixFileIO> posix_bs_t;
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t>, std::less<std::string>, posix_bs_t > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_direct");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { posix_bs_t* bs = new posix_bs_t(test_pathname); bs->io().direct(true); return bs; }, N_KEYS);
+	}
+#endif /* defined(HAVE_UNISTD_H) */
+
+#if defined(HAVE_SYS_MMAN_H)
+	SECTION( "works on the memory-mapped backend" ) {
+		typedef milliways::MmapBlockStorage<BLOCK_SIZE> mmap_bs_t;
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<std::string>, seriously::Traits<int32_t>, std::less<std::string>, mmap_bs_t > btree_fs_t;
+
+		const std::string test_pathname("./test_tree_mmap");
+
+		insert_reopen_and_search<btree_t, btree_fs_t>(test_pathname,
+			[&]() { return new mmap_bs_t(test_pathname, 16); }, N_KEYS);
+	}
+#endif /* defined(HAVE_SYS_MMAN_H) */
 }
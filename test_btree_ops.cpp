@@ -21,6 +21,11 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+
 #include "Seriously.h"
 #include "BTreeNode.h"
 #include "BTree.h"
@@ -473,4 +478,326 @@ TEST_CASE( "BTree Operations", "[BTreeOps]" ) {
 
 		tree.close();
 	}
+
+	SECTION( "removal rebalances the tree" ) {
+		struct L {
+			/* every node but the root holds at least B-1 keys, and all leaves are at the same depth */
+			static int check(btree_t& tree, const btree_node_ptr_t& node, bool is_root)
+			{
+				REQUIRE(node);
+				if (! is_root)
+					REQUIRE(node->n() >= (B_TEST - 1));
+				REQUIRE(node->n() <= (2 * B_TEST - 1));
+				if (node->leaf())
+					return 1;
+				int depth = -1;
+				for (int i = 0; i <= node->n(); i++)
+				{
+					btree_node_ptr_t child( node->child_node(i) );
+					REQUIRE(child);
+					REQUIRE(child->parentId() == node->id());
+					int child_depth = check(tree, child, false);
+					REQUIRE(((depth < 0) || (depth == child_depth)));
+					depth = child_depth;
+				}
+				return depth + 1;
+			}
+		};
+
+		btree_t tree;
+
+		const int n_keys = 1000;
+
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << std::setw(4) << std::setfill('0') << i;
+			tree.insert(ss.str(), i);
+		}
+		size_t n_nodes = tree.size();
+		int height = L::check(tree, tree.root(), true);
+		REQUIRE(height > 2);
+
+		/* keep one key out of ten, removing in an order that hits both ends of the nodes */
+		for (int k = 0; k < n_keys; k++)
+		{
+			int i = (k % 2) ? (n_keys - 1 - k / 2) : (k / 2);
+			if ((i % 10) == 0)
+				continue;
+			std::ostringstream ss;
+			ss << std::setw(4) << std::setfill('0') << i;
+			btree_lookup_t lookup;
+			REQUIRE(tree.remove(lookup, ss.str()));
+			REQUIRE(! tree.remove(lookup, ss.str()));
+		}
+		REQUIRE(tree.size() < n_nodes / 4);
+		REQUIRE(L::check(tree, tree.root(), true) < height);
+
+		int i = 0;
+		typedef XTYPENAME btree_t::iterator btree_iterator_t;
+		for (btree_iterator_t it = tree.begin(); it != tree.end(); ++it)
+		{
+			btree_t::lookup_type& l = *it;
+			std::ostringstream ss;
+			ss << std::setw(4) << std::setfill('0') << i;
+			REQUIRE(l.found());
+			REQUIRE(l.key() == ss.str());
+			REQUIRE(l.node()->value(l.pos()) == i);
+			i += 10;
+		}
+		REQUIRE(i == n_keys);
+
+		/* emptying the tree collapses it back to a single leaf */
+		for (i = 0; i < n_keys; i += 10)
+		{
+			std::ostringstream ss;
+			ss << std::setw(4) << std::setfill('0') << i;
+			btree_lookup_t lookup;
+			REQUIRE(tree.remove(lookup, ss.str()));
+		}
+		REQUIRE(tree.size() == 1);
+		REQUIRE(tree.root()->leaf());
+		REQUIRE(tree.root()->n() == 0);
+		REQUIRE(! tree.begin());
+
+		tree.close();
+	}
+
+	SECTION( "bulk loading builds a packed, balanced tree" ) {
+		struct L {
+			static int check(const btree_node_ptr_t& node, bool is_root)
+			{
+				REQUIRE(node);
+				if (! is_root)
+					REQUIRE(node->n() >= (B_TEST - 1));
+				REQUIRE(node->n() <= (2 * B_TEST - 1));
+				if (node->leaf())
+					return 1;
+				int depth = -1;
+				for (int i = 0; i <= node->n(); i++)
+				{
+					btree_node_ptr_t child( node->child_node(i) );
+					REQUIRE(child);
+					REQUIRE(child->parentId() == node->id());
+					if (i > 0)
+						REQUIRE(child->leftId() == node->child(i - 1));
+					int child_depth = check(child, false);
+					REQUIRE(((depth < 0) || (depth == child_depth)));
+					depth = child_depth;
+				}
+				return depth + 1;
+			}
+
+			static std::string key(int i)
+			{
+				std::ostringstream ss;
+				ss << std::setw(4) << std::setfill('0') << i;
+				return ss.str();
+			}
+		};
+
+		std::vector< std::pair<std::string, int32_t> > sorted;
+		for (int i = 0; i < 1000; i++)
+			sorted.push_back(std::make_pair(L::key(i), i));
+
+		size_t packed_nodes = 0;
+		const double fill_factors[] = { 1.0, 0.5 };
+		for (int f = 0; f < 2; f++)
+		{
+			btree_t tree;
+			REQUIRE(tree.bulk_load(sorted.begin(), sorted.end(), fill_factors[f]));
+			L::check(tree.root(), true);
+			if (f == 0)
+				packed_nodes = tree.size();
+			else
+				REQUIRE(tree.size() > packed_nodes);
+
+			int i = 0;
+			typedef XTYPENAME btree_t::iterator btree_iterator_t;
+			for (btree_iterator_t it = tree.begin(); it != tree.end(); ++it, ++i)
+			{
+				REQUIRE((*it).key() == L::key(i));
+				REQUIRE((*it).node()->value((*it).pos()) == i);
+			}
+			REQUIRE(i == 1000);
+
+			for (i = 0; i < 1000; i += 7)
+			{
+				btree_lookup_t lookup;
+				REQUIRE(tree.search(lookup, L::key(i)));
+				REQUIRE(lookup.node()->value(lookup.pos()) == i);
+			}
+
+			/* only on empty trees */
+			REQUIRE(! tree.bulk_load(sorted.begin(), sorted.end()));
+
+			/* and the tree keeps working as usual */
+			tree.insert("0005x", 5);
+			btree_lookup_t lookup;
+			REQUIRE(tree.search(lookup, "0005x"));
+			for (i = 0; i < 1000; i += 2)
+				REQUIRE(tree.remove(lookup, L::key(i)));
+			L::check(tree.root(), true);
+
+			tree.close();
+		}
+
+		/* unsorted input is refused */
+		std::vector< std::pair<std::string, int32_t> > unsorted(sorted);
+		std::swap(unsorted[10], unsorted[11]);
+		btree_t tree;
+		REQUIRE(! tree.bulk_load(unsorted.begin(), unsorted.end()));
+		REQUIRE(tree.empty());
+		tree.close();
+	}
+
+	SECTION( "the memory storage finds its nodes past the first chunks of ids" ) {
+		typedef milliways::BTree<B_TEST, seriously::Traits<int32_t>, seriously::Traits<int32_t> > int_btree_t;
+		typedef XTYPENAME int_btree_t::memory_storage_type int_mem_st_t;
+		typedef XTYPENAME int_btree_t::lookup_type int_lookup_t;
+
+		static const int N_KEYS = 100000;
+
+		int_btree_t tree;
+		for (int i = 0; i < N_KEYS; i++)
+			tree.insert(i, i);
+		// enough nodes to outgrow the first directory of chunks
+		REQUIRE(tree.size() > 16 * int_mem_st_t::node_table_type::CHUNK_SIZE);
+
+		int errors = 0;
+		for (int i = 0; i < N_KEYS; i++)
+		{
+			int32_t value = -1;
+			if ((! tree.concurrent_find(i, value)) || (value != i))
+				errors++;
+		}
+		REQUIRE(errors == 0);
+
+		// disposed nodes are gone, the others still found
+		int_lookup_t lookup;
+		for (int i = 0; i < N_KEYS; i += 2)
+			REQUIRE(tree.remove(lookup, i));
+		for (int i = 0; i < N_KEYS; i++)
+		{
+			int32_t value = -1;
+			if (tree.concurrent_find(i, value) != ((i % 2) == 1))
+				errors++;
+		}
+		REQUIRE(errors == 0);
+		REQUIRE(! tree.storage()->has_id(milliways::NODE_ID_INVALID));
+		REQUIRE(! tree.storage()->has_id(static_cast<milliways::node_id_t>(1000 * N_KEYS)));
+
+		tree.close();
+	}
+
+	SECTION( "concurrent puts and finds with optimistic lock coupling" ) {
+		typedef milliways::BTree<B_TEST, seriously::Traits<int32_t>, seriously::Traits<int32_t> > int_btree_t;
+		typedef milliways::shptr<XTYPENAME int_btree_t::node_type> int_node_ptr_t;
+
+		struct L {
+			static int check(const int_node_ptr_t& node, bool is_root)
+			{
+				REQUIRE(node);
+				if (! is_root)
+					REQUIRE(node->n() >= (B_TEST - 1));
+				REQUIRE(node->n() <= (2 * B_TEST - 1));
+				if (node->leaf())
+					return 1;
+				int depth = -1;
+				for (int i = 0; i <= node->n(); i++)
+				{
+					int_node_ptr_t child( node->child_node(i) );
+					REQUIRE(child);
+					REQUIRE(child->parentId() == node->id());
+					int child_depth = check(child, false);
+					REQUIRE(((depth < 0) || (depth == child_depth)));
+					depth = child_depth;
+				}
+				return depth + 1;
+			}
+		};
+
+		static const int N_WRITERS = 4;
+		static const int N_READERS = 2;
+		static const int N_KEYS = 20000;
+
+		int_btree_t tree;
+		REQUIRE(tree.storage()->concurrent());
+
+		// writers interleave their keys, so that they keep meeting in the same leaves
+		std::vector<int> errors(N_WRITERS + N_READERS, 0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < N_WRITERS; t++)
+		{
+			threads.push_back(std::thread([&, t]() {
+				for (int i = t; i < N_KEYS; i += N_WRITERS)
+					if (! tree.concurrent_put(i, i))
+						errors[t]++;
+				for (int i = t; i < N_KEYS; i += N_WRITERS)
+					if (! tree.concurrent_put(i, 2 * i))
+						errors[t]++;
+			}));
+		}
+		for (int t = N_WRITERS; t < N_WRITERS + N_READERS; t++)
+		{
+			threads.push_back(std::thread([&, t]() {
+				for (int round = 0; round < 4; round++)
+					for (int i = 0; i < N_KEYS; i++)
+					{
+						int32_t value = -1;
+						if (tree.concurrent_find(i, value) && (value != i) && (value != 2 * i))
+							errors[t]++;
+						if (tree.concurrent_find(N_KEYS + i, value))
+							errors[t]++;
+					}
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].join();
+
+		for (size_t t = 0; t < errors.size(); t++)
+			REQUIRE(errors[t] == 0);
+
+		for (int i = 0; i < N_KEYS; i++)
+		{
+			int32_t value = -1;
+			REQUIRE(tree.concurrent_find(i, value));
+			REQUIRE(value == 2 * i);
+		}
+		L::check(tree.root(), true);
+
+		int i = 0;
+		typedef XTYPENAME int_btree_t::iterator int_iterator_t;
+		for (int_iterator_t it = tree.begin(); it != tree.end(); ++it, ++i)
+			REQUIRE((*it).key() == i);
+		REQUIRE(i == N_KEYS);
+
+		tree.close();
+	}
+
+	SECTION( "optimistic lock coupling is refused on the file storage" ) {
+		typedef milliways::BTree<B_TEST, seriously::Traits<int32_t>, seriously::Traits<int32_t> > int_btree_t;
+		typedef milliways::BTreeFileStorage< BLOCK_SIZE, B_TEST, seriously::Traits<int32_t>, seriously::Traits<int32_t> > int_fs_t;
+
+		const std::string test_pathname("./test_tree_olc");
+		std::remove(test_pathname.c_str());
+
+		int_fs_t storage(test_pathname);
+		int_btree_t tree(&storage);
+		tree.open();
+		REQUIRE(tree.isOpen());
+		REQUIRE(! tree.storage()->concurrent());
+
+		int32_t value = -1;
+		REQUIRE(! tree.concurrent_put(1, 1));
+		REQUIRE(! tree.concurrent_find(1, value));
+
+		// the exclusive interface still works
+		REQUIRE(tree.insert(1, 1));
+		REQUIRE(tree.find(1, value));
+		REQUIRE(value == 1);
+
+		tree.close();
+		std::remove(test_pathname.c_str());
+	}
 }
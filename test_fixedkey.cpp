@@ -0,0 +1,127 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+
+#include "FixedKey.h"
+#include "BTreeNode.h"
+#include "BTree.h"
+
+typedef milliways::FixedKey<20> fixed_key_t;
+
+static int sign(int v) { return (v > 0) - (v < 0); }
+
+TEST_CASE( "FixedKey inline keys", "[FixedKey]" ) {
+
+	SECTION( "orders like std::string" ) {
+		std::vector<std::string> values;
+		values.push_back("");
+		values.push_back("a");
+		values.push_back("ab");
+		values.push_back(std::string("ab\0", 3));
+		values.push_back(std::string("ab\0\0\0\0\0\0\0", 9));
+		values.push_back("abcdefgh");
+		values.push_back("abcdefghi");
+		values.push_back("abcdefghh");
+		values.push_back("abcdefgh\xff");
+		values.push_back("\xff\xfe");
+		values.push_back("12345678901234567890");
+		values.push_back("12345678901234567899");
+		srand(7);
+		for (int i = 0; i < 200; i++)
+		{
+			std::string s(rand() % 21, '\0');
+			for (size_t j = 0; j < s.length(); j++)
+				s[j] = static_cast<char>("\0\x01" "abAB\x7f\x80\xff"[rand() % 9]);
+			values.push_back(s);
+		}
+
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			fixed_key_t a(values[i]);
+			REQUIRE(a.length() == values[i].length());
+			REQUIRE(a.str() == values[i]);
+			for (size_t j = 0; j < values.size(); j++)
+			{
+				fixed_key_t b(values[j]);
+				REQUIRE(sign(a.compare(b)) == sign(values[i].compare(values[j])));
+				REQUIRE((a < b) == (values[i] < values[j]));
+				REQUIRE((a == b) == (values[i] == values[j]));
+			}
+		}
+	}
+
+	SECTION( "serializes like std::string" ) {
+		typedef seriously::Traits<fixed_key_t> fk_traits;
+		typedef seriously::Traits<std::string> s_traits;
+
+		std::string value("some key");
+		char buf_a[64], buf_b[64];
+		char* dst_a = buf_a;
+		char* dst_b = buf_b;
+		size_t avail_a = sizeof(buf_a), avail_b = sizeof(buf_b);
+		REQUIRE(fk_traits::serialize(dst_a, avail_a, fixed_key_t(value)) == s_traits::serialize(dst_b, avail_b, value));
+		REQUIRE(memcmp(buf_a, buf_b, fk_traits::serializedsize(fixed_key_t(value))) == 0);
+
+		const char* src = buf_b;
+		size_t avail = sizeof(buf_b);
+		fixed_key_t back;
+		REQUIRE(fk_traits::deserialize(src, avail, back) > 0);
+		REQUIRE(back == fixed_key_t(value));
+		REQUIRE(back.str() == value);
+	}
+
+	SECTION( "works as a BTree key" ) {
+		typedef milliways::BTree<4, seriously::Traits<fixed_key_t>, seriously::Traits<int32_t> > btree_t;
+		typedef XTYPENAME btree_t::iterator btree_iterator_t;
+
+		REQUIRE(sizeof(fixed_key_t) <= 24);
+
+		btree_t tree;
+		std::vector<std::string> keys;
+		for (int i = 0; i < 500; i++)
+		{
+			std::string key(1 + (i * 7) % 20, static_cast<char>('a' + (i % 26)));
+			key[0] = static_cast<char>('A' + (i % 23));
+			if (std::find(keys.begin(), keys.end(), key) != keys.end())
+				continue;
+			keys.push_back(key);
+			tree.insert(key, i);
+		}
+		std::sort(keys.begin(), keys.end());
+
+		size_t n = 0;
+		for (btree_iterator_t it = tree.begin(); it != tree.end(); ++it, ++n)
+		{
+			REQUIRE(n < keys.size());
+			REQUIRE((*it).key().str() == keys[n]);
+		}
+		REQUIRE(n == keys.size());
+
+		tree.close();
+	}
+}
@@ -21,6 +21,14 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
 #include "KeyValueStore.h"
 
 static inline int rand_int(int lo, int hi)
@@ -43,6 +51,48 @@ static std::string random_string(int length)
 	return r;
 }
 
+static size_t file_size(const std::string& pathname)
+{
+	std::ifstream f(pathname.c_str(), std::ifstream::binary | std::ifstream::ate);
+	return f.is_open() ? static_cast<size_t>(f.tellg()) : 0;
+}
+
+static bool copy_file(const std::string& src_pathname, const std::string& dst_pathname)
+{
+	std::ifstream src(src_pathname.c_str(), std::ifstream::binary);
+	std::ofstream dst(dst_pathname.c_str(), std::ofstream::binary | std::ofstream::trunc);
+	if ((! src.is_open()) || (! dst.is_open()))
+		return false;
+	dst << src.rdbuf();
+	return dst.good();
+}
+
+/* an iterator telling the leaf it's on */
+class LeafIterator : public milliways::KeyValueStore::iterator
+{
+public:
+	LeafIterator(const milliways::KeyValueStore::iterator& other) : milliways::KeyValueStore::iterator(other) {}
+
+	milliways::node_id_t leafId() const { return m_view.id(); }
+	milliways::node_id_t parentId() const { return m_view.parentId(); }
+};
+
+/* a store failing its batches after a given number of tree changes */
+class FailingKeyValueStore : public milliways::KeyValueStore
+{
+public:
+	FailingKeyValueStore(block_storage_type* blockstorage) :
+		milliways::KeyValueStore(blockstorage), m_fail_after(-1) {}
+
+	void failAfter(int n_applied) { m_fail_after = n_applied; }
+
+protected:
+	virtual bool apply_continue(size_t n_applied) { return (m_fail_after < 0) || (static_cast<int>(n_applied) < m_fail_after); }
+
+private:
+	int m_fail_after;
+};
+
 TEST_CASE( "KeyValue store", "[KeyValueStore]" ) {
 	typedef milliways::KeyValueStore kv_t;
 	typedef XTYPENAME kv_t::block_storage_type kv_blockstorage_t;
@@ -334,6 +384,7 @@ TEST_CASE( "KeyValue store", "[KeyValueStore]" ) {
 			kv.open();
 			REQUIRE(kv.isOpen());
 
+			size_t n_visited = 0;
 			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
 			{
 				std::string key = (*it);
@@ -341,7 +392,18 @@ TEST_CASE( "KeyValue store", "[KeyValueStore]" ) {
 				std::string value;
 				REQUIRE(kv.get(*it, value));
 				REQUIRE(value == test_set[key]);
+				n_visited++;
 			}
+			REQUIRE(n_visited == test_set.size());
+
+			/* backward iteration visits the same keys, in reverse order */
+			std::vector<std::string> forward_keys, backward_keys;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				forward_keys.push_back(*it);
+			for (kv_t::iterator it = kv.rbegin(); it != kv.rend(); ++it)
+				backward_keys.push_back(*it);
+			std::reverse(backward_keys.begin(), backward_keys.end());
+			REQUIRE(backward_keys == forward_keys);
 
 			for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
 			{
@@ -507,4 +569,1467 @@ TEST_CASE( "KeyValue store", "[KeyValueStore]" ) {
 
 		std::remove(test_pathname.c_str());
 	}
+
+	SECTION( "overwrites reuse released space" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		const int n_keys = 200;
+		const int n_rounds = 30;
+
+		std::map<std::string, std::string> expected;
+		size_t n_fragments = 0;
+		size_t n_free_blocks = 0;
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			milliways::block_id_t warm_next_id = 0;
+			for (int round = 0; round < n_rounds; round++)
+			{
+				for (int i = 0; i < n_keys; i++)
+				{
+					std::ostringstream ss;
+					ss << "key-" << i;
+					/* values shrink and grow, some of them span several blocks */
+					int len = 10 + ((round * 7 + i) % 11) * 170;
+					if ((i % 25) == 0)
+						len += 9000;
+					std::string value(len, static_cast<char>('a' + (round % 26)));
+					REQUIRE(kv.put(ss.str(), value));
+					expected[ss.str()] = value;
+				}
+				if (round == 9)
+					warm_next_id = bs->nextId();
+			}
+
+			/* without reclamation the file would grow by ~60 blocks per round */
+			REQUIRE(bs->nextId() < 2 * warm_next_id);
+			REQUIRE(kv.freeFragments() > 0);
+
+			n_fragments = kv.freeFragments();
+			n_free_blocks = bs->freeBlocks();
+
+			kv.close();
+		}
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			/* the free space map survives a reopen */
+			REQUIRE(kv.freeFragments() == n_fragments);
+			REQUIRE(bs->freeBlocks() + 1 >= n_free_blocks);	/* the map takes a block */
+
+			std::map<std::string, std::string>::const_iterator it;
+			for (it = expected.begin(); it != expected.end(); ++it)
+			{
+				std::string value;
+				REQUIRE(kv.get(it->first, value));
+				REQUIRE(value == it->second);
+			}
+
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "a damaged free space map keeps the store from opening" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			for (int i = 0; i < 100; i++)
+				REQUIRE(kv.put("key-" + std::to_string(i), std::string(100, 'x')));
+			for (int i = 0; i < 100; i += 2)
+				REQUIRE(kv.remove("key-" + std::to_string(i)));
+			REQUIRE(kv.freeFragments() > 0);
+			kv.close();
+		}
+
+		/* the map claims more fragments than it holds (the tree header comes first) */
+		{
+			kv_blockstorage_t bs(test_pathname);
+			bs.allocUserHeader();
+			int uid = bs.allocUserHeader();
+			REQUIRE(bs.open());
+			REQUIRE(! bs.getUserData(uid).empty());
+			bs.setUserData(uid, std::string(4, '\xff'));
+			REQUIRE(bs.close());
+		}
+
+		/* and the refused file isn't rewritten */
+		auto contents = [&test_pathname]() {
+			std::ifstream src(test_pathname.c_str(), std::ifstream::binary);
+			std::ostringstream ss;
+			ss << src.rdbuf();
+			return ss.str();
+		};
+		std::string before = contents();
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			REQUIRE(! kv.open());
+			REQUIRE(! kv.isOpen());
+		}
+		REQUIRE(contents() == before);
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "remove works and reclaims space" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		const int n_keys = 500;
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			REQUIRE(! kv.remove("missing"));
+
+			for (int i = 0; i < n_keys; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				REQUIRE(kv.put(ss.str(), std::string(((i % 10) == 0) ? 6000 : 100, 'x')));
+			}
+
+			milliways::block_id_t next_id = bs->nextId();
+
+			/* remove the odd keys */
+			for (int i = 1; i < n_keys; i += 2)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				REQUIRE(kv.remove(ss.str()));
+				REQUIRE(! kv.has(ss.str()));
+				REQUIRE(! kv.remove(ss.str()));
+			}
+			REQUIRE(kv.freeFragments() > 0);
+
+			for (int i = 0; i < n_keys; i += 2)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				std::string value;
+				REQUIRE(kv.get(ss.str(), value));
+				REQUIRE(value == std::string(((i % 10) == 0) ? 6000 : 100, 'x'));
+			}
+
+			/* new values land in the released space */
+			size_t free_bytes = kv.freeFragmentBytes();
+			for (int i = 1; i < n_keys; i += 2)
+			{
+				std::ostringstream ss;
+				ss << "new-" << i;
+				REQUIRE(kv.put(ss.str(), std::string(100, 'y')));
+			}
+			REQUIRE(kv.freeFragmentBytes() == free_bytes - (n_keys / 2) * (100 + sizeof(milliways::serialized_value_size_type)));
+			REQUIRE(bs->nextId() < next_id + 4);	/* tree node splits only */
+
+			kv.close();
+		}
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			int n_found = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+			{
+				bool known = ((*it).compare(0, 4, "key-") == 0) || ((*it).compare(0, 4, "new-") == 0);
+				REQUIRE(known);
+				n_found++;
+			}
+			REQUIRE(n_found == n_keys);
+
+			for (int i = 1; i < n_keys; i += 2)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				REQUIRE(! kv.has(ss.str()));
+			}
+
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "compaction moves live data down and truncates the file" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		const int n_keys = 2000;
+
+		std::map<std::string, std::string> expected;
+		size_t size_before = 0;
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			for (int i = 0; i < n_keys; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				std::string value = random_string(((i % 20) == 0) ? 9000 : rand_int(50, 500));
+				REQUIRE(kv.put(ss.str(), value));
+				expected[ss.str()] = value;
+			}
+
+			/* the values written first go away, leaving the space at the start of the file free */
+			for (int i = 0; i < (3 * n_keys) / 4; i++)
+			{
+				std::ostringstream ss;
+				ss << "key-" << i;
+				REQUIRE(kv.remove(ss.str()));
+				expected.erase(ss.str());
+			}
+			REQUIRE(kv.flush());
+			size_before = file_size(test_pathname);
+
+			/* in short time slices, with updates in between */
+			kv_t::CompactReport total;
+			int n_calls = 0;
+			while (! total.done)
+			{
+				kv_t::CompactReport report;
+				REQUIRE(kv.compact(report, 1));
+				REQUIRE(report.elapsed_ms >= 0.0);
+				total.done = report.done;
+				total.values_moved += report.values_moved;
+				total.nodes_moved += report.nodes_moved;
+				total.reclaimed_bytes += report.reclaimed_bytes;
+				REQUIRE(kv.compacting() == (! report.done));
+
+				if ((++n_calls == 1) && (! report.done))
+				{
+					std::string value = random_string(300);
+					REQUIRE(kv.put("key-1999", value));
+					expected["key-1999"] = value;
+				}
+				REQUIRE(n_calls < 100000);
+			}
+			REQUIRE(total.values_moved > 0);
+			REQUIRE(total.reclaimed_bytes > 0);
+
+			size_t size_after = file_size(test_pathname);
+			REQUIRE(size_after < size_before / 2);
+			REQUIRE(size_before - size_after == total.reclaimed_bytes);
+
+			std::map<std::string, std::string>::const_iterator it;
+			for (it = expected.begin(); it != expected.end(); ++it)
+			{
+				std::string value;
+				REQUIRE(kv.get(it->first, value));
+				REQUIRE(value == it->second);
+			}
+
+			/* a second pass has nothing left to move */
+			kv_t::CompactReport again = kv.compact();
+			REQUIRE(again.done);
+			REQUIRE(again.values_moved == 0);
+
+			kv.close();
+		}
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			std::map<std::string, std::string>::const_iterator it;
+			for (it = expected.begin(); it != expected.end(); ++it)
+			{
+				std::string value;
+				REQUIRE(kv.get(it->first, value));
+				REQUIRE(value == it->second);
+			}
+			REQUIRE(! kv.has("key-0"));
+
+			/* removals rebalance the tree: iteration sees exactly the live keys */
+			it = expected.begin();
+			for (kv_t::iterator kv_it = kv.begin(); kv_it != kv.end(); ++kv_it)
+			{
+				REQUIRE(it != expected.end());
+				REQUIRE(*kv_it == it->first);
+				++it;
+			}
+			REQUIRE(it == expected.end());
+
+			/* the store keeps working on the compacted file */
+			REQUIRE(kv.put("after", std::string(5000, 'z')));
+			REQUIRE(kv.get("after") == std::string(5000, 'z'));
+
+			kv.close();
+		}
+
+		REQUIRE(file_size(test_pathname) < size_before / 2);
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "bulk put builds the store from unsorted pairs" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		const int n_keys = 5000;
+
+		std::vector< std::pair<std::string, std::string> > items;
+		std::map<std::string, std::string> expected;
+		for (int i = 0; i < n_keys; i++)
+		{
+			std::ostringstream ss;
+			ss << "key-" << ((i * 7919) % n_keys);
+			std::string value = random_string(((i % 50) == 0) ? 7000 : rand_int(10, 200));
+			items.push_back(std::make_pair(ss.str(), value));
+			expected[ss.str()] = value;
+		}
+		/* a duplicate: the last one wins */
+		items.push_back(std::make_pair(std::string("key-42"), std::string("again")));
+		expected["key-42"] = "again";
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			REQUIRE(kv.bulk_put(items, 0.9));
+
+			std::map<std::string, std::string>::const_iterator it;
+			for (it = expected.begin(); it != expected.end(); ++it)
+			{
+				std::string value;
+				REQUIRE(kv.get(it->first, value));
+				REQUIRE(value == it->second);
+			}
+
+			/* on a non-empty store the pairs are simply put */
+			std::vector< std::pair<std::string, std::string> > more;
+			more.push_back(std::make_pair(std::string("key-7"), std::string("updated")));
+			more.push_back(std::make_pair(std::string("new"), std::string("value")));
+			REQUIRE(kv.bulk_put(more));
+			expected["key-7"] = "updated";
+			expected["new"] = "value";
+
+			kv.close();
+		}
+
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+
+			kv_t kv(bs);
+
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			std::map<std::string, std::string>::const_iterator it = expected.begin();
+			for (kv_t::iterator kv_it = kv.begin(); kv_it != kv.end(); ++kv_it)
+			{
+				REQUIRE(it != expected.end());
+				REQUIRE(*kv_it == it->first);
+				REQUIRE(kv.get(it->first) == it->second);
+				++it;
+			}
+			REQUIRE(it == expected.end());
+
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "memory budget sizes the block cache" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		typedef std::map<std::string, std::string> kv_set_t;
+		kv_set_t test_set;
+		for (int i = 0; i < 4096; ++i)
+			test_set[random_string(rand_int(4, 20))] = random_string(rand_int(1, 512));
+
+		kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname, 32);
+		REQUIRE(bs->cacheCapacity() == 32);
+
+		kv_t kv(bs);
+
+		kv.open();
+		REQUIRE(kv.isOpen());
+		REQUIRE(kv.memoryBudget() == 0);
+		REQUIRE(bs->cacheCapacity() == 32);
+
+		for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
+			REQUIRE(kv.put(t_it->first, t_it->second));
+		REQUIRE(bs->cacheSize() <= 32);
+
+		const size_t small_budget = 1024 * 1024;
+		kv.memoryBudget(small_budget);
+		REQUIRE(kv.memoryBudget() == small_budget);
+		const size_t min_blocks = kv_t::MIN_CACHE_BLOCKS;
+		REQUIRE(bs->cacheCapacity() >= min_blocks);
+		REQUIRE(bs->cacheCapacity() <= small_budget / 1024);
+
+		for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
+			REQUIRE(kv.get(t_it->first) == t_it->second);
+		kv.rebalance();
+		REQUIRE(kv.memoryFootprint() <= 2 * small_budget);
+		size_t small_capacity = bs->cacheCapacity();
+
+		// a larger budget grows the pool, live
+		kv.memoryBudget(16 * small_budget);
+		REQUIRE(bs->cacheCapacity() > small_capacity);
+
+		for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
+			REQUIRE(kv.get(t_it->first) == t_it->second);
+		REQUIRE(kv.memoryFootprint() <= 2 * 16 * small_budget);
+
+		kv.close();
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "concurrent readers share the store" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		typedef std::map<std::string, std::string> kv_set_t;
+		kv_set_t test_set;
+		for (int i = 0; i < 2000; ++i)
+			test_set[random_string(rand_int(4, 20))] = random_string((i % 50) ? rand_int(1, 512) : rand_int(5000, 12000));
+
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
+				REQUIRE(kv.put(t_it->first, t_it->second));
+			kv.close();
+		}
+
+		// a small cache, so that the readers keep missing and evicting
+		kv_t kv(new kv_blockstorage_t(test_pathname, 64));
+		kv.open();
+		REQUIRE(kv.isOpen());
+
+		static const int N_THREADS = 4;
+		std::vector<std::string> keys;
+		for (kv_set_t::const_iterator t_it = test_set.begin(); t_it != test_set.end(); ++t_it)
+			keys.push_back(t_it->first);
+
+		std::vector<int> errors(N_THREADS, 0);
+		std::vector<size_t> iterated(N_THREADS, 0);
+		std::vector<std::thread> readers;
+		for (int t = 0; t < N_THREADS; ++t)
+		{
+			readers.push_back(std::thread([&, t]() {
+				for (size_t i = 0; i < keys.size(); ++i)
+				{
+					// every thread walks the keys from a different start
+					const std::string& key = keys[(i + t * keys.size() / N_THREADS) % keys.size()];
+					std::string value;
+					if ((! kv.has(key)) || (! kv.get(key, value)) || (value != test_set.find(key)->second))
+						errors[t]++;
+					if (kv.has(key + "-missing"))
+						errors[t]++;
+				}
+				std::string last;
+				for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				{
+					if ((! last.empty()) && (*it <= last))
+						errors[t]++;
+					last = *it;
+					iterated[t]++;
+				}
+			}));
+		}
+		for (int t = 0; t < N_THREADS; ++t)
+			readers[t].join();
+
+		for (int t = 0; t < N_THREADS; ++t)
+		{
+			REQUIRE(errors[t] == 0);
+			REQUIRE(iterated[t] == test_set.size());
+		}
+
+		kv.close();
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "write-ahead log replays the writes lost in a crash" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string wal_pathname("./test_kv-wal");
+		const std::string saved_pathname("./test_kv.saved");
+		const std::string saved_wal_pathname("./test_kv-wal.saved");
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		std::map<std::string, std::string> expected;
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			for (int i = 0; i < 100; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(rand_int(1, 2000));
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			// checkpoint: the store is durable, the log empty
+			REQUIRE(kv.flush());
+			REQUIRE(file_size(wal_pathname) == 0);
+			REQUIRE(copy_file(test_pathname, saved_pathname));
+
+			for (int i = 100; i < 200; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(rand_int(1, 2000));
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			for (int i = 0; i < 10; ++i)
+			{
+				REQUIRE(kv.remove("key-" + std::to_string(i)));
+				expected.erase("key-" + std::to_string(i));
+			}
+			REQUIRE(kv.rename("key-10", "renamed"));
+			expected["renamed"] = expected["key-10"];
+			expected.erase("key-10");
+			expected["key-11"] = "overwritten";
+			REQUIRE(kv.put("key-11", "overwritten"));
+
+			// every commit synced, in groups at best
+			REQUIRE(kv.wal()->records() == 100 + 100 + 10 + 1 + 1);
+			REQUIRE(kv.wal()->syncs() > 0);
+			REQUIRE(kv.wal()->syncs() <= kv.wal()->records());
+			REQUIRE(kv.wal()->syncedLsn() == kv.wal()->appendedLsn());
+			REQUIRE(copy_file(wal_pathname, saved_wal_pathname));
+
+			kv.close();
+		}
+
+		// the crash: the store as of the checkpoint, the log with a torn record at its end
+		REQUIRE(copy_file(saved_pathname, test_pathname));
+		REQUIRE(copy_file(saved_wal_pathname, wal_pathname));
+		{
+			std::ofstream wal_file(wal_pathname.c_str(), std::ofstream::binary | std::ofstream::app);
+			wal_file.write("\x40\x00\x00\x00torn", 8);
+		}
+
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(file_size(wal_pathname) == 0);
+
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == expected.size());
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+			{
+				std::string value;
+				REQUIRE(kv.get(e_it->first, value));
+				REQUIRE(value == e_it->second);
+			}
+			REQUIRE(! kv.has("key-0"));
+			REQUIRE(! kv.has("key-10"));
+
+			// without syncs until the checkpoint
+			kv.wal()->syncPolicy(milliways::WriteAheadLog::SYNC_NEVER);
+			REQUIRE(kv.put("key-0", "back"));
+			REQUIRE(kv.wal()->syncs() == 0);
+			REQUIRE(kv.wal()->syncedLsn() < kv.wal()->appendedLsn());
+			kv.close();
+		}
+
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.get("key-0") == "back");
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+		std::remove(saved_pathname.c_str());
+		std::remove(saved_wal_pathname.c_str());
+	}
+
+	SECTION( "write-ahead log keeps changed pages out of the store until a checkpoint" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string wal_pathname("./test_kv-wal");
+		const std::string crash_pathname("./test_kv.crash");
+		const std::string crash_wal_pathname("./test_kv-wal.crash");
+		const std::string saved_pathname("./test_kv.saved");
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		std::map<std::string, std::string> checkpointed, expected;
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname, 64);
+			kv_t kv(bs);
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(bs->copyOnWrite());
+			for (int i = 0; i < 100; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(rand_int(1, 4000));
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			REQUIRE(kv.flush());
+			checkpointed = expected;
+
+			// many more pages than the cache holds: changed ones are written back before the checkpoint
+			for (int i = 50; i < 400; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(rand_int(1, 4000));
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			REQUIRE(bs->cacheSize() <= 64);
+
+			// failed operations leave no record
+			uint64_t appended = kv.wal()->appendedLsn();
+			REQUIRE(! kv.put("key-1", "kept", /* overwrite */ false));
+			REQUIRE(! kv.remove("missing"));
+			REQUIRE(! kv.rename("missing", "renamed"));
+			REQUIRE(kv.wal()->appendedLsn() == appended);
+
+			REQUIRE(copy_file(test_pathname, saved_pathname));
+			REQUIRE(copy_file(wal_pathname, crash_wal_pathname));
+			kv.close();
+		}
+
+		// the store alone is the checkpoint, whatever was written back since
+		REQUIRE(copy_file(saved_pathname, crash_pathname));
+		{
+			kv_t kv(new kv_blockstorage_t(crash_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == checkpointed.size());
+			for (std::map<std::string, std::string>::const_iterator e_it = checkpointed.begin(); e_it != checkpointed.end(); ++e_it)
+				REQUIRE(kv.get(e_it->first) == e_it->second);
+			kv.close();
+		}
+
+		// with its log, every acknowledged write
+		REQUIRE(copy_file(saved_pathname, crash_pathname));
+		{
+			kv_t kv(new kv_blockstorage_t(crash_pathname));
+			kv.wal(new milliways::WriteAheadLog(crash_wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(file_size(crash_wal_pathname) == 0);
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == expected.size());
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+				REQUIRE(kv.get(e_it->first) == e_it->second);
+			kv.close();
+		}
+
+		// a plain store can't take a log: its pages would be overwritten in place
+		std::remove(crash_pathname.c_str());
+		{
+			kv_t kv(new kv_blockstorage_t(crash_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			kv.close();
+		}
+		{
+			kv_t kv(new kv_blockstorage_t(crash_pathname));
+			kv.wal(new milliways::WriteAheadLog(crash_wal_pathname));
+			REQUIRE(! kv.open());
+			REQUIRE(! kv.isOpen());
+		}
+
+		std::remove(crash_pathname.c_str());
+		std::remove(crash_wal_pathname.c_str());
+		std::remove(saved_pathname.c_str());
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+	}
+
+	SECTION( "write-ahead log syncs in the background with the periodic policy" ) {
+		const std::string wal_pathname("./test_kv-wal");
+
+		std::remove(wal_pathname.c_str());
+
+		milliways::WriteAheadLog wal(wal_pathname, milliways::WriteAheadLog::SYNC_PERIODIC, 20);
+		REQUIRE(wal.open());
+		uint64_t lsn = 0;
+		REQUIRE(wal.append(milliways::WriteAheadLog::RECORD_PUT, "key", "value", lsn));
+		REQUIRE(wal.commit(lsn));
+
+		// no further commit: the record is synced anyway
+		for (int i = 0; (i < 100) && (wal.syncedLsn() < lsn); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		REQUIRE(wal.syncedLsn() == lsn);
+		REQUIRE(wal.syncs() >= 1);
+
+		// nothing is synced twice, or under another policy
+		size_t n_syncs = wal.syncs();
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		REQUIRE(wal.syncs() == n_syncs);
+		wal.syncPolicy(milliways::WriteAheadLog::SYNC_NEVER);
+		REQUIRE(wal.append(milliways::WriteAheadLog::RECORD_REMOVE, "key", "", lsn));
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		REQUIRE(wal.syncedLsn() < lsn);
+
+		// a rollback drops the record
+		uint64_t mark = wal.appendedLsn();
+		REQUIRE(wal.append(milliways::WriteAheadLog::RECORD_PUT, "other", "value", lsn));
+		REQUIRE(wal.rollback(mark));
+		REQUIRE(wal.appendedLsn() == mark);
+		std::vector<milliways::WriteAheadLog::Record> records;
+		REQUIRE(wal.read(records));
+		REQUIRE(records.size() == 2);
+		REQUIRE(wal.close());
+
+		std::remove(wal_pathname.c_str());
+	}
+
+	SECTION( "copy-on-write storage rolls back to the last flush after a crash" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string crash_pathname("./test_kv.crash");
+
+		std::remove(test_pathname.c_str());
+
+		std::map<std::string, std::string> expected;
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+			bs->copyOnWrite(true);
+			kv_t kv(bs);
+			kv.open();
+			REQUIRE(kv.isOpen());
+			for (int i = 0; i < 200; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(rand_int(1, 20000));
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			REQUIRE(kv.flush());
+
+			// overwrites, removals and new values reach the file, not the commit
+			for (int i = 0; i < 200; i += 2)
+				REQUIRE(kv.put("key-" + std::to_string(i), random_string(rand_int(1, 20000))));
+			for (int i = 1; i < 100; i += 2)
+				REQUIRE(kv.remove("key-" + std::to_string(i)));
+			for (int i = 200; i < 400; ++i)
+				REQUIRE(kv.put("key-" + std::to_string(i), random_string(rand_int(1, 20000))));
+			REQUIRE(copy_file(test_pathname, crash_pathname));
+
+			kv.close();
+		}
+
+		{
+			kv_t kv(new kv_blockstorage_t(crash_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == expected.size());
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+			{
+				std::string value;
+				REQUIRE(kv.get(e_it->first, value));
+				REQUIRE(value == e_it->second);
+			}
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(crash_pathname.c_str());
+	}
+
+	SECTION( "snapshots see the store as it was while writers go on" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		typedef std::map<std::string, std::string> kv_set_t;
+		kv_set_t before;
+		for (int i = 0; i < 1000; ++i)
+			before["key-" + std::to_string(i)] = random_string((i % 50) ? rand_int(1, 512) : rand_int(5000, 12000));
+
+		// plain storage has no snapshots
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(! kv.snapshot());
+			kv.close();
+			std::remove(test_pathname.c_str());
+		}
+
+		kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname, 64);
+		bs->copyOnWrite(true);
+		kv_t kv(bs);
+		kv.open();
+		REQUIRE(kv.isOpen());
+		for (kv_set_t::const_iterator b_it = before.begin(); b_it != before.end(); ++b_it)
+			REQUIRE(kv.put(b_it->first, b_it->second));
+
+		milliways::shptr<kv_t::Snapshot> snapshot = kv.snapshot();
+		REQUIRE(snapshot);
+		REQUIRE(bs->snapshotCount() == 1);
+
+		// overwrites, removals and splits while the snapshot is scanned
+		kv_set_t after(before);
+		std::vector< std::pair<std::string, std::string> > writes;
+		for (int i = 0; i < 1000; i += 3)
+			writes.push_back(std::make_pair("key-" + std::to_string(i), random_string(rand_int(1, 2000))));
+		for (int i = 1000; i < 3000; ++i)
+			writes.push_back(std::make_pair("key-" + std::to_string(i), random_string(rand_int(1, 512))));
+		std::vector<std::string> removals;
+		for (int i = 1; i < 1000; i += 3)
+			removals.push_back("key-" + std::to_string(i));
+		for (size_t i = 0; i < writes.size(); ++i)
+			after[writes[i].first] = writes[i].second;
+		for (size_t i = 0; i < removals.size(); ++i)
+			after.erase(removals[i]);
+
+		std::thread writer([&]() {
+			for (size_t i = 0; i < writes.size(); ++i)
+			{
+				kv.put(writes[i].first, writes[i].second);
+				if (i < removals.size())
+					kv.remove(removals[i]);
+			}
+		});
+
+		int errors = 0;
+		for (int pass = 0; pass < 3; ++pass)
+		{
+			kv_set_t::const_iterator b_it = before.begin();
+			for (kv_t::iterator it = snapshot->begin(); it != snapshot->end(); ++it, ++b_it)
+			{
+				if ((b_it == before.end()) || (*it != b_it->first))
+				{
+					errors++;
+					break;
+				}
+			}
+			if (b_it != before.end())
+				errors++;
+		}
+		for (kv_set_t::const_iterator b_it = before.begin(); b_it != before.end(); ++b_it)
+		{
+			std::string value;
+			if ((! snapshot->get(b_it->first, value)) || (value != b_it->second))
+				errors++;
+		}
+		writer.join();
+		REQUIRE(errors == 0);
+		REQUIRE(! snapshot->has("key-1500"));
+		REQUIRE(snapshot->get("key-1") == before["key-1"]);
+		REQUIRE(*snapshot->lower_bound("key-1") == "key-1");
+		size_t n_before = std::distance(before.lower_bound("key-1"), before.lower_bound("key-2"));
+		REQUIRE(snapshot->scan("key-1", "key-2", [](const char*, size_t) { return true; }) == n_before);
+		REQUIRE(snapshot->prefix_scan("key-1", [](const char*, size_t) { return true; }) == n_before);
+
+		// backwards too
+		size_t count = 0;
+		for (kv_t::iterator it = snapshot->rbegin(); it != snapshot->rend(); ++it)
+			count++;
+		REQUIRE(count == before.size());
+
+		// the live store has moved on
+		count = 0;
+		for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+			count++;
+		REQUIRE(count == after.size());
+		REQUIRE(! kv.has("key-1"));
+		REQUIRE(kv.get("key-1500") == after["key-1500"]);
+
+		// the blocks replaced since the snapshot are kept until it goes
+		REQUIRE(kv.flush());
+		REQUIRE(bs->retiredCount() > 0);
+		snapshot.reset();
+		REQUIRE(bs->snapshotCount() == 0);
+		REQUIRE(bs->retiredCount() == 0);
+
+		for (kv_set_t::const_iterator a_it = after.begin(); a_it != after.end(); ++a_it)
+			REQUIRE(kv.get(a_it->first) == a_it->second);
+
+		kv.close();
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "range and prefix scans seek down to the first key" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		typedef std::map<std::string, std::string> kv_set_t;
+		kv_set_t dict;
+		for (int i = 0; i < 4000; ++i)
+		{
+			char key[32];
+			snprintf(key, sizeof(key), "%s/%05d", (i % 4) ? "obj" : "ref", i * 7);
+			dict[key] = random_string(rand_int(1, 64));
+		}
+
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname, 64));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(kv.lower_bound("a") == kv.end());
+			REQUIRE(kv.prefix_scan("ref/").empty());
+			for (kv_set_t::const_iterator d_it = dict.begin(); d_it != dict.end(); ++d_it)
+				REQUIRE(kv.put(d_it->first, d_it->second));
+			kv.close();
+		}
+
+		kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname, 64);
+		kv_t kv(bs);
+		kv.open();
+		REQUIRE(kv.isOpen());
+
+		// on a cold cache a prefix scan reads only the path to its first leaf and the leaves in range
+		bs->cacheResetStats();
+		REQUIRE(kv.prefix_scan("ref/1").size() == 357);
+		size_t prefix_misses = bs->cacheMisses();
+		REQUIRE(prefix_misses > 0);
+		bs->cacheResetStats();
+		size_t count = 0;
+		for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+			count++;
+		REQUIRE(count == dict.size());
+		REQUIRE(prefix_misses * 4 < bs->cacheMisses());
+
+		// lower_bound() on present, missing, truncated and out of range keys
+		const char* probes[] = { "", "a", "obj/", "obj/00007", "obj/00008", "obj/27993", "obj/28000",
+				"obj/0001", "ref/00000", "ref/00000-too-long-to-store", "ref/1", "ref/27972", "ref/27973", "z" };
+		for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i)
+		{
+			kv_set_t::const_iterator d_it = dict.lower_bound(probes[i]);
+			kv_t::iterator it = kv.lower_bound(probes[i]);
+			if (d_it == dict.end())
+				REQUIRE(it == kv.end());
+			else
+			{
+				REQUIRE(it != kv.end());
+				REQUIRE(*it == d_it->first);
+				// the iterator goes on along the leaves
+				for (int n = 0; (n < 50) && (d_it != dict.end()); ++n, ++it, ++d_it)
+					REQUIRE(*it == d_it->first);
+			}
+		}
+
+		// [start, end) ranges and early stops
+		std::vector<std::string> keys;
+		auto collect = [&keys](const char* key, size_t length) { keys.push_back(std::string(key, length)); return true; };
+		size_t n_scanned = kv.scan("obj/10000", "obj/11000", collect);
+		REQUIRE(n_scanned == keys.size());
+		std::vector<std::string> expected;
+		for (kv_set_t::const_iterator d_it = dict.lower_bound("obj/10000"); d_it != dict.lower_bound("obj/11000"); ++d_it)
+			expected.push_back(d_it->first);
+		REQUIRE(keys == expected);
+		REQUIRE(n_scanned == 108);
+		REQUIRE(kv.scan("obj/11000", "obj/10000", collect) == 0);
+		REQUIRE(kv.scan("ref/27000", "", collect) == static_cast<size_t>(std::distance(dict.lower_bound("ref/27000"), dict.end())));
+		size_t seen = 0;
+		REQUIRE(kv.scan("", "", [&seen](const char*, size_t) { return ++seen < 10; }) == 10);
+
+		// prefix scans
+		keys = kv.prefix_scan("ref/");
+		REQUIRE(keys.size() == 1000);
+		for (size_t i = 0; i < keys.size(); ++i)
+			REQUIRE(keys[i].compare(0, 4, "ref/") == 0);
+		REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+		const char* prefixes[] = { "ref/0002", "ref/1", "obj/2799", "obj/x", "ref/27972", "ref/27972/" };
+		for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+		{
+			const std::string prefix(prefixes[i]);
+			size_t n = 0;
+			for (kv_set_t::const_iterator d_it = dict.lower_bound(prefix); (d_it != dict.end()) && (d_it->first.compare(0, prefix.size(), prefix) == 0); ++d_it)
+				n++;
+			REQUIRE(kv.prefix_scan(prefix).size() == n);
+		}
+
+		kv.close();
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "scans copy the keys out while writers change the leaves" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		static const int N_KEYS = 4000;
+		auto make_key = [](const char* prefix, int i) { char key[32]; snprintf(key, sizeof(key), "%s/%05d", prefix, i); return std::string(key); };
+
+		kv_t kv(new kv_blockstorage_t(test_pathname, 64));
+		kv.open();
+		REQUIRE(kv.isOpen());
+		for (int i = 0; i < N_KEYS; i += 2)
+			REQUIRE(kv.put(make_key("a", i), random_string(rand_int(1, 64))));
+
+		// the writer splits, updates and shrinks the leaves being scanned
+		std::atomic<bool> writing(true);
+		int write_errors = 0;
+		std::thread writer([&]() {
+			for (int round = 0; round < 4; ++round)
+			{
+				for (int i = 1; i < N_KEYS; i += 2)
+					if (! kv.put(make_key("a", i), std::string(1 + (i + round) % 64, 'w')))
+						write_errors++;
+				for (int i = 0; i < N_KEYS; i += 8)
+					if (! kv.put(make_key("a", i), std::string(1 + (i + round) % 64, 'w')))
+						write_errors++;
+				for (int i = 1; i < N_KEYS; i += 2)
+					if (! kv.remove(make_key("a", i)))
+						write_errors++;
+			}
+			writing = false;
+		});
+
+		// keys seen by the callbacks are whole, and the callbacks can write to the store
+		int scan_errors = 0;
+		int n_scans = 0;
+		do
+		{
+			bool wrote = false;
+			size_t n = kv.prefix_scan("a/", [&](const char* key, size_t length) {
+				std::string key_(key, length);
+				if ((length != 7) || (key_.compare(0, 2, "a/") != 0) || (key_.find_first_not_of("0123456789", 2) != std::string::npos))
+					scan_errors++;
+				if (! wrote)
+				{
+					wrote = true;
+					if (! kv.put(make_key("b", n_scans), key_))
+						scan_errors++;
+				}
+				return true;
+			});
+			if (n < N_KEYS / 4)
+				scan_errors++;
+			n_scans++;
+		} while (writing);
+		writer.join();
+
+		REQUIRE(write_errors == 0);
+		REQUIRE(scan_errors == 0);
+		REQUIRE(kv.prefix_scan("a/").size() == N_KEYS / 2);
+		REQUIRE(kv.prefix_scan("b/").size() == static_cast<size_t>(n_scans));
+
+		kv.close();
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "iteration reads the leaves ahead and copies the keys out once per position" ) {
+		const std::string test_pathname("./test_kv");
+
+		std::remove(test_pathname.c_str());
+
+		typedef std::map<std::string, std::string> kv_set_t;
+		kv_set_t dict;
+		for (int i = 0; i < 20000; ++i)
+			dict["key-" + std::to_string(i)] = random_string(rand_int(1, 16));
+
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			for (kv_set_t::const_iterator d_it = dict.begin(); d_it != dict.end(); ++d_it)
+				REQUIRE(kv.put(d_it->first, d_it->second));
+			kv.close();
+		}
+
+		// cold scans, without and with read-ahead: the same keys, the leaves found in the cache
+		size_t misses[2] = { 0, 0 };
+		size_t hits[2] = { 0, 0 };
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+			kv_t kv(bs);
+			kv.readAhead(pass ? kv_t::DEFAULT_READ_AHEAD : 0);
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			bs->cacheResetStats();
+			kv_set_t::const_iterator d_it = dict.begin();
+			int errors = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it, ++d_it)
+			{
+				const char* bytes = NULL;
+				size_t length = 0;
+				if ((d_it == dict.end()) || (! it.keyData(bytes, length)) || (std::string(bytes, length) != d_it->first))
+					errors++;
+			}
+			REQUIRE(errors == 0);
+			REQUIRE(d_it == dict.end());
+			misses[pass] = bs->cacheMisses();
+			hits[pass] = bs->cacheHits();
+
+			// backwards, over the cached leaves
+			kv_set_t::const_reverse_iterator r_it = dict.rbegin();
+			for (kv_t::iterator it = kv.rbegin(); it != kv.rend(); ++it, ++r_it)
+			{
+				if ((r_it == dict.rend()) || (*it != r_it->first))
+					errors++;
+			}
+			REQUIRE(errors == 0);
+			REQUIRE(r_it == dict.rend());
+
+			kv.close();
+		}
+		REQUIRE(hits[1] > hits[0] + misses[0] / 2);
+
+		// past the last child of its parent, the read-ahead goes on under the parent's sibling
+		{
+			std::vector< std::pair<milliways::node_id_t, milliways::node_id_t> > leaves;		/* leaf, parent */
+			std::vector<std::string> first_keys;
+			{
+				kv_t kv(new kv_blockstorage_t(test_pathname));
+				kv.readAhead(0);
+				kv.open();
+				REQUIRE(kv.isOpen());
+				for (LeafIterator it(kv.begin()); it != kv.end(); ++it)
+				{
+					if (leaves.empty() || (leaves.back().first != it.leafId()))
+					{
+						leaves.push_back(std::make_pair(it.leafId(), it.parentId()));
+						first_keys.push_back(*it);
+					}
+				}
+				kv.close();
+			}
+			size_t last_child = 0;
+			while ((last_child + 1 < leaves.size()) && (leaves[last_child].second == leaves[last_child + 1].second))
+				last_child++;
+			REQUIRE(last_child + 1 < leaves.size());
+
+			kv_blockstorage_t* bs = new kv_blockstorage_t(test_pathname);
+			kv_t kv(bs);
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(! bs->cached(static_cast<milliways::block_id_t>(leaves[last_child + 1].first)));
+			kv_t::iterator it = kv.lower_bound(first_keys[last_child]);
+			REQUIRE(*it == first_keys[last_child]);
+			REQUIRE(bs->cached(static_cast<milliways::block_id_t>(leaves[last_child + 1].first)));
+			kv.close();
+		}
+
+		// keys written since the leaf was read come from the materialized node
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+			REQUIRE(kv.put("key-0", "changed"));
+			kv_t::iterator it = kv.begin();
+			const char* bytes = NULL;
+			size_t length = 0;
+			REQUIRE(it.keyData(bytes, length));
+			REQUIRE(std::string(bytes, length) == "key-0");
+			REQUIRE(*it == "key-0");
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+	}
+
+	SECTION( "write batches apply puts and removes together" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string wal_pathname("./test_kv-wal");
+		const std::string saved_pathname("./test_kv.saved");
+		const std::string saved_wal_pathname("./test_kv-wal.saved");
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		std::map<std::string, std::string> expected;
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			for (int i = 0; i < 50; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string(100);
+				REQUIRE(kv.put(key, expected[key]));
+			}
+			REQUIRE(kv.flush());
+			REQUIRE(copy_file(test_pathname, saved_pathname));
+
+			milliways::WriteBatch batch;
+			for (int i = 0; i < 300; ++i)
+			{
+				// new keys, small and large, in no particular order
+				std::string key = "new-" + std::to_string((i * 37) % 300);
+				expected[key] = random_string((i % 25) ? rand_int(1, 300) : rand_int(5000, 12000));
+				batch.put(key, expected[key]);
+			}
+			for (int i = 0; i < 10; ++i)
+			{
+				// overwrites in place, and with values needing more space
+				std::string key = "key-" + std::to_string(i);
+				expected[key] = random_string((i % 2) ? 50 : 3000);
+				batch.put(key, expected[key]);
+			}
+			for (int i = 10; i < 20; ++i)
+			{
+				batch.remove("key-" + std::to_string(i));
+				expected.erase("key-" + std::to_string(i));
+			}
+			// the last operation on a key wins
+			batch.put("key-20", "first").remove("key-20").put("key-20", "last");
+			expected["key-20"] = "last";
+			batch.remove("missing");
+			REQUIRE(batch.size() == 300 + 10 + 10 + 3 + 1);
+
+			size_t records = kv.wal()->records();
+			REQUIRE(kv.apply(batch));
+			REQUIRE(kv.wal()->records() == records + 1);
+			REQUIRE(copy_file(wal_pathname, saved_wal_pathname));
+
+			REQUIRE(kv.apply(milliways::WriteBatch()));
+
+			milliways::WriteBatch bad;
+			bad.put("key-0", "changed").put(std::string(kv_t::KEY_MAX_SIZE + 1, 'x'), "too long");
+			REQUIRE(! kv.apply(bad));
+
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+				REQUIRE(kv.get(e_it->first) == e_it->second);
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == expected.size());
+
+			kv.close();
+		}
+
+		// a crash right after the batch: it comes back whole from the log
+		REQUIRE(copy_file(saved_pathname, test_pathname));
+		REQUIRE(copy_file(saved_wal_pathname, wal_pathname));
+		{
+			kv_t kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+			{
+				std::string value;
+				REQUIRE(kv.get(e_it->first, value));
+				REQUIRE(value == e_it->second);
+			}
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == expected.size());
+
+			// removing everything gives all the space back
+			milliways::WriteBatch batch;
+			for (std::map<std::string, std::string>::const_iterator e_it = expected.begin(); e_it != expected.end(); ++e_it)
+				batch.remove(e_it->first);
+			REQUIRE(kv.apply(batch));
+			REQUIRE(kv.begin() == kv.end());
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+		std::remove(saved_pathname.c_str());
+		std::remove(saved_wal_pathname.c_str());
+	}
+
+	SECTION( "write batches failing half-way leave the store and the log as they were" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string wal_pathname("./test_kv-wal");
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		std::map<std::string, std::string> before;
+		std::map<std::string, std::string> after;
+		milliways::WriteBatch batch;
+		{
+			FailingKeyValueStore kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			for (int i = 0; i < 40; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				before[key] = random_string((i % 8) ? 200 : 6000);
+				REQUIRE(kv.put(key, before[key]));
+			}
+			REQUIRE(kv.flush());
+			after = before;
+
+			for (int i = 0; i < 40; ++i)
+			{
+				std::string key = "key-" + std::to_string(i);
+				switch (i % 4)
+				{
+				case 0:		// in place
+					after[key] = random_string(20);
+					batch.put(key, after[key]);
+					break;
+				case 1:		// needing more space
+					after[key] = random_string((i % 3) ? 700 : 9000);
+					batch.put(key, after[key]);
+					break;
+				case 2:
+					batch.remove(key);
+					after.erase(key);
+					break;
+				default:
+					break;
+				}
+			}
+			for (int i = 0; i < 20; ++i)
+			{
+				std::string key = "new-" + std::to_string(i);
+				after[key] = random_string((i % 5) ? 100 : 5000);
+				batch.put(key, after[key]);
+			}
+
+			uint64_t appended = kv.wal()->appendedLsn();
+			for (int fail_after = 0; fail_after < 50; fail_after += 7)
+			{
+				kv.failAfter(fail_after);
+				REQUIRE(! kv.apply(batch));
+				REQUIRE(kv.wal()->appendedLsn() == appended);
+
+				for (std::map<std::string, std::string>::const_iterator e_it = before.begin(); e_it != before.end(); ++e_it)
+					REQUIRE(kv.get(e_it->first) == e_it->second);
+				size_t count = 0;
+				for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+					count++;
+				REQUIRE(count == before.size());
+			}
+			kv.close();
+		}
+
+		// nothing of the failed batches comes back from the log
+		{
+			FailingKeyValueStore kv(new kv_blockstorage_t(test_pathname));
+			kv.wal(new milliways::WriteAheadLog(wal_pathname));
+			kv.open();
+			REQUIRE(kv.isOpen());
+
+			for (std::map<std::string, std::string>::const_iterator e_it = before.begin(); e_it != before.end(); ++e_it)
+				REQUIRE(kv.get(e_it->first) == e_it->second);
+			size_t count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == before.size());
+
+			// the same batch goes through once nothing stands in the way
+			REQUIRE(kv.apply(batch));
+			for (std::map<std::string, std::string>::const_iterator e_it = after.begin(); e_it != after.end(); ++e_it)
+				REQUIRE(kv.get(e_it->first) == e_it->second);
+			count = 0;
+			for (kv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+				count++;
+			REQUIRE(count == after.size());
+			kv.close();
+		}
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+	}
+
+	SECTION( "write-ahead log commits concurrent writers in groups" ) {
+		const std::string test_pathname("./test_kv");
+		const std::string wal_pathname("./test_kv-wal");
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+
+		kv_t kv(new kv_blockstorage_t(test_pathname));
+		kv.wal(new milliways::WriteAheadLog(wal_pathname));
+		kv.open();
+		REQUIRE(kv.isOpen());
+
+		static const int N_THREADS = 4;
+		static const int N_PUTS = 200;
+		std::vector<int> errors(N_THREADS, 0);
+		std::vector<std::thread> writers;
+		for (int t = 0; t < N_THREADS; ++t)
+		{
+			writers.push_back(std::thread([&, t]() {
+				for (int i = 0; i < N_PUTS; ++i)
+				{
+					std::string key = std::to_string(t) + "-" + std::to_string(i);
+					if (! kv.put(key, key))
+						errors[t]++;
+				}
+			}));
+		}
+		for (int t = 0; t < N_THREADS; ++t)
+			writers[t].join();
+
+		for (int t = 0; t < N_THREADS; ++t)
+			REQUIRE(errors[t] == 0);
+		REQUIRE(kv.wal()->records() == N_THREADS * N_PUTS);
+		REQUIRE(kv.wal()->syncs() <= kv.wal()->records());
+		REQUIRE(kv.wal()->syncedLsn() == kv.wal()->appendedLsn());
+
+		kv.close();
+		REQUIRE(file_size(wal_pathname) == 0);
+
+		std::remove(test_pathname.c_str());
+		std::remove(wal_pathname.c_str());
+	}
 }
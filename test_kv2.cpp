@@ -32,9 +32,6 @@
 #undef MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE
 #define MILLIWAYS_DEFAULT_BLOCK_CACHE_SIZE 32
 
-#undef MILLIWAYS_DEFAULT_NODE_CACHE_SIZE
-#define MILLIWAYS_DEFAULT_NODE_CACHE_SIZE 32
-
 #include "KeyValueStore.h"
 
 static inline int rand_int(int lo, int hi)
@@ -24,6 +24,10 @@
 #include <string>
 #include <vector>
 #include <utility>
+#include <chrono>
+#include <iostream>
+
+#include <stdlib.h>
 
 #include "LRUCache.h"
 
@@ -131,6 +135,42 @@ TEST_CASE( "LRU Cache", "[LRUCache]" ) {
 
 		REQUIRE(lru.size() == 0);
 	}
+
+	SECTION( "capacity can be changed at runtime" ) {
+		lru_t big(INVALID_INT_KEY, 8);
+		int k;
+		REQUIRE(big.capacity() == 8);
+		REQUIRE(big.max_size() == 8);
+
+		for (int i = 0; i < 8; i++)
+			big[i] = "v";
+		REQUIRE(big.size() == 8);
+
+		// shrinking evicts from the LRU end
+		big.capacity(3);
+		REQUIRE(big.capacity() == 3);
+		REQUIRE(big.size() == 3);
+		REQUIRE(! big.has(k = 4));
+		REQUIRE(big.has(k = 5));
+		REQUIRE(big.has(k = 6));
+		REQUIRE(big.has(k = 7));
+
+		// growing keeps the entries and makes room for more
+		big.capacity(5);
+		big[8] = "v";
+		big[9] = "v";
+		REQUIRE(big.size() == 5);
+		REQUIRE(big.has(k = 5));
+		big[10] = "v";
+		REQUIRE(big.size() == 5);
+		REQUIRE(! big.has(k = 5));
+
+		// never below one entry
+		big.capacity(0);
+		REQUIRE(big.capacity() == 1);
+		REQUIRE(big.size() == 1);
+		REQUIRE(big.has(k = 10));
+	}
 }
 
 static std::string miss_string(int value) {
@@ -242,3 +282,295 @@ TEST_CASE( "Extended LRU Cache", "[ExtendedLRUCache]" ) {
 		std::cerr << "lru[8373]:" << lru[8373] << std::endl;
 	}
 }
+
+TEST_CASE( "Cache replacement policies", "[LRUCache][CachePolicy]" ) {
+	typedef milliways::LRUCache<16, int, int> cache_t;
+
+	struct L
+	{
+		// hot keys 0..3 are touched twice, far apart, then a scan goes by
+		static int hot_survivors(cache_t& cache)
+		{
+			for (int k = 0; k < 4; k++)
+				cache[k] = k;
+			for (int k = 100; k < 116; k++)
+				cache[k] = k;
+			for (int k = 0; k < 4; k++)
+				cache[k] = k;
+			for (int k = 1000; k < 1200; k++)
+				cache[k] = k;
+
+			int n = 0;
+			for (int k = 0; k < 4; k++)
+				if (cache.has(k))
+					n++;
+			return n;
+		}
+	};
+
+	SECTION( "plain LRU is flushed by a scan" ) {
+		cache_t cache(INVALID_INT_KEY);
+		REQUIRE(cache.policy() == NULL);
+		REQUIRE(L::hot_survivors(cache) == 0);
+		REQUIRE(cache.size() == 16);
+	}
+
+	SECTION( "2Q keeps reused keys through a scan" ) {
+		cache_t cache(INVALID_INT_KEY);
+		milliways::TwoQueuePolicy<int>* policy = new milliways::TwoQueuePolicy<int>();
+		cache.policy(policy);
+		REQUIRE(cache.policy() == policy);
+
+		REQUIRE(L::hot_survivors(cache) == 4);
+		REQUIRE(cache.size() == 16);
+		REQUIRE(policy->am_size() == 4);
+		REQUIRE(policy->a1in_size() == 12);
+		REQUIRE(policy->a1out_size() <= 8);
+
+		int k = 0;
+		REQUIRE(cache.del(k));
+		REQUIRE(policy->am_size() == 3);
+	}
+
+	SECTION( "CLOCK gives referenced keys a second chance" ) {
+		cache_t cache(INVALID_INT_KEY, 4);
+		cache.policy(new milliways::ClockPolicy<int>());
+
+		for (int k = 0; k < 4; k++)
+			cache[k] = k;
+		int value;
+		int k = 0;
+		REQUIRE(cache.get(value, k));
+
+		cache[4] = 4;
+		int k0 = 0, k1 = 1, k2 = 2;
+		REQUIRE(cache.has(k0));
+		REQUIRE(! cache.has(k1));
+
+		// deleted keys are never picked as victims
+		REQUIRE(cache.del(k2));
+		for (int k = 10; k < 30; k++)
+			cache[k] = k;
+		REQUIRE(cache.size() == 4);
+	}
+
+	SECTION( "policies can be switched on a populated cache" ) {
+		cache_t cache(INVALID_INT_KEY, 8);
+		for (int k = 0; k < 8; k++)
+			cache[k] = k;
+
+		cache.policy(new milliways::TwoQueuePolicy<int>());
+		REQUIRE(cache.size() == 8);
+		for (int k = 8; k < 32; k++)
+			cache[k] = k;
+		REQUIRE(cache.size() == 8);
+
+		cache.policy(new milliways::ClockPolicy<int>());
+		cache.capacity(4);
+		REQUIRE(cache.size() == 4);
+		for (int k = 32; k < 40; k++)
+			cache[k] = k;
+		REQUIRE(cache.size() == 4);
+
+		cache.policy(NULL);
+		for (int k = 40; k < 48; k++)
+			cache[k] = k;
+		REQUIRE(cache.size() == 4);
+
+		cache.evict_all();
+		REQUIRE(cache.empty());
+	}
+
+	SECTION( "pinned entries are never evicted" ) {
+		cache_t cache(INVALID_INT_KEY, 4);
+		for (int k = 0; k < 4; k++)
+			cache[k] = k;
+		REQUIRE(cache.pin(0));
+		REQUIRE(cache.pin(0));
+		REQUIRE(cache.pin(1));
+		REQUIRE(! cache.pin(100));
+		REQUIRE(cache.n_pinned() == 2);
+
+		for (int k = 10; k < 20; k++)
+			cache[k] = k;
+		int k0 = 0, k1 = 1, k2 = 2;
+		REQUIRE(cache.has(k0));
+		REQUIRE(cache.has(k1));
+		REQUIRE(! cache.has(k2));
+		REQUIRE(cache.size() == 4);
+
+		// the same with a policy, installed over the pins
+		cache.policy(new milliways::TwoQueuePolicy<int>());
+		for (int k = 20; k < 30; k++)
+			cache[k] = k;
+		REQUIRE(cache.has(k0));
+		REQUIRE(cache.has(k1));
+
+		// pins are counted
+		cache.unpin(0);
+		REQUIRE(cache.pinned(0));
+		cache.unpin(0);
+		REQUIRE(! cache.pinned(0));
+		cache.unpin(1);
+		for (int k = 30; k < 40; k++)
+			cache[k] = k;
+		REQUIRE(! cache.has(k0));
+		REQUIRE(! cache.has(k1));
+
+		// all pinned: the cache grows over its capacity
+		cache.policy(NULL);
+		for (int k = 36; k < 40; k++)
+			REQUIRE(cache.pin(k));
+		REQUIRE(cache.n_pinned() == 4);
+		cache[50] = 50;
+		REQUIRE(cache.size() == 5);
+
+		cache.evict_all();
+		REQUIRE(cache.empty());
+		REQUIRE(cache.n_pinned() == 0);
+	}
+
+	SECTION( "hits and misses are counted" ) {
+		cache_t cache(INVALID_INT_KEY, 4);
+		for (int k = 0; k < 4; k++)
+			cache[k] = k;
+		REQUIRE(cache.misses() == 4);
+		REQUIRE(cache.hits() == 0);
+		for (int k = 0; k < 4; k++)
+			cache[k] = k;
+		REQUIRE(cache.hits() == 4);
+		cache.reset_stats();
+		REQUIRE(cache.hits() == 0);
+		REQUIRE(cache.misses() == 0);
+	}
+}
+
+class CountingLRUCache : public milliways::LRUCache<100000, int, int>
+{
+public:
+	typedef milliways::LRUCache<100000, int, int> base_type;
+
+	CountingLRUCache(size_type capacity_ = base_type::Size) :
+		base_type(INVALID_INT_KEY, capacity_), m_n_eviction(0), m_last_evicted(INVALID_INT_KEY) {}
+	~CountingLRUCache() { evict_all(); }
+
+	long n_eviction() const { return m_n_eviction; }
+	int last_evicted() const { return m_last_evicted; }
+
+	bool on_miss(op_type op, const key_type& key, mapped_type& value)
+	{
+		value = key;
+		return true;
+	}
+	bool on_eviction(const key_type& key, mapped_type& value)
+	{
+		m_n_eviction++;
+		m_last_evicted = key;
+		return true;
+	}
+
+private:
+	long m_n_eviction;
+	int m_last_evicted;
+};
+
+/* best of a few runs of hits and evicting misses on a full cache, in seconds per operation */
+static double seconds_per_op(int n_entries)
+{
+	typedef std::chrono::steady_clock clock_type;
+	static const int N_OPS = 200000;
+	static const int N_RUNS = 3;
+
+	double best = 0.0;
+	for (int run = 0; run < N_RUNS; run++)
+	{
+		CountingLRUCache lru(n_entries);
+		for (int i = 0; i < n_entries; i++)
+			lru[i] = i;
+
+		int value = 0;
+		int next_key = n_entries;
+		clock_type::time_point start = clock_type::now();
+		for (int i = 0; i < N_OPS; i++)
+		{
+			int key = next_key - 1 - (rand() % n_entries);
+			lru.get(value, key);
+			lru[next_key] = next_key;
+			next_key++;
+		}
+		double elapsed = std::chrono::duration<double>(clock_type::now() - start).count() / (2.0 * N_OPS);
+		if ((run == 0) || (elapsed < best))
+			best = elapsed;
+	}
+	return best;
+}
+
+TEST_CASE( "LRU Cache at scale", "[LRUCache]" ) {
+	static const int N_ENTRIES = 100000;
+	static const int N_OPS = 1000000;
+
+	CountingLRUCache* lru = new CountingLRUCache();
+
+	/* the timing is in benchmark_kv */
+	SECTION("hits, updates and evictions keep the recency order at 100k entries") {
+		for (int i = 0; i < N_ENTRIES; i++)
+			(*lru)[i] = i;
+		REQUIRE(lru->size() == N_ENTRIES);
+		REQUIRE(lru->n_eviction() == 0);
+
+		srand(42);
+		int value = 0;
+		long n_hits = 0, n_mismatches = 0;
+		for (int i = 0; i < N_OPS; i++)
+		{
+			int key = rand() % N_ENTRIES;
+			if (lru->get(value, key))
+				n_hits++;
+			if (value != key)
+				n_mismatches++;
+		}
+		REQUIRE(n_hits == N_OPS);
+		REQUIRE(n_mismatches == 0);
+
+		for (int i = 0; i < N_OPS; i++)
+		{
+			int key = rand() % N_ENTRIES;
+			value = key;
+			lru->set(key, value);
+		}
+		REQUIRE(lru->n_eviction() == 0);
+
+		// touch the first half again: the second half becomes the LRU end
+		n_hits = 0;
+		for (int i = 0; i < N_ENTRIES / 2; i++)
+			if (lru->get(value, i))
+				n_hits++;
+		REQUIRE(n_hits == N_ENTRIES / 2);
+
+		// the following misses evict only the untouched half
+		for (int i = N_ENTRIES; i < N_ENTRIES + N_ENTRIES / 2; i++)
+			(*lru)[i] = i;
+		REQUIRE(lru->size() == N_ENTRIES);
+		REQUIRE(lru->n_eviction() == N_ENTRIES / 2);
+		REQUIRE(lru->last_evicted() >= N_ENTRIES / 2);
+		REQUIRE(lru->last_evicted() < N_ENTRIES);
+
+		long n_deleted = 0;
+		for (int i = 0; i < N_ENTRIES / 2; i++)
+			if (lru->has(i) && lru->del(i))
+				n_deleted++;
+		REQUIRE(n_deleted == N_ENTRIES / 2);
+		REQUIRE(lru->size() == N_ENTRIES / 2);
+	}
+
+	/* linear recency updates would make each operation 100 times as expensive */
+	SECTION("the cost of an operation doesn't grow with the number of entries") {
+		double small = seconds_per_op(N_ENTRIES / 100);
+		double large = seconds_per_op(N_ENTRIES);
+		std::cerr << "LRU per-op cost: " << (small * 1e9) << " ns at " << (N_ENTRIES / 100) << " entries, " <<
+			(large * 1e9) << " ns at " << N_ENTRIES << " entries" << std::endl;
+		REQUIRE(large < 10.0 * small);
+	}
+
+	delete lru;
+}
@@ -139,4 +139,35 @@ TEST_CASE( "Ordered map", "[ordered_map]" ) {
 
 		REQUIRE(omap.size() == 0);
 	}
+	SECTION( "pop(key) and move_to_back() keep the order consistent" ) {
+		omap["Zed"] = 1;
+		omap["Something"] = 2;
+		omap["Abc"] = 3;
+		omap["Last"] = 4;
+
+		milliways::ordered_map<std::string, int>::value_type item;
+
+		item = omap.pop("Something");
+		REQUIRE(item.first == "Something");
+		REQUIRE(item.second == 2);
+		REQUIRE(omap.size() == 3);
+		REQUIRE(! omap.has("Something"));
+
+		milliways::ordered_map<std::string, int>::iterator it = omap.find("Zed");
+		REQUIRE(it != omap.end());
+		omap.move_to_back(it);
+		REQUIRE(it->first == "Zed");
+		REQUIRE(it->second == 1);
+
+		REQUIRE(omap.find("Missing") == omap.end());
+
+		item = omap.pop_front();
+		REQUIRE(item.first == "Abc");
+		item = omap.pop_front();
+		REQUIRE(item.first == "Last");
+		item = omap.pop_front();
+		REQUIRE(item.first == "Zed");
+
+		REQUIRE(omap.empty());
+	}
 }
\ No newline at end of file
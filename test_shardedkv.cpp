@@ -0,0 +1,250 @@
+/*****************************************************************************/
+/*  Milliways - B+ trees and key-value store C++ library                     */
+/*                                                                           */
+/*  Copyright 2016 Marco Pantaleoni and J CUBE Inc. Tokyo, Japan.            */
+/*                                                                           */
+/*  Author: Marco Pantaleoni <marco.pantaleoni@gmail.com>                    */
+/*                                                                           */
+/*  Licensed under the Apache License, Version 2.0 (the "License");          */
+/*  you may not use this file except in compliance with the License.         */
+/*  You may obtain a copy of the License at                                  */
+/*                                                                           */
+/*      http://www.apache.org/licenses/LICENSE-2.0                           */
+/*                                                                           */
+/*  Unless required by applicable law or agreed to in writing, software      */
+/*  distributed under the License is distributed on an "AS IS" BASIS,        */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/*  See the License for the specific language governing permissions and      */
+/*  limitations under the License.                                           */
+/*****************************************************************************/
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#include "catch.hpp"
+
+#include <sstream>
+#include <iomanip>
+#include <set>
+#include <vector>
+#include <thread>
+
+#include "ShardedKeyValueStore.h"
+
+static void remove_shards(const std::string& basename, int n_shards)
+{
+	for (int i = 0; i < n_shards; i++)
+		std::remove(milliways::ShardedKeyValueStore::shardPathname(basename, i).c_str());
+}
+
+static std::string make_key(int i)
+{
+	std::ostringstream ss;
+	ss << "key-" << std::setfill('0') << std::setw(6) << i;
+	return ss.str();
+}
+
+TEST_CASE( "Sharded KeyValue store", "[ShardedKeyValueStore]" ) {
+	typedef milliways::ShardedKeyValueStore skv_t;
+
+	static const int N_SHARDS = 4;
+
+	SECTION( "keys are spread over the shards and survive a reopen" ) {
+		const std::string test_basename("./test_shardedkv");
+		const int N = 2000;
+
+		remove_shards(test_basename, N_SHARDS);
+		{
+			skv_t kv(test_basename, N_SHARDS);
+			REQUIRE(kv.shards() == N_SHARDS);
+			REQUIRE(kv.open());
+			REQUIRE(kv.isOpen());
+
+			for (int i = 0; i < N; i++)
+				REQUIRE(kv.put(make_key(i), "value of " + make_key(i)));
+
+			std::vector<int> per_shard(N_SHARDS, 0);
+			for (int i = 0; i < N; i++)
+			{
+				int shard = kv.shardOf(make_key(i));
+				REQUIRE(((shard >= 0) && (shard < N_SHARDS)));
+				REQUIRE(kv.shard(shard)->has(make_key(i)));
+				per_shard[shard]++;
+			}
+			for (int s = 0; s < N_SHARDS; s++)
+				REQUIRE(per_shard[s] > (N / N_SHARDS / 2));
+
+			REQUIRE(kv.flush());
+			REQUIRE(kv.close());
+			REQUIRE(! kv.isOpen());
+		}
+		{
+			skv_t kv(test_basename, N_SHARDS);
+			REQUIRE(kv.open());
+
+			std::string value;
+			for (int i = 0; i < N; i++)
+			{
+				REQUIRE(kv.get(make_key(i), value));
+				REQUIRE(value == "value of " + make_key(i));
+			}
+			REQUIRE(! kv.has("missing"));
+
+			/* renames within a shard and across shards */
+			int moved = 0;
+			for (int i = 0; i < 100; i++)
+			{
+				std::string new_key = "renamed-" + make_key(i);
+				if (kv.shardOf(new_key) != kv.shardOf(make_key(i)))
+					moved++;
+				REQUIRE(kv.rename(make_key(i), new_key));
+				REQUIRE(! kv.has(make_key(i)));
+				REQUIRE(kv.get(new_key) == "value of " + make_key(i));
+			}
+			REQUIRE(moved > 0);
+
+			/* an existing key is never replaced, within a shard nor across shards */
+			int refused_across = 0;
+			for (int i = 1000; i < 1020; i++)
+			{
+				std::string existing = make_key(i + 20);
+				if (kv.shardOf(existing) != kv.shardOf(make_key(i)))
+					refused_across++;
+				REQUIRE(! kv.rename(make_key(i), existing));
+				REQUIRE(kv.get(make_key(i)) == "value of " + make_key(i));
+				REQUIRE(kv.get(existing) == "value of " + existing);
+			}
+			REQUIRE(refused_across > 0);
+
+			for (int i = 100; i < 200; i++)
+			{
+				REQUIRE(kv.remove(make_key(i)));
+				REQUIRE(! kv.has(make_key(i)));
+			}
+
+			/* a batch is split among the shards */
+			milliways::WriteBatch batch;
+			for (int i = 200; i < 300; i++)
+				batch.put(make_key(i), "batched").remove(make_key(i + 100));
+			REQUIRE(kv.apply(batch));
+			for (int i = 200; i < 300; i++)
+			{
+				REQUIRE(kv.get(make_key(i)) == "batched");
+				REQUIRE(! kv.has(make_key(i + 100)));
+			}
+			kv.close();
+		}
+
+		remove_shards(test_basename, N_SHARDS);
+	}
+
+	SECTION( "a shard failing to open leaves the others closed" ) {
+		const std::string test_basename("./test_shardedkv");
+
+		remove_shards(test_basename, N_SHARDS);
+		{
+			skv_t kv(test_basename, N_SHARDS);
+			REQUIRE(kv.open());
+			for (int i = 0; i < 100; i++)
+				REQUIRE(kv.put(make_key(i), "value"));
+			REQUIRE(kv.close());
+		}
+
+		/* a damaged free space map in one shard (the tree header comes first) */
+		{
+			skv_t::block_storage_type bs(skv_t::shardPathname(test_basename, 2));
+			bs.allocUserHeader();
+			int uid = bs.allocUserHeader();
+			REQUIRE(bs.open());
+			bs.setUserData(uid, std::string(4, '\xff'));
+			REQUIRE(bs.close());
+		}
+		{
+			skv_t kv(test_basename, N_SHARDS);
+			REQUIRE(! kv.open());
+			REQUIRE(! kv.isOpen());
+			for (int s = 0; s < N_SHARDS; s++)
+				REQUIRE(! kv.shard(s)->isOpen());
+		}
+
+		remove_shards(test_basename, N_SHARDS);
+	}
+
+	SECTION( "iteration merges the shards in key order" ) {
+		const std::string test_basename("./test_shardedkv_iter");
+
+		remove_shards(test_basename, N_SHARDS);
+
+		std::set<std::string> keys;
+		std::vector< std::pair<std::string, std::string> > items;
+		for (int i = 0; i < 3000; i++)
+		{
+			std::string key = make_key((i * 7919) % 10007);
+			keys.insert(key);
+			items.push_back(std::make_pair(key, key));
+		}
+
+		skv_t kv(test_basename, N_SHARDS);
+		REQUIRE(kv.open());
+		REQUIRE(kv.bulk_put(items));
+
+		std::set<std::string>::const_iterator expected = keys.begin();
+		for (skv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+		{
+			REQUIRE(expected != keys.end());
+			REQUIRE(*it == *expected);
+			REQUIRE(it.shard() == kv.shardOf(*it));
+			++expected;
+		}
+		REQUIRE(expected == keys.end());
+
+		std::set<std::string>::const_reverse_iterator r_expected = keys.rbegin();
+		for (skv_t::iterator it = kv.rbegin(); it != kv.rend(); ++it)
+		{
+			REQUIRE(r_expected != keys.rend());
+			REQUIRE(*it == *r_expected);
+			++r_expected;
+		}
+		REQUIRE(r_expected == keys.rend());
+
+		kv.close();
+		remove_shards(test_basename, N_SHARDS);
+	}
+
+	SECTION( "writers on different shards run concurrently" ) {
+		const std::string test_basename("./test_shardedkv_mt");
+		static const int N_THREADS = 4;
+		static const int N_PER_THREAD = 1000;
+
+		remove_shards(test_basename, N_SHARDS);
+
+		skv_t kv(test_basename, N_SHARDS);
+		REQUIRE(kv.open());
+
+		std::vector<int> errors(N_THREADS, 0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < N_THREADS; t++)
+		{
+			threads.push_back(std::thread([&, t]() {
+				for (int i = t; i < N_THREADS * N_PER_THREAD; i += N_THREADS)
+				{
+					if (! kv.put(make_key(i), make_key(i)))
+						errors[t]++;
+					if (kv.get(make_key(i)) != make_key(i))
+						errors[t]++;
+				}
+			}));
+		}
+		for (int t = 0; t < N_THREADS; t++)
+			threads[t].join();
+
+		for (int t = 0; t < N_THREADS; t++)
+			REQUIRE(errors[t] == 0);
+
+		int count = 0;
+		for (skv_t::iterator it = kv.begin(); it != kv.end(); ++it)
+			count++;
+		REQUIRE(count == N_THREADS * N_PER_THREAD);
+
+		kv.close();
+		remove_shards(test_basename, N_SHARDS);
+	}
+}